@@ -1,21 +1,1397 @@
-#ifdef CPU_OCTREE
-#include "../structures/octree.h"
+/*
+    file - benchmark_octree.cc
 
-template <typename InputIterator, class PointExtractor, 
-          size_t max_per_node, size_t max_depth>
-using Octree_Implementation = Octree<InputIterator, PointExtractor, max_per_node, max_depth>;
+    Races every tree implementation over the same set of workloads and reports
+    build time, query latency percentiles, query throughput and heap usage.
+    Each query is raced through the tree's own search and, where there is
+    one, the way callers had to answer it with box searches alone:
 
-#endif
+    - Box searches on every tree, one at a time and in batches.
+    - Radius searches, through radiusSearch() and by filtering a box.
+    - k nearest neighbour searches, through knn() and by growing boxes.
+    - Line of sight segments, through raycast() and firstHits() and by
+      covering the segment with small boxes.
+    - View frustums, through search() with a ConvexPolytope and by testing
+      what the box around the frustum holds against its planes.
+    - Every pair of points within a small distance of each other, through
+      selfJoin() serially and on a pool, and by a radius search around
+      every point.
+    - Whether a box holds anything, through visit(), which stops at the
+      first value, and through search().
+    - Box searches on a LooseOctree holding each point as a box with no
+      extent.
+    - Box searches on an Octree read through snapshots while another thread
+      keeps publishing rebuilt copies of it.
+    - Box searches through searchRange(), which finds values as they are
+      asked for.
+    - Keeping the Octree up to date while 1% of the points move each tick,
+      through erase() and insert() against building every tree again.
+    - Following points that all drift a little each tick, through update().
+    - Box, radius and k nearest neighbour searches on trees storing float
+      coordinates and on a PointerlessOctree storing 16 bit quantized leaves.
+    - The same three on a PointerlessOctree saved to a file and mapped back
+      in, whose build time is the time to open the file.
+    - Box searches on that mapped tree built out of core by
+      StreamingTreeBuilder.
+    - Box and k nearest neighbour searches on an Octree built lazily.
+
+    Results are printed as a table and written out as CSV and JSON so that
+    they can be compared between releases. The JSON also profiles the Octree
+    and PointerlessOctree over each workload, untimed: the shape of each
+    tree, and the nodes and points the average query looks at.
+
+    usage: benchmark_octree [--csv=<path>] [--json=<path>]
+
+ */
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/octree.h"
+#include "../structures/leaf_kernel.h"
+#include "../structures/loose_octree.h"
+#include "../structures/mapped_octree.h"
+#include "../structures/pointerless_octree.h"
+#include "../structures/polytope.h"
+#include "../structures/ray.h"
+#include "../structures/snapshot_tree.h"
+#include "../structures/streaming_build.h"
+#include "../structures/taskpool.h"
+#include "../structures/tree_stats.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifndef NUM_TRIALS
 #define NUM_TRIALS 10
 #endif
 
-#ifndef TOLERANCE
-#define TOLERANCE 0.00001
+#ifndef NUM_QUERIES
+#define NUM_QUERIES 1000
+#endif
+
+#ifndef SMALL_WORKLOAD_SIZE
+#define SMALL_WORKLOAD_SIZE 10000
+#endif
+
+#ifndef LARGE_WORKLOAD_SIZE
+#define LARGE_WORKLOAD_SIZE 1000000
+#endif
+
+#ifndef KNN_K
+#define KNN_K 16
 #endif
 
-void benchmark_small_even_dispersion();
-void benchmark_large_even_dispersion();
-void benchmark_small_uneven_dispersion();
-void benchmark_large_mostlyeven_dispersion();
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 1000
+#endif
+
+#ifndef CHURN_TICKS
+#define CHURN_TICKS 10
+#endif
+
+#ifndef JOIN_REPEATS
+#define JOIN_REPEATS 3
+#endif
+
+// Heap accounting. Every allocation in the process goes through these, so the
+// peak seen while a tree is being built is the build's true high water mark.
+namespace {
+
+std::atomic<std::size_t> liveBytes(0);
+std::atomic<std::size_t> peakBytes(0);
+const std::size_t allocationHeader = alignof(std::max_align_t);
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  void* block = std::malloc(size + allocationHeader);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  *static_cast<std::size_t*>(block) = size;
+
+  std::size_t live = liveBytes += size;
+  std::size_t peak = peakBytes.load();
+  while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) { }
+
+  return static_cast<char*>(block) + allocationHeader;
+}
+
+// Reading the size in front of the block looks out of bounds to GCC once
+// this is inlined into a caller that knows how big the array it freed was
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"
+#endif
+void operator delete(void* p) noexcept {
+  if (p == nullptr) {
+    return;
+  }
+  char* block = static_cast<char*>(p) - allocationHeader;
+  liveBytes -= *reinterpret_cast<std::size_t*>(block);
+  std::free(block);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+struct PointIdentity {
+  Point3d operator()(const Point3d& p) const {
+    return p;
+  }
+};
+
+using PointIterator = std::vector<Point3d>::const_iterator;
+
+// Each point as a box with no extent, for the LooseOctree
+struct PointBox {
+  BoundingBox operator()(const Point3d& p) const {
+    return BoundingBox{p, p};
+  }
+};
+
+struct Workload {
+  std::string name_;
+  std::vector<Point3d> points_;
+  std::vector<BoundingBox> queries_;
+  // Number of points inside each query, found by brute force
+  std::vector<std::size_t> expected_;
+  // Nearest neighbour and radius queries, and the squared distance to the
+  // KNN_K'th nearest point and the number of points within the radius of
+  // each, found by brute force
+  std::vector<Point3d> centres_;
+  std::vector<double> radii_;
+  std::vector<std::size_t> radiusExpected_;
+  std::vector<double> kthDistance_;
+  // Line of sight segments between two data points, the radius around them,
+  // and the number of points within it and how far along the first of them
+  // is, found by brute force
+  std::vector<Ray> rays_;
+  std::vector<double> rayRadii_;
+  std::vector<std::size_t> rayExpected_;
+  std::vector<double> firstHit_;
+  // View frustums looking at the query centres, and the number of points
+  // inside each, found by brute force
+  std::vector<ConvexPolytope> frustums_;
+  std::vector<std::size_t> frustumExpected_;
+  // The distance self joins pair points within, half the median distance to
+  // the KNN_K'th nearest point, and the number of pairs, found by hashing the
+  // points into cells that wide
+  double joinEpsilon_;
+  std::size_t joinExpected_;
+  // Where growing box searches start: the half width of a box that would
+  // hold KNN_K points if they were spread evenly
+  double knnStartHalfWidth_;
+};
+
+struct RaceResult {
+  std::string workload_;
+  std::string structure_;
+  std::string query_;
+  std::size_t points_;
+  std::size_t queries_;
+  std::size_t trials_;
+  double buildMeanMs_;
+  double buildMinMs_;
+  double buildMaxMs_;
+  double latencyP50Us_;
+  double latencyP90Us_;
+  double latencyP99Us_;
+  double latencyMaxUs_;
+  double queriesPerSecond_;
+  std::size_t buildPeakBytes_;
+  std::size_t treeBytes_;
+  bool correct_;
+};
+
+// The shape of a tree built over a workload, and the work its queries did
+// in total, for telling a badly shaped tree from a large query
+struct ProfileResult {
+  std::string workload_;
+  std::string structure_;
+  std::size_t queries_;
+  TreeStats tree_;
+  QueryStats box_;
+  QueryStats radius_;
+  QueryStats knn_;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedMicroseconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+double distanceSquared(const Point3d& a, const Point3d& b) {
+  double dx = a.x - b.x;
+  double dy = a.y - b.y;
+  double dz = a.z - b.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+double percentile(const std::vector<double>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0.;
+  }
+  std::size_t rank = static_cast<std::size_t>(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[rank];
+}
+
+// Pairs of points no further than epsilon apart, each pair counted once.
+// Points are hashed into cells epsilon wide, numbered from 1 so that every
+// neighbour of a cell has a number too, and each pair is in the same cell or
+// neighbouring ones.
+std::size_t countPairsWithin(const std::vector<Point3d>& points, const BoundingBox& extent,
+                             double epsilon) {
+  double width = std::max(epsilon, 1e-9);
+  auto cell = [&](const Point3d& p) {
+    return std::array<std::uint64_t, 3>{{
+      static_cast<std::uint64_t>((p.x - extent.mins_.x) / width) + 1,
+      static_cast<std::uint64_t>((p.y - extent.mins_.y) / width) + 1,
+      static_cast<std::uint64_t>((p.z - extent.mins_.z) / width) + 1
+    }};
+  };
+  auto key = [](std::uint64_t x, std::uint64_t y, std::uint64_t z) {
+    return x << 42 | y << 21 | z;
+  };
+
+  std::unordered_map<std::uint64_t, std::vector<std::size_t>> cells;
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    std::array<std::uint64_t, 3> c = cell(points[i]);
+    cells[key(c[0], c[1], c[2])].push_back(i);
+  }
+
+  std::size_t pairs = 0;
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    std::array<std::uint64_t, 3> c = cell(points[i]);
+    for (std::uint64_t x = c[0] - 1; x <= c[0] + 1; ++x) {
+      for (std::uint64_t y = c[1] - 1; y <= c[1] + 1; ++y) {
+        for (std::uint64_t z = c[2] - 1; z <= c[2] + 1; ++z) {
+          auto found = cells.find(key(x, y, z));
+          if (found == cells.end()) {
+            continue;
+          }
+          for (std::size_t j : found->second) {
+            pairs += j > i && distanceSquared(points[i], points[j]) <= epsilon * epsilon;
+          }
+        }
+      }
+    }
+  }
+  return pairs;
+}
+
+// Query boxes are centred on data points, so that they land where the data is,
+// with edges between 1% and 10% of the extent of the whole data set. Nearest
+// neighbour and radius queries are asked from the same centres, the spheres
+// just fitting inside the boxes. Rays run between two data points, with a
+// quarter of a sphere's radius around them. Cameras two radii from each
+// centre look at it from a random direction, seeing out to six radii.
+void makeQueries(Workload& w, std::mt19937_64& generator) {
+  BoundingBox extent = makeBoundingBox(w.points_.begin(), w.points_.end());
+  std::uniform_int_distribution<std::size_t> pick(0, w.points_.size() - 1);
+  std::uniform_real_distribution<double> scale(0.005, 0.05);
+
+  double volume = (extent.maxes_.x - extent.mins_.x) *
+                  (extent.maxes_.y - extent.mins_.y) *
+                  (extent.maxes_.z - extent.mins_.z);
+  w.knnStartHalfWidth_ = std::cbrt(volume * KNN_K / w.points_.size()) / 2.;
+
+  std::size_t k = std::min<std::size_t>(KNN_K, w.points_.size());
+
+  w.queries_.clear();
+  w.expected_.clear();
+  w.centres_.clear();
+  w.radii_.clear();
+  w.radiusExpected_.clear();
+  w.kthDistance_.clear();
+  for (std::size_t q = 0; q < NUM_QUERIES; ++q) {
+    const Point3d& centre = w.points_[pick(generator)];
+    double s = scale(generator);
+    double dx = s * (extent.maxes_.x - extent.mins_.x);
+    double dy = s * (extent.maxes_.y - extent.mins_.y);
+    double dz = s * (extent.maxes_.z - extent.mins_.z);
+    BoundingBox box{
+      { centre.x - dx, centre.y - dy, centre.z - dz },
+      { centre.x + dx, centre.y + dy, centre.z + dz }
+    };
+
+    double radius = std::min(dx, std::min(dy, dz));
+    std::size_t expected = 0;
+    std::size_t radiusExpected = 0;
+    for (const Point3d& p : w.points_) {
+      expected += box.contains(p);
+      radiusExpected += distanceSquared(p, centre) <= radius * radius;
+    }
+
+    w.queries_.push_back(box);
+    w.expected_.push_back(expected);
+
+    // A max heap of the k smallest distances seen so far
+    std::array<double, KNN_K> nearest;
+    std::size_t kept = 0;
+    for (const Point3d& p : w.points_) {
+      double distance = distanceSquared(p, centre);
+      if (kept < k) {
+        nearest[kept++] = distance;
+        std::push_heap(nearest.begin(), nearest.begin() + kept);
+      } else if (distance < nearest[0]) {
+        std::pop_heap(nearest.begin(), nearest.begin() + kept);
+        nearest[kept - 1] = distance;
+        std::push_heap(nearest.begin(), nearest.begin() + kept);
+      }
+    }
+    w.centres_.push_back(centre);
+    w.radii_.push_back(radius);
+    w.radiusExpected_.push_back(radiusExpected);
+    w.kthDistance_.push_back(nearest[0]);
+  }
+
+  w.rays_.clear();
+  w.rayRadii_.clear();
+  w.rayExpected_.clear();
+  w.firstHit_.clear();
+  for (std::size_t q = 0; q < NUM_QUERIES; ++q) {
+    Ray ray = Ray::segment(w.centres_[q], w.points_[pick(generator)]);
+    double radius = w.radii_[q] / 4.;
+    std::size_t expected = 0;
+    double first = limits::infinity();
+    for (const Point3d& p : w.points_) {
+      double t = ray.along(p);
+      if (ray.distanceSquared(p, t) <= radius * radius) {
+        ++expected;
+        first = std::min(first, t);
+      }
+    }
+    w.rays_.push_back(ray);
+    w.rayRadii_.push_back(radius);
+    w.rayExpected_.push_back(expected);
+    w.firstHit_.push_back(first);
+  }
+
+  const double fovY = 0.8, aspect = 4. / 3.;
+  std::normal_distribution<double> direction;
+  w.frustums_.clear();
+  w.frustumExpected_.clear();
+  for (std::size_t q = 0; q < NUM_QUERIES; ++q) {
+    Point3d f{direction(generator), direction(generator), direction(generator)};
+    double norm = std::sqrt(f.x * f.x + f.y * f.y + f.z * f.z);
+    f = Point3d{f.x / norm, f.y / norm, f.z / norm};
+    double distance = 2 * w.radii_[q];
+    const Point3d& centre = w.centres_[q];
+    Point3d eye{centre.x - f.x * distance, centre.y - f.y * distance, centre.z - f.z * distance};
+    double nearDistance = distance / 10, farDistance = 3 * distance;
+    ConvexPolytope frustum = ConvexPolytope::frustum(eye, f, Point3d{0, 0, 1}, fovY, aspect,
+                                                     nearDistance, farDistance);
+
+    std::size_t expected = 0;
+    for (const Point3d& p : w.points_) {
+      expected += frustum.contains(p);
+    }
+    w.frustums_.push_back(frustum);
+    w.frustumExpected_.push_back(expected);
+  }
+
+  std::vector<double> kth(w.kthDistance_);
+  std::nth_element(kth.begin(), kth.begin() + kth.size() / 2, kth.end());
+  w.joinEpsilon_ = std::sqrt(kth[kth.size() / 2]) / 2;
+  w.joinExpected_ = countPairsWithin(w.points_, extent, w.joinEpsilon_);
+}
+
+// Point clouds mostly come as float, and keeping the points to what float can
+// hold lets the float trees race for exactly the same answers
+void roundToFloat(std::vector<Point3d>& points) {
+  for (Point3d& p : points) {
+    p = toScalarPoint<float>(p);
+  }
+}
+
+Workload makeEvenWorkload(const std::string& name, std::size_t size, unsigned seed) {
+  std::mt19937_64 generator(seed);
+  std::uniform_real_distribution<double> coordinate(0., 1000.);
+
+  Workload w;
+  w.name_ = name;
+  w.points_.reserve(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    w.points_.push_back(Point3d{
+        coordinate(generator), coordinate(generator), coordinate(generator)});
+  }
+  roundToFloat(w.points_);
+  makeQueries(w, generator);
+  return w;
+}
+
+// Points are drawn from a handful of tight gaussian clusters, with
+// uniformFraction of them scattered evenly over the whole space instead.
+Workload makeClusteredWorkload(const std::string& name, std::size_t size,
+                               double uniformFraction, unsigned seed) {
+  const std::size_t numClusters = 8;
+  std::mt19937_64 generator(seed);
+  std::uniform_real_distribution<double> coordinate(0., 1000.);
+  std::uniform_real_distribution<double> unit(0., 1.);
+  std::uniform_int_distribution<std::size_t> pickCluster(0, numClusters - 1);
+  std::normal_distribution<double> spread(0., 15.);
+
+  std::vector<Point3d> centres;
+  for (std::size_t c = 0; c < numClusters; ++c) {
+    centres.push_back(Point3d{
+        coordinate(generator), coordinate(generator), coordinate(generator)});
+  }
+
+  Workload w;
+  w.name_ = name;
+  w.points_.reserve(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    if (unit(generator) < uniformFraction) {
+      w.points_.push_back(Point3d{
+          coordinate(generator), coordinate(generator), coordinate(generator)});
+    } else {
+      const Point3d& centre = centres[pickCluster(generator)];
+      w.points_.push_back(Point3d{centre.x + spread(generator),
+                                  centre.y + spread(generator),
+                                  centre.z + spread(generator)});
+    }
+  }
+  roundToFloat(w.points_);
+  makeQueries(w, generator);
+  return w;
+}
+
+// Shared by every pool the race uses
+TaskPool& benchmarkPool() {
+  static TaskPool pool;
+  return pool;
+}
+
+// A tree saved before the race, so that building it is opening the file
+struct MappedPointerlessOctree : MappedOctree<PointIterator, PointIdentity> {
+  MappedPointerlessOctree(PointIterator begin, PointIterator, const std::string& path) {
+    open(path, begin);
+  }
+};
+
+// A tree streamed out to path with an eighth of the points in memory at a
+// time, so that building it is the out of core build plus opening the file
+struct StreamedPointerlessOctree : MappedOctree<PointIterator, PointIdentity> {
+  StreamedPointerlessOctree(PointIterator begin, PointIterator end, const std::string& path) {
+    std::size_t memory = static_cast<std::size_t>(end - begin) / 8;
+    StreamingTreeBuilder<> builder(path + ".scratch", memory);
+    builder.add(begin, end);
+    builder.finish(path);
+    open(path, begin);
+  }
+};
+
+// An Octree served through a SnapshotTree while a thread builds it again and
+// publishes the new one, over and over, for as long as the race runs. Every
+// query takes a snapshot, and shares the machine with the rebuilds.
+struct PublishedOctree {
+  using tree_type = Octree<PointIterator, PointIdentity>;
+
+  PublishedOctree(PointIterator begin, PointIterator end)
+    : trees_(tree_type(begin, end)), stopping_(false),
+      publisher_([this, begin, end]() {
+        while (!stopping_.load()) {
+          trees_.publish(tree_type(begin, end));
+        }
+      }) { }
+
+  ~PublishedOctree() {
+    stopping_.store(true);
+    publisher_.join();
+  }
+
+  template <typename OutputIterator>
+  bool search(const BoundingBox& box, OutputIterator& it) const {
+    return trees_.snapshot()->search(box, it);
+  }
+
+  SnapshotTree<tree_type> trees_;
+  std::atomic<bool> stopping_;
+  std::thread publisher_;
+};
+
+// The kinds of query a race can time. time() runs every query of the
+// workload against tree, appending one latency per query, and reports
+// whether every answer matched the brute force one.
+//
+// Queries asked one at a time derive from SingleQuery, and only need run()
+// to answer query q into found and check() to compare the answer.
+template <typename Query>
+struct SingleQuery {
+  template <typename Tree>
+  static bool time(const Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    std::vector<PointIterator> found;
+    found.reserve(w.points_.size());
+
+    for (std::size_t q = 0; q < w.queries_.size(); ++q) {
+      found.clear();
+
+      Clock::time_point queryStart = Clock::now();
+      Query::run(tree, w, q, found);
+      Clock::time_point queryEnd = Clock::now();
+
+      latencies.push_back(elapsedMicroseconds(queryStart, queryEnd));
+      correct &= Query::check(w, q, found);
+    }
+    return correct;
+  }
+};
+
+struct BoxQuery : SingleQuery<BoxQuery> {
+  static const char* name() { return "box"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.search(w.queries_[q], out);
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return found.size() == w.expected_[q];
+  }
+};
+
+// Walks searchRange(), which finds the values as it goes
+struct RangeBoxQuery : SingleQuery<RangeBoxQuery> {
+  static const char* name() { return "box_range"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    for (PointIterator it : tree.searchRange(w.queries_[q])) {
+      found.push_back(it);
+    }
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return BoxQuery::check(w, q, found);
+  }
+};
+
+// Asks whether the box holds anything, stopping at the first value visit()
+// comes to
+struct AnyBoxQuery : SingleQuery<AnyBoxQuery> {
+  static const char* name() { return "box_any"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    tree.visit(w.queries_[q], [&](PointIterator it, const Point3d&) {
+      found.push_back(it);
+      return Visit::STOP;
+    });
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return found.size() == std::min<std::size_t>(1, w.expected_[q]);
+  }
+};
+
+// The same through search(), which finds everything in the box first
+struct SearchAnyBoxQuery : SingleQuery<SearchAnyBoxQuery> {
+  static const char* name() { return "box_any_via_search"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.search(w.queries_[q], out);
+    found.resize(std::min<std::size_t>(1, found.size()));
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return AnyBoxQuery::check(w, q, found);
+  }
+};
+
+struct RadiusQuery : SingleQuery<RadiusQuery> {
+  static const char* name() { return "radius"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.radiusSearch(w.centres_[q], w.radii_[q], out);
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return found.size() == w.radiusExpected_[q];
+  }
+};
+
+// Searches the sphere's bounding box and throws away the corners
+struct BoxFilterRadiusQuery : SingleQuery<BoxFilterRadiusQuery> {
+  static const char* name() { return "radius_via_box"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    const Point3d& centre = w.centres_[q];
+    double radius = w.radii_[q];
+    BoundingBox box{
+      { centre.x - radius, centre.y - radius, centre.z - radius },
+      { centre.x + radius, centre.y + radius, centre.z + radius }
+    };
+    auto out = std::back_inserter(found);
+    tree.search(box, out);
+    found.erase(std::remove_if(found.begin(), found.end(),
+        [&](PointIterator it) { return distanceSquared(*it, centre) > radius * radius; }),
+        found.end());
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return RadiusQuery::check(w, q, found);
+  }
+};
+
+struct KnnQuery : SingleQuery<KnnQuery> {
+  static const char* name() { return "knn"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.knn(w.centres_[q], KNN_K, out);
+  }
+
+  // The right number of points, nearest first, ending at the right distance
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    const Point3d& centre = w.centres_[q];
+    if (found.size() != std::min<std::size_t>(KNN_K, w.points_.size())) {
+      return false;
+    }
+    for (std::size_t i = 1; i < found.size(); ++i) {
+      if (distanceSquared(*found[i - 1], centre) > distanceSquared(*found[i], centre)) {
+        return false;
+      }
+    }
+    return distanceSquared(*found.back(), centre) == w.kthDistance_[q];
+  }
+};
+
+struct RayQuery : SingleQuery<RayQuery> {
+  static const char* name() { return "ray"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.raycast(w.rays_[q], w.rayRadii_[q], out);
+  }
+
+  // The right number of points, front to back
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    const Ray& ray = w.rays_[q];
+    for (std::size_t i = 1; i < found.size(); ++i) {
+      if (ray.along(*found[i - 1]) > ray.along(*found[i])) {
+        return false;
+      }
+    }
+    return found.size() == w.rayExpected_[q];
+  }
+};
+
+// The nearest hit alone, which can stop at the first leaf that has one
+struct FirstHitQuery : SingleQuery<FirstHitQuery> {
+  static const char* name() { return "ray_first"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.firstHits(w.rays_[q], w.rayRadii_[q], 1, out);
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    if (w.rayExpected_[q] == 0) {
+      return found.empty();
+    }
+    return found.size() == 1 && w.rays_[q].along(*found[0]) == w.firstHit_[q];
+  }
+};
+
+// Covers the segment with boxes, each around a piece of it twice the radius
+// long, and keeps what they find within the radius, once each, front to back
+struct SweptBoxRayQuery : SingleQuery<SweptBoxRayQuery> {
+  static const char* name() { return "ray_via_boxes"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    const Ray& ray = w.rays_[q];
+    double radius = w.rayRadii_[q];
+    double step = std::max(2 * radius, ray.length_ / 1000.);
+    auto out = std::back_inserter(found);
+    for (double t = 0; ; t += step) {
+      Point3d a = ray.at(t), b = ray.at(std::min(t + step, ray.length_));
+      BoundingBox box{
+        { std::min(a.x, b.x) - radius, std::min(a.y, b.y) - radius, std::min(a.z, b.z) - radius },
+        { std::max(a.x, b.x) + radius, std::max(a.y, b.y) + radius, std::max(a.z, b.z) + radius }
+      };
+      tree.search(box, out);
+      if (t + step >= ray.length_) {
+        break;
+      }
+    }
+    found.erase(std::remove_if(found.begin(), found.end(),
+        [&](PointIterator it) { return ray.distanceSquared(*it, ray.along(*it)) > radius * radius; }),
+        found.end());
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    std::sort(found.begin(), found.end(), [&](PointIterator a, PointIterator b) {
+      return ray.along(*a) < ray.along(*b);
+    });
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return RayQuery::check(w, q, found);
+  }
+};
+
+struct FrustumQuery : SingleQuery<FrustumQuery> {
+  static const char* name() { return "frustum"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    auto out = std::back_inserter(found);
+    tree.search(w.frustums_[q], out);
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return found.size() == w.frustumExpected_[q];
+  }
+};
+
+// Searches the box around the frustum and keeps what is inside its planes
+struct FrustumViaBoxQuery : SingleQuery<FrustumViaBoxQuery> {
+  static const char* name() { return "frustum_via_box"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    const ConvexPolytope& frustum = w.frustums_[q];
+    auto out = std::back_inserter(found);
+    tree.search(frustum.bounds_, out);
+    found.erase(std::remove_if(found.begin(), found.end(),
+        [&](PointIterator it) { return !frustum.contains(*it); }), found.end());
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return FrustumQuery::check(w, q, found);
+  }
+};
+
+// Counts what is written to it, as the joins below only need to know how
+// many pairs they found
+struct PairCounter {
+  std::size_t* count_;
+
+  PairCounter& operator*() { return *this; }
+
+  template <typename Pair>
+  PairCounter& operator=(const Pair&) {
+    ++*count_;
+    return *this;
+  }
+
+  PairCounter& operator++() { return *this; }
+};
+
+// Finds every pair of points within joinEpsilon_ of each other JOIN_REPEATS
+// times, each join's time its latency, on the calling thread alone or split
+// over the pool
+template <bool parallel>
+struct SelfJoinQuery {
+  static const char* name() { return parallel ? "self_join_parallel" : "self_join"; }
+
+  template <typename Tree>
+  static bool time(const Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    for (std::size_t repeat = 0; repeat < JOIN_REPEATS; ++repeat) {
+      std::size_t pairs = 0;
+      PairCounter out{&pairs};
+      Clock::time_point joinStart = Clock::now();
+      if (parallel) {
+        tree.selfJoin(w.joinEpsilon_, out, benchmarkPool());
+      } else {
+        tree.selfJoin(w.joinEpsilon_, out);
+      }
+      Clock::time_point joinEnd = Clock::now();
+      latencies.push_back(elapsedMicroseconds(joinStart, joinEnd));
+      correct &= pairs == w.joinExpected_;
+    }
+    return correct;
+  }
+};
+
+// The same pairs from a radius search around every point, keeping the
+// points found that come after it in the workload so that each pair is
+// counted once
+struct RadiusSelfJoinQuery {
+  static const char* name() { return "self_join_via_radius"; }
+
+  template <typename Tree>
+  static bool time(const Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    std::vector<PointIterator> found;
+    for (std::size_t repeat = 0; repeat < JOIN_REPEATS; ++repeat) {
+      std::size_t pairs = 0;
+      Clock::time_point joinStart = Clock::now();
+      for (PointIterator it = w.points_.cbegin(); it != w.points_.cend(); ++it) {
+        found.clear();
+        auto out = std::back_inserter(found);
+        tree.radiusSearch(*it, w.joinEpsilon_, out);
+        pairs += std::count_if(found.begin(), found.end(),
+                               [it](PointIterator other) { return other > it; });
+      }
+      Clock::time_point joinEnd = Clock::now();
+      latencies.push_back(elapsedMicroseconds(joinStart, joinEnd));
+      correct &= pairs == w.joinExpected_;
+    }
+    return correct;
+  }
+};
+
+// Grows a box around the query point until it holds KNN_K points no further
+// away than its half width, which must then include the nearest KNN_K, and
+// sorts those out of everything it found
+struct GrowingBoxKnnQuery : SingleQuery<GrowingBoxKnnQuery> {
+  static const char* name() { return "knn_growing_box"; }
+
+  template <typename Tree>
+  static void run(const Tree& tree, const Workload& w, std::size_t q,
+                  std::vector<PointIterator>& found) {
+    const Point3d& centre = w.centres_[q];
+    std::size_t k = std::min<std::size_t>(KNN_K, w.points_.size());
+    for (double half = w.knnStartHalfWidth_; ; half *= 2.) {
+      found.clear();
+      auto out = std::back_inserter(found);
+      BoundingBox box{
+        { centre.x - half, centre.y - half, centre.z - half },
+        { centre.x + half, centre.y + half, centre.z + half }
+      };
+      tree.search(box, out);
+
+      std::size_t within = std::count_if(found.begin(), found.end(),
+          [&](PointIterator it) { return distanceSquared(*it, centre) <= half * half; });
+      if (within >= k || found.size() == w.points_.size()) {
+        break;
+      }
+    }
+
+    std::partial_sort(found.begin(), found.begin() + k, found.end(),
+        [&](PointIterator a, PointIterator b) {
+          return distanceSquared(*a, centre) < distanceSquared(*b, centre);
+        });
+    found.resize(k);
+  }
+
+  static bool check(const Workload& w, std::size_t q, const std::vector<PointIterator>& found) {
+    return KnnQuery::check(w, q, found);
+  }
+};
+
+// Box queries answered BATCH_SIZE at a time through searchBatch(), on the
+// calling thread alone or split over the pool. Every query in a batch is
+// given an equal share of the batch's time as its latency.
+template <bool parallel>
+struct BatchBoxQuery {
+  static const char* name() { return parallel ? "box_batch_parallel" : "box_batch"; }
+
+  template <typename Tree>
+  static bool time(const Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    typename Tree::batch_results found;
+
+    for (std::size_t first = 0; first < w.queries_.size(); first += BATCH_SIZE) {
+      std::size_t last = std::min<std::size_t>(first + BATCH_SIZE, w.queries_.size());
+
+      Clock::time_point batchStart = Clock::now();
+      if (parallel) {
+        tree.searchBatch(w.queries_.begin() + first, w.queries_.begin() + last, found,
+                         benchmarkPool());
+      } else {
+        tree.searchBatch(w.queries_.begin() + first, w.queries_.begin() + last, found);
+      }
+      Clock::time_point batchEnd = Clock::now();
+
+      double us = elapsedMicroseconds(batchStart, batchEnd) / (last - first);
+      for (std::size_t q = first; q < last; ++q) {
+        latencies.push_back(us);
+        correct &= found[q - first].size() == w.expected_[q];
+      }
+    }
+    return correct;
+  }
+};
+
+// Each of CHURN_TICKS ticks moves 1% of the points, by erasing them from the
+// tree being raced and inserting them again, and the tick's time is its
+// latency. Points are taken at a stride so that each tick moves different ones.
+struct ChurnQuery {
+  static const char* name() { return "churn"; }
+
+  template <typename Tree>
+  static bool time(Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    for (std::size_t tick = 0; tick < CHURN_TICKS; ++tick) {
+      Clock::time_point tickStart = Clock::now();
+      for (std::size_t i = tick % 100; i < w.points_.size(); i += 100) {
+        correct &= tree.erase(w.points_.cbegin() + i);
+      }
+      for (std::size_t i = tick % 100; i < w.points_.size(); i += 100) {
+        correct &= tree.insert(w.points_.cbegin() + i);
+      }
+      Clock::time_point tickEnd = Clock::now();
+      latencies.push_back(elapsedMicroseconds(tickStart, tickEnd));
+    }
+
+    // The tree should still answer as if it had just been built
+    std::vector<PointIterator> found;
+    for (std::size_t q = 0; q < w.queries_.size(); ++q) {
+      found.clear();
+      BoxQuery::run(tree, w, q, found);
+      correct &= BoxQuery::check(w, q, found);
+    }
+    return correct && tree.size() == w.points_.size();
+  }
+};
+
+// Keeps up with the same moves by building the tree again every tick
+struct RebuildChurnQuery {
+  static const char* name() { return "churn_rebuild"; }
+
+  template <typename Tree>
+  static bool time(const Tree& tree, const Workload& w, std::vector<double>& latencies) {
+    bool correct = true;
+    for (std::size_t tick = 0; tick < CHURN_TICKS; ++tick) {
+      Clock::time_point tickStart = Clock::now();
+      Tree rebuilt(w.points_.cbegin(), w.points_.cend());
+      Clock::time_point tickEnd = Clock::now();
+      latencies.push_back(elapsedMicroseconds(tickStart, tickEnd));
+      correct &= rebuilt.size() == tree.size();
+    }
+    return correct;
+  }
+};
+
+// Every point drifts up to a tenth of a unit along each axis each tick, and
+// the tree follows through update(), either exactly or letting points stray
+// half a unit outside their leaf. The workload's points can't move, so this
+// builds its own tree over a copy of them. Moving the points isn't timed.
+template <bool loose>
+struct RefitQuery {
+  static const char* name() { return loose ? "refit_loose" : "refit"; }
+
+  template <typename Tree>
+  static bool time(const Tree&, const Workload& w, std::vector<double>& latencies) {
+    std::vector<Point3d> points(w.points_);
+    Tree tree(points.cbegin(), points.cend());
+    std::mt19937_64 generator(CHURN_TICKS);
+    std::uniform_real_distribution<double> drift(-0.1, 0.1);
+
+    for (std::size_t tick = 0; tick < CHURN_TICKS; ++tick) {
+      for (Point3d& p : points) {
+        p.x += drift(generator);
+        p.y += drift(generator);
+        p.z += drift(generator);
+      }
+
+      Clock::time_point tickStart = Clock::now();
+      tree.update(loose ? 0.5 : 0.);
+      Clock::time_point tickEnd = Clock::now();
+      latencies.push_back(elapsedMicroseconds(tickStart, tickEnd));
+    }
+
+    // A few of the boxes, against brute force over where the points are now
+    bool correct = tree.size() == points.size();
+    std::vector<PointIterator> found;
+    for (std::size_t q = 0; q < std::min<std::size_t>(10, w.queries_.size()); ++q) {
+      found.clear();
+      auto out = std::back_inserter(found);
+      tree.search(w.queries_[q], out);
+      correct &= static_cast<std::size_t>(std::count_if(points.begin(), points.end(),
+          [&](const Point3d& p) { return w.queries_[q].contains(p); })) == found.size();
+    }
+    return correct;
+  }
+};
+
+// Any extra arguments are handed to the tree's constructor after the range
+template <typename Tree, typename Query, typename... Args>
+RaceResult race(const std::string& structure, const Workload& w, Args&... args) {
+  RaceResult result = RaceResult();
+  result.workload_ = w.name_;
+  result.structure_ = structure;
+  result.query_ = Query::name();
+  result.points_ = w.points_.size();
+  result.queries_ = w.queries_.size();
+  result.trials_ = NUM_TRIALS;
+  result.correct_ = true;
+  result.buildMinMs_ = std::numeric_limits<double>::max();
+
+  std::vector<double> latencies;
+  latencies.reserve(NUM_TRIALS * w.queries_.size());
+  double totalBuildMs = 0.;
+
+  for (std::size_t trial = 0; trial < NUM_TRIALS; ++trial) {
+    std::size_t baseline = liveBytes.load();
+    peakBytes.store(baseline);
+
+    Clock::time_point buildStart = Clock::now();
+    Tree tree(w.points_.cbegin(), w.points_.cend(), args...);
+    Clock::time_point buildEnd = Clock::now();
+
+    double buildMs = elapsedMicroseconds(buildStart, buildEnd) / 1000.;
+    totalBuildMs += buildMs;
+    result.buildMinMs_ = std::min(result.buildMinMs_, buildMs);
+    result.buildMaxMs_ = std::max(result.buildMaxMs_, buildMs);
+    result.buildPeakBytes_ = std::max(result.buildPeakBytes_, peakBytes.load() - baseline);
+    result.treeBytes_ = std::max(result.treeBytes_, liveBytes.load() - baseline);
+
+    if (!Query::time(tree, w, latencies)) {
+      result.correct_ = false;
+    }
+  }
+
+  double totalQueryUs = std::accumulate(latencies.begin(), latencies.end(), 0.);
+  std::sort(latencies.begin(), latencies.end());
+  result.buildMeanMs_ = totalBuildMs / NUM_TRIALS;
+  result.latencyP50Us_ = percentile(latencies, 0.50);
+  result.latencyP90Us_ = percentile(latencies, 0.90);
+  result.latencyP99Us_ = percentile(latencies, 0.99);
+  result.latencyMaxUs_ = latencies.empty() ? 0. : latencies.back();
+  result.queriesPerSecond_ = totalQueryUs > 0. ? latencies.size() / (totalQueryUs / 1e6) : 0.;
+  return result;
+}
+
+// Every structure taking part in the race. New implementations only need a
+// line here to be raced over every workload.
+void raceAll(const Workload& w, std::vector<RaceResult>& results) {
+  using OctreeType = Octree<PointIterator, PointIdentity>;
+  using PointerlessOctreeType = PointerlessOctree<PointIterator, PointIdentity>;
+  using FloatOctreeType = Octree<PointIterator, PointIdentity, 16, 100, std::allocator<char>, float>;
+  using FloatPointerlessOctreeType = PointerlessOctree<PointIterator, PointIdentity, 16, 21, float>;
+  using QuantizedPointerlessOctreeType = PointerlessOctree<PointIterator, PointIdentity, 16, 21, Quantized<16>>;
+  using LooseOctreeType = LooseOctree<PointIterator, PointBox>;
+  TaskPool& pool = benchmarkPool();
+
+  results.push_back(race<OctreeType, BoxQuery>("Octree", w));
+  LazyBuild lazy;
+  results.push_back(race<OctreeType, BoxQuery>("Octree (lazy)", w, lazy));
+  results.push_back(race<OctreeType, BoxQuery>("Octree (parallel)", w, pool));
+  results.push_back(race<PublishedOctree, BoxQuery>("Octree (published)", w));
+  results.push_back(race<PointerlessOctreeType, BoxQuery>("PointerlessOctree", w));
+  results.push_back(race<LooseOctreeType, BoxQuery>("LooseOctree", w));
+  results.push_back(race<FloatOctreeType, BoxQuery>("Octree (float)", w));
+  results.push_back(race<FloatPointerlessOctreeType, BoxQuery>("PointerlessOctree (float)", w));
+  results.push_back(race<QuantizedPointerlessOctreeType, BoxQuery>("PointerlessOctree (16 bit)", w));
+
+  results.push_back(race<OctreeType, BatchBoxQuery<false>>("Octree", w));
+  results.push_back(race<OctreeType, BatchBoxQuery<true>>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, BatchBoxQuery<false>>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, BatchBoxQuery<true>>("PointerlessOctree", w));
+
+  results.push_back(race<OctreeType, RangeBoxQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, RangeBoxQuery>("PointerlessOctree", w));
+
+  results.push_back(race<OctreeType, AnyBoxQuery>("Octree", w));
+  results.push_back(race<OctreeType, SearchAnyBoxQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, AnyBoxQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, SearchAnyBoxQuery>("PointerlessOctree", w));
+
+  results.push_back(race<OctreeType, RadiusQuery>("Octree", w));
+  results.push_back(race<OctreeType, BoxFilterRadiusQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, RadiusQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, BoxFilterRadiusQuery>("PointerlessOctree", w));
+  results.push_back(race<FloatOctreeType, RadiusQuery>("Octree (float)", w));
+  results.push_back(race<FloatPointerlessOctreeType, RadiusQuery>("PointerlessOctree (float)", w));
+  results.push_back(race<QuantizedPointerlessOctreeType, RadiusQuery>("PointerlessOctree (16 bit)", w));
+
+  results.push_back(race<OctreeType, KnnQuery>("Octree", w));
+  results.push_back(race<OctreeType, KnnQuery>("Octree (lazy)", w, lazy));
+  results.push_back(race<OctreeType, GrowingBoxKnnQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, KnnQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, GrowingBoxKnnQuery>("PointerlessOctree", w));
+  results.push_back(race<FloatOctreeType, KnnQuery>("Octree (float)", w));
+  results.push_back(race<FloatPointerlessOctreeType, KnnQuery>("PointerlessOctree (float)", w));
+  results.push_back(race<QuantizedPointerlessOctreeType, KnnQuery>("PointerlessOctree (16 bit)", w));
+
+  results.push_back(race<OctreeType, RayQuery>("Octree", w));
+  results.push_back(race<OctreeType, FirstHitQuery>("Octree", w));
+  results.push_back(race<OctreeType, SweptBoxRayQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, RayQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, FirstHitQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, SweptBoxRayQuery>("PointerlessOctree", w));
+
+  results.push_back(race<OctreeType, FrustumQuery>("Octree", w));
+  results.push_back(race<OctreeType, FrustumViaBoxQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, FrustumQuery>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, FrustumViaBoxQuery>("PointerlessOctree", w));
+  results.push_back(race<QuantizedPointerlessOctreeType, FrustumQuery>("PointerlessOctree (16 bit)", w));
+
+  results.push_back(race<OctreeType, SelfJoinQuery<false>>("Octree", w));
+  results.push_back(race<OctreeType, SelfJoinQuery<true>>("Octree", w));
+  results.push_back(race<OctreeType, RadiusSelfJoinQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, SelfJoinQuery<false>>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, SelfJoinQuery<true>>("PointerlessOctree", w));
+  results.push_back(race<PointerlessOctreeType, RadiusSelfJoinQuery>("PointerlessOctree", w));
+
+  std::string treePath = "benchmark_octree.tree";
+  PointerlessOctreeType(w.points_.cbegin(), w.points_.cend()).save(treePath, w.points_.cbegin());
+  results.push_back(race<MappedPointerlessOctree, BoxQuery>("PointerlessOctree (mapped)", w, treePath));
+  results.push_back(race<MappedPointerlessOctree, RadiusQuery>("PointerlessOctree (mapped)", w, treePath));
+  results.push_back(race<MappedPointerlessOctree, KnnQuery>("PointerlessOctree (mapped)", w, treePath));
+  results.push_back(race<StreamedPointerlessOctree, BoxQuery>("PointerlessOctree (streamed)", w, treePath));
+  std::remove(treePath.c_str());
+
+  results.push_back(race<OctreeType, ChurnQuery>("Octree", w));
+  results.push_back(race<OctreeType, RebuildChurnQuery>("Octree", w));
+  results.push_back(race<PointerlessOctreeType, RebuildChurnQuery>("PointerlessOctree", w));
+
+  results.push_back(race<OctreeType, RefitQuery<false>>("Octree", w));
+  results.push_back(race<OctreeType, RefitQuery<true>>("Octree", w));
+}
+
+template <typename Tree>
+ProfileResult profile(const std::string& structure, const Workload& w) {
+  ProfileResult result = ProfileResult();
+  result.workload_ = w.name_;
+  result.structure_ = structure;
+  result.queries_ = w.queries_.size();
+
+  Tree tree(w.points_.cbegin(), w.points_.cend());
+  result.tree_ = tree.stats();
+  std::vector<PointIterator> found;
+  auto out = std::back_inserter(found);
+  for (std::size_t q = 0; q < w.queries_.size(); ++q) {
+    found.clear();
+    tree.search(w.queries_[q], out, result.box_);
+    found.clear();
+    tree.radiusSearch(w.centres_[q], w.radii_[q], out, result.radius_);
+    found.clear();
+    tree.knn(w.centres_[q], KNN_K, out, result.knn_);
+  }
+  return result;
+}
+
+void profileAll(const Workload& w, std::vector<ProfileResult>& profiles) {
+  profiles.push_back(profile<Octree<PointIterator, PointIdentity>>("Octree", w));
+  profiles.push_back(profile<PointerlessOctree<PointIterator, PointIdentity>>("PointerlessOctree", w));
+}
+
+void benchmark_small_even_dispersion(std::vector<RaceResult>& results,
+                                     std::vector<ProfileResult>& profiles) {
+  Workload w = makeEvenWorkload("small_even_dispersion", SMALL_WORKLOAD_SIZE, 1);
+  raceAll(w, results);
+  profileAll(w, profiles);
+}
+
+void benchmark_large_even_dispersion(std::vector<RaceResult>& results,
+                                     std::vector<ProfileResult>& profiles) {
+  Workload w = makeEvenWorkload("large_even_dispersion", LARGE_WORKLOAD_SIZE, 2);
+  raceAll(w, results);
+  profileAll(w, profiles);
+}
+
+void benchmark_small_uneven_dispersion(std::vector<RaceResult>& results,
+                                       std::vector<ProfileResult>& profiles) {
+  Workload w = makeClusteredWorkload("small_uneven_dispersion", SMALL_WORKLOAD_SIZE, 0.05, 3);
+  raceAll(w, results);
+  profileAll(w, profiles);
+}
+
+void benchmark_large_mostlyeven_dispersion(std::vector<RaceResult>& results,
+                                           std::vector<ProfileResult>& profiles) {
+  Workload w = makeClusteredWorkload("large_mostlyeven_dispersion", LARGE_WORKLOAD_SIZE, 0.8, 4);
+  raceAll(w, results);
+  profileAll(w, profiles);
+}
+
+void printTable(std::ostream& out, const std::vector<RaceResult>& results) {
+  out << std::left << std::setw(30) << "workload"
+      << std::setw(30) << "structure"
+      << std::setw(20) << "query"
+      << std::right << std::setw(12) << "build ms"
+      << std::setw(12) << "p50 us"
+      << std::setw(12) << "p99 us"
+      << std::setw(14) << "queries/s"
+      << std::setw(14) << "peak KiB"
+      << std::setw(9) << "correct" << "\n";
+  out << std::fixed << std::setprecision(2);
+  for (const RaceResult& r : results) {
+    out << std::left << std::setw(30) << r.workload_
+        << std::setw(30) << r.structure_
+        << std::setw(20) << r.query_
+        << std::right << std::setw(12) << r.buildMeanMs_
+        << std::setw(12) << r.latencyP50Us_
+        << std::setw(12) << r.latencyP99Us_
+        << std::setw(14) << r.queriesPerSecond_
+        << std::setw(14) << r.buildPeakBytes_ / 1024
+        << std::setw(9) << (r.correct_ ? "yes" : "NO") << "\n";
+  }
+}
+
+void writeCsv(std::ostream& out, const std::vector<RaceResult>& results) {
+  out << "workload,structure,query,points,queries,trials,"
+      << "build_mean_ms,build_min_ms,build_max_ms,"
+      << "latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us,"
+      << "queries_per_second,build_peak_bytes,tree_bytes,correct\n";
+  out << std::setprecision(6) << std::fixed;
+  for (const RaceResult& r : results) {
+    out << r.workload_ << "," << r.structure_ << "," << r.query_ << ","
+        << r.points_ << "," << r.queries_ << "," << r.trials_ << ","
+        << r.buildMeanMs_ << "," << r.buildMinMs_ << "," << r.buildMaxMs_ << ","
+        << r.latencyP50Us_ << "," << r.latencyP90Us_ << ","
+        << r.latencyP99Us_ << "," << r.latencyMaxUs_ << ","
+        << r.queriesPerSecond_ << ","
+        << r.buildPeakBytes_ << "," << r.treeBytes_ << ","
+        << (r.correct_ ? "true" : "false") << "\n";
+  }
+}
+
+void writeJsonCounts(std::ostream& out, const std::vector<std::size_t>& counts) {
+  out << "[";
+  for (std::size_t i = 0; i < counts.size(); ++i) {
+    out << (i == 0 ? "" : ", ") << counts[i];
+  }
+  out << "]";
+}
+
+// Per query averages
+void writeJsonQueryStats(std::ostream& out, const char* name, const QueryStats& stats,
+                         std::size_t queries, bool last) {
+  double n = std::max<std::size_t>(queries, 1);
+  out << "        \"" << name << "\": {"
+      << "\"nodes_visited\": " << stats.nodes_visited_ / n << ", "
+      << "\"nodes_pruned\": " << stats.nodes_pruned_ / n << ", "
+      << "\"points_tested\": " << stats.points_tested_ / n << ", "
+      << "\"hits\": " << stats.hits_ / n << "}" << (last ? "\n" : ",\n");
+}
+
+void writeJson(std::ostream& out, const std::vector<RaceResult>& results,
+               const std::vector<ProfileResult>& profiles) {
+  out << std::setprecision(6) << std::fixed;
+  out << "{\n"
+      << "  \"num_trials\": " << NUM_TRIALS << ",\n"
+      << "  \"num_queries\": " << NUM_QUERIES << ",\n"
+      << "  \"knn_k\": " << KNN_K << ",\n"
+      << "  \"batch_size\": " << BATCH_SIZE << ",\n"
+      << "  \"leaf_kernel\": \"" << leafKernelName() << "\",\n"
+      << "  \"results\": [";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const RaceResult& r = results[i];
+    out << (i == 0 ? "\n" : ",\n")
+        << "    {\n"
+        << "      \"workload\": \"" << r.workload_ << "\",\n"
+        << "      \"structure\": \"" << r.structure_ << "\",\n"
+        << "      \"query\": \"" << r.query_ << "\",\n"
+        << "      \"points\": " << r.points_ << ",\n"
+        << "      \"queries\": " << r.queries_ << ",\n"
+        << "      \"trials\": " << r.trials_ << ",\n"
+        << "      \"build_mean_ms\": " << r.buildMeanMs_ << ",\n"
+        << "      \"build_min_ms\": " << r.buildMinMs_ << ",\n"
+        << "      \"build_max_ms\": " << r.buildMaxMs_ << ",\n"
+        << "      \"latency_p50_us\": " << r.latencyP50Us_ << ",\n"
+        << "      \"latency_p90_us\": " << r.latencyP90Us_ << ",\n"
+        << "      \"latency_p99_us\": " << r.latencyP99Us_ << ",\n"
+        << "      \"latency_max_us\": " << r.latencyMaxUs_ << ",\n"
+        << "      \"queries_per_second\": " << r.queriesPerSecond_ << ",\n"
+        << "      \"build_peak_bytes\": " << r.buildPeakBytes_ << ",\n"
+        << "      \"tree_bytes\": " << r.treeBytes_ << ",\n"
+        << "      \"correct\": " << (r.correct_ ? "true" : "false") << "\n"
+        << "    }";
+  }
+  out << "\n  ],\n"
+      << "  \"profiles\": [";
+  for (std::size_t i = 0; i < profiles.size(); ++i) {
+    const ProfileResult& p = profiles[i];
+    const TreeStats& t = p.tree_;
+    out << (i == 0 ? "\n" : ",\n")
+        << "    {\n"
+        << "      \"workload\": \"" << p.workload_ << "\",\n"
+        << "      \"structure\": \"" << p.structure_ << "\",\n"
+        << "      \"tree\": {\n"
+        << "        \"nodes\": " << t.nodes_ << ",\n"
+        << "        \"internal_nodes\": " << t.internal_nodes_ << ",\n"
+        << "        \"leaves\": " << t.leaves_ << ",\n"
+        << "        \"max_depth_leaves\": " << t.max_depth_leaves_ << ",\n"
+        << "        \"points\": " << t.points_ << ",\n"
+        << "        \"bytes\": " << t.bytes_ << ",\n"
+        << "        \"bytes_per_point\": " << t.bytesPerPoint() << ",\n"
+        << "        \"empty_child_ratio\": " << t.emptyChildRatio() << ",\n"
+        << "        \"nodes_by_depth\": ";
+    writeJsonCounts(out, t.nodes_by_depth_);
+    out << ",\n"
+        << "        \"leaves_by_size\": ";
+    writeJsonCounts(out, t.leaves_by_size_);
+    out << "\n"
+        << "      },\n"
+        << "      \"per_query\": {\n";
+    writeJsonQueryStats(out, "box", p.box_, p.queries_, false);
+    writeJsonQueryStats(out, "radius", p.radius_, p.queries_, false);
+    writeJsonQueryStats(out, "knn", p.knn_, p.queries_, true);
+    out << "      }\n"
+        << "    }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+  std::string csvPath = "benchmark_results.csv";
+  std::string jsonPath = "benchmark_results.json";
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 6, "--csv=") == 0) {
+      csvPath = arg.substr(6);
+    } else if (arg.compare(0, 7, "--json=") == 0) {
+      jsonPath = arg.substr(7);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--csv=<path>] [--json=<path>]\n";
+      return 2;
+    }
+  }
+
+  std::vector<RaceResult> results;
+  std::vector<ProfileResult> profiles;
+  benchmark_small_even_dispersion(results, profiles);
+  benchmark_large_even_dispersion(results, profiles);
+  benchmark_small_uneven_dispersion(results, profiles);
+  benchmark_large_mostlyeven_dispersion(results, profiles);
+
+  std::cout << "leaf kernel: " << leafKernelName() << "\n";
+  printTable(std::cout, results);
+
+  std::ofstream csv(csvPath);
+  writeCsv(csv, results);
+  std::ofstream json(jsonPath);
+  writeJson(json, results, profiles);
+
+  bool allCorrect = std::all_of(results.begin(), results.end(),
+      [](const RaceResult& r) { return r.correct_; });
+  return allCorrect ? 0 : 1;
+}
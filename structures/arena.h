@@ -0,0 +1,148 @@
+/*
+    file - arena.h
+
+    A bump allocator that hands out memory from large chunks and gives it all
+    back at once. Objects placed in an arena are never freed individually;
+    their owner runs any destructors that matter and then releases the arena.
+
+    Chunks come from the given allocator (rebound to char), start small and
+    double up to a cap, so tiny trees stay tiny and big ones make few calls
+    into the allocator. Allocation is guarded by a mutex so that a parallel
+    build can share one arena.
+
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template <typename Allocator = std::allocator<char>>
+class Arena {
+ public:
+  using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<char>;
+
+  static const std::size_t initial_chunk_size = 16 * 1024;
+  static const std::size_t max_chunk_size = 4 * 1024 * 1024;
+
+  explicit Arena(const Allocator& alloc = Allocator());
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  Arena(Arena&& rhs);
+
+  ~Arena();
+
+  void swap(Arena& rhs);
+
+  void* allocate(std::size_t bytes, std::size_t alignment);
+
+  // Uninitialised room for count objects of type T
+  template <typename T>
+  T* allocate(std::size_t count);
+
+  // Returns every chunk to the allocator
+  void release();
+
+  // Total size of the chunks currently held
+  std::size_t reserved() const;
+
+ private:
+  struct Chunk {
+    char* data_;
+    std::size_t size_;
+  };
+
+  allocator_type allocator_;
+  std::vector<Chunk> chunks_;
+  char* cursor_;
+  char* limit_;
+  std::size_t next_chunk_size_;
+  std::mutex mutex_;
+};
+
+#define ARENA_TEMPLATE typename Allocator
+#define ARENA Arena<Allocator>
+
+template <ARENA_TEMPLATE>
+ARENA::Arena(const Allocator& alloc)
+  : allocator_(alloc), cursor_(nullptr), limit_(nullptr),
+    next_chunk_size_(initial_chunk_size) { }
+
+template <ARENA_TEMPLATE>
+ARENA::Arena(ARENA&& rhs)
+  : allocator_(rhs.allocator_), cursor_(nullptr), limit_(nullptr),
+    next_chunk_size_(initial_chunk_size) {
+  swap(rhs);
+}
+
+template <ARENA_TEMPLATE>
+ARENA::~Arena() {
+  release();
+}
+
+template <ARENA_TEMPLATE>
+void ARENA::swap(ARENA& rhs) {
+  std::swap(allocator_, rhs.allocator_);
+  std::swap(chunks_, rhs.chunks_);
+  std::swap(cursor_, rhs.cursor_);
+  std::swap(limit_, rhs.limit_);
+  std::swap(next_chunk_size_, rhs.next_chunk_size_);
+}
+
+template <ARENA_TEMPLATE>
+void* ARENA::allocate(std::size_t bytes, std::size_t alignment) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::uintptr_t address = reinterpret_cast<std::uintptr_t>(cursor_);
+  std::uintptr_t aligned = (address + alignment - 1) & ~(alignment - 1);
+  if (cursor_ == nullptr || aligned + bytes > reinterpret_cast<std::uintptr_t>(limit_)) {
+    std::size_t size = std::max(next_chunk_size_, bytes + alignment);
+    Chunk chunk{allocator_.allocate(size), size};
+    chunks_.push_back(chunk);
+    cursor_ = chunk.data_;
+    limit_ = chunk.data_ + size;
+    next_chunk_size_ = std::min(next_chunk_size_ * 2, static_cast<std::size_t>(max_chunk_size));
+
+    address = reinterpret_cast<std::uintptr_t>(cursor_);
+    aligned = (address + alignment - 1) & ~(alignment - 1);
+  }
+
+  cursor_ += (aligned - address) + bytes;
+  return reinterpret_cast<void*>(aligned);
+}
+
+template <ARENA_TEMPLATE>
+template <typename T>
+T* ARENA::allocate(std::size_t count) {
+  return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+}
+
+template <ARENA_TEMPLATE>
+void ARENA::release() {
+  for (const Chunk& chunk : chunks_) {
+    allocator_.deallocate(chunk.data_, chunk.size_);
+  }
+  chunks_.clear();
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  next_chunk_size_ = initial_chunk_size;
+}
+
+template <ARENA_TEMPLATE>
+std::size_t ARENA::reserved() const {
+  std::size_t total = 0;
+  for (const Chunk& chunk : chunks_) {
+    total += chunk.size_;
+  }
+  return total;
+}
+
+#endif // defined ARENA_H
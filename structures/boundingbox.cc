@@ -4,6 +4,7 @@
 #include <cmath>
 #include <iostream>
 #include <array>
+#include <algorithm>
 
 using std::array;
 
@@ -19,6 +20,47 @@ bool BoundingBox::contains(const Point3d& point) const {
          mins_.z <= point.z && point.z <= maxes_.z;
 }
 
+bool BoundingBox::intersects(const BoundingBox& other) const {
+  return mins_.x <= other.maxes_.x && other.mins_.x <= maxes_.x &&
+         mins_.y <= other.maxes_.y && other.mins_.y <= maxes_.y &&
+         mins_.z <= other.maxes_.z && other.mins_.z <= maxes_.z;
+}
+
+double BoundingBox::distanceSquared(const Point3d& p) const {
+  double dx = std::max(std::max(mins_.x - p.x, p.x - maxes_.x), 0.);
+  double dy = std::max(std::max(mins_.y - p.y, p.y - maxes_.y), 0.);
+  double dz = std::max(std::max(mins_.z - p.z, p.z - maxes_.z), 0.);
+  return dx * dx + dy * dy + dz * dz;
+}
+
+double BoundingBox::maxDistanceSquared(const Point3d& p) const {
+  double dx = std::max(p.x - mins_.x, maxes_.x - p.x);
+  double dy = std::max(p.y - mins_.y, maxes_.y - p.y);
+  double dz = std::max(p.z - mins_.z, maxes_.z - p.z);
+  return dx * dx + dy * dy + dz * dz;
+}
+
+double BoundingBox::distanceSquared(const BoundingBox& other) const {
+  double dx = std::max(std::max(mins_.x - other.maxes_.x, other.mins_.x - maxes_.x), 0.);
+  double dy = std::max(std::max(mins_.y - other.maxes_.y, other.mins_.y - maxes_.y), 0.);
+  double dz = std::max(std::max(mins_.z - other.maxes_.z, other.mins_.z - maxes_.z), 0.);
+  return dx * dx + dy * dy + dz * dz;
+}
+
+double BoundingBox::maxDistanceSquared(const BoundingBox& other) const {
+  double dx = std::max(other.maxes_.x - mins_.x, maxes_.x - other.mins_.x);
+  double dy = std::max(other.maxes_.y - mins_.y, maxes_.y - other.mins_.y);
+  double dz = std::max(other.maxes_.z - mins_.z, maxes_.z - other.mins_.z);
+  return dx * dx + dy * dy + dz * dz;
+}
+
+BoundingBox BoundingBox::grown(double margin) const {
+  return BoundingBox{
+    { mins_.x - margin, mins_.y - margin, mins_.z - margin },
+    { maxes_.x + margin, maxes_.y + margin, maxes_.z + margin }
+  };
+}
+
 BoundingBox BoundingBox::overlap(const BoundingBox& other) const {
   // trivial cases
   if (contains(other)) {
@@ -28,9 +70,7 @@ BoundingBox BoundingBox::overlap(const BoundingBox& other) const {
   } 
 
   // Check if there is no intersection
-  if (maxes_.x < other.mins_.x || mins_.x > other.maxes_.x ||
-      maxes_.y < other.mins_.y || mins_.y > other.maxes_.y ||
-      maxes_.z < other.mins_.z || mins_.z > other.maxes_.z) {
+  if (!intersects(other)) {
     return invalidBox;
   }
 
@@ -50,9 +90,9 @@ BoundingBox BoundingBox::overlap(const BoundingBox& other) const {
 }
 
 array<BoundingBox, 8> BoundingBox::partition() const {
-  const double xmid = (maxes_.x - mins_.x) / 2.;
-  const double ymid = (maxes_.y - mins_.y) / 2.;
-  const double zmid = (maxes_.z - mins_.z) / 2.;
+  const double xmid = mins_.x + (maxes_.x - mins_.x) / 2.;
+  const double ymid = mins_.y + (maxes_.y - mins_.y) / 2.;
+  const double zmid = mins_.z + (maxes_.z - mins_.z) / 2.;
 
   std::array<BoundingBox, 8> ret{{
     BoundingBox{{mins_.x, mins_.y, mins_.z}, {xmid, ymid, zmid}},   // bottom left front
@@ -89,14 +129,15 @@ std::ostream& operator<<(std::ostream& out, const BoundingBox& rhs) {
 
 
 std::size_t BoundingBox::getChildPartitionIndex(const Point3d& p) const {
-  // children are ordered left to right, front to back, bottom to top.
-
-  double xmid = (maxes_.x - mins_.x) / 2.;
-  double ymid = (maxes_.y - mins_.y) / 2.;
-  double zmid = (maxes_.z - mins_.z) / 2.;
-  bool left = p.x < xmid && p.x >= mins_.x;
-  bool front = p.y < ymid && p.y >= mins_.y;
-  bool bottom = p.z < zmid && p.z >= mins_.z;
-
-  return (!bottom << 2) | (!left << 1) | !front;
+  // children are ordered left to right, front to back, bottom to top, the
+  // same as partition(). Points on a midplane belong to the upper child so
+  // that every point lands in exactly one child.
+  double xmid = mins_.x + (maxes_.x - mins_.x) / 2.;
+  double ymid = mins_.y + (maxes_.y - mins_.y) / 2.;
+  double zmid = mins_.z + (maxes_.z - mins_.z) / 2.;
+  bool right = p.x >= xmid;
+  bool back = p.y >= ymid;
+  bool top = p.z >= zmid;
+
+  return (top << 2) | (back << 1) | right;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef BOUNDINGBOX_H
 #define BOUNDINGBOX_H
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <limits>
@@ -15,6 +16,24 @@ struct BoundingBox {
   bool contains(const BoundingBox& other) const;
   bool contains(const Point3d& p) const;
 
+  // Whether the boxes share at least one point, faces included
+  bool intersects(const BoundingBox& other) const;
+
+  // Squared distance from p to the nearest point of the box, 0 inside it
+  double distanceSquared(const Point3d& p) const;
+
+  // Squared distance from p to the furthest corner of the box
+  double maxDistanceSquared(const Point3d& p) const;
+
+  // The least and greatest squared distance between a point in this box and
+  // a point in other. Rounding never takes either past the distance worked
+  // out the same way between any two such points.
+  double distanceSquared(const BoundingBox& other) const;
+  double maxDistanceSquared(const BoundingBox& other) const;
+
+  // The box pushed out by margin on every side
+  BoundingBox grown(double margin) const;
+
   BoundingBox overlap(const BoundingBox& other) const;
   std::array<BoundingBox, 8> partition() const;
 
@@ -26,9 +45,11 @@ struct BoundingBox {
   Point3d mins_, maxes_;
 };
 
+std::ostream& operator<<(std::ostream& out, const BoundingBox& rhs);
+
 static const BoundingBox initialBox = {
   { limits::max(), limits::max(), limits::max() },
-  { limits::min(), limits::min(), limits::min() }
+  { limits::lowest(), limits::lowest(), limits::lowest() }
 };
 
 static const BoundingBox invalidBox = {
@@ -52,4 +73,42 @@ BoundingBox makeBoundingBox(InputIterator begin, InputIterator end) {
   return returnBox;
 }
 
+// Reorders the elements [first, last) in place so that the ones falling in
+// each child of box (in partition() order) are contiguous, using
+// getChildPartitionIndex on pointAt(i). swapAt(i, j) exchanges two elements,
+// so the elements can be spread over several arrays. Elements already in their
+// child's run never move. Returns where each child's run starts, then last.
+template <typename PointAt, typename SwapAt>
+std::array<std::size_t, 9> partitionByOctant(
+    const BoundingBox& box, std::size_t first, std::size_t last,
+    PointAt pointAt, SwapAt swapAt) {
+  std::array<std::size_t, 8> counts{{}};
+  for (std::size_t i = first; i < last; ++i) {
+    ++counts[box.getChildPartitionIndex(pointAt(i))];
+  }
+
+  std::array<std::size_t, 9> bounds;
+  std::array<std::size_t, 8> next;
+  bounds[0] = first;
+  for (std::size_t child = 0; child < 8; ++child) {
+    next[child] = bounds[child];
+    bounds[child + 1] = bounds[child] + counts[child];
+  }
+
+  // Swap every element straight into the next free slot of its child's run
+  for (std::size_t child = 0; child < 8; ++child) {
+    while (next[child] != bounds[child + 1]) {
+      std::size_t target = box.getChildPartitionIndex(pointAt(next[child]));
+      if (target == child) {
+        ++next[child];
+      } else {
+        swapAt(next[child], next[target]);
+        ++next[target];
+      }
+    }
+  }
+
+  return bounds;
+}
+
 #endif // defined BOUNDINGBOX_H
@@ -0,0 +1,658 @@
+/*
+    file - leaf_kernel.h
+
+    Box, sphere and half-space containment tests over points stored as
+    separate x, y and z arrays, of either double or float.
+
+    containsBlock(), withinBlock() and belowPlaneBlock() test up to 64 points
+    at a time and return a bit mask of the ones inside the box, sphere or
+    half-space. Joins find the pairs of points from two leaves, or within
+    one, that are close enough by testing every point of one leaf against the
+    other with withinBlock(). The widest instruction set the translation unit
+    is compiled for is used (AVX-512, AVX, SSE2), and any points left over
+    fall through to a scalar loop. Build with -march=native (make NATIVE=1)
+    to get the widest kernel the machine supports.
+
+    Trees that store float coordinates round every point to float as it goes
+    in, and box tests round the box's edges inwards to float, so a float box
+    test gives exactly the answer the double one would for the stored point
+    while testing twice as many points per instruction. Sphere and plane
+    tests widen the points back to double.
+
+ */
+
+#ifndef LEAF_KERNEL_H
+#define LEAF_KERNEL_H
+
+#include "boundingbox.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+inline const char* leafKernelName() {
+#if defined(__AVX512F__)
+  return "avx512";
+#elif defined(__AVX__)
+  return "avx";
+#elif defined(__SSE2__)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// v as a tree storing Scalar coordinates keeps it. Doubles beyond float's
+// range become infinite, where a plain conversion would be undefined.
+template <typename Scalar>
+inline Scalar toScalar(double v) {
+  return static_cast<Scalar>(v);
+}
+
+template <>
+inline float toScalar<float>(double v) {
+  const double largest = std::numeric_limits<float>::max();
+  if (v > largest) {
+    return std::numeric_limits<float>::infinity();
+  } else if (v < -largest) {
+    return -std::numeric_limits<float>::infinity();
+  }
+  return static_cast<float>(v);
+}
+
+// The smallest Scalar no less than v, and the largest no greater than it, so
+// that x >= v exactly when x >= scalarAtLeast(v) for every Scalar x
+template <typename Scalar>
+inline Scalar scalarAtLeast(double v) {
+  return toScalar<Scalar>(v);
+}
+
+template <typename Scalar>
+inline Scalar scalarAtMost(double v) {
+  return toScalar<Scalar>(v);
+}
+
+// The float after f, towards infinity if up and away from it if not. f has to
+// be finite, and is stepped by its bits since this runs for every leaf a box
+// search scans.
+inline float stepFloat(float f, bool up) {
+  if (f == 0.f) {
+    return up ? std::numeric_limits<float>::denorm_min() : -std::numeric_limits<float>::denorm_min();
+  }
+  std::uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  bits = (f > 0.f) == up ? bits + 1 : bits - 1;
+  std::memcpy(&f, &bits, sizeof(bits));
+  return f;
+}
+
+template <>
+inline float scalarAtLeast<float>(double v) {
+  float rounded = toScalar<float>(v);
+  return rounded < v ? stepFloat(rounded, true) : rounded;
+}
+
+template <>
+inline float scalarAtMost<float>(double v) {
+  float rounded = toScalar<float>(v);
+  return rounded > v ? stepFloat(rounded, false) : rounded;
+}
+
+// p as a tree storing Scalar coordinates keeps it
+template <typename Scalar>
+inline Point3d toScalarPoint(const Point3d& p) {
+  return Point3d{toScalar<Scalar>(p.x), toScalar<Scalar>(p.y), toScalar<Scalar>(p.z)};
+}
+
+// Bit i of the result is set if point i is in box. Requires n <= 64.
+inline std::uint64_t containsBlock(const BoundingBox& box,
+                                   const double* xs, const double* ys, const double* zs,
+                                   std::size_t n) {
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d minX = _mm512_set1_pd(box.mins_.x), maxX = _mm512_set1_pd(box.maxes_.x);
+  const __m512d minY = _mm512_set1_pd(box.mins_.y), maxY = _mm512_set1_pd(box.maxes_.y);
+  const __m512d minZ = _mm512_set1_pd(box.mins_.z), maxZ = _mm512_set1_pd(box.maxes_.z);
+  for (; i + 8 <= n; i += 8) {
+    __m512d x = _mm512_loadu_pd(xs + i);
+    __m512d y = _mm512_loadu_pd(ys + i);
+    __m512d z = _mm512_loadu_pd(zs + i);
+    __mmask8 inside = _mm512_cmp_pd_mask(x, minX, _CMP_GE_OQ) &
+                      _mm512_cmp_pd_mask(x, maxX, _CMP_LE_OQ) &
+                      _mm512_cmp_pd_mask(y, minY, _CMP_GE_OQ) &
+                      _mm512_cmp_pd_mask(y, maxY, _CMP_LE_OQ) &
+                      _mm512_cmp_pd_mask(z, minZ, _CMP_GE_OQ) &
+                      _mm512_cmp_pd_mask(z, maxZ, _CMP_LE_OQ);
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+#elif defined(__AVX__)
+  const __m256d minX = _mm256_set1_pd(box.mins_.x), maxX = _mm256_set1_pd(box.maxes_.x);
+  const __m256d minY = _mm256_set1_pd(box.mins_.y), maxY = _mm256_set1_pd(box.maxes_.y);
+  const __m256d minZ = _mm256_set1_pd(box.mins_.z), maxZ = _mm256_set1_pd(box.maxes_.z);
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(xs + i);
+    __m256d y = _mm256_loadu_pd(ys + i);
+    __m256d z = _mm256_loadu_pd(zs + i);
+    __m256d inside = _mm256_and_pd(
+        _mm256_and_pd(
+            _mm256_and_pd(_mm256_cmp_pd(x, minX, _CMP_GE_OQ), _mm256_cmp_pd(x, maxX, _CMP_LE_OQ)),
+            _mm256_and_pd(_mm256_cmp_pd(y, minY, _CMP_GE_OQ), _mm256_cmp_pd(y, maxY, _CMP_LE_OQ))),
+        _mm256_and_pd(_mm256_cmp_pd(z, minZ, _CMP_GE_OQ), _mm256_cmp_pd(z, maxZ, _CMP_LE_OQ)));
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_pd(inside)) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128d minX = _mm_set1_pd(box.mins_.x), maxX = _mm_set1_pd(box.maxes_.x);
+  const __m128d minY = _mm_set1_pd(box.mins_.y), maxY = _mm_set1_pd(box.maxes_.y);
+  const __m128d minZ = _mm_set1_pd(box.mins_.z), maxZ = _mm_set1_pd(box.maxes_.z);
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(xs + i);
+    __m128d y = _mm_loadu_pd(ys + i);
+    __m128d z = _mm_loadu_pd(zs + i);
+    __m128d inside = _mm_and_pd(
+        _mm_and_pd(
+            _mm_and_pd(_mm_cmpge_pd(x, minX), _mm_cmple_pd(x, maxX)),
+            _mm_and_pd(_mm_cmpge_pd(y, minY), _mm_cmple_pd(y, maxY))),
+        _mm_and_pd(_mm_cmpge_pd(z, minZ), _mm_cmple_pd(z, maxZ)));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_pd(inside)) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    bool inside = (box.mins_.x <= xs[i]) & (xs[i] <= box.maxes_.x) &
+                  (box.mins_.y <= ys[i]) & (ys[i] <= box.maxes_.y) &
+                  (box.mins_.z <= zs[i]) & (zs[i] <= box.maxes_.z);
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+
+  return mask;
+}
+
+// The same for float coordinates, comparing against the box rounded inwards
+inline std::uint64_t containsBlock(const BoundingBox& box,
+                                   const float* xs, const float* ys, const float* zs,
+                                   std::size_t n) {
+  const float minX = scalarAtLeast<float>(box.mins_.x), maxX = scalarAtMost<float>(box.maxes_.x);
+  const float minY = scalarAtLeast<float>(box.mins_.y), maxY = scalarAtMost<float>(box.maxes_.y);
+  const float minZ = scalarAtLeast<float>(box.mins_.z), maxZ = scalarAtMost<float>(box.maxes_.z);
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512 lowX = _mm512_set1_ps(minX), highX = _mm512_set1_ps(maxX);
+  const __m512 lowY = _mm512_set1_ps(minY), highY = _mm512_set1_ps(maxY);
+  const __m512 lowZ = _mm512_set1_ps(minZ), highZ = _mm512_set1_ps(maxZ);
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps(xs + i);
+    __m512 y = _mm512_loadu_ps(ys + i);
+    __m512 z = _mm512_loadu_ps(zs + i);
+    __mmask16 inside = _mm512_cmp_ps_mask(x, lowX, _CMP_GE_OQ) &
+                       _mm512_cmp_ps_mask(x, highX, _CMP_LE_OQ) &
+                       _mm512_cmp_ps_mask(y, lowY, _CMP_GE_OQ) &
+                       _mm512_cmp_ps_mask(y, highY, _CMP_LE_OQ) &
+                       _mm512_cmp_ps_mask(z, lowZ, _CMP_GE_OQ) &
+                       _mm512_cmp_ps_mask(z, highZ, _CMP_LE_OQ);
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+#elif defined(__AVX__)
+  const __m256 lowX = _mm256_set1_ps(minX), highX = _mm256_set1_ps(maxX);
+  const __m256 lowY = _mm256_set1_ps(minY), highY = _mm256_set1_ps(maxY);
+  const __m256 lowZ = _mm256_set1_ps(minZ), highZ = _mm256_set1_ps(maxZ);
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(xs + i);
+    __m256 y = _mm256_loadu_ps(ys + i);
+    __m256 z = _mm256_loadu_ps(zs + i);
+    __m256 inside = _mm256_and_ps(
+        _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(x, lowX, _CMP_GE_OQ), _mm256_cmp_ps(x, highX, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(y, lowY, _CMP_GE_OQ), _mm256_cmp_ps(y, highY, _CMP_LE_OQ))),
+        _mm256_and_ps(_mm256_cmp_ps(z, lowZ, _CMP_GE_OQ), _mm256_cmp_ps(z, highZ, _CMP_LE_OQ)));
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_ps(inside)) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128 lowX = _mm_set1_ps(minX), highX = _mm_set1_ps(maxX);
+  const __m128 lowY = _mm_set1_ps(minY), highY = _mm_set1_ps(maxY);
+  const __m128 lowZ = _mm_set1_ps(minZ), highZ = _mm_set1_ps(maxZ);
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(xs + i);
+    __m128 y = _mm_loadu_ps(ys + i);
+    __m128 z = _mm_loadu_ps(zs + i);
+    __m128 inside = _mm_and_ps(
+        _mm_and_ps(
+            _mm_and_ps(_mm_cmpge_ps(x, lowX), _mm_cmple_ps(x, highX)),
+            _mm_and_ps(_mm_cmpge_ps(y, lowY), _mm_cmple_ps(y, highY))),
+        _mm_and_ps(_mm_cmpge_ps(z, lowZ), _mm_cmple_ps(z, highZ)));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_ps(inside)) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    bool inside = (minX <= xs[i]) & (xs[i] <= maxX) &
+                  (minY <= ys[i]) & (ys[i] <= maxY) &
+                  (minZ <= zs[i]) & (zs[i] <= maxZ);
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+
+  return mask;
+}
+
+// Bit i of the result is set if point i is no further than the square root
+// of radiusSquared from centre. Requires n <= 64.
+inline std::uint64_t withinBlock(const Point3d& centre, double radiusSquared,
+                                 const double* xs, const double* ys, const double* zs,
+                                 std::size_t n) {
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d cx = _mm512_set1_pd(centre.x), cy = _mm512_set1_pd(centre.y);
+  const __m512d cz = _mm512_set1_pd(centre.z), r2 = _mm512_set1_pd(radiusSquared);
+  for (; i + 8 <= n; i += 8) {
+    __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(xs + i), cx);
+    __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(ys + i), cy);
+    __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(zs + i), cz);
+    __m512d d2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)),
+                               _mm512_mul_pd(dz, dz));
+    mask |= static_cast<std::uint64_t>(_mm512_cmp_pd_mask(d2, r2, _CMP_LE_OQ)) << i;
+  }
+#elif defined(__AVX__)
+  const __m256d cx = _mm256_set1_pd(centre.x), cy = _mm256_set1_pd(centre.y);
+  const __m256d cz = _mm256_set1_pd(centre.z), r2 = _mm256_set1_pd(radiusSquared);
+  for (; i + 4 <= n; i += 4) {
+    __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(xs + i), cx);
+    __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(ys + i), cy);
+    __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(zs + i), cz);
+    __m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+                               _mm256_mul_pd(dz, dz));
+    mask |= static_cast<std::uint64_t>(
+        _mm256_movemask_pd(_mm256_cmp_pd(d2, r2, _CMP_LE_OQ))) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128d cx = _mm_set1_pd(centre.x), cy = _mm_set1_pd(centre.y);
+  const __m128d cz = _mm_set1_pd(centre.z), r2 = _mm_set1_pd(radiusSquared);
+  for (; i + 2 <= n; i += 2) {
+    __m128d dx = _mm_sub_pd(_mm_loadu_pd(xs + i), cx);
+    __m128d dy = _mm_sub_pd(_mm_loadu_pd(ys + i), cy);
+    __m128d dz = _mm_sub_pd(_mm_loadu_pd(zs + i), cz);
+    __m128d d2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+                            _mm_mul_pd(dz, dz));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_pd(_mm_cmple_pd(d2, r2))) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    double dx = xs[i] - centre.x;
+    double dy = ys[i] - centre.y;
+    double dz = zs[i] - centre.z;
+    bool inside = (dx * dx + dy * dy) + dz * dz <= radiusSquared;
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+
+  return mask;
+}
+
+// The same for float coordinates, which are widened to double first so that
+// distances come out exactly as they would for the stored points as doubles
+inline std::uint64_t withinBlock(const Point3d& centre, double radiusSquared,
+                                 const float* xs, const float* ys, const float* zs,
+                                 std::size_t n) {
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d cx = _mm512_set1_pd(centre.x), cy = _mm512_set1_pd(centre.y);
+  const __m512d cz = _mm512_set1_pd(centre.z), r2 = _mm512_set1_pd(radiusSquared);
+  // The zero-masked widening is the same conversion, but unlike
+  // _mm512_cvtps_pd() it doesn't start from an undefined register, which
+  // GCC's -Wmaybe-uninitialized rejects
+  for (; i + 8 <= n; i += 8) {
+    __m512d dx = _mm512_sub_pd(_mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(xs + i)), cx);
+    __m512d dy = _mm512_sub_pd(_mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(ys + i)), cy);
+    __m512d dz = _mm512_sub_pd(_mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(zs + i)), cz);
+    __m512d d2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)),
+                               _mm512_mul_pd(dz, dz));
+    mask |= static_cast<std::uint64_t>(_mm512_cmp_pd_mask(d2, r2, _CMP_LE_OQ)) << i;
+  }
+#elif defined(__AVX__)
+  const __m256d cx = _mm256_set1_pd(centre.x), cy = _mm256_set1_pd(centre.y);
+  const __m256d cz = _mm256_set1_pd(centre.z), r2 = _mm256_set1_pd(radiusSquared);
+  for (; i + 4 <= n; i += 4) {
+    __m256d dx = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(xs + i)), cx);
+    __m256d dy = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(ys + i)), cy);
+    __m256d dz = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(zs + i)), cz);
+    __m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+                               _mm256_mul_pd(dz, dz));
+    mask |= static_cast<std::uint64_t>(
+        _mm256_movemask_pd(_mm256_cmp_pd(d2, r2, _CMP_LE_OQ))) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    double dx = static_cast<double>(xs[i]) - centre.x;
+    double dy = static_cast<double>(ys[i]) - centre.y;
+    double dz = static_cast<double>(zs[i]) - centre.z;
+    bool inside = (dx * dx + dy * dy) + dz * dz <= radiusSquared;
+    mask |= static_cast<std::uint64_t>(inside) << i;
+  }
+
+  return mask;
+}
+
+// Bit i of the result is set if normal . point i <= offset. Requires n <= 64.
+// The dot product is summed in the same order as Plane::contains(), so the
+// answers match it exactly.
+inline std::uint64_t belowPlaneBlock(const Point3d& normal, double offset,
+                                     const double* xs, const double* ys, const double* zs,
+                                     std::size_t n) {
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d nx = _mm512_set1_pd(normal.x), ny = _mm512_set1_pd(normal.y);
+  const __m512d nz = _mm512_set1_pd(normal.z), d = _mm512_set1_pd(offset);
+  for (; i + 8 <= n; i += 8) {
+    __m512d dot = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx, _mm512_loadu_pd(xs + i)),
+                                              _mm512_mul_pd(ny, _mm512_loadu_pd(ys + i))),
+                                _mm512_mul_pd(nz, _mm512_loadu_pd(zs + i)));
+    mask |= static_cast<std::uint64_t>(_mm512_cmp_pd_mask(dot, d, _CMP_LE_OQ)) << i;
+  }
+#elif defined(__AVX__)
+  const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y);
+  const __m256d nz = _mm256_set1_pd(normal.z), d = _mm256_set1_pd(offset);
+  for (; i + 4 <= n; i += 4) {
+    __m256d dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, _mm256_loadu_pd(xs + i)),
+                                              _mm256_mul_pd(ny, _mm256_loadu_pd(ys + i))),
+                                _mm256_mul_pd(nz, _mm256_loadu_pd(zs + i)));
+    mask |= static_cast<std::uint64_t>(
+        _mm256_movemask_pd(_mm256_cmp_pd(dot, d, _CMP_LE_OQ))) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128d nx = _mm_set1_pd(normal.x), ny = _mm_set1_pd(normal.y);
+  const __m128d nz = _mm_set1_pd(normal.z), d = _mm_set1_pd(offset);
+  for (; i + 2 <= n; i += 2) {
+    __m128d dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, _mm_loadu_pd(xs + i)),
+                                        _mm_mul_pd(ny, _mm_loadu_pd(ys + i))),
+                             _mm_mul_pd(nz, _mm_loadu_pd(zs + i)));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_pd(_mm_cmple_pd(dot, d))) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    bool below = normal.x * xs[i] + normal.y * ys[i] + normal.z * zs[i] <= offset;
+    mask |= static_cast<std::uint64_t>(below) << i;
+  }
+
+  return mask;
+}
+
+// The same for float coordinates, widened to double first
+inline std::uint64_t belowPlaneBlock(const Point3d& normal, double offset,
+                                     const float* xs, const float* ys, const float* zs,
+                                     std::size_t n) {
+  std::uint64_t mask = 0;
+  std::size_t i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d nx = _mm512_set1_pd(normal.x), ny = _mm512_set1_pd(normal.y);
+  const __m512d nz = _mm512_set1_pd(normal.z), d = _mm512_set1_pd(offset);
+  for (; i + 8 <= n; i += 8) {
+    __m512d x = _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(xs + i));
+    __m512d y = _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(ys + i));
+    __m512d z = _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(zs + i));
+    __m512d dot = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx, x), _mm512_mul_pd(ny, y)),
+                                _mm512_mul_pd(nz, z));
+    mask |= static_cast<std::uint64_t>(_mm512_cmp_pd_mask(dot, d, _CMP_LE_OQ)) << i;
+  }
+#elif defined(__AVX__)
+  const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y);
+  const __m256d nz = _mm256_set1_pd(normal.z), d = _mm256_set1_pd(offset);
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(xs + i));
+    __m256d y = _mm256_cvtps_pd(_mm_loadu_ps(ys + i));
+    __m256d z = _mm256_cvtps_pd(_mm_loadu_ps(zs + i));
+    __m256d dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, x), _mm256_mul_pd(ny, y)),
+                                _mm256_mul_pd(nz, z));
+    mask |= static_cast<std::uint64_t>(
+        _mm256_movemask_pd(_mm256_cmp_pd(dot, d, _CMP_LE_OQ))) << i;
+  }
+#endif
+
+  for (; i < n; ++i) {
+    bool below = normal.x * static_cast<double>(xs[i]) + normal.y * static_cast<double>(ys[i]) +
+                 normal.z * static_cast<double>(zs[i]) <= offset;
+    mask |= static_cast<std::uint64_t>(below) << i;
+  }
+
+  return mask;
+}
+
+inline std::size_t lowestSetBit(std::uint64_t mask) {
+#if defined(__GNUC__)
+  return static_cast<std::size_t>(__builtin_ctzll(mask));
+#else
+  std::size_t bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+// The mask of the first n points of a block, all in
+inline std::uint64_t lowBits(std::size_t n) {
+  return n >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << n) - 1;
+}
+
+// Writes values[i] to out for every bit i set in mask, in order
+template <typename Value, typename OutputIterator>
+void emitMask(std::uint64_t mask, const Value* values, OutputIterator& out) {
+  while (mask) {
+    *out = values[lowestSetBit(mask)];
+    ++out;
+    mask &= mask - 1;
+  }
+}
+
+// Writes values[i] to out for every point i in box, in order, and reports
+// whether there were any
+template <typename Scalar, typename Value, typename OutputIterator>
+bool emitContained(const BoundingBox& box,
+                   const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                   const Value* values, std::size_t n, OutputIterator& out) {
+  bool success = false;
+  for (std::size_t block = 0; block < n; block += 64) {
+    std::size_t count = n - block < 64 ? n - block : 64;
+    std::uint64_t mask = containsBlock(box, xs + block, ys + block, zs + block, count);
+    success |= mask != 0;
+    emitMask(mask, values + block, out);
+  }
+  return success;
+}
+
+// The same for every point within the sphere
+template <typename Scalar, typename Value, typename OutputIterator>
+bool emitWithin(const Point3d& centre, double radiusSquared,
+                const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                const Value* values, std::size_t n, OutputIterator& out) {
+  bool success = false;
+  for (std::size_t block = 0; block < n; block += 64) {
+    std::size_t count = n - block < 64 ? n - block : 64;
+    std::uint64_t mask = withinBlock(centre, radiusSquared, xs + block, ys + block, zs + block, count);
+    success |= mask != 0;
+    emitMask(mask, values + block, out);
+  }
+  return success;
+}
+
+// Writes all n values to out without testing them, for a leaf or run of
+// leaves that the box is already known to contain
+template <typename Value, typename OutputIterator>
+bool emitAll(const Value* values, std::size_t n, OutputIterator& out) {
+  for (std::size_t i = 0; i < n; ++i) {
+    *out = values[i];
+    ++out;
+  }
+  return n != 0;
+}
+
+// Passes (first, value) on to out for every value written to it
+template <typename Value, typename OutputIterator>
+class PairedOutput {
+ public:
+  PairedOutput(const Value& first, OutputIterator& out) : first_(first), out_(&out) {}
+
+  PairedOutput& operator*() { return *this; }
+
+  PairedOutput& operator=(const Value& value) {
+    **out_ = std::make_pair(first_, value);
+    return *this;
+  }
+
+  PairedOutput& operator++() {
+    ++*out_;
+    return *this;
+  }
+
+ private:
+  Value first_;
+  OutputIterator* out_;
+};
+
+// Appends the pairs written to it to pairs, and for every job added to jobs
+// meanwhile notes in before how many pairs came ahead of it, so that a join
+// split into jobs can put its pairs back in the order of the whole walk.
+// mark() notes the jobs added since the last pair.
+template <typename Pair, typename Job>
+class JoinSplitOutput {
+ public:
+  JoinSplitOutput(std::vector<Pair>& pairs, const std::vector<Job>& jobs,
+                  std::vector<std::size_t>& before)
+    : pairs_(&pairs), jobs_(&jobs), before_(&before) {}
+
+  JoinSplitOutput& operator*() { return *this; }
+
+  JoinSplitOutput& operator=(const Pair& pair) {
+    mark();
+    pairs_->push_back(pair);
+    return *this;
+  }
+
+  JoinSplitOutput& operator++() { return *this; }
+
+  void mark() {
+    while (before_->size() < jobs_->size()) {
+      before_->push_back(pairs_->size());
+    }
+  }
+
+ private:
+  std::vector<Pair>* pairs_;
+  const std::vector<Job>* jobs_;
+  std::vector<std::size_t>* before_;
+};
+
+// Writes (values[i], otherValues[j]) to out for every point i of the first
+// run and point j of the second no further apart than the square root of
+// radiusSquared, and reports whether there were any
+template <typename Scalar, typename Value, typename OutputIterator>
+bool emitPairsWithin(double radiusSquared,
+                     const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                     const Value* values, std::size_t n,
+                     const Scalar* otherXs, const Scalar* otherYs, const Scalar* otherZs,
+                     const Value* otherValues, std::size_t otherN, OutputIterator& out) {
+  bool success = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    Point3d centre{static_cast<double>(xs[i]), static_cast<double>(ys[i]),
+                   static_cast<double>(zs[i])};
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    success |= emitWithin(centre, radiusSquared, otherXs, otherYs, otherZs, otherValues, otherN,
+                          paired);
+  }
+  return success;
+}
+
+// The same for the pairs within one run, each once, the earlier point first
+template <typename Scalar, typename Value, typename OutputIterator>
+bool emitPairsWithin(double radiusSquared, const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                     const Value* values, std::size_t n, OutputIterator& out) {
+  bool success = false;
+  for (std::size_t i = 0; i + 1 < n; ++i) {
+    Point3d centre{static_cast<double>(xs[i]), static_cast<double>(ys[i]),
+                   static_cast<double>(zs[i])};
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    success |= emitWithin(centre, radiusSquared, xs + i + 1, ys + i + 1, zs + i + 1,
+                          values + i + 1, n - i - 1, paired);
+  }
+  return success;
+}
+
+// Every pair of the two runs, or within one, untested
+template <typename Value, typename OutputIterator>
+bool emitAllPairs(const Value* values, std::size_t n,
+                  const Value* otherValues, std::size_t otherN, OutputIterator& out) {
+  for (std::size_t i = 0; i < n; ++i) {
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    emitAll(otherValues, otherN, paired);
+  }
+  return n != 0 && otherN != 0;
+}
+
+template <typename Value, typename OutputIterator>
+bool emitAllPairs(const Value* values, std::size_t n, OutputIterator& out) {
+  for (std::size_t i = 0; i + 1 < n; ++i) {
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    emitAll(values + i + 1, n - i - 1, paired);
+  }
+  return n > 1;
+}
+
+// What a visitor given each value a search finds wants the search to do next
+enum class Visit : char {
+  CONTINUE,
+  STOP
+};
+
+// Calls visitor(values[i], point i) for every point i in box, in order,
+// until it returns Visit::STOP, and reports whether it did
+template <typename Scalar, typename Value, typename Visitor>
+bool visitContained(const BoundingBox& box,
+                    const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                    const Value* values, std::size_t n, Visitor& visitor) {
+  for (std::size_t block = 0; block < n; block += 64) {
+    std::size_t count = n - block < 64 ? n - block : 64;
+    std::uint64_t mask = containsBlock(box, xs + block, ys + block, zs + block, count);
+    for (; mask; mask &= mask - 1) {
+      std::size_t i = block + lowestSetBit(mask);
+      Point3d p{static_cast<double>(xs[i]), static_cast<double>(ys[i]), static_cast<double>(zs[i])};
+      if (visitor(values[i], p) == Visit::STOP) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The same for all n points, without testing them
+template <typename Scalar, typename Value, typename Visitor>
+bool visitAll(const Scalar* xs, const Scalar* ys, const Scalar* zs,
+              const Value* values, std::size_t n, Visitor& visitor) {
+  for (std::size_t i = 0; i < n; ++i) {
+    Point3d p{static_cast<double>(xs[i]), static_cast<double>(ys[i]), static_cast<double>(zs[i])};
+    if (visitor(values[i], p) == Visit::STOP) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif // defined LEAF_KERNEL_H
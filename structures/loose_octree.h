@@ -0,0 +1,314 @@
+/*
+    file - loose_octree.h
+
+    A loose octree, over values that take up space: BoxExtractor gives each
+    value a BoundingBox where the other trees' PointExtractor gives a point.
+
+    Every node has a cube, its share of the root cube as in the other trees,
+    and loose bounds: the cube grown by (looseness - 1) / 2 of its side on
+    every side, so that with the default looseness of 2 a node's loose bounds
+    are twice as wide as its cube. A value is stored exactly once, in the
+    deepest node whose cube holds the centre of its box and whose loose
+    bounds hold all of it. Boxes too big for any child of a node stay in the
+    node itself, so nothing is duplicated between octants. Points are boxes
+    with no extent, which go as deep as the tree does.
+
+    Nodes are stored in one array, with the children of a node side by side,
+    and values depth first, so every subtree's values are one run. Each node
+    also keeps the extrema of every box in its subtree, which are tighter
+    than its loose bounds, and searches prune against those.
+
+ */
+
+#ifndef LOOSE_OCTREE_H
+#define LOOSE_OCTREE_H
+
+#include "boundingbox.h"
+#include "leaf_kernel.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+template <typename InputIterator, class BoxExtractor,
+          std::size_t max_per_node = 16, std::size_t max_depth = 21>
+class LooseOctree {
+ public:
+  using tree_type = LooseOctree<InputIterator, BoxExtractor, max_per_node, max_depth>;
+
+  LooseOctree();
+
+  // Values whose boxes aren't finite, or are inside out, are left out.
+  // looseness below 1 is taken as 1, which leaves every box that straddles
+  // a child's cube in the node above.
+  LooseOctree(InputIterator begin, InputIterator end, double looseness = 2.);
+
+  LooseOctree(InputIterator begin, InputIterator end, BoxExtractor f, double looseness = 2.);
+
+  // Writes every value whose box overlaps box, faces included: those for
+  // which BoundingBox::overlap() is a valid box
+  template <typename OutputIterator>
+  bool search(const BoundingBox& box, OutputIterator& it) const;
+
+  // Writes every value whose box lies entirely inside box
+  template <typename OutputIterator>
+  bool searchContained(const BoundingBox& box, OutputIterator& it) const;
+
+  std::size_t size() const;
+  std::size_t depth() const;
+  double looseness() const;
+
+ private:
+  struct Entry {
+    InputIterator value_;
+    BoundingBox box_;
+  };
+
+  struct Node {
+    // Of every box in the subtree
+    BoundingBox extrema_;
+    // The node's own values are [first_, own_last_) of values_ and boxes_,
+    // and its whole subtree's [first_, last_)
+    std::size_t first_;
+    std::size_t own_last_;
+    std::size_t last_;
+    // Children are nodes_[children_first_, children_last_)
+    std::size_t children_first_;
+    std::size_t children_last_;
+  };
+
+  // Builds node over entries[first, last), which lie in cube, depth levels
+  // down. Sorts the node's own entries to the front of the range, followed
+  // by each child's in octant order; scratch is room to do that in.
+  void build(std::vector<Entry>& entries, std::vector<Entry>& scratch, std::size_t node,
+             std::size_t first, std::size_t last, const BoundingBox& cube, std::size_t depth);
+
+  // Writes what matches(box, value's box) picks out of the subtree at node.
+  // Subtrees the query box holds all of match whole for both searches.
+  template <typename OutputIterator, typename Matches>
+  bool search_node(const BoundingBox& box, OutputIterator& it, std::size_t node,
+                   Matches matches) const;
+
+  BoxExtractor functor_;
+  std::vector<Node> nodes_;
+  std::vector<BoundingBox> boxes_;
+  std::vector<InputIterator> values_;
+  double looseness_;
+  std::size_t depth_;
+};
+
+#define LOOSE_OCTREE_TEMPLATE typename InputIterator, class BoxExtractor, std::size_t max_per_node, std::size_t max_depth
+#define LOOSEOCTREE LooseOctree<InputIterator, BoxExtractor, max_per_node, max_depth>
+
+namespace loose_detail {
+
+// Whether the box is finite and no side of it is inside out
+inline bool usable(const BoundingBox& box) {
+  return std::isfinite(box.mins_.x) && std::isfinite(box.mins_.y) && std::isfinite(box.mins_.z) &&
+         std::isfinite(box.maxes_.x) && std::isfinite(box.maxes_.y) && std::isfinite(box.maxes_.z) &&
+         box.mins_.x <= box.maxes_.x && box.mins_.y <= box.maxes_.y && box.mins_.z <= box.maxes_.z;
+}
+
+inline Point3d centre(const BoundingBox& box) {
+  return Point3d{box.mins_.x + (box.maxes_.x - box.mins_.x) / 2.,
+                 box.mins_.y + (box.maxes_.y - box.mins_.y) / 2.,
+                 box.mins_.z + (box.maxes_.z - box.mins_.z) / 2.};
+}
+
+}  // namespace loose_detail
+
+template <LOOSE_OCTREE_TEMPLATE>
+LOOSEOCTREE::LooseOctree()
+  : functor_(BoxExtractor()), looseness_(2.), depth_(0) { }
+
+template <LOOSE_OCTREE_TEMPLATE>
+LOOSEOCTREE::LooseOctree(InputIterator begin, InputIterator end, double looseness)
+  : LooseOctree(begin, end, BoxExtractor(), looseness) { }
+
+// The root cube is the smallest cube around the centres of the boxes. Boxes
+// the root's loose bounds don't hold stay in the root.
+template <LOOSE_OCTREE_TEMPLATE>
+LOOSEOCTREE::LooseOctree(InputIterator begin, InputIterator end, BoxExtractor f, double looseness)
+  : functor_(f), looseness_(std::max(looseness, 1.)), depth_(0) {
+  std::vector<Entry> entries;
+  BoundingBox cube = initialBox;
+  for (auto it = begin; it != end; ++it) {
+    BoundingBox box = functor_(*it);
+    if (!loose_detail::usable(box)) {
+      continue;
+    }
+    Point3d centre = loose_detail::centre(box);
+    cube.mins_.x = std::min(cube.mins_.x, centre.x);
+    cube.mins_.y = std::min(cube.mins_.y, centre.y);
+    cube.mins_.z = std::min(cube.mins_.z, centre.z);
+    cube.maxes_.x = std::max(cube.maxes_.x, centre.x);
+    cube.maxes_.y = std::max(cube.maxes_.y, centre.y);
+    cube.maxes_.z = std::max(cube.maxes_.z, centre.z);
+    entries.push_back(Entry{it, box});
+  }
+  if (entries.empty()) {
+    return;
+  }
+
+  double side = std::max(std::max(cube.maxes_.x - cube.mins_.x, cube.maxes_.y - cube.mins_.y),
+                         cube.maxes_.z - cube.mins_.z);
+  cube.maxes_ = Point3d{cube.mins_.x + side, cube.mins_.y + side, cube.mins_.z + side};
+
+  std::vector<Entry> scratch(entries.size());
+  nodes_.push_back(Node());
+  build(entries, scratch, 0, 0, entries.size(), cube, 1);
+
+  boxes_.reserve(entries.size());
+  values_.reserve(entries.size());
+  for (const Entry& entry : entries) {
+    boxes_.push_back(entry.box_);
+    values_.push_back(entry.value_);
+  }
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+void LOOSEOCTREE::build(std::vector<Entry>& entries, std::vector<Entry>& scratch, std::size_t node,
+                        std::size_t first, std::size_t last, const BoundingBox& cube,
+                        std::size_t depth) {
+  depth_ = std::max(depth_, depth);
+  Node& n = nodes_[node];
+  n.first_ = first;
+  n.own_last_ = last;
+  n.last_ = last;
+  n.children_first_ = n.children_last_ = 0;
+  n.extrema_ = initialBox;
+
+  if (last - first > max_per_node && depth < max_depth) {
+    // Octant 8 holds the entries too big for any child, and sorts first
+    const std::array<BoundingBox, 8> children = cube.partition();
+    const double margin = (looseness_ - 1.) / 2. * (cube.maxes_.x - cube.mins_.x) / 2.;
+    std::array<BoundingBox, 8> loose;
+    for (std::size_t octant = 0; octant < 8; ++octant) {
+      loose[octant] = children[octant].grown(margin);
+    }
+    auto octantOf = [&](const Entry& entry) -> std::size_t {
+      std::size_t octant = cube.getChildPartitionIndex(loose_detail::centre(entry.box_));
+      return loose[octant].contains(entry.box_) ? octant : 8;
+    };
+
+    std::array<std::size_t, 10> starts = {};
+    for (std::size_t i = first; i < last; ++i) {
+      std::size_t octant = octantOf(entries[i]);
+      ++starts[octant == 8 ? 1 : octant + 2];
+    }
+    for (std::size_t i = 1; i < starts.size(); ++i) {
+      starts[i] += starts[i - 1];
+    }
+    // starts[0] is where the entries that stay begin, and starts[octant + 1]
+    // where octant's begin, both from first
+    std::array<std::size_t, 9> next;
+    next[8] = first + starts[0];
+    for (std::size_t octant = 0; octant < 8; ++octant) {
+      next[octant] = first + starts[octant + 1];
+    }
+    for (std::size_t i = first; i < last; ++i) {
+      scratch[next[octantOf(entries[i])]++] = entries[i];
+    }
+    std::copy(scratch.begin() + first, scratch.begin() + last, entries.begin() + first);
+
+    std::size_t own_last = first + starts[1];
+    if (own_last != last) {
+      std::size_t count = 0;
+      for (std::size_t octant = 0; octant < 8; ++octant) {
+        count += starts[octant + 2] != starts[octant + 1];
+      }
+      std::size_t children_first = nodes_.size();
+      nodes_.resize(children_first + count);
+      nodes_[node].own_last_ = own_last;
+      nodes_[node].children_first_ = children_first;
+      nodes_[node].children_last_ = children_first + count;
+
+      std::size_t child = children_first;
+      for (std::size_t octant = 0; octant < 8; ++octant) {
+        std::size_t begin = first + starts[octant + 1], end = first + starts[octant + 2];
+        if (begin != end) {
+          build(entries, scratch, child, begin, end, children[octant], depth + 1);
+          const BoundingBox& extrema = nodes_[child].extrema_;
+          BoundingBox& parent = nodes_[node].extrema_;
+          parent.mins_.x = std::min(parent.mins_.x, extrema.mins_.x);
+          parent.mins_.y = std::min(parent.mins_.y, extrema.mins_.y);
+          parent.mins_.z = std::min(parent.mins_.z, extrema.mins_.z);
+          parent.maxes_.x = std::max(parent.maxes_.x, extrema.maxes_.x);
+          parent.maxes_.y = std::max(parent.maxes_.y, extrema.maxes_.y);
+          parent.maxes_.z = std::max(parent.maxes_.z, extrema.maxes_.z);
+          ++child;
+        }
+      }
+    }
+  }
+
+  BoundingBox& extrema = nodes_[node].extrema_;
+  for (std::size_t i = first; i < nodes_[node].own_last_; ++i) {
+    const BoundingBox& box = entries[i].box_;
+    extrema.mins_.x = std::min(extrema.mins_.x, box.mins_.x);
+    extrema.mins_.y = std::min(extrema.mins_.y, box.mins_.y);
+    extrema.mins_.z = std::min(extrema.mins_.z, box.mins_.z);
+    extrema.maxes_.x = std::max(extrema.maxes_.x, box.maxes_.x);
+    extrema.maxes_.y = std::max(extrema.maxes_.y, box.maxes_.y);
+    extrema.maxes_.z = std::max(extrema.maxes_.z, box.maxes_.z);
+  }
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool LOOSEOCTREE::search(const BoundingBox& box, OutputIterator& it) const {
+  return !nodes_.empty() && search_node(box, it, 0,
+      [](const BoundingBox& query, const BoundingBox& b) { return query.intersects(b); });
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool LOOSEOCTREE::searchContained(const BoundingBox& box, OutputIterator& it) const {
+  return !nodes_.empty() && search_node(box, it, 0,
+      [](const BoundingBox& query, const BoundingBox& b) { return query.contains(b); });
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Matches>
+bool LOOSEOCTREE::search_node(const BoundingBox& box, OutputIterator& it, std::size_t node,
+                              Matches matches) const {
+  const Node& n = nodes_[node];
+  if (!box.intersects(n.extrema_)) {
+    return false;
+  } else if (box.contains(n.extrema_)) {
+    return emitAll(values_.data() + n.first_, n.last_ - n.first_, it);
+  }
+
+  bool success = false;
+  for (std::size_t i = n.first_; i < n.own_last_; ++i) {
+    if (matches(box, boxes_[i])) {
+      *it = values_[i];
+      ++it;
+      success = true;
+    }
+  }
+  for (std::size_t child = n.children_first_; child < n.children_last_; ++child) {
+    success |= search_node(box, it, child, matches);
+  }
+  return success;
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+std::size_t LOOSEOCTREE::size() const {
+  return values_.size();
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+std::size_t LOOSEOCTREE::depth() const {
+  return depth_;
+}
+
+template <LOOSE_OCTREE_TEMPLATE>
+double LOOSEOCTREE::looseness() const {
+  return looseness_;
+}
+
+#endif // defined LOOSE_OCTREE_H
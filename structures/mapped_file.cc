@@ -0,0 +1,112 @@
+#include "mapped_file.h"
+
+#include <cstddef>
+#include <fstream>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : data_(nullptr), size_(0) { }
+
+MappedFile::MappedFile(MappedFile&& rhs) : data_(nullptr), size_(0) {
+  swap(rhs);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) {
+  close();
+  swap(rhs);
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+void MappedFile::swap(MappedFile& rhs) {
+  std::swap(data_, rhs.data_);
+  std::swap(size_, rhs.size_);
+}
+
+bool MappedFile::open(const std::string& path) {
+  close();
+
+#ifdef MAPPED_FILE_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  if (::fstat(fd, &status) != 0) {
+    ::close(fd);
+    return false;
+  }
+  std::size_t size = static_cast<std::size_t>(status.st_size);
+  if (size == 0) {
+    // mmap refuses empty mappings, and there is nothing to map anyway
+    ::close(fd);
+    data_ = "";
+    return true;
+  }
+  void* address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping holds its own reference to the file
+  ::close(fd);
+  if (address == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<const char*>(address);
+  size_ = size;
+  return true;
+#else
+  std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+  if (!in) {
+    return false;
+  }
+  std::size_t size = static_cast<std::size_t>(in.tellg());
+  if (size == 0) {
+    data_ = "";
+    return true;
+  }
+  // Whole max_align_t's, so the contents are as aligned as a mapping's
+  std::size_t blocks = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  std::max_align_t* buffer = new std::max_align_t[blocks];
+  in.seekg(0);
+  if (!in.read(reinterpret_cast<char*>(buffer), size)) {
+    delete[] buffer;
+    return false;
+  }
+  data_ = reinterpret_cast<const char*>(buffer);
+  size_ = size;
+  return true;
+#endif
+}
+
+void MappedFile::close() {
+  // An empty file holds nothing of its own
+  if (size_ > 0) {
+#ifdef MAPPED_FILE_MMAP
+    ::munmap(const_cast<char*>(data_), size_);
+#else
+    delete[] reinterpret_cast<const std::max_align_t*>(data_);
+#endif
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+bool MappedFile::is_open() const {
+  return data_ != nullptr;
+}
+
+const char* MappedFile::data() const {
+  return data_;
+}
+
+std::size_t MappedFile::size() const {
+  return size_;
+}
@@ -0,0 +1,52 @@
+/*
+    file - mapped_file.h
+
+    A read-only view of a whole file. Where the platform has mmap the file
+    is mapped, so opening it costs next to nothing and its pages are read in
+    as they are touched and shared between every process mapping the same
+    file. Elsewhere the file is read into memory instead.
+
+    Mapped memory starts on a page boundary, and the buffer used instead is
+    aligned to max_align_t, so structures laid out at suitably aligned
+    offsets can be used in place.
+
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+ public:
+  MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(MappedFile&& rhs);
+  MappedFile& operator=(MappedFile&& rhs);
+
+  ~MappedFile();
+
+  void swap(MappedFile& rhs);
+
+  // Maps path, dropping whatever was open before. Fails, leaving nothing
+  // open, if the file can't be opened or read.
+  bool open(const std::string& path);
+
+  void close();
+
+  bool is_open() const;
+
+  const char* data() const;
+  std::size_t size() const;
+
+ private:
+  // Mapped, or read into a buffer of our own where there is no mmap
+  const char* data_;
+  std::size_t size_;
+};
+
+#endif // defined MAPPED_FILE_H
@@ -0,0 +1,484 @@
+/*
+    file - mapped_octree.h
+
+    A flat file format for a built PointerlessOctree, and MappedOctree,
+    which maps such a file and answers queries straight out of it.
+
+    The file is the header below followed by five arrays, each starting on a
+    64 byte boundary: the nodes in key order, the x, y and z coordinates of
+    every point in morton order, stored as the tree's Scalar, and for every
+    point its index in the range the tree was built over. There are no
+    pointers, so nothing needs fixing up after loading: opening a tree maps
+    the file, checks its header and sets up five pointers into it. Pages are
+    read in as queries first touch them.
+
+    Values are stored as indices, so a MappedOctree is opened over the same
+    points, in the same order, that the tree was built over, and writes out
+    begin + index for every value it finds. Files are tied to the byte order
+    they were written with, and to the Scalar; a mismatch of either, or of
+    the format version, fails the open rather than giving wrong answers.
+
+ */
+
+#ifndef MAPPED_OCTREE_H
+#define MAPPED_OCTREE_H
+
+#include "boundingbox.h"
+#include "leaf_kernel.h"
+#include "mapped_file.h"
+#include "nearest.h"
+#include "quantized_leaf.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+static const std::uint32_t tree_file_version = 1;
+static const std::uint32_t tree_file_byte_order = 0x01020304;
+static const char tree_file_magic[8] = {'T', 'R', 'E', 'E', 'R', 'A', 'C', 'E'};
+
+// How a file's coordinates are stored: as IEEE floating point of the given
+// width, or as quantized codes of the given width
+template <typename Scalar>
+struct TreeFileScalar;
+
+template <>
+struct TreeFileScalar<double> {
+  static const std::uint32_t quantized = 0;
+  static const std::uint32_t bits = 64;
+};
+
+template <>
+struct TreeFileScalar<float> {
+  static const std::uint32_t quantized = 0;
+  static const std::uint32_t bits = 32;
+};
+
+template <unsigned width>
+struct TreeFileScalar<Quantized<width>> {
+  static const std::uint32_t quantized = 1;
+  static const std::uint32_t bits = width;
+};
+
+struct TreeFileHeader {
+  char magic_[8];
+  std::uint32_t version_;
+  std::uint32_t byte_order_;
+  std::uint32_t quantized_;
+  std::uint32_t scalar_bits_;
+  std::uint32_t node_bytes_;
+  std::uint32_t reserved_;
+  std::uint64_t node_count_;
+  std::uint64_t point_count_;
+  std::uint64_t depth_;
+  // Where each array starts, in bytes from the start of the file
+  std::uint64_t nodes_;
+  std::uint64_t xs_;
+  std::uint64_t ys_;
+  std::uint64_t zs_;
+  std::uint64_t values_;
+  std::uint64_t file_bytes_;
+};
+
+// A node as PointerlessOctree keeps it, less its key. Children are nodes
+// [first_, last_) of an internal node, and points [first_, last_) belong to a
+// leaf; every subtree's points are [points_first_, points_last_).
+struct TreeFileNode {
+  BoundingBox extrema_;
+  std::uint64_t first_;
+  std::uint64_t last_;
+  std::uint64_t points_first_;
+  std::uint64_t points_last_;
+  std::uint64_t leaf_;
+};
+
+// Arrays start on cache line boundaries
+inline std::uint64_t treeFileAlign(std::uint64_t offset) {
+  return (offset + 63) & ~std::uint64_t(63);
+}
+
+// The header of a file holding a tree of this many nodes and points
+template <typename Scalar>
+TreeFileHeader makeTreeFileHeader(std::uint64_t nodes, std::uint64_t points, std::uint64_t depth) {
+  using stored_type = typename LeafCoordinates<Scalar>::stored_type;
+  TreeFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic_, tree_file_magic, sizeof(header.magic_));
+  header.version_ = tree_file_version;
+  header.byte_order_ = tree_file_byte_order;
+  header.quantized_ = TreeFileScalar<Scalar>::quantized;
+  header.scalar_bits_ = TreeFileScalar<Scalar>::bits;
+  header.node_bytes_ = sizeof(TreeFileNode);
+  header.node_count_ = nodes;
+  header.point_count_ = points;
+  header.depth_ = depth;
+  header.nodes_ = treeFileAlign(sizeof(TreeFileHeader));
+  header.xs_ = treeFileAlign(header.nodes_ + nodes * sizeof(TreeFileNode));
+  header.ys_ = treeFileAlign(header.xs_ + points * sizeof(stored_type));
+  header.zs_ = treeFileAlign(header.ys_ + points * sizeof(stored_type));
+  header.values_ = treeFileAlign(header.zs_ + points * sizeof(stored_type));
+  header.file_bytes_ = header.values_ + points * sizeof(std::uint64_t);
+  return header;
+}
+
+// Whether header describes a file of size bytes that a tree storing Scalar
+// can read: everything it could have been written with has to match, and
+// the arrays have to be where a writer would have put them
+template <typename Scalar>
+bool validTreeFileHeader(const TreeFileHeader& header, std::size_t size) {
+  // Counts too large to lay out would wrap the offsets around
+  const std::uint64_t limit = std::uint64_t(1) << 56;
+  if (std::memcmp(header.magic_, tree_file_magic, sizeof(header.magic_)) != 0 ||
+      header.version_ != tree_file_version || header.byte_order_ != tree_file_byte_order ||
+      header.node_count_ >= limit || header.point_count_ >= limit) {
+    return false;
+  }
+  TreeFileHeader expected = makeTreeFileHeader<Scalar>(header.node_count_, header.point_count_,
+                                                       header.depth_);
+  return std::memcmp(&expected, &header, sizeof(header)) == 0 && header.file_bytes_ <= size;
+}
+
+// Writes begin + i for every index i written to it
+template <typename InputIterator, typename OutputIterator>
+class IndexOutput {
+ public:
+  IndexOutput(InputIterator begin, OutputIterator& out) : begin_(begin), out_(out) { }
+
+  IndexOutput& operator*() {
+    return *this;
+  }
+
+  IndexOutput& operator=(std::uint64_t index) {
+    *out_ = begin_ + index;
+    return *this;
+  }
+
+  IndexOutput& operator++() {
+    ++out_;
+    return *this;
+  }
+
+ private:
+  InputIterator begin_;
+  OutputIterator& out_;
+};
+
+// Queries a tree file written by PointerlessOctree::save() without loading
+// it. InputIterator has to be random access, since values are found again
+// from their index.
+template <typename InputIterator, typename PointExtractor, typename Scalar = double>
+class MappedOctree {
+ public:
+  using tree_type = MappedOctree<InputIterator, PointExtractor, Scalar>;
+  using stored_type = typename LeafCoordinates<Scalar>::stored_type;
+
+  MappedOctree();
+
+  MappedOctree(const tree_type&) = delete;
+  tree_type& operator=(const tree_type&) = delete;
+
+  MappedOctree(tree_type&& rhs);
+  tree_type& operator=(tree_type&& rhs);
+
+  ~MappedOctree() = default;
+
+  void swap(tree_type& rhs);
+
+  // Maps the tree in path, built over the points from begin on. Fails,
+  // leaving the tree empty, if the file can't be mapped or isn't a tree
+  // file for Scalar. Only the header is checked: a file that passes is
+  // trusted to be as save() wrote it.
+  bool open(const std::string& path, InputIterator begin, PointExtractor f = PointExtractor());
+
+  void close();
+
+  template <typename OutputIterator>
+  bool search(const BoundingBox& box, OutputIterator& it) const;
+
+  // Writes every value no further than radius from centre
+  template <typename OutputIterator>
+  bool radiusSearch(const Point3d& centre, double radius, OutputIterator& it) const;
+
+  // Writes the (up to) k values nearest to p, nearest first
+  template <typename OutputIterator>
+  bool knn(const Point3d& p, std::size_t k, OutputIterator& it) const;
+
+  std::size_t size() const;
+  std::size_t depth() const;
+
+ private:
+  using is_quantized = std::integral_constant<bool, LeafCoordinates<Scalar>::quantized>;
+
+  template <typename OutputIterator>
+  bool search_node(const BoundingBox& box, OutputIterator& it, std::size_t node) const;
+
+  template <typename OutputIterator>
+  bool radius_search_node(const Point3d& centre, double radiusSquared,
+                          OutputIterator& it, std::size_t node) const;
+
+  // The leaf scans, for plain and for quantized coordinates
+  template <typename OutputIterator>
+  bool leaf_contained(const BoundingBox& box, const TreeFileNode& n, OutputIterator& it,
+                      std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_contained(const BoundingBox& box, const TreeFileNode& n, OutputIterator& it,
+                      std::true_type) const;
+
+  template <typename OutputIterator>
+  bool leaf_within(const Point3d& centre, double radiusSquared, const TreeFileNode& n,
+                   OutputIterator& it, std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_within(const Point3d& centre, double radiusSquared, const TreeFileNode& n,
+                   OutputIterator& it, std::true_type) const;
+
+  void leaf_nearest(const Point3d& p, const TreeFileNode& n, NearestSet<std::uint64_t>& nearest,
+                    std::false_type) const;
+  void leaf_nearest(const Point3d& p, const TreeFileNode& n, NearestSet<std::uint64_t>& nearest,
+                    std::true_type) const;
+
+  Point3d exact(std::uint64_t index) const;
+
+  MappedFile file_;
+  InputIterator begin_;
+  PointExtractor functor_;
+  // The arrays in file_
+  const TreeFileNode* nodes_;
+  const stored_type* xs_;
+  const stored_type* ys_;
+  const stored_type* zs_;
+  const std::uint64_t* values_;
+  std::size_t node_count_;
+  std::size_t depth_;
+  std::size_t size_;
+};
+
+#define MAPPED_OCTREE_TEMPLATE typename InputIterator, typename PointExtractor, typename Scalar
+#define MAPPEDOCTREE MappedOctree<InputIterator, PointExtractor, Scalar>
+
+template <MAPPED_OCTREE_TEMPLATE>
+MAPPEDOCTREE::MappedOctree()
+  : begin_(), functor_(PointExtractor()), nodes_(nullptr), xs_(nullptr), ys_(nullptr),
+    zs_(nullptr), values_(nullptr), node_count_(0), depth_(0), size_(0) { }
+
+template <MAPPED_OCTREE_TEMPLATE>
+MAPPEDOCTREE::MappedOctree(MAPPEDOCTREE::tree_type&& rhs) : MappedOctree() {
+  swap(rhs);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+typename MAPPEDOCTREE::tree_type& MAPPEDOCTREE::operator=(MAPPEDOCTREE::tree_type&& rhs) {
+  close();
+  swap(rhs);
+  return *this;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+void MAPPEDOCTREE::swap(MAPPEDOCTREE::tree_type& rhs) {
+  file_.swap(rhs.file_);
+  std::swap(begin_, rhs.begin_);
+  std::swap(functor_, rhs.functor_);
+  std::swap(nodes_, rhs.nodes_);
+  std::swap(xs_, rhs.xs_);
+  std::swap(ys_, rhs.ys_);
+  std::swap(zs_, rhs.zs_);
+  std::swap(values_, rhs.values_);
+  std::swap(node_count_, rhs.node_count_);
+  std::swap(depth_, rhs.depth_);
+  std::swap(size_, rhs.size_);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+bool MAPPEDOCTREE::open(const std::string& path, InputIterator begin, PointExtractor f) {
+  close();
+  if (!file_.open(path) || file_.size() < sizeof(TreeFileHeader)) {
+    file_.close();
+    return false;
+  }
+  TreeFileHeader header;
+  std::memcpy(&header, file_.data(), sizeof(header));
+  if (!validTreeFileHeader<Scalar>(header, file_.size())) {
+    file_.close();
+    return false;
+  }
+
+  const char* data = file_.data();
+  begin_ = begin;
+  functor_ = f;
+  nodes_ = reinterpret_cast<const TreeFileNode*>(data + header.nodes_);
+  xs_ = reinterpret_cast<const stored_type*>(data + header.xs_);
+  ys_ = reinterpret_cast<const stored_type*>(data + header.ys_);
+  zs_ = reinterpret_cast<const stored_type*>(data + header.zs_);
+  values_ = reinterpret_cast<const std::uint64_t*>(data + header.values_);
+  node_count_ = static_cast<std::size_t>(header.node_count_);
+  depth_ = static_cast<std::size_t>(header.depth_);
+  size_ = static_cast<std::size_t>(header.point_count_);
+  return true;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+void MAPPEDOCTREE::close() {
+  file_.close();
+  nodes_ = nullptr;
+  xs_ = ys_ = zs_ = nullptr;
+  values_ = nullptr;
+  node_count_ = 0;
+  depth_ = 0;
+  size_ = 0;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+std::size_t MAPPEDOCTREE::size() const {
+  return size_;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+std::size_t MAPPEDOCTREE::depth() const {
+  return depth_;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+Point3d MAPPEDOCTREE::exact(std::uint64_t index) const {
+  PointExtractor extract(functor_);
+  return extract(*(begin_ + index));
+}
+
+// The same walks PointerlessOctree makes, over the mapped arrays
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::search(const BoundingBox& b, OutputIterator& out) const {
+  IndexOutput<InputIterator, OutputIterator> indexed(begin_, out);
+  return node_count_ > 0 && search_node(b, indexed, 0);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::search_node(const BoundingBox& b, OutputIterator& out, std::size_t node) const {
+  const TreeFileNode& n = nodes_[node];
+  if (!b.intersects(n.extrema_)) {
+    return false;
+  } else if (b.contains(n.extrema_)) {
+    return emitAll(values_ + n.points_first_, n.points_last_ - n.points_first_, out);
+  }
+
+  bool success = false;
+  if (!n.leaf_) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= search_node(b, out, child);
+    }
+  } else {
+    success = leaf_contained(b, n, out, is_quantized());
+  }
+  return success;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::radiusSearch(const Point3d& centre, double radius, OutputIterator& out) const {
+  IndexOutput<InputIterator, OutputIterator> indexed(begin_, out);
+  return node_count_ > 0 && radius >= 0 && radius_search_node(centre, radius * radius, indexed, 0);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::radius_search_node(const Point3d& centre, double radiusSquared,
+                                      OutputIterator& out, std::size_t node) const {
+  const TreeFileNode& n = nodes_[node];
+  if (!(n.extrema_.distanceSquared(centre) <= radiusSquared)) {
+    return false;
+  } else if (n.extrema_.maxDistanceSquared(centre) <= radiusSquared) {
+    return emitAll(values_ + n.points_first_, n.points_last_ - n.points_first_, out);
+  }
+
+  bool success = false;
+  if (!n.leaf_) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= radius_search_node(centre, radiusSquared, out, child);
+    }
+  } else {
+    success = leaf_within(centre, radiusSquared, n, out, is_quantized());
+  }
+  return success;
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::knn(const Point3d& p, std::size_t k, OutputIterator& out) const {
+  NearestSet<std::uint64_t> nearest(k);
+  NearestQueue<std::size_t> pending;
+  if (node_count_ > 0) {
+    pending.push(std::make_pair(nodes_[0].extrema_.distanceSquared(p), std::size_t(0)));
+  }
+  while (!pending.empty() && pending.top().first < nearest.bound()) {
+    const TreeFileNode& n = nodes_[pending.top().second];
+    pending.pop();
+    if (!n.leaf_) {
+      for (std::size_t child = n.first_; child < n.last_; ++child) {
+        double distance = nodes_[child].extrema_.distanceSquared(p);
+        if (distance < nearest.bound()) {
+          pending.push(std::make_pair(distance, child));
+        }
+      }
+    } else {
+      leaf_nearest(p, n, nearest, is_quantized());
+    }
+  }
+  IndexOutput<InputIterator, OutputIterator> indexed(begin_, out);
+  return nearest.emit(indexed);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::leaf_contained(const BoundingBox& b, const TreeFileNode& n, OutputIterator& out,
+                                  std::false_type) const {
+  return emitContained(b, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_, values_ + n.first_,
+                       n.last_ - n.first_, out);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::leaf_contained(const BoundingBox& b, const TreeFileNode& n, OutputIterator& out,
+                                  std::true_type) const {
+  const std::uint64_t* values = values_ + n.first_;
+  return emitContainedQuantized<Scalar::width>(
+      b, n.extrema_, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return exact(values[i]); }, out);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::leaf_within(const Point3d& centre, double radiusSquared, const TreeFileNode& n,
+                               OutputIterator& out, std::false_type) const {
+  return emitWithin(centre, radiusSquared, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_,
+                    values_ + n.first_, n.last_ - n.first_, out);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool MAPPEDOCTREE::leaf_within(const Point3d& centre, double radiusSquared, const TreeFileNode& n,
+                               OutputIterator& out, std::true_type) const {
+  const std::uint64_t* values = values_ + n.first_;
+  return emitWithinQuantized<Scalar::width>(
+      centre, radiusSquared, n.extrema_, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_,
+      values, n.last_ - n.first_, [&](std::size_t i) -> Point3d { return exact(values[i]); }, out);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+void MAPPEDOCTREE::leaf_nearest(const Point3d& p, const TreeFileNode& n,
+                                NearestSet<std::uint64_t>& nearest, std::false_type) const {
+  offerNearest(p, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_, values_ + n.first_,
+               n.last_ - n.first_, nearest);
+}
+
+template <MAPPED_OCTREE_TEMPLATE>
+void MAPPEDOCTREE::leaf_nearest(const Point3d& p, const TreeFileNode& n,
+                                NearestSet<std::uint64_t>& nearest, std::true_type) const {
+  const std::uint64_t* values = values_ + n.first_;
+  offerNearestQuantized<Scalar::width>(
+      p, n.extrema_, xs_ + n.first_, ys_ + n.first_, zs_ + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return exact(values[i]); }, nearest);
+}
+
+#endif // defined MAPPED_OCTREE_H
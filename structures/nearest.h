@@ -0,0 +1,126 @@
+/*
+    file - nearest.h
+
+    Pieces shared by the trees' nearest neighbour searches.
+
+    NearestSet keeps the k closest values offered to it in a max heap on
+    squared distance, so the furthest one kept, which is what anything new
+    has to beat, is always on top. Ray casts (see ray.h) key it on distance
+    along the ray instead. The trees visit nodes best first from a
+    NearestQueue, ordered by the squared distance from the query point to
+    each node's extrema, and stop once the nearest node left can't beat it.
+
+ */
+
+#ifndef NEAREST_H
+#define NEAREST_H
+
+#include "point3d.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Orders (distance, anything) pairs on the distance alone
+struct CloserThan {
+  template <typename Entry>
+  bool operator()(const Entry& lhs, const Entry& rhs) const {
+    return lhs.first < rhs.first;
+  }
+};
+
+struct FurtherThan {
+  template <typename Entry>
+  bool operator()(const Entry& lhs, const Entry& rhs) const {
+    return lhs.first > rhs.first;
+  }
+};
+
+// Nodes waiting to be visited, nearest first
+template <typename NodeRef>
+using NearestQueue = std::priority_queue<std::pair<double, NodeRef>,
+                                         std::vector<std::pair<double, NodeRef>>,
+                                         FurtherThan>;
+
+template <typename Value>
+class NearestSet {
+ public:
+  explicit NearestSet(std::size_t k);
+
+  // Anything at this squared distance or further can't make it into the set
+  double bound() const;
+
+  void offer(double distanceSquared, const Value& value);
+
+  // Writes the values out nearest first, ties in no particular order, and
+  // reports whether there were any
+  template <typename OutputIterator>
+  bool emit(OutputIterator& out);
+
+ private:
+  std::size_t k_;
+  std::vector<std::pair<double, Value>> heap_;
+};
+
+// k may be far more than will ever be offered, for a set that keeps every
+// hit of a ray, so only a modest heap is reserved up front
+template <typename Value>
+NearestSet<Value>::NearestSet(std::size_t k) : k_(k) {
+  heap_.reserve(std::min<std::size_t>(k, 1024));
+}
+
+template <typename Value>
+double NearestSet<Value>::bound() const {
+  if (heap_.size() < k_) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return k_ == 0 ? -std::numeric_limits<double>::infinity() : heap_.front().first;
+}
+
+template <typename Value>
+void NearestSet<Value>::offer(double distanceSquared, const Value& value) {
+  if (!(distanceSquared < bound())) {
+    return;
+  }
+  if (heap_.size() == k_) {
+    std::pop_heap(heap_.begin(), heap_.end(), CloserThan());
+    heap_.pop_back();
+  }
+  heap_.push_back(std::make_pair(distanceSquared, value));
+  std::push_heap(heap_.begin(), heap_.end(), CloserThan());
+}
+
+template <typename Value>
+template <typename OutputIterator>
+bool NearestSet<Value>::emit(OutputIterator& out) {
+  std::sort_heap(heap_.begin(), heap_.end(), CloserThan());
+  for (const std::pair<double, Value>& entry : heap_) {
+    *out = entry.second;
+    ++out;
+  }
+  return !heap_.empty();
+}
+
+// Offers every one of n points that is closer to p than the set's bound. The
+// coordinates may be float or double.
+template <typename Scalar, typename Value>
+void offerNearest(const Point3d& p,
+                  const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                  const Value* values, std::size_t n, NearestSet<Value>& nearest) {
+  double bound = nearest.bound();
+  for (std::size_t i = 0; i < n; ++i) {
+    double dx = static_cast<double>(xs[i]) - p.x;
+    double dy = static_cast<double>(ys[i]) - p.y;
+    double dz = static_cast<double>(zs[i]) - p.z;
+    double distanceSquared = dx * dx + dy * dy + dz * dz;
+    if (distanceSquared < bound) {
+      nearest.offer(distanceSquared, values[i]);
+      bound = nearest.bound();
+    }
+  }
+}
+
+#endif // defined NEAREST_H
@@ -12,21 +12,55 @@
 #include "point3d.h"
 #include "boundingbox.h"
 #include "inneriterator.h"
+#include "arena.h"
+#include "leaf_kernel.h"
+#include "nearest.h"
+#include "polytope.h"
+#include "ray.h"
+#include "search_range.h"
+#include "taskpool.h"
+#include "tree_stats.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <utility>
 #include <type_traits>
+#include <vector>
 
 
+// Passed to an Octree constructor to build it lazily. Subtrees of more than
+// threshold_ values are left as an unsorted range of points, and only split
+// when a query first reaches them.
+struct LazyBuild {
+  explicit LazyBuild(size_t threshold = 1024) : threshold_(threshold) {}
+
+  size_t threshold_;
+};
+
+// Nodes are placed in a per-tree Arena whose chunks come from Allocator. The
+// children of a node are allocated together, so siblings sit side by side,
+// and tearing the tree down releases whole chunks rather than every node.
+//
+// Leaves store coordinates as Scalar, double or float. A float tree rounds
+// every point to float as it goes in and answers every query for the rounded
+// points, in half the memory.
 template <typename InputIterator, class PointExtractor, 
-          size_t max_per_node = 16, size_t max_depth = 100>
+          size_t max_per_node = 16, size_t max_depth = 100,
+          class Allocator = std::allocator<char>, typename Scalar = double>
 class Octree {
  public:
-  using tree_type = Octree<InputIterator, PointExtractor, max_per_node, max_depth>;
+  using tree_type = Octree<InputIterator, PointExtractor, max_per_node, max_depth, Allocator, Scalar>;
+  // The values found for each box of a batch, by position in the batch
+  using batch_results = std::vector<std::vector<InputIterator>>;
 
   Octree();
 
@@ -34,16 +68,33 @@ class Octree {
 
   Octree(InputIterator begin, InputIterator end, PointExtractor f);
 
+  // Builds subtrees in parallel on the given pool. The resulting tree is
+  // identical to the one the serial constructors build.
+  Octree(InputIterator begin, InputIterator end, TaskPool& pool);
+
+  Octree(InputIterator begin, InputIterator end, PointExtractor f, TaskPool& pool);
+
+  // Builds only the top of the tree, down to subtrees of lazy.threshold_
+  // values. Queries split those as they reach them, so the first query
+  // comes sooner and regions no query visits are never built. Queries may
+  // still run concurrently; each subtree is split once, by whichever query
+  // gets there first. Splitting reuses the construction buffer, which the
+  // tree keeps until it goes. Fully split, the tree is identical to the one
+  // the other constructors build.
+  Octree(InputIterator begin, InputIterator end, LazyBuild lazy);
+
+  Octree(InputIterator begin, InputIterator end, PointExtractor f, LazyBuild lazy);
+
   Octree(const tree_type& rhs);
 
   template <size_t max_per_node_>
-  Octree(const Octree<InputIterator, PointExtractor, max_per_node_, max_depth>& rhs);
+  Octree(const Octree<InputIterator, PointExtractor, max_per_node_, max_depth, Allocator, Scalar>& rhs);
   
   template <size_t max_depth_>
-  Octree(const Octree<InputIterator, PointExtractor, max_per_node, max_depth_>& rhs);
+  Octree(const Octree<InputIterator, PointExtractor, max_per_node, max_depth_, Allocator, Scalar>& rhs);
   
   template <size_t max_per_node_, size_t max_depth_>
-  Octree(const Octree<InputIterator, PointExtractor, max_per_node_, max_depth_>& rhs);
+  Octree(const Octree<InputIterator, PointExtractor, max_per_node_, max_depth_, Allocator, Scalar>& rhs);
   
   Octree(tree_type&& rhs);
 
@@ -52,6 +103,132 @@ class Octree {
   template <typename OutputIterator>
   bool search(const BoundingBox& box, OutputIterator& it) const;
 
+  // Writes every value inside polytope, such as a view frustum. Subtrees
+  // entirely inside it are written without testing their points, and leaves
+  // test their points against only the planes their bounds straddle.
+  template <typename OutputIterator>
+  bool search(const ConvexPolytope& polytope, OutputIterator& it) const;
+
+  // Answers every box in [first, last) in one walk of the tree, which visits
+  // each node once for all of the boxes still interested in it. results[i]
+  // ends up holding what search() would find for the i'th box; passing the
+  // same results to the next batch reuses the space it already holds.
+  template <typename BoxIterator>
+  void searchBatch(BoxIterator first, BoxIterator last, batch_results& results) const;
+
+  // The same, with the batch split between the threads of pool
+  template <typename BoxIterator>
+  void searchBatch(BoxIterator first, BoxIterator last, batch_results& results,
+                   TaskPool& pool) const;
+
+  // Writes every value no further than radius from centre
+  template <typename OutputIterator>
+  bool radiusSearch(const Point3d& centre, double radius, OutputIterator& it) const;
+
+  // Writes the (up to) k values nearest to p, nearest first
+  template <typename OutputIterator>
+  bool knn(const Point3d& p, size_t k, OutputIterator& it) const;
+
+  // Writes every value no further than radius from ray, front to back: in
+  // order of how far along the ray the point of it nearest each one lies,
+  // ties in no particular order. Only nodes the ray passes through, once
+  // grown by radius, are visited, in the order the ray enters them.
+  template <typename OutputIterator>
+  bool raycast(const Ray& ray, double radius, OutputIterator& it) const;
+
+  // The first (up to) k of those, in the same order, stopping as soon as no
+  // node left could hold anything earlier. k = 1 is the nearest hit.
+  template <typename OutputIterator>
+  bool firstHits(const Ray& ray, double radius, size_t k, OutputIterator& it) const;
+
+  // A value of this tree and a value of the tree it was joined with, or of
+  // this tree again
+  using join_pair = std::pair<InputIterator, InputIterator>;
+
+  // Writes a join_pair for every value here and value of other no further
+  // than epsilon apart, in one walk down both trees together. Pairs of nodes
+  // further apart than epsilon are skipped whole, pairs entirely within it
+  // are written without looking at their points, and only pairs of leaves
+  // in between compare points.
+  template <typename OutputIterator>
+  bool join(const tree_type& other, double epsilon, OutputIterator& it) const;
+
+  // The same, with the walk split into pairs of subtrees shared out between
+  // the threads of pool. Each piece's pairs are written to it as soon as it
+  // and every piece before it are done, in the same order as the serial
+  // join's, however many threads there are.
+  template <typename OutputIterator>
+  bool join(const tree_type& other, double epsilon, OutputIterator& it, TaskPool& pool) const;
+
+  // Every pair of values in this tree no further than epsilon apart, each
+  // pair once and no value paired with itself
+  template <typename OutputIterator>
+  bool selfJoin(double epsilon, OutputIterator& it) const;
+
+  template <typename OutputIterator>
+  bool selfJoin(double epsilon, OutputIterator& it, TaskPool& pool) const;
+
+  // Calls visitor(value, point) for every value in box, in the order search()
+  // would find them, with the point the tree holds for it. The visitor
+  // returns Visit::CONTINUE for more or Visit::STOP to end the search there
+  // and then, which this reports.
+  template <typename Visitor>
+  bool visit(const BoundingBox& box, Visitor&& visitor) const;
+
+  class search_iterator;
+  using search_range = SearchRange<search_iterator>;
+
+  // The values search() would find in box, in the same order, found one leaf
+  // at a time as the range is walked rather than all up front. Leaving the
+  // loop early skips the rest of the search. The tree mustn't change while
+  // the range is in use.
+  search_range searchRange(const BoundingBox& box) const;
+
+  // The same queries, adding the work each does to stats
+  template <typename OutputIterator>
+  bool search(const BoundingBox& box, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool search(const ConvexPolytope& polytope, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool radiusSearch(const Point3d& centre, double radius, OutputIterator& it,
+                    QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool knn(const Point3d& p, size_t k, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool raycast(const Ray& ray, double radius, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool firstHits(const Ray& ray, double radius, size_t k, OutputIterator& it,
+                 QueryStats& stats) const;
+
+  // Describes the shape of the tree. Subtrees of a lazily built tree that no
+  // query has split are counted as they are, so this shouldn't run while
+  // queries might be splitting them.
+  TreeStats stats() const;
+
+  // Adds one value without rebuilding. A full leaf splits, and a point
+  // outside the tree grows the root until it fits. Values whose points
+  // aren't finite are turned away, and false returned.
+  bool insert(InputIterator it);
+
+  // Removes one copy of a value, found by where functor_ puts it now, so
+  // erase a value before changing its point. Subtrees left small enough to
+  // fit in a leaf are folded back into one. Reports whether it was there.
+  bool erase(InputIterator it);
+
+  // Reads every value's point through functor_ again, for values that have
+  // moved, and relocates only the ones that have left their leaf. A point may
+  // stray up to tolerance outside its leaf and stay put, so small jitter
+  // doesn't change the tree; searches allow for the tolerance of the latest
+  // update(), as every point is checked against it. Values whose points are
+  // no longer finite are dropped. Returns the number of values relocated or
+  // dropped.
+  size_t update(double tolerance = 0.);
+
   tree_type& operator=(tree_type rhs);
 
   tree_type& operator=(tree_type&& rhs);
@@ -63,78 +240,394 @@ class Octree {
  private:  
   class Node;
 
+ public:
+  // Walks the tree with a stack of its own, and scans each leaf it reaches
+  // 64 points at a time. A default constructed iterator is the end of every
+  // search.
+  class search_iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = InputIterator;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const InputIterator*;
+    using reference = const InputIterator&;
+
+    search_iterator();
+
+    reference operator*() const;
+    pointer operator->() const;
+
+    search_iterator& operator++();
+    search_iterator operator++(int);
+
+    bool operator==(const search_iterator& rhs) const;
+    bool operator!=(const search_iterator& rhs) const;
+
+   private:
+    friend class Octree;
+
+    search_iterator(const Node* root, const BoundingBox& box, double slack);
+
+    // Moves on to the next leaf with anything in the box, or to the end
+    void next_leaf();
+
+    // Finds the first block of the leaf from block on with a point in the
+    // box, and reports whether there was one
+    bool scan(size_t block);
+
+    BoundingBox box_;
+    double slack_;
+    // Nodes still to look at, each with whether the box holds all of it
+    std::vector<std::pair<const Node*, bool>> pending_;
+    // The leaf being scanned, which the box holds all of if whole_ is set.
+    // mask_ holds the points of block_ onwards not handed out yet.
+    const Scalar* xs_;
+    const Scalar* ys_;
+    const Scalar* zs_;
+    const InputIterator* values_;
+    size_t size_;
+    size_t block_;
+    std::uint64_t mask_;
+    bool whole_;
+  };
+
+ private:
+
+  // Leaves keep each coordinate in its own array, so that leaf_kernel.h can
+  // test several points per instruction
   struct LeafNodeValues {
-    std::array<std::pair<InputIterator, Point3d>, max_per_node> values_;
+    std::array<Scalar, max_per_node> xs_;
+    std::array<Scalar, max_per_node> ys_;
+    std::array<Scalar, max_per_node> zs_;
+    std::array<InputIterator, max_per_node> values_;
+    size_t size_;
+  };
+
+  // Leaves past max_depth can hold any number of values, kept in the arena
+  struct MaxDepthLeafValues {
+    Scalar* xs_;
+    Scalar* ys_;
+    Scalar* zs_;
+    InputIterator* values_;
     size_t size_;
+    size_t capacity_;
   };
 
   using childNodeArray = std::array<Node*, 8>;
-  using maxItemNode = std::vector<std::pair<InputIterator, Point3d>>;
 
+  struct LazyState;
+
+  // Construction works on sub-ranges of one buffer of every input point,
+  // which each internal node partitions in place among its children
+  using buffer_iterator = typename std::vector<std::pair<InputIterator, Point3d>>::iterator;
+
+  // A subtree not yet built, whose values are still in lazy_'s buffer
+  struct UnsplitValues {
+    buffer_iterator begin_;
+    buffer_iterator end_;
+    size_t depth_;
+    LazyState* lazy_;
+  };
+
+  // The active member is selected by Node::tag_ and is constructed in place by
+  // the Node::init_* functions, and torn down by ~Node.
   union NodeValues {
-    NodeValues() : internalValue_() {}
-    NodeValues(const LeafNodeValues& v) : leafValue_(v) {}
-    NodeValues(const childNodeArray& v) : internalValue_(v) {}
-    NodeValues(const maxItemNode& v) : maxDepthLeafValue_(v) {}
-    NodeValues(const NodeValues& v) : NodeValues() {
-      memcpy(this, &v, sizeof(NodeValues));
-    }
-    NodeValues& operator=(const NodeValues& rhs) {
-      memcpy(this, &rhs, sizeof(NodeValues));
-      return *this;
-    }
+    NodeValues() {}
+    NodeValues(const NodeValues&) = delete;
+    NodeValues& operator=(const NodeValues&) = delete;
     ~NodeValues() {}
 
     LeafNodeValues leafValue_;
     childNodeArray internalValue_;
-    maxItemNode maxDepthLeafValue_;
+    MaxDepthLeafValues maxDepthLeafValue_;
+    UnsplitValues unsplitValue_;
   };
 
+  using node_arena = Arena<Allocator>;
+
+  // Nodes only need destroying one by one if the values they hold do
+  static const bool trivial_values = std::is_trivially_destructible<InputIterator>::value;
+
   enum class NodeContents : char {
     LEAF = 1,
     MAX_DEPTH_LEAF = 2,
-    INTERNAL = 4
+    INTERNAL = 4,
+    UNSPLIT = 8
+  };
+
+  // Subtrees with fewer points than this are always built on the thread
+  // that reaches them; anything smaller isn't worth the hand-off
+  static const size_t parallel_build_cutoff = 4096;
+
+  // Batches are only split between threads into pieces at least this big
+  static const size_t parallel_batch_cutoff = 64;
+
+  // Parallel joins are split into this many pieces per thread, as pairs of
+  // subtrees vary a lot in how many pairs they hold, going no deeper than
+  // max_join_split_depth to find them
+  static const size_t join_pieces_per_thread = 8;
+  static const size_t max_join_split_depth = 8;
+  // Pieces are started no more than this many per thread ahead of the
+  // oldest one whose pairs haven't been written out, which bounds how many
+  // pieces' pairs are held at once
+  static const size_t join_jobs_held_per_thread = 4;
+
+  // The most times insert() will double the root to reach a point before
+  // rebuilding around it instead
+  static const size_t max_root_growth = 64;
+
+  using value_buffer = std::vector<std::pair<InputIterator, Point3d>>;
+
+  // What a lazily built tree keeps for splitting subtrees later. Nodes made
+  // by splitting come from an arena of its own, which moves with the tree
+  // where the tree's own arena_ is swapped from under them.
+  struct LazyState {
+    explicit LazyState(size_t threshold) : threshold_(threshold) {}
+
+    value_buffer values_;
+    node_arena arena_;
+    size_t threshold_;
+  };
+
+  // Everything the nodes of one tree share while it's being built or changed.
+  // Nodes given up by erase() wait in free_nodes_ to be reused; a build
+  // running in parallel leaves it null and takes everything from the arena.
+  // Subtrees are only left unsplit where lazy_ is set, and only over its
+  // buffer.
+  struct BuildContext {
+    node_arena* arena_;
+    TaskPool* pool_;
+    std::vector<Node*>* free_nodes_;
+    LazyState* lazy_;
+  };
+
+  // A pair of subtrees whose pairs of values are still to be found, or a
+  // subtree whose values are to be paired among themselves if other_ is null
+  struct JoinJob {
+    const Node* node_;
+    const Node* other_;
   };
 
   class Node {
    public:    
-    Node(const std::vector<std::pair<InputIterator, Point3d>>& input_values);
+    Node(buffer_iterator begin, buffer_iterator end, const BuildContext& context);
 
-    Node(const std::vector<std::pair<InputIterator, Point3d>>& input_values, 
+    Node(buffer_iterator begin, 
+         buffer_iterator end, 
          const BoundingBox& box,
-         size_t current_depth);
+         size_t current_depth,
+         const BuildContext& context);
+
+    // An internal node whose only child is child, in the given octant
+    Node(const BoundingBox& box, size_t octant, Node* child);
 
     ~Node();
 
+    // Room for one node, reusing one that was given up if there is one
+    static Node* allocate(const BuildContext& context);
+
+    const BoundingBox& extrema() const;
+
+    bool empty() const;
+
+    // The number of values in the subtree, or anything over limit once it's
+    // clear there are more than that
+    size_t count(size_t limit) const;
+
+    // Appends every value in the subtree and its point to values
+    void collect(value_buffer& values) const;
+
+    // Hands every node below this one to context's free list. They are still
+    // destroyed along with this node.
+    void release(const BuildContext& context);
+
+    // Adds value at p to the subtree, which is current_depth below the root
+    void insert(InputIterator value, const Point3d& p, size_t current_depth,
+                const BuildContext& context);
+
+    // Points may lie up to slack outside their leaf, so a value is looked for
+    // in every child that could hold it, the one p falls in first
+    bool erase(const InputIterator& value, const Point3d& p, double slack,
+               const BuildContext& context);
+
+    // Stores the points functor gives for the subtree's values, keeping those
+    // no further than tolerance outside their leaf, or their unsplit node,
+    // and appending the rest to moved
+    void refit(PointExtractor& functor, double tolerance, value_buffer& moved,
+               const BuildContext& context);
+
+    // Drops empty children, and turns the node back into a leaf if the whole
+    // subtree fits in one
+    void fold(const BuildContext& context);
+
+    // The searches treat each node as slack bigger on every side than its
+    // extrema_, since update() may have left points that far outside it.
+    // Their work is counted in stats, a QueryStats or NoQueryStats.
+    template <typename OutputIterator, typename Stats>
+    bool search(const BoundingBox& box, double slack, OutputIterator& it, Stats& stats) const;
+
+    // active has a bit set for each plane of polytope the node's parent
+    // straddles
+    template <typename OutputIterator, typename Stats>
+    bool search(const ConvexPolytope& polytope, std::uint64_t active, double slack,
+                OutputIterator& it, Stats& stats) const;
+
+    template <typename OutputIterator, typename Stats>
+    bool radiusSearch(const Point3d& centre, double radiusSquared, double slack,
+                      OutputIterator& it, Stats& stats) const;
+
+    // Answers the boxes numbered active[first, last) from this node down.
+    // The boxes that still need to look inside it are appended to active
+    // for the children and dropped again afterwards.
+    void searchBatch(const std::vector<BoundingBox>& boxes, double slack,
+                     std::vector<size_t>& active, size_t first, size_t last,
+                     batch_results& results) const;
+
+    // Writes a pair for every value here and value in other's subtree no
+    // further apart than the square root of epsilonSquared, allowing for
+    // points up to slack (both trees' slack together) outside their leaves.
+    // With jobs set, the pairs of subtrees depth levels down are added to it
+    // rather than walked.
+    template <typename OutputIterator>
+    bool join(const Node& other, double epsilonSquared, double slack, OutputIterator& it,
+              size_t depth, std::vector<JoinJob>* jobs) const;
+
+    // The same for the pairs of values within the subtree, each once
+    template <typename OutputIterator>
+    bool selfJoin(double epsilonSquared, double slack, OutputIterator& it, size_t depth,
+                  std::vector<JoinJob>* jobs) const;
+
+    // Every value in the subtree, in the order search() would find them
     template <typename OutputIterator>
-    bool search(const BoundingBox& box, OutputIterator& it) const;
+    bool emit(OutputIterator& it) const;
+
+    // Hands visitor the values in box, or every value in the subtree, until
+    // it asks to stop, and reports whether it did
+    template <typename Visitor>
+    bool visit(const BoundingBox& box, double slack, Visitor& visitor) const;
+
+    template <typename Visitor>
+    bool visitAll(Visitor& visitor) const;
+
+    // Builds an unsplit node's children, making it internal, and returns
+    // what the node holds. Changes nothing a query could tell apart, so it
+    // is const, and safe to call from concurrent queries.
+    NodeContents split() const;
+
+    // Offers a leaf's values to nearest, or queues the children that could
+    // still hold something nearer
+    template <typename Stats>
+    void nearest(const Point3d& p, double slack, NearestSet<InputIterator>& nearest,
+                 NearestQueue<const Node*>& pending, Stats& stats) const;
+
+    // Offers a leaf's values within radius of ray to hits, or queues the
+    // children the ray enters before the last hit kept, by where it enters
+    template <typename Stats>
+    void cast(const Ray& ray, double radius, double slack, NearestSet<InputIterator>& hits,
+              NearestQueue<const Node*>& pending, Stats& stats) const;
+
+    // Adds the subtree, which is depth below the root, to stats
+    void describe(size_t depth, TreeStats& stats) const;
 
    private:
+    friend class search_iterator;
+
     NodeValues value_;
     BoundingBox extrema_;
-    NodeContents tag_;
+    // Atomic only so that a query can tell an unsplit node from one another
+    // query has just split
+    std::atomic<NodeContents> tag_;
+
+    // Nodes being split lock one of these, picked by address
+    static std::mutex& split_lock(const Node* node);
 
-    void init_max_depth_leaf(const std::vector<std::pair<InputIterator, Point3d>>& input_values);
+    // The arrays of a leaf of either kind
+    void leaf_arrays(const Scalar*& xs, const Scalar*& ys, const Scalar*& zs,
+                     const InputIterator*& values, size_t& size) const;
 
-    void init_leaf(const std::vector<std::pair<InputIterator, Point3d>>& input_values);
+    void init_unsplit(buffer_iterator begin, buffer_iterator end, size_t current_depth,
+                      const BuildContext& context);
+
+    void init_max_depth_leaf(buffer_iterator begin, buffer_iterator end,
+                             const BuildContext& context);
+
+    void init_leaf(buffer_iterator begin, buffer_iterator end);
+
+    // Compacts a leaf's arrays down to the values whose new points are in
+    // bounds, and returns how many there are
+    static size_t refit_leaf(PointExtractor& functor, const BoundingBox& bounds,
+                             Scalar* xs, Scalar* ys, Scalar* zs, InputIterator* values,
+                             size_t size, value_buffer& moved);
     
     void init_internal(
-        const std::vector<std::pair<InputIterator, Point3d>>& input_values,
-        size_t current_depth);
+        buffer_iterator begin,
+        buffer_iterator end,
+        size_t current_depth,
+        const BuildContext& context);
 
   };
 
+  // Builds over values, which a lazy build of lazy_threshold > 0 takes over
+  void build(std::vector<std::pair<InputIterator, Point3d>>& values, TaskPool* pool,
+             size_t lazy_threshold = 0);
+
+  // Adds value at p, for insert() and update()
+  bool place(InputIterator value, const Point3d& p);
+
+  // Doubles the root until it holds p, and reports whether that worked
+  bool grow(const Point3d& p, const BuildContext& context);
+
+  // Works out one axis of a root twice the size of [low, high], with the old
+  // root as one half of it, where the midpoint sends every coordinate in
+  // [low, high] to the old root's half. Coordinates up to gap outside
+  // [low, high] go there too, so points can end up that far outside their
+  // leaf. Fails if the root can't grow any further.
+  static bool grow_axis(double low, double high, double p,
+                        double& grownLow, double& grownHigh, bool& upper, double& gap);
+
+  // Throws the tree away and builds it again with value added
+  void rebuild(InputIterator value, const Point3d& p);
+
+  // Walks the tree for boxes [first, last) of the batch
+  void search_batch(const std::vector<BoundingBox>& boxes, size_t first, size_t last,
+                    batch_results& results) const;
+
+  template <typename OutputIterator, typename Stats>
+  bool find_nearest(const Point3d& p, size_t k, OutputIterator& it, Stats& stats) const;
+
+  template <typename OutputIterator, typename Stats>
+  bool find_hits(const Ray& ray, double radius, size_t k, OutputIterator& it, Stats& stats) const;
+
+  template <typename OutputIterator>
+  static bool run_join(const JoinJob& job, double epsilonSquared, double slack,
+                       OutputIterator& it, size_t depth, std::vector<JoinJob>* jobs);
+
+  // Joins the root with other, or with itself if other is null, on pool
+  template <typename OutputIterator>
+  bool parallel_join(const Node* other, double epsilonSquared, double slack, OutputIterator& it,
+                     TaskPool& pool) const;
+
   PointExtractor functor_;
+  node_arena arena_;
+  std::vector<Node*> free_nodes_;
   Node* head_;
   size_t size_;
+  // Only for a lazily built tree
+  std::unique_ptr<LazyState> lazy_;
+  // How far outside its leaf a point may be, left there by the last update()
+  // or by rounding when the root grew. The rounding stays with the nodes it
+  // misplaced until the next build, so it is kept apart in growth_slack_.
+  double slack_;
+  double growth_slack_;
 };
 
 // convenience macros to avoid typing so much
-#define OCTREE Octree<InputIterator, PointExtractor, max_per_node, max_depth>
-#define OCTREE_TEMPLATE typename InputIterator, class PointExtractor, size_t max_per_node, size_t max_depth
+#define OCTREE Octree<InputIterator, PointExtractor, max_per_node, max_depth, Allocator, Scalar>
+#define OCTREE_TEMPLATE typename InputIterator, class PointExtractor, size_t max_per_node, size_t max_depth, class Allocator, typename Scalar
 
 template <OCTREE_TEMPLATE>
-OCTREE::Octree(): functor_(PointExtractor()), head_(nullptr), size_(0) {}
+OCTREE::Octree()
+  : functor_(PointExtractor()), head_(nullptr), size_(0), slack_(0.), growth_slack_(0.) {}
 
 template <OCTREE_TEMPLATE>
 OCTREE::Octree(InputIterator begin, InputIterator end)
@@ -142,171 +635,1547 @@ OCTREE::Octree(InputIterator begin, InputIterator end)
 
 template <OCTREE_TEMPLATE>
 OCTREE::Octree(InputIterator begin, InputIterator end, PointExtractor f)
-    : functor_(f), head_(nullptr), size_(0) {
+    : functor_(f), head_(nullptr), size_(0), slack_(0.), growth_slack_(0.) {
+
+  std::vector<std::pair<InputIterator, Point3d>> v;
+  v.reserve(std::distance(begin, end));
+
+  for (auto it = begin; it != end; ++it) {
+    v.push_back(std::pair<InputIterator, Point3d>(it, toScalarPoint<Scalar>(functor_(*it))));
+  }
+  
+  build(v, nullptr);
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::Octree(InputIterator begin, InputIterator end, TaskPool& pool)
+  : Octree(begin, end, PointExtractor(), pool) { }
+
+template <OCTREE_TEMPLATE>
+OCTREE::Octree(InputIterator begin, InputIterator end, PointExtractor f, TaskPool& pool)
+    : functor_(f), head_(nullptr), size_(0), slack_(0.), growth_slack_(0.) {
 
   std::vector<std::pair<InputIterator, Point3d>> v;
   v.reserve(std::distance(begin, end));
 
   for (auto it = begin; it != end; ++it) {
-    v.push_back(std::pair<InputIterator, Point3d>(it, functor_(*it)));
+    v.push_back(std::pair<InputIterator, Point3d>(it, toScalarPoint<Scalar>(functor_(*it))));
   }
   
-  size_ = v.size();
-  head_ = new Node(v);
+  build(v, &pool);
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::Octree(InputIterator begin, InputIterator end, LazyBuild lazy)
+  : Octree(begin, end, PointExtractor(), lazy) { }
+
+template <OCTREE_TEMPLATE>
+OCTREE::Octree(InputIterator begin, InputIterator end, PointExtractor f, LazyBuild lazy)
+    : functor_(f), head_(nullptr), size_(0), slack_(0.), growth_slack_(0.) {
+
+  std::vector<std::pair<InputIterator, Point3d>> v;
+  v.reserve(std::distance(begin, end));
+
+  for (auto it = begin; it != end; ++it) {
+    v.push_back(std::pair<InputIterator, Point3d>(it, toScalarPoint<Scalar>(functor_(*it))));
+  }
+
+  build(v, nullptr, std::max<size_t>(lazy.threshold_, 1));
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::build(std::vector<std::pair<InputIterator, Point3d>>& values, TaskPool* pool,
+                   size_t lazy_threshold) {
+  lazy_.reset();
+  if (lazy_threshold > 0) {
+    lazy_.reset(new LazyState(lazy_threshold));
+    lazy_->values_.swap(values);
+  }
+  value_buffer& buffer = lazy_ ? lazy_->values_ : values;
+  BuildContext context{&arena_, pool, nullptr, lazy_.get()};
+  size_ = buffer.size();
+  slack_ = 0.;
+  growth_slack_ = 0.;
+  head_ = new (arena_.template allocate<Node>(1)) Node(buffer.begin(), buffer.end(), context);
 }
 
 template <OCTREE_TEMPLATE>
 OCTREE::Octree(OCTREE::tree_type&& rhs) 
-  : functor_(rhs.functor), head_(rhs.head_), size_(rhs.size_) { }
+  : functor_(rhs.functor_), arena_(std::move(rhs.arena_)),
+    free_nodes_(std::move(rhs.free_nodes_)), head_(rhs.head_), size_(rhs.size_),
+    lazy_(std::move(rhs.lazy_)), slack_(rhs.slack_), growth_slack_(rhs.growth_slack_) {
+  rhs.head_ = nullptr;
+  rhs.size_ = 0;
+}
 
 template <OCTREE_TEMPLATE>
 void OCTREE::swap(OCTREE::tree_type& rhs) {
   std::swap(head_, rhs.head_);
   std::swap(functor_, rhs.functor_);
+  arena_.swap(rhs.arena_);
+  std::swap(free_nodes_, rhs.free_nodes_);
   std::swap(size_, rhs.size_);
+  std::swap(lazy_, rhs.lazy_);
+  std::swap(slack_, rhs.slack_);
+  std::swap(growth_slack_, rhs.growth_slack_);
 }
 
 template <OCTREE_TEMPLATE>
 template <typename OutputIterator>
 bool OCTREE::search(const BoundingBox& box, OutputIterator& it) const {
-  return head_->search(box, it);
+  NoQueryStats stats;
+  return head_ && head_->search(box, slack_, it, stats);
 }
 
 template <OCTREE_TEMPLATE>
-typename OCTREE::tree_type& OCTREE::operator=(typename OCTREE::tree_type rhs) {
-  swap(rhs);
-  return *this;
+template <typename OutputIterator>
+bool OCTREE::search(const BoundingBox& box, OutputIterator& it, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return head_ && head_->search(box, slack_, counted, stats);
 }
 
 template <OCTREE_TEMPLATE>
-typename OCTREE::tree_type& OCTREE::operator=(typename OCTREE::tree_type&& rhs) {
-  swap(rhs);
-  return *this;
+template <typename OutputIterator>
+bool OCTREE::search(const ConvexPolytope& polytope, OutputIterator& it) const {
+  NoQueryStats stats;
+  return head_ && polytope.valid() &&
+         head_->search(polytope, polytope.allPlanes(), slack_, it, stats);
 }
 
 template <OCTREE_TEMPLATE>
-OCTREE::~Octree() {
-  delete head_;
+template <typename OutputIterator>
+bool OCTREE::search(const ConvexPolytope& polytope, OutputIterator& it, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return head_ && polytope.valid() &&
+         head_->search(polytope, polytope.allPlanes(), slack_, counted, stats);
 }
 
 template <OCTREE_TEMPLATE>
-size_t OCTREE::size() const {
-  return size_;
+template <typename BoxIterator>
+void OCTREE::searchBatch(BoxIterator first, BoxIterator last, batch_results& results) const {
+  std::vector<BoundingBox> boxes(first, last);
+  results.resize(boxes.size());
+  for (std::vector<InputIterator>& found : results) {
+    found.clear();
+  }
+  search_batch(boxes, 0, boxes.size(), results);
 }
 
 template <OCTREE_TEMPLATE>
-OCTREE::Node::Node(const std::vector<std::pair<InputIterator, Point3d>>& input_values)
-  : Node(input_values, 
-         makeBoundingBox(
-            InnerIterator<InputIterator>(input_values.begin()), 
-            InnerIterator<InputIterator>(input_values.end())),
-         0) { }
+template <typename BoxIterator>
+void OCTREE::searchBatch(BoxIterator first, BoxIterator last, batch_results& results,
+                         TaskPool& pool) const {
+  std::vector<BoundingBox> boxes(first, last);
+  results.resize(boxes.size());
+  for (std::vector<InputIterator>& found : results) {
+    found.clear();
+  }
 
-template <OCTREE_TEMPLATE>
-OCTREE::Node::Node(
-    const std::vector<std::pair<InputIterator, Point3d>>& input_values, 
-    const BoundingBox& box,
-    size_t current_depth) : extrema_(box)  {
-  if (current_depth > max_depth) {
-    init_max_depth_leaf(input_values);
-  } else if (input_values.size() <= max_per_node) {
-    init_leaf(input_values);
-  } else {
-    init_internal(input_values, current_depth);
+  // A few pieces per thread, so that one slow piece doesn't hold up the rest
+  size_t pieces = std::max<size_t>(1, std::min((pool.size() + 1) * 4,
+                                               boxes.size() / parallel_batch_cutoff));
+  TaskGroup group(pool);
+  for (size_t piece = 0; piece < pieces; ++piece) {
+    size_t begin = boxes.size() * piece / pieces;
+    size_t end = boxes.size() * (piece + 1) / pieces;
+    const std::vector<BoundingBox>* shared = &boxes;
+    batch_results* output = &results;
+    group.run([this, shared, begin, end, output]() {
+      search_batch(*shared, begin, end, *output);
+    });
   }
+  group.wait();
 }
 
 template <OCTREE_TEMPLATE>
-OCTREE::Node::~Node() {
-  if (tag_ == NodeContents::INTERNAL) {
-    for (auto childPointer : value_.internalValue_) {
-      delete childPointer;
-    }
-    value_.internalValue_.~childNodeArray();
-  } else if (tag_ == NodeContents::LEAF) {
-    value_.leafValue_.~LeafNodeValues();
-  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
-    value_.maxDepthLeafValue_.~maxItemNode();
+void OCTREE::search_batch(const std::vector<BoundingBox>& boxes, size_t first, size_t last,
+                          batch_results& results) const {
+  if (!head_ || first == last) {
+    return;
   }
+  std::vector<size_t> active;
+  for (size_t box = first; box < last; ++box) {
+    active.push_back(box);
+  }
+  head_->searchBatch(boxes, slack_, active, 0, active.size(), results);
 }
 
 template <OCTREE_TEMPLATE>
 template <typename OutputIterator>
-bool OCTREE::Node::search(const BoundingBox& p, OutputIterator& it) const {
-  bool success = false;
-  if (tag_ == NodeContents::INTERNAL) {
-    for (auto child : value_.internalValue_) {
-      if (child) {
-        success |= child->search(p, it);
-      }
-    }
-  } else if (tag_ == NodeContents::LEAF) {
-    const LeafNodeValues& children = value_.leafValue_;
-    for (size_t i = 0; i < children.size_; ++i) {
-      const Point3d& point = std::get<1>(children.values_[i]);
-      if (p.contains(point)) {
-        *it = std::get<0>(children.values_[i]);
-        ++it;
-        success = true;
-      }
-    }
-  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
-    for (auto child : value_.maxDepthLeafValue_) {
-      Point3d& point = std::get<1>(child);
-      if (p.contains(point)) {
-        *it = std::get<0>(child);
-        ++it;
-        success = true;
-      }
-    }
+bool OCTREE::radiusSearch(const Point3d& centre, double radius, OutputIterator& it) const {
+  NoQueryStats stats;
+  return head_ && radius >= 0 && head_->radiusSearch(centre, radius * radius, slack_, it, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::radiusSearch(const Point3d& centre, double radius, OutputIterator& it,
+                          QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return head_ && radius >= 0 &&
+         head_->radiusSearch(centre, radius * radius, slack_, counted, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::knn(const Point3d& p, size_t k, OutputIterator& it) const {
+  NoQueryStats stats;
+  return find_nearest(p, k, it, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::knn(const Point3d& p, size_t k, OutputIterator& it, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return find_nearest(p, k, counted, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::raycast(const Ray& ray, double radius, OutputIterator& it) const {
+  NoQueryStats stats;
+  return find_hits(ray, radius, size_, it, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::raycast(const Ray& ray, double radius, OutputIterator& it, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return find_hits(ray, radius, size_, counted, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::firstHits(const Ray& ray, double radius, size_t k, OutputIterator& it) const {
+  NoQueryStats stats;
+  return find_hits(ray, radius, k, it, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::firstHits(const Ray& ray, double radius, size_t k, OutputIterator& it,
+                       QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(it, stats);
+  return find_hits(ray, radius, k, counted, stats);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename Visitor>
+bool OCTREE::visit(const BoundingBox& box, Visitor&& visitor) const {
+  return head_ && head_->visit(box, slack_, visitor);
+}
+
+template <OCTREE_TEMPLATE>
+typename OCTREE::search_range OCTREE::searchRange(const BoundingBox& box) const {
+  return search_range(search_iterator(head_, box, slack_), search_iterator());
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::search_iterator::search_iterator()
+  : box_(invalidBox), slack_(0), xs_(nullptr), ys_(nullptr), zs_(nullptr), values_(nullptr),
+    size_(0), block_(0), mask_(0), whole_(false) { }
+
+template <OCTREE_TEMPLATE>
+OCTREE::search_iterator::search_iterator(const Node* root, const BoundingBox& box, double slack)
+  : search_iterator() {
+  box_ = box;
+  slack_ = slack;
+  if (root) {
+    pending_.emplace_back(root, false);
   }
-  return success;
+  next_leaf();
 }
 
 template <OCTREE_TEMPLATE>
-void OCTREE::Node::init_max_depth_leaf(
-    const std::vector<std::pair<InputIterator, Point3d>>& input_values) {  
-  value_ = input_values;
-  tag_ = NodeContents::MAX_DEPTH_LEAF;
+typename OCTREE::search_iterator::reference OCTREE::search_iterator::operator*() const {
+  return values_[block_ + lowestSetBit(mask_)];
 }
 
 template <OCTREE_TEMPLATE>
-void OCTREE::Node::init_leaf(
-    const std::vector<std::pair<InputIterator, Point3d>>& input_values)  {
-  std::array<std::pair<InputIterator, Point3d>, max_per_node> a;
-  std::copy(input_values.begin(), input_values.end(), a.begin());
-  value_ = LeafNodeValues{a, input_values.size()};
-  tag_ = NodeContents::LEAF;
+typename OCTREE::search_iterator::pointer OCTREE::search_iterator::operator->() const {
+  return &operator*();
 }
 
 template <OCTREE_TEMPLATE>
-void OCTREE::Node::init_internal(
-    const std::vector<std::pair<InputIterator, Point3d>>& input_values,
-    size_t current_depth)  {
-  std::array<std::vector<std::pair<InputIterator, Point3d>>, 8> childVectors;
-  std::array<BoundingBox, 8> boxes = extrema_.partition();
-  std::array<Node*, 8> children;
+typename OCTREE::search_iterator& OCTREE::search_iterator::operator++() {
+  mask_ &= mask_ - 1;
+  if (!mask_ && !scan(block_ + 64)) {
+    next_leaf();
+  }
+  return *this;
+}
 
-  for (unsigned child = 0; child < 8; ++child) {
-    std::vector<std::pair<InputIterator, Point3d>>& childVector = childVectors[child];
-    childVector.reserve(input_values.size() / 8);
-
-    std::copy_if(
-      input_values.begin(), 
-      input_values.end(), 
-      std::back_inserter(childVector),
-      [&boxes, child](const std::pair<InputIterator, Point3d>& element) -> bool {
-        Point3d p = std::get<1>(element);
-        return boxes[child].contains(p);
-      }
-    );
+template <OCTREE_TEMPLATE>
+typename OCTREE::search_iterator OCTREE::search_iterator::operator++(int) {
+  search_iterator other = *this;
+  operator++();
+  return other;
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::search_iterator::operator==(const search_iterator& rhs) const {
+  return values_ == rhs.values_ && block_ == rhs.block_ && mask_ == rhs.mask_;
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::search_iterator::operator!=(const search_iterator& rhs) const {
+  return !operator==(rhs);
+}
+
+// Makes the same decisions as Node::search(), with children pushed last
+// first so that they come off the stack in search()'s order
+template <OCTREE_TEMPLATE>
+void OCTREE::search_iterator::next_leaf() {
+  while (!pending_.empty()) {
+    const Node* node = pending_.back().first;
+    bool whole = pending_.back().second;
+    pending_.pop_back();
+    if (!whole) {
+      BoundingBox bounds = node->extrema_.grown(slack_);
+      if (!box_.intersects(bounds)) {
+        continue;
+      }
+      whole = box_.contains(bounds);
+    }
+
+    NodeContents tag = node->split();
+    if (tag == NodeContents::INTERNAL) {
+      const childNodeArray& children = node->value_.internalValue_;
+      for (auto child = children.rbegin(); child != children.rend(); ++child) {
+        if (*child) {
+          pending_.emplace_back(*child, whole);
+        }
+      }
+      continue;
+    } else if (tag == NodeContents::LEAF) {
+      const LeafNodeValues& leaf = node->value_.leafValue_;
+      xs_ = leaf.xs_.data();
+      ys_ = leaf.ys_.data();
+      zs_ = leaf.zs_.data();
+      values_ = leaf.values_.data();
+      size_ = leaf.size_;
+    } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+      const MaxDepthLeafValues& leaf = node->value_.maxDepthLeafValue_;
+      xs_ = leaf.xs_;
+      ys_ = leaf.ys_;
+      zs_ = leaf.zs_;
+      values_ = leaf.values_;
+      size_ = leaf.size_;
+    } else {
+      continue;
+    }
+    whole_ = whole;
+    if (scan(0)) {
+      return;
+    }
+  }
+
+  *this = search_iterator();
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::search_iterator::scan(size_t block) {
+  for (block_ = block; block_ < size_; block_ += 64) {
+    size_t count = std::min<size_t>(size_ - block_, 64);
+    mask_ = whole_ ? lowBits(count)
+                   : containsBlock(box_, xs_ + block_, ys_ + block_, zs_ + block_, count);
+    if (mask_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Nodes still queued once nothing in them could be nearer count as pruned
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool OCTREE::find_nearest(const Point3d& p, size_t k, OutputIterator& it, Stats& stats) const {
+  NearestSet<InputIterator> nearest(k);
+  NearestQueue<const Node*> pending;
+  if (head_) {
+    stats.visit();
+    pending.push(std::make_pair(0., head_));
+  }
+  while (!pending.empty() && pending.top().first < nearest.bound()) {
+    const Node* node = pending.top().second;
+    pending.pop();
+    node->nearest(p, slack_, nearest, pending, stats);
+  }
+  stats.prune(pending.size());
+  return nearest.emit(it);
+}
+
+// The same best first walk as find_nearest(), keyed on where the ray enters
+// each node rather than how far the node is from a point
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool OCTREE::find_hits(const Ray& ray, double radius, size_t k, OutputIterator& it,
+                       Stats& stats) const {
+  NearestSet<InputIterator> hits(k);
+  NearestQueue<const Node*> pending;
+  double enter, leave;
+  if (head_ && radius >= 0 && ray.valid()) {
+    stats.visit();
+    if (ray.clip(head_->extrema().grown(slack_ + radius), enter, leave)) {
+      pending.push(std::make_pair(enter, static_cast<const Node*>(head_)));
+    } else {
+      stats.prune();
+    }
+  }
+  while (!pending.empty() && pending.top().first < hits.bound()) {
+    const Node* node = pending.top().second;
+    pending.pop();
+    node->cast(ray, radius, slack_, hits, pending, stats);
+  }
+  stats.prune(pending.size());
+  return hits.emit(it);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::join(const tree_type& other, double epsilon, OutputIterator& it) const {
+  return head_ && other.head_ && epsilon >= 0 &&
+         head_->join(*other.head_, epsilon * epsilon, slack_ + other.slack_, it, 0, nullptr);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::join(const tree_type& other, double epsilon, OutputIterator& it,
+                  TaskPool& pool) const {
+  return head_ && other.head_ && epsilon >= 0 &&
+         parallel_join(other.head_, epsilon * epsilon, slack_ + other.slack_, it, pool);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::selfJoin(double epsilon, OutputIterator& it) const {
+  return head_ && epsilon >= 0 && head_->selfJoin(epsilon * epsilon, 2 * slack_, it, 0, nullptr);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::selfJoin(double epsilon, OutputIterator& it, TaskPool& pool) const {
+  return head_ && epsilon >= 0 && parallel_join(nullptr, epsilon * epsilon, 2 * slack_, it, pool);
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::run_join(const JoinJob& job, double epsilonSquared, double slack,
+                      OutputIterator& it, size_t depth, std::vector<JoinJob>* jobs) {
+  return job.other_ ? job.node_->join(*job.other_, epsilonSquared, slack, it, depth, jobs)
+                    : job.node_->selfJoin(epsilonSquared, slack, it, depth, jobs);
+}
+
+// The top of the walk runs here, taking the pairs of subtrees one level
+// deeper each time until there are enough for the threads to share, and
+// finds the pairs it comes across on the way itself. Those pairs are kept in
+// walk order, with before[j] of them ahead of job j, and every job's pairs
+// are written out as soon as it and every job ahead of it are done, so the
+// pairs come out in the order the serial join finds them, whatever the
+// threads do.
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::parallel_join(const Node* other, double epsilonSquared, double slack,
+                           OutputIterator& it, TaskPool& pool) const {
+  const size_t wanted = (pool.size() + 1) * join_pieces_per_thread;
+  std::vector<join_pair> top, deeperTop;
+  std::vector<JoinJob> jobs{JoinJob{head_, other}}, deeper;
+  std::vector<size_t> before{0}, deeperBefore;
+  for (size_t depth = 1; depth <= max_join_split_depth; ++depth) {
+    deeperTop.clear();
+    deeper.clear();
+    deeperBefore.clear();
+    JoinSplitOutput<join_pair, JoinJob> split(deeperTop, deeper, deeperBefore);
+    size_t copied = 0;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+      deeperTop.insert(deeperTop.end(), top.begin() + copied, top.begin() + before[j]);
+      copied = before[j];
+      run_join(jobs[j], epsilonSquared, slack, split, 1, &deeper);
+      split.mark();
+    }
+    deeperTop.insert(deeperTop.end(), top.begin() + copied, top.end());
+    top.swap(deeperTop);
+    jobs.swap(deeper);
+    before.swap(deeperBefore);
+    if (jobs.size() >= wanted || jobs.empty()) {
+      break;
+    }
+  }
+
+  bool success = false;
+  size_t emitted = 0;
+  std::vector<std::vector<join_pair>> found(jobs.size());
+  runOrdered(pool, jobs.size(), (pool.size() + 1) * join_jobs_held_per_thread,
+             [&jobs, &found, epsilonSquared, slack](size_t i) {
+               auto pairsIterator = std::back_inserter(found[i]);
+               run_join(jobs[i], epsilonSquared, slack, pairsIterator, 0, nullptr);
+             },
+             [&top, &before, &found, &emitted, &success, &it](size_t i) {
+               success |= emitAll(top.data() + emitted, before[i] - emitted, it);
+               emitted = before[i];
+               success |= emitAll(found[i].data(), found[i].size(), it);
+               std::vector<join_pair>().swap(found[i]);
+             });
+  success |= emitAll(top.data() + emitted, top.size() - emitted, it);
+  return success;
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::insert(InputIterator it) {
+  return place(it, toScalarPoint<Scalar>(functor_(*it)));
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::place(InputIterator it, const Point3d& p) {
+  if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+    return false;
+  }
+
+  BuildContext context{&arena_, nullptr, &free_nodes_, nullptr};
+  if (size_ == 0) {
+    // Start again from a leaf around just this point
+    if (head_) {
+      head_->release(context);
+      head_->~Node();
+      free_nodes_.push_back(head_);
+    }
+    value_buffer none;
+    head_ = new (Node::allocate(context)) Node(none.begin(), none.end(), BoundingBox{p, p}, 0, context);
+    head_->insert(it, p, 0, context);
+  } else if (grow(p, context)) {
+    head_->insert(it, p, 0, context);
+  } else {
+    rebuild(it, p);
+    return true;
+  }
+  ++size_;
+  return true;
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::erase(InputIterator it) {
+  if (size_ == 0) {
+    return false;
+  }
+  BuildContext context{&arena_, nullptr, &free_nodes_, nullptr};
+  if (!head_->erase(it, toScalarPoint<Scalar>(functor_(*it)), slack_, context)) {
+    return false;
+  }
+  --size_;
+  return true;
+}
+
+// Relocated values go back in through place(), which puts them where the
+// root sends them, so after the pass no point is further than this pass's
+// tolerance outside its leaf, or than growth_slack_ where the root grew.
+// Every point is checked again, so a small tolerance after a big one makes
+// the node tests tight again.
+template <OCTREE_TEMPLATE>
+size_t OCTREE::update(double tolerance) {
+  if (!head_) {
+    return 0;
+  }
+  BuildContext context{&arena_, nullptr, &free_nodes_, nullptr};
+  value_buffer moved;
+  tolerance = std::max(tolerance, 0.);
+  head_->refit(functor_, tolerance, moved, context);
+  slack_ = std::max(growth_slack_, tolerance);
+
+  size_ -= moved.size();
+  for (const std::pair<InputIterator, Point3d>& value : moved) {
+    place(value.first, value.second);
+  }
+  return moved.size();
+}
+
+// A root that's outside p on some axis grows towards it there, and grows away
+// from the old root's low side on the others, so the old root becomes one
+// octant of the new one. Each time round doubles the root's size.
+template <OCTREE_TEMPLATE>
+bool OCTREE::grow(const Point3d& p, const BuildContext& context) {
+  for (size_t growth = 0; !head_->extrema().contains(p); ++growth) {
+    const BoundingBox& box = head_->extrema();
+    BoundingBox grown;
+    bool right, back, top;
+    double gapX, gapY, gapZ;
+    if (growth == max_root_growth ||
+        !grow_axis(box.mins_.x, box.maxes_.x, p.x, grown.mins_.x, grown.maxes_.x, right, gapX) ||
+        !grow_axis(box.mins_.y, box.maxes_.y, p.y, grown.mins_.y, grown.maxes_.y, back, gapY) ||
+        !grow_axis(box.mins_.z, box.maxes_.z, p.z, grown.mins_.z, grown.maxes_.z, top, gapZ)) {
+      return false;
+    }
+    size_t octant = (top << 2) | (back << 1) | right;
+    head_ = new (Node::allocate(context)) Node(grown, octant, head_);
+    growth_slack_ = std::max(growth_slack_, std::max(gapX, std::max(gapY, gapZ)));
+    slack_ = std::max(slack_, growth_slack_);
+  }
+  return true;
+}
+
+// getChildPartitionIndex sends coordinates at or above the midpoint to the
+// upper half, so growing down the midpoint mustn't be above low, and growing
+// up it must be above high. Rounding seldom lets it land right on the old
+// root's edge, so the free end of the axis is nudged a representable value at
+// a time until it's on the right side, and what it misses by comes back as gap.
+template <OCTREE_TEMPLATE>
+bool OCTREE::grow_axis(double low, double high, double p,
+                       double& grownLow, double& grownHigh, bool& upper, double& gap) {
+  const size_t max_nudges = 64;
+  const double infinity = limits::infinity();
+
+  upper = p <= high;
+  gap = 0.;
+  if (low == high) {
+    // Can't double nothing, but there's nothing to do if p is level with it
+    grownLow = grownHigh = low;
+    return p == low;
+  }
+
+  grownLow = upper ? low - (high - low) : low;
+  grownHigh = upper ? high : high + (high - low);
+  double& end = upper ? grownLow : grownHigh;
+
+  for (size_t nudge = 0; nudge < max_nudges && std::isfinite(end); ++nudge) {
+    double mid = grownLow + (grownHigh - grownLow) / 2.;
+    if (upper ? mid <= low : mid > high) {
+      gap = upper ? low - mid : mid - high;
+      return true;
+    }
+    end = std::nextafter(end, upper ? -infinity : infinity);
+  }
+  return false;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::rebuild(InputIterator value, const Point3d& p) {
+  value_buffer values;
+  values.reserve(size_ + 1);
+  head_->collect(values);
+  values.push_back(std::make_pair(value, p));
+
+  if (!trivial_values) {
+    head_->~Node();
+  }
+  head_ = nullptr;
+  free_nodes_.clear();
+  arena_.release();
+  build(values, nullptr, lazy_ ? lazy_->threshold_ : 0);
+}
+
+template <OCTREE_TEMPLATE>
+typename OCTREE::tree_type& OCTREE::operator=(typename OCTREE::tree_type rhs) {
+  swap(rhs);
+  return *this;
+}
+
+template <OCTREE_TEMPLATE>
+typename OCTREE::tree_type& OCTREE::operator=(typename OCTREE::tree_type&& rhs) {
+  swap(rhs);
+  return *this;
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::~Octree() {
+  if (head_ && !trivial_values) {
+    head_->~Node();
+  }
+  arena_.release();
+}
+
+template <OCTREE_TEMPLATE>
+size_t OCTREE::size() const {
+  return size_;
+}
+
+template <OCTREE_TEMPLATE>
+TreeStats OCTREE::stats() const {
+  TreeStats stats(max_per_node);
+  if (head_) {
+    head_->describe(0, stats);
+  }
+  stats.bytes_ = sizeof(*this) + arena_.reserved() + free_nodes_.capacity() * sizeof(Node*);
+  if (lazy_) {
+    stats.bytes_ += sizeof(LazyState) + lazy_->arena_.reserved() +
+                    lazy_->values_.capacity() * sizeof(typename value_buffer::value_type);
+  }
+  return stats;
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::Node::Node(buffer_iterator begin, buffer_iterator end, const BuildContext& context)
+  : Node(begin, 
+         end,
+         makeBoundingBox(
+            InnerIterator<InputIterator>(begin), 
+            InnerIterator<InputIterator>(end)),
+         0,
+         context) { }
+
+template <OCTREE_TEMPLATE>
+OCTREE::Node::Node(
+    buffer_iterator begin, 
+    buffer_iterator end, 
+    const BoundingBox& box,
+    size_t current_depth,
+    const BuildContext& context) : extrema_(box)  {
+  if (current_depth > max_depth) {
+    init_max_depth_leaf(begin, end, context);
+  } else if (static_cast<size_t>(end - begin) <= max_per_node) {
+    init_leaf(begin, end);
+  } else if (context.lazy_ && static_cast<size_t>(end - begin) > context.lazy_->threshold_) {
+    init_unsplit(begin, end, current_depth, context);
+  } else {
+    init_internal(begin, end, current_depth, context);
+  }
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::Node::Node(const BoundingBox& box, size_t octant, Node* child) : extrema_(box) {
+  childNodeArray children;
+  children.fill(nullptr);
+  children[octant] = child;
+  new (&value_.internalValue_) childNodeArray(children);
+  tag_ = NodeContents::INTERNAL;
+}
+
+template <OCTREE_TEMPLATE>
+OCTREE::Node::~Node() {
+  // Children live in the tree's arena, so they are destroyed but not freed
+  if (tag_ == NodeContents::INTERNAL) {
+    for (auto childPointer : value_.internalValue_) {
+      if (childPointer) {
+        childPointer->~Node();
+      }
+    }
+    value_.internalValue_.~childNodeArray();
+  } else if (tag_ == NodeContents::LEAF) {
+    value_.leafValue_.~LeafNodeValues();
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& values = value_.maxDepthLeafValue_;
+    for (size_t i = 0; i < values.size_; ++i) {
+      values.values_[i].~InputIterator();
+    }
+    value_.maxDepthLeafValue_.~MaxDepthLeafValues();
+  } else if (tag_ == NodeContents::UNSPLIT) {
+    value_.unsplitValue_.~UnsplitValues();
+  }
+}
+
+template <OCTREE_TEMPLATE>
+typename OCTREE::Node* OCTREE::Node::allocate(const BuildContext& context) {
+  if (context.free_nodes_ && !context.free_nodes_->empty()) {
+    Node* node = context.free_nodes_->back();
+    context.free_nodes_->pop_back();
+    return node;
+  }
+  return context.arena_->template allocate<Node>(1);
+}
+
+template <OCTREE_TEMPLATE>
+const BoundingBox& OCTREE::Node::extrema() const {
+  return extrema_;
+}
+
+template <OCTREE_TEMPLATE>
+bool OCTREE::Node::empty() const {
+  return count(0) == 0;
+}
+
+template <OCTREE_TEMPLATE>
+size_t OCTREE::Node::count(size_t limit) const {
+  size_t total = 0;
+  if (tag_ == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        total += child->count(limit - std::min(total, limit));
+        if (total > limit) {
+          break;
+        }
+      }
+    }
+  } else if (tag_ == NodeContents::LEAF) {
+    total = value_.leafValue_.size_;
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    total = value_.maxDepthLeafValue_.size_;
+  } else if (tag_ == NodeContents::UNSPLIT) {
+    total = value_.unsplitValue_.end_ - value_.unsplitValue_.begin_;
+  }
+  return total;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::collect(value_buffer& values) const {
+  if (tag_ == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        child->collect(values);
+      }
+    }
+  } else if (tag_ == NodeContents::LEAF) {
+    const LeafNodeValues& leaf = value_.leafValue_;
+    for (size_t i = 0; i < leaf.size_; ++i) {
+      values.push_back(std::make_pair(leaf.values_[i], Point3d{leaf.xs_[i], leaf.ys_[i], leaf.zs_[i]}));
+    }
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& leaf = value_.maxDepthLeafValue_;
+    for (size_t i = 0; i < leaf.size_; ++i) {
+      values.push_back(std::make_pair(leaf.values_[i], Point3d{leaf.xs_[i], leaf.ys_[i], leaf.zs_[i]}));
+    }
+  } else if (tag_ == NodeContents::UNSPLIT) {
+    values.insert(values.end(), value_.unsplitValue_.begin_, value_.unsplitValue_.end_);
+  }
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::release(const BuildContext& context) {
+  if (tag_ == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        child->release(context);
+        context.free_nodes_->push_back(child);
+      }
+    }
+  }
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::insert(InputIterator value, const Point3d& p, size_t current_depth,
+                          const BuildContext& context) {
+  split();
+  if (tag_ == NodeContents::INTERNAL) {
+    size_t octant = extrema_.getChildPartitionIndex(p);
+    Node*& child = value_.internalValue_[octant];
+    if (child) {
+      child->insert(value, p, current_depth + 1, context);
+    } else {
+      value_buffer none;
+      child = new (allocate(context)) Node(none.begin(), none.end(),
+                                           extrema_.partition()[octant], current_depth + 1, context);
+      child->insert(value, p, current_depth + 1, context);
+    }
+  } else if (tag_ == NodeContents::LEAF && value_.leafValue_.size_ < max_per_node) {
+    LeafNodeValues& leaf = value_.leafValue_;
+    leaf.xs_[leaf.size_] = p.x;
+    leaf.ys_[leaf.size_] = p.y;
+    leaf.zs_[leaf.size_] = p.z;
+    leaf.values_[leaf.size_] = value;
+    ++leaf.size_;
+  } else if (tag_ == NodeContents::LEAF) {
+    // Full, so it becomes whatever the build would have made of it
+    value_buffer values;
+    values.reserve(max_per_node + 1);
+    collect(values);
+    values.push_back(std::make_pair(value, p));
+    BoundingBox box = extrema_;
+    this->~Node();
+    new (this) Node(values.begin(), values.end(), box, current_depth, context);
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    MaxDepthLeafValues& leaf = value_.maxDepthLeafValue_;
+    if (leaf.size_ == leaf.capacity_) {
+      // The old arrays stay behind in the arena until the tree goes
+      size_t capacity = std::max<size_t>(2 * leaf.capacity_, max_per_node);
+      MaxDepthLeafValues grown{
+          context.arena_->template allocate<Scalar>(capacity),
+          context.arena_->template allocate<Scalar>(capacity),
+          context.arena_->template allocate<Scalar>(capacity),
+          context.arena_->template allocate<InputIterator>(capacity),
+          leaf.size_,
+          capacity};
+      std::copy(leaf.xs_, leaf.xs_ + leaf.size_, grown.xs_);
+      std::copy(leaf.ys_, leaf.ys_ + leaf.size_, grown.ys_);
+      std::copy(leaf.zs_, leaf.zs_ + leaf.size_, grown.zs_);
+      for (size_t i = 0; i < leaf.size_; ++i) {
+        new (&grown.values_[i]) InputIterator(std::move(leaf.values_[i]));
+        leaf.values_[i].~InputIterator();
+      }
+      leaf = grown;
+    }
+    leaf.xs_[leaf.size_] = p.x;
+    leaf.ys_[leaf.size_] = p.y;
+    leaf.zs_[leaf.size_] = p.z;
+    new (&leaf.values_[leaf.size_]) InputIterator(value);
+    ++leaf.size_;
+  }
+}
+
+// Values come out of leaves without disturbing the order of the rest
+template <OCTREE_TEMPLATE>
+bool OCTREE::Node::erase(const InputIterator& value, const Point3d& p, double slack,
+                         const BuildContext& context) {
+  split();
+  if (tag_ == NodeContents::INTERNAL) {
+    size_t routed = extrema_.getChildPartitionIndex(p);
+    for (size_t offset = 0; offset < 8; ++offset) {
+      size_t octant = (routed + offset) % 8;
+      Node* child = value_.internalValue_[octant];
+      if (!child || (offset != 0 && !(slack > 0 && child->extrema_.grown(slack).contains(p)))) {
+        continue;
+      }
+      if (child->erase(value, p, slack, context)) {
+        fold(context);
+        return true;
+      }
+    }
+    return false;
+  } else if (tag_ == NodeContents::LEAF) {
+    LeafNodeValues& leaf = value_.leafValue_;
+    size_t i = std::find(leaf.values_.begin(), leaf.values_.begin() + leaf.size_, value) - leaf.values_.begin();
+    if (i == leaf.size_) {
+      return false;
+    }
+    --leaf.size_;
+    std::copy(leaf.xs_.begin() + i + 1, leaf.xs_.begin() + leaf.size_ + 1, leaf.xs_.begin() + i);
+    std::copy(leaf.ys_.begin() + i + 1, leaf.ys_.begin() + leaf.size_ + 1, leaf.ys_.begin() + i);
+    std::copy(leaf.zs_.begin() + i + 1, leaf.zs_.begin() + leaf.size_ + 1, leaf.zs_.begin() + i);
+    std::move(leaf.values_.begin() + i + 1, leaf.values_.begin() + leaf.size_ + 1, leaf.values_.begin() + i);
+    return true;
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    MaxDepthLeafValues& leaf = value_.maxDepthLeafValue_;
+    size_t i = std::find(leaf.values_, leaf.values_ + leaf.size_, value) - leaf.values_;
+    if (i == leaf.size_) {
+      return false;
+    }
+    --leaf.size_;
+    std::copy(leaf.xs_ + i + 1, leaf.xs_ + leaf.size_ + 1, leaf.xs_ + i);
+    std::copy(leaf.ys_ + i + 1, leaf.ys_ + leaf.size_ + 1, leaf.ys_ + i);
+    std::copy(leaf.zs_ + i + 1, leaf.zs_ + leaf.size_ + 1, leaf.zs_ + i);
+    std::move(leaf.values_ + i + 1, leaf.values_ + leaf.size_ + 1, leaf.values_ + i);
+    leaf.values_[leaf.size_].~InputIterator();
+    return true;
+  }
+  return false;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::fold(const BuildContext& context) {
+  if (tag_ != NodeContents::INTERNAL) {
+    return;
+  }
+  for (Node*& child : value_.internalValue_) {
+    if (child && child->empty()) {
+      child->~Node();
+      context.free_nodes_->push_back(child);
+      child = nullptr;
+    }
+  }
+  if (count(max_per_node) <= max_per_node) {
+    value_buffer values;
+    values.reserve(max_per_node);
+    collect(values);
+    release(context);
+    this->~Node();
+    init_leaf(values.begin(), values.end());
+  }
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::refit(PointExtractor& functor, double tolerance, value_buffer& moved,
+                         const BuildContext& context) {
+  if (tag_ == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        child->refit(functor, tolerance, moved, context);
+      }
+    }
+    fold(context);
+  } else if (tag_ == NodeContents::UNSPLIT) {
+    // Left unsplit, as its values aren't partitioned yet and only need to
+    // stay near the node itself; the split sorts them out by their new points
+    UnsplitValues& unsplit = value_.unsplitValue_;
+    BoundingBox bounds = extrema_.grown(tolerance);
+    buffer_iterator kept = unsplit.begin_;
+    for (buffer_iterator value = unsplit.begin_; value != unsplit.end_; ++value) {
+      Point3d p = toScalarPoint<Scalar>(functor(*value->first));
+      if (bounds.contains(p)) {
+        *kept++ = std::make_pair(value->first, p);
+      } else {
+        moved.push_back(std::make_pair(value->first, p));
+      }
+    }
+    unsplit.end_ = kept;
+  } else if (tag_ == NodeContents::LEAF) {
+    LeafNodeValues& leaf = value_.leafValue_;
+    leaf.size_ = refit_leaf(functor, extrema_.grown(tolerance), leaf.xs_.data(), leaf.ys_.data(),
+                            leaf.zs_.data(), leaf.values_.data(), leaf.size_, moved);
+  } else if (tag_ == NodeContents::MAX_DEPTH_LEAF) {
+    MaxDepthLeafValues& leaf = value_.maxDepthLeafValue_;
+    size_t kept = refit_leaf(functor, extrema_.grown(tolerance), leaf.xs_, leaf.ys_, leaf.zs_,
+                             leaf.values_, leaf.size_, moved);
+    for (size_t i = kept; i < leaf.size_; ++i) {
+      leaf.values_[i].~InputIterator();
+    }
+    leaf.size_ = kept;
+  }
+}
+
+template <OCTREE_TEMPLATE>
+size_t OCTREE::Node::refit_leaf(PointExtractor& functor, const BoundingBox& bounds,
+                                Scalar* xs, Scalar* ys, Scalar* zs, InputIterator* values,
+                                size_t size, value_buffer& moved) {
+  size_t kept = 0;
+  for (size_t i = 0; i < size; ++i) {
+    Point3d p = toScalarPoint<Scalar>(functor(*values[i]));
+    if (bounds.contains(p)) {
+      xs[kept] = p.x;
+      ys[kept] = p.y;
+      zs[kept] = p.z;
+      values[kept] = values[i];
+      ++kept;
+    } else {
+      moved.push_back(std::make_pair(values[i], p));
+    }
+  }
+  return kept;
+}
+
+// Subtrees outside the query are skipped, and subtrees entirely inside it
+// are emitted whole without looking at their points
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool OCTREE::Node::search(const BoundingBox& p, double slack, OutputIterator& it, Stats& stats) const {
+  stats.visit();
+  BoundingBox bounds = extrema_.grown(slack);
+  if (!p.intersects(bounds)) {
+    stats.prune();
+    return false;
+  } else if (p.contains(bounds)) {
+    return emit(it);
+  }
+
+  bool success = false;
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        success |= child->search(p, slack, it, stats);
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    stats.test(children.size_);
+    success = emitContained(p, children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                            children.values_.data(), children.size_, it);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    stats.test(children.size_);
+    success = emitContained(p, children.xs_, children.ys_, children.zs_,
+                            children.values_, children.size_, it);
+  }
+  return success;
+}
+
+// The same for a polytope, with the planes a node's box is inside dropped
+// for the whole subtree
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool OCTREE::Node::search(const ConvexPolytope& polytope, std::uint64_t active, double slack,
+                          OutputIterator& it, Stats& stats) const {
+  stats.visit();
+  Containment where = polytope.classify(extrema_.grown(slack), active);
+  if (where == Containment::OUTSIDE) {
+    stats.prune();
+    return false;
+  } else if (where == Containment::INSIDE) {
+    return emit(it);
+  }
+
+  bool success = false;
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        success |= child->search(polytope, active, slack, it, stats);
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    stats.test(children.size_);
+    success = emitInside(polytope, active, children.xs_.data(), children.ys_.data(),
+                         children.zs_.data(), children.values_.data(), children.size_, it);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    stats.test(children.size_);
+    success = emitInside(polytope, active, children.xs_, children.ys_, children.zs_,
+                         children.values_, children.size_, it);
+  }
+  return success;
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool OCTREE::Node::radiusSearch(const Point3d& centre, double radiusSquared, double slack,
+                                OutputIterator& it, Stats& stats) const {
+  stats.visit();
+  BoundingBox bounds = extrema_.grown(slack);
+  if (!(bounds.distanceSquared(centre) <= radiusSquared)) {
+    stats.prune();
+    return false;
+  } else if (bounds.maxDistanceSquared(centre) <= radiusSquared) {
+    return emit(it);
+  }
+
+  bool success = false;
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        success |= child->radiusSearch(centre, radiusSquared, slack, it, stats);
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    stats.test(children.size_);
+    success = emitWithin(centre, radiusSquared,
+                         children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                         children.values_.data(), children.size_, it);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    stats.test(children.size_);
+    success = emitWithin(centre, radiusSquared, children.xs_, children.ys_, children.zs_,
+                         children.values_, children.size_, it);
+  }
+  return success;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::searchBatch(const std::vector<BoundingBox>& boxes, double slack,
+                               std::vector<size_t>& active, size_t first, size_t last,
+                               batch_results& results) const {
+  // The same decisions search() makes, for each box in turn
+  BoundingBox bounds = extrema_.grown(slack);
+  size_t begin = active.size();
+  for (size_t i = first; i < last; ++i) {
+    size_t box = active[i];
+    if (!boxes[box].intersects(bounds)) {
+      continue;
+    }
+    if (boxes[box].contains(bounds)) {
+      auto out = std::back_inserter(results[box]);
+      emit(out);
+    } else {
+      active.push_back(box);
+    }
+  }
+  size_t end = active.size();
+
+  if (begin == end) {
+    return;
+  }
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        child->searchBatch(boxes, slack, active, begin, end, results);
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    for (size_t i = begin; i < end; ++i) {
+      auto out = std::back_inserter(results[active[i]]);
+      emitContained(boxes[active[i]], children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                    children.values_.data(), children.size_, out);
+    }
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    for (size_t i = begin; i < end; ++i) {
+      auto out = std::back_inserter(results[active[i]]);
+      emitContained(boxes[active[i]], children.xs_, children.ys_, children.zs_,
+                    children.values_, children.size_, out);
+    }
+  }
+  active.resize(begin);
+}
+
+// Goes down whichever of the two nodes is bigger, or isn't a leaf, until
+// the pair can be settled from their bounds or both are leaves
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::Node::join(const Node& other, double epsilonSquared, double slack,
+                        OutputIterator& it, size_t depth, std::vector<JoinJob>* jobs) const {
+  if (jobs && depth == 0) {
+    jobs->push_back(JoinJob{this, &other});
+    return false;
+  }
+  BoundingBox bounds = extrema_.grown(slack);
+  if (!(bounds.distanceSquared(other.extrema_) <= epsilonSquared)) {
+    return false;
+  } else if (bounds.maxDistanceSquared(other.extrema_) <= epsilonSquared) {
+    std::vector<InputIterator> values, otherValues;
+    auto valuesIterator = std::back_inserter(values);
+    auto otherValuesIterator = std::back_inserter(otherValues);
+    emit(valuesIterator);
+    other.emit(otherValuesIterator);
+    return emitAllPairs(values.data(), values.size(), otherValues.data(), otherValues.size(), it);
+  }
+
+  NodeContents tag = split();
+  NodeContents otherTag = other.split();
+  size_t below = depth ? depth - 1 : 0;
+  bool success = false;
+  if (tag != NodeContents::INTERNAL && otherTag != NodeContents::INTERNAL) {
+    const Scalar *xs, *ys, *zs, *otherXs, *otherYs, *otherZs;
+    const InputIterator *values, *otherValues;
+    size_t size, otherSize;
+    leaf_arrays(xs, ys, zs, values, size);
+    other.leaf_arrays(otherXs, otherYs, otherZs, otherValues, otherSize);
+    success = emitPairsWithin(epsilonSquared, xs, ys, zs, values, size,
+                              otherXs, otherYs, otherZs, otherValues, otherSize, it);
+  } else if (tag == NodeContents::INTERNAL &&
+             (otherTag != NodeContents::INTERNAL ||
+              extrema_.maxDistanceSquared(extrema_) >=
+              other.extrema_.maxDistanceSquared(other.extrema_))) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        success |= child->join(other, epsilonSquared, slack, it, below, jobs);
+      }
+    }
+  } else {
+    for (auto child : other.value_.internalValue_) {
+      if (child) {
+        success |= join(*child, epsilonSquared, slack, it, below, jobs);
+      }
+    }
+  }
+  return success;
+}
+
+// Pairs within each child, then between each pair of children
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::Node::selfJoin(double epsilonSquared, double slack, OutputIterator& it,
+                            size_t depth, std::vector<JoinJob>* jobs) const {
+  if (jobs && depth == 0) {
+    jobs->push_back(JoinJob{this, nullptr});
+    return false;
+  }
+  if (extrema_.grown(slack).maxDistanceSquared(extrema_) <= epsilonSquared) {
+    std::vector<InputIterator> values;
+    auto valuesIterator = std::back_inserter(values);
+    emit(valuesIterator);
+    return emitAllPairs(values.data(), values.size(), it);
+  }
+
+  NodeContents tag = split();
+  if (tag != NodeContents::INTERNAL) {
+    const Scalar *xs, *ys, *zs;
+    const InputIterator* values;
+    size_t size;
+    leaf_arrays(xs, ys, zs, values, size);
+    return emitPairsWithin(epsilonSquared, xs, ys, zs, values, size, it);
+  }
+
+  size_t below = depth ? depth - 1 : 0;
+  bool success = false;
+  const childNodeArray& children = value_.internalValue_;
+  for (size_t i = 0; i < children.size(); ++i) {
+    if (!children[i]) {
+      continue;
+    }
+    success |= children[i]->selfJoin(epsilonSquared, slack, it, below, jobs);
+    for (size_t j = i + 1; j < children.size(); ++j) {
+      if (children[j]) {
+        success |= children[i]->join(*children[j], epsilonSquared, slack, it, below, jobs);
+      }
+    }
+  }
+  return success;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::leaf_arrays(const Scalar*& xs, const Scalar*& ys, const Scalar*& zs,
+                               const InputIterator*& values, size_t& size) const {
+  if (tag_ == NodeContents::LEAF) {
+    const LeafNodeValues& leaf = value_.leafValue_;
+    xs = leaf.xs_.data();
+    ys = leaf.ys_.data();
+    zs = leaf.zs_.data();
+    values = leaf.values_.data();
+    size = leaf.size_;
+  } else {
+    const MaxDepthLeafValues& leaf = value_.maxDepthLeafValue_;
+    xs = leaf.xs_;
+    ys = leaf.ys_;
+    zs = leaf.zs_;
+    values = leaf.values_;
+    size = leaf.size_;
+  }
+}
+
+template <OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool OCTREE::Node::emit(OutputIterator& it) const {
+  bool success = false;
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        success |= child->emit(it);
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    success = emitAll(value_.leafValue_.values_.data(), value_.leafValue_.size_, it);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    success = emitAll(value_.maxDepthLeafValue_.values_, value_.maxDepthLeafValue_.size_, it);
+  }
+  return success;
+}
+
+// The same walk as search(), leaving as soon as the visitor stops it
+template <OCTREE_TEMPLATE>
+template <typename Visitor>
+bool OCTREE::Node::visit(const BoundingBox& p, double slack, Visitor& visitor) const {
+  BoundingBox bounds = extrema_.grown(slack);
+  if (!p.intersects(bounds)) {
+    return false;
+  } else if (p.contains(bounds)) {
+    return visitAll(visitor);
+  }
+
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child && child->visit(p, slack, visitor)) {
+        return true;
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    return visitContained(p, children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                          children.values_.data(), children.size_, visitor);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    return visitContained(p, children.xs_, children.ys_, children.zs_,
+                          children.values_, children.size_, visitor);
+  }
+  return false;
+}
+
+template <OCTREE_TEMPLATE>
+template <typename Visitor>
+bool OCTREE::Node::visitAll(Visitor& visitor) const {
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child && child->visitAll(visitor)) {
+        return true;
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    return ::visitAll(children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                      children.values_.data(), children.size_, visitor);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    return ::visitAll(children.xs_, children.ys_, children.zs_,
+                      children.values_, children.size_, visitor);
+  }
+  return false;
+}
+
+template <OCTREE_TEMPLATE>
+template <typename Stats>
+void OCTREE::Node::nearest(const Point3d& p, double slack, NearestSet<InputIterator>& nearest,
+                           NearestQueue<const Node*>& pending, Stats& stats) const {
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        stats.visit();
+        double distance = child->extrema_.grown(slack).distanceSquared(p);
+        if (distance < nearest.bound()) {
+          pending.push(std::make_pair(distance, static_cast<const Node*>(child)));
+        } else {
+          stats.prune();
+        }
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    stats.test(children.size_);
+    offerNearest(p, children.xs_.data(), children.ys_.data(), children.zs_.data(),
+                 children.values_.data(), children.size_, nearest);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    stats.test(children.size_);
+    offerNearest(p, children.xs_, children.ys_, children.zs_,
+                 children.values_, children.size_, nearest);
+  }
+}
+
+template <OCTREE_TEMPLATE>
+template <typename Stats>
+void OCTREE::Node::cast(const Ray& ray, double radius, double slack, NearestSet<InputIterator>& hits,
+                        NearestQueue<const Node*>& pending, Stats& stats) const {
+  NodeContents tag = split();
+  if (tag == NodeContents::INTERNAL) {
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        stats.visit();
+        double enter, leave;
+        if (ray.clip(child->extrema_.grown(slack + radius), enter, leave) &&
+            enter < hits.bound()) {
+          pending.push(std::make_pair(enter, static_cast<const Node*>(child)));
+        } else {
+          stats.prune();
+        }
+      }
+    }
+  } else if (tag == NodeContents::LEAF) {
+    const LeafNodeValues& children = value_.leafValue_;
+    stats.test(children.size_);
+    offerAlongRay(ray, radius * radius, children.xs_.data(), children.ys_.data(),
+                  children.zs_.data(), children.values_.data(), children.size_, hits);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    const MaxDepthLeafValues& children = value_.maxDepthLeafValue_;
+    stats.test(children.size_);
+    offerAlongRay(ray, radius * radius, children.xs_, children.ys_, children.zs_,
+                  children.values_, children.size_, hits);
+  }
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::describe(size_t depth, TreeStats& stats) const {
+  NodeContents tag = tag_.load(std::memory_order_acquire);
+  if (tag == NodeContents::INTERNAL) {
+    size_t children = 0;
+    for (auto child : value_.internalValue_) {
+      if (child) {
+        child->describe(depth + 1, stats);
+        ++children;
+      }
+    }
+    stats.addInternal(depth, children);
+  } else if (tag == NodeContents::LEAF) {
+    stats.addLeaf(depth, value_.leafValue_.size_, false);
+  } else if (tag == NodeContents::MAX_DEPTH_LEAF) {
+    stats.addLeaf(depth, value_.maxDepthLeafValue_.size_, true);
+  } else if (tag == NodeContents::UNSPLIT) {
+    stats.addUnsplit(depth, value_.unsplitValue_.end_ - value_.unsplitValue_.begin_);
+  }
+}
+
+// Unsplit nodes become internal in place, under a lock so that concurrent
+// queries reaching the same node split it once. The tag is written last, so
+// a query that finds the node split also finds its children.
+template <OCTREE_TEMPLATE>
+typename OCTREE::NodeContents OCTREE::Node::split() const {
+  NodeContents tag = tag_.load(std::memory_order_acquire);
+  if (tag != NodeContents::UNSPLIT) {
+    return tag;
+  }
+  std::lock_guard<std::mutex> lock(split_lock(this));
+  tag = tag_.load(std::memory_order_acquire);
+  if (tag == NodeContents::UNSPLIT) {
+    Node* self = const_cast<Node*>(this);
+    UnsplitValues unsplit = value_.unsplitValue_;
+    self->value_.unsplitValue_.~UnsplitValues();
+    BuildContext context{&unsplit.lazy_->arena_, nullptr, nullptr, unsplit.lazy_};
+    self->init_internal(unsplit.begin_, unsplit.end_, unsplit.depth_, context);
+    tag = NodeContents::INTERNAL;
+  }
+  return tag;
+}
+
+template <OCTREE_TEMPLATE>
+std::mutex& OCTREE::Node::split_lock(const Node* node) {
+  static std::array<std::mutex, 64> locks;
+  return locks[reinterpret_cast<std::uintptr_t>(node) / sizeof(Node) % locks.size()];
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::init_unsplit(buffer_iterator begin, buffer_iterator end, size_t current_depth,
+                                const BuildContext& context) {
+  new (&value_.unsplitValue_) UnsplitValues{begin, end, current_depth, context.lazy_};
+  tag_ = NodeContents::UNSPLIT;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::init_max_depth_leaf(buffer_iterator begin, buffer_iterator end,
+                                       const BuildContext& context) {  
+  size_t size = end - begin;
+  MaxDepthLeafValues* leaf = new (&value_.maxDepthLeafValue_) MaxDepthLeafValues{
+      context.arena_->template allocate<Scalar>(size),
+      context.arena_->template allocate<Scalar>(size),
+      context.arena_->template allocate<Scalar>(size),
+      context.arena_->template allocate<InputIterator>(size),
+      size,
+      size};
+  for (size_t i = 0; i < size; ++i) {
+    const Point3d& point = std::get<1>(begin[i]);
+    leaf->xs_[i] = point.x;
+    leaf->ys_[i] = point.y;
+    leaf->zs_[i] = point.z;
+    new (&leaf->values_[i]) InputIterator(std::get<0>(begin[i]));
+  }
+  tag_ = NodeContents::MAX_DEPTH_LEAF;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::init_leaf(buffer_iterator begin, buffer_iterator end)  {
+  LeafNodeValues* leaf = new (&value_.leafValue_) LeafNodeValues();
+  leaf->size_ = end - begin;
+  for (size_t i = 0; i < leaf->size_; ++i) {
+    const Point3d& point = std::get<1>(begin[i]);
+    leaf->xs_[i] = point.x;
+    leaf->ys_[i] = point.y;
+    leaf->zs_[i] = point.z;
+    leaf->values_[i] = std::get<0>(begin[i]);
+  }
+  tag_ = NodeContents::LEAF;
+}
+
+template <OCTREE_TEMPLATE>
+void OCTREE::Node::init_internal(
+    buffer_iterator begin,
+    buffer_iterator end,
+    size_t current_depth,
+    const BuildContext& context)  {
+  std::array<BoundingBox, 8> boxes = extrema_.partition();
+  std::array<Node*, 8> children;
+  std::unique_ptr<TaskGroup> group;
+
+  std::array<size_t, 9> bounds = partitionByOctant(
+      extrema_, 0, end - begin,
+      [begin](size_t i) -> const Point3d& { return std::get<1>(begin[i]); },
+      [begin](size_t i, size_t j) { std::iter_swap(begin + i, begin + j); });
+
+  // One block for all of the non-empty children, in octant order
+  size_t numChildren = 0;
+  for (unsigned child = 0; child < 8; ++child) {
+    numChildren += bounds[child] != bounds[child + 1];
+  }
+  Node* block = context.arena_->template allocate<Node>(numChildren);
+
+  for (unsigned child = 0; child < 8; ++child) {
+    buffer_iterator childBegin = begin + bounds[child];
+    buffer_iterator childEnd = begin + bounds[child + 1];
+
+    if (childBegin == childEnd) {
+      children[child] = nullptr;
+      continue;
+    }
+
+    Node* slot = block++;
+    children[child] = slot;
+    if (context.pool_ && static_cast<size_t>(childEnd - childBegin) >= parallel_build_cutoff) {
+      if (!group) {
+        group.reset(new TaskGroup(*context.pool_));
+      }
+      const BoundingBox* box = &boxes[child];
+      const BuildContext* shared = &context;
+      group->run([slot, childBegin, childEnd, box, current_depth, shared]() {
+        new (slot) Node(childBegin, childEnd, *box, current_depth + 1, *shared);
+      });
+    } else {
+      new (slot) Node(childBegin, childEnd, boxes[child], current_depth + 1, context);
+    }
+  }
 
-    children[child] = childVector.empty()
-        ? nullptr
-        : new Node(childVector, boxes[child], ++current_depth);
+  if (group) {
+    group->wait();
   }
 
-  value_ = children;
+  new (&value_.internalValue_) childNodeArray(children);
   tag_ = NodeContents::INTERNAL;
 }
 
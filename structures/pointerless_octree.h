@@ -2,22 +2,66 @@
 #define POINTERLESS_OCTREE_CPU_H
 
 #include "boundingbox.h"
-#include "inneriterator.h"
+#include "leaf_kernel.h"
+#include "mapped_octree.h"
+#include "nearest.h"
+#include "polytope.h"
+#include "quantized_leaf.h"
+#include "ray.h"
+#include "search_range.h"
+#include "taskpool.h"
+#include "tree_stats.h"
 
 #include <iostream>
-#include <unordered_map>
+#include <fstream>
 #include <array>
 #include <vector>
 #include <utility>
-#include <bitset>
 #include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <string>
+#include <type_traits>
 
-template <typename InputIterator, typename PointExtractor, std::size_t max_node_size = 16, std::size_t max_depth = 100>
+// The smallest unsigned integer that fits a morton key of the given number of
+// bits. 64 bits covers 21 levels below the root, and where the compiler has a
+// 128 bit integer that covers 42.
+template <std::size_t bits>
+struct MortonIndex {
+#ifdef __SIZEOF_INT128__
+  static_assert(bits <= 128, "max_depth is too large for a 128 bit morton key");
+  __extension__ typedef unsigned __int128 wide_type;
+#else
+  static_assert(bits <= 64, "max_depth is too large for a 64 bit morton key");
+  typedef std::uint64_t wide_type;
+#endif
+  using type = typename std::conditional<bits <= 64, std::uint64_t, wide_type>::type;
+};
+
+// A linear octree: nodes live in one array sorted by their morton key, and the
+// points of every leaf live in one shared set of coordinate arrays. Nodes refer
+// to their children and points by offset, so there are no pointers and no
+// per-node allocations.
+//
+// Coordinates are stored as Scalar, double or float. A float tree rounds every
+// point to float as it goes in and answers every query for the rounded
+// points, in half the memory. Scalar may also be Quantized<bits>, which stores
+// each coordinate as a bits wide code within its leaf's extrema (see
+// quantized_leaf.h) and looks points up through the PointExtractor whenever
+// a code alone can't settle a query, so queries still give exact answers.
+template <typename InputIterator, typename PointExtractor, std::size_t max_node_size = 16, std::size_t max_depth = 21,
+          typename Scalar = double>
 class PointerlessOctree {
  public:
-  using tree_type = PointerlessOctree<InputIterator, PointExtractor, max_node_size, max_depth>;
+  using tree_type = PointerlessOctree<InputIterator, PointExtractor, max_node_size, max_depth, Scalar>;
   // Use 3 bits for each successive level, and 1 for the root
-  using index_type = std::bitset<max_depth * 3 + 1>;
+  using index_type = typename MortonIndex<max_depth * 3 + 1>::type;
+  // The values found for each box of a batch, by position in the batch
+  using batch_results = std::vector<std::vector<InputIterator>>;
+  // What the leaves hold, and what points are read as while building
+  using stored_type = typename LeafCoordinates<Scalar>::stored_type;
+  using build_type = typename LeafCoordinates<Scalar>::build_type;
 
   PointerlessOctree();
 
@@ -25,8 +69,8 @@ class PointerlessOctree {
 
   PointerlessOctree(InputIterator begin, InputIterator end, PointExtractor f);
 
-  PointerlessOctree(const tree_type& rhs);
-  
+  PointerlessOctree(const tree_type& rhs) = default;
+
   PointerlessOctree(tree_type&& rhs);
 
   void swap(tree_type& rhs);
@@ -37,6 +81,118 @@ class PointerlessOctree {
   template <typename OutputIterator>
   bool search(const BoundingBox& box, OutputIterator& it, const index_type& current_index) const;
 
+  // Writes every value inside polytope, such as a view frustum. Subtrees
+  // entirely inside it are written as one run without testing their points,
+  // and leaves test their points against only the planes their bounds
+  // straddle.
+  template <typename OutputIterator>
+  bool search(const ConvexPolytope& polytope, OutputIterator& it) const;
+
+  // Answers every box in [first, last) in one walk of the tree, which visits
+  // each node once for all of the boxes still interested in it. results[i]
+  // ends up holding what search() would find for the i'th box; passing the
+  // same results to the next batch reuses the space it already holds.
+  template <typename BoxIterator>
+  void searchBatch(BoxIterator first, BoxIterator last, batch_results& results) const;
+
+  // The same, with the batch split between the threads of pool
+  template <typename BoxIterator>
+  void searchBatch(BoxIterator first, BoxIterator last, batch_results& results,
+                   TaskPool& pool) const;
+
+  // Writes every value no further than radius from centre
+  template <typename OutputIterator>
+  bool radiusSearch(const Point3d& centre, double radius, OutputIterator& it) const;
+
+  // Writes the (up to) k values nearest to p, nearest first
+  template <typename OutputIterator>
+  bool knn(const Point3d& p, std::size_t k, OutputIterator& it) const;
+
+  // Writes every value no further than radius from ray, front to back: in
+  // order of how far along the ray the point of it nearest each one lies,
+  // ties in no particular order. Only nodes the ray passes through, once
+  // grown by radius, are visited, in the order the ray enters them.
+  template <typename OutputIterator>
+  bool raycast(const Ray& ray, double radius, OutputIterator& it) const;
+
+  // The first (up to) k of those, in the same order, stopping as soon as no
+  // node left could hold anything earlier. k = 1 is the nearest hit.
+  template <typename OutputIterator>
+  bool firstHits(const Ray& ray, double radius, std::size_t k, OutputIterator& it) const;
+
+  // A value of this tree and a value of the tree it was joined with, or of
+  // this tree again
+  using join_pair = std::pair<InputIterator, InputIterator>;
+
+  // Writes a join_pair for every value here and value of other no further
+  // than epsilon apart, in one walk down both trees together. Pairs of nodes
+  // further apart than epsilon are skipped whole, pairs entirely within it
+  // are written as runs of values, and only pairs of leaves in between
+  // compare points.
+  template <typename OutputIterator>
+  bool join(const tree_type& other, double epsilon, OutputIterator& it) const;
+
+  // The same, with the walk split into pairs of subtrees shared out between
+  // the threads of pool. Each piece's pairs are written to it as soon as it
+  // and every piece before it are done, in the same order as the serial
+  // join's, however many threads there are.
+  template <typename OutputIterator>
+  bool join(const tree_type& other, double epsilon, OutputIterator& it, TaskPool& pool) const;
+
+  // Every pair of values in this tree no further than epsilon apart, each
+  // pair once and no value paired with itself
+  template <typename OutputIterator>
+  bool selfJoin(double epsilon, OutputIterator& it) const;
+
+  template <typename OutputIterator>
+  bool selfJoin(double epsilon, OutputIterator& it, TaskPool& pool) const;
+
+  // Calls visitor(value, point) for every value in box, in the order search()
+  // would find them. The point is the one the tree tested, or for quantized
+  // leaves the value's exact point. The visitor returns Visit::CONTINUE for
+  // more or Visit::STOP to end the search there and then, which this reports.
+  template <typename Visitor>
+  bool visit(const BoundingBox& box, Visitor&& visitor) const;
+
+  class search_iterator;
+  using search_range = SearchRange<search_iterator>;
+
+  // The values search() would find in box, in the same order, found one leaf
+  // at a time as the range is walked rather than all up front. Leaving the
+  // loop early skips the rest of the search. The tree mustn't change while
+  // the range is in use.
+  search_range searchRange(const BoundingBox& box) const;
+
+  // The same queries, adding the work each does to stats
+  template <typename OutputIterator>
+  bool search(const BoundingBox& box, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool search(const ConvexPolytope& polytope, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool radiusSearch(const Point3d& centre, double radius, OutputIterator& it,
+                    QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool knn(const Point3d& p, std::size_t k, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool raycast(const Ray& ray, double radius, OutputIterator& it, QueryStats& stats) const;
+
+  template <typename OutputIterator>
+  bool firstHits(const Ray& ray, double radius, std::size_t k, OutputIterator& it,
+                 QueryStats& stats) const;
+
+  // Describes the shape of the tree
+  TreeStats stats() const;
+
+  // Writes the tree to path in the format MappedOctree reads (see
+  // mapped_octree.h), with every value stored as its offset from begin, the
+  // start of the range the tree was built over. InputIterator has to be
+  // random access. Reports whether the whole file was written.
+  bool save(const std::string& path, InputIterator begin) const;
+
   tree_type& operator=(tree_type rhs);
 
   tree_type& operator=(tree_type&& rhs);
@@ -49,128 +205,688 @@ class PointerlessOctree {
  private:
   struct Node;
 
-  Node& init_nodes(
-      const std::vector<std::pair<InputIterator, Point3d>>& v,
-      std::size_t depth, index_type index_so_far);
+ public:
+  // Walks the tree with a stack of its own. Each leaf it reaches, and each
+  // run of values under a node the box holds all of, is scanned 64 points at
+  // a time. A default constructed iterator is the end of every search.
+  class search_iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = InputIterator;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const InputIterator*;
+    using reference = const InputIterator&;
+
+    search_iterator();
+
+    reference operator*() const;
+    pointer operator->() const;
+
+    search_iterator& operator++();
+    search_iterator operator++(int);
+
+    bool operator==(const search_iterator& rhs) const;
+    bool operator!=(const search_iterator& rhs) const;
 
-  using LeafNodeValue = std::vector<std::pair<InputIterator, Point3d>>;
-  using InternalNodeValue = std::array<index_type, 8>;
+   private:
+    friend class PointerlessOctree;
 
-  union NodeValues {
-    NodeValues() : internalValue_() {}
-    NodeValues(const LeafNodeValue& v) : leafValue_(v) {}
-    NodeValues(const InternalNodeValue& v) : internalValue_(v) {}
-    ~NodeValues() {}
+    search_iterator(const tree_type* tree, const BoundingBox& box);
 
-    LeafNodeValue leafValue_;
-    InternalNodeValue internalValue_;
+    // Moves on to the next run with anything in the box, or to the end
+    void next_run();
+
+    // Finds the first block of the run from block on with a point in the
+    // box, and reports whether there was one
+    bool scan(std::size_t block);
+
+    const tree_type* tree_;
+    BoundingBox box_;
+    // Nodes still to look at
+    std::vector<std::size_t> pending_;
+    // The run being scanned is [first_, first_ + size_) of the tree's
+    // arrays: either the leaf nodes_[leaf_], or everything under a node the
+    // box holds all of, when whole_ is set. mask_ holds the points of block_
+    // onwards not handed out yet.
+    std::size_t leaf_;
+    std::size_t first_;
+    std::size_t size_;
+    std::size_t block_;
+    std::uint64_t mask_;
+    bool whole_;
   };
 
+ private:
+
+  using is_quantized = std::integral_constant<bool, LeafCoordinates<Scalar>::quantized>;
+
+  // Builds the nodes over the points in xs, ys and zs, which are put in
+  // morton order along with values_ on the way
+  void init_nodes(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                  std::vector<build_type>& zs);
+
+  // Keeps the ordered points as the leaves' coordinates
+  void store_points(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                    std::vector<build_type>& zs, std::false_type);
+  void store_points(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                    std::vector<build_type>& zs, std::true_type);
+
+  // The leaf scans, for plain and for quantized coordinates
+  template <typename OutputIterator>
+  bool leaf_contained(const BoundingBox& box, const Node& n, OutputIterator& it, std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_contained(const BoundingBox& box, const Node& n, OutputIterator& it, std::true_type) const;
+
+  template <typename OutputIterator>
+  bool leaf_inside(const ConvexPolytope& polytope, std::uint64_t active, const Node& n,
+                   OutputIterator& it, std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_inside(const ConvexPolytope& polytope, std::uint64_t active, const Node& n,
+                   OutputIterator& it, std::true_type) const;
+
+  template <typename OutputIterator>
+  bool leaf_within(const Point3d& centre, double radiusSquared, const Node& n,
+                   OutputIterator& it, std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_within(const Point3d& centre, double radiusSquared, const Node& n,
+                   OutputIterator& it, std::true_type) const;
+
+  // Pairs between leaf n and other's leaf otherN
+  template <typename OutputIterator>
+  bool leaf_pairs(const tree_type& other, const Node& n, const Node& otherN,
+                  double epsilonSquared, OutputIterator& it, std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_pairs(const tree_type& other, const Node& n, const Node& otherN,
+                  double epsilonSquared, OutputIterator& it, std::true_type) const;
+
+  // Pairs within leaf n
+  template <typename OutputIterator>
+  bool leaf_self_pairs(const Node& n, double epsilonSquared, OutputIterator& it,
+                       std::false_type) const;
+  template <typename OutputIterator>
+  bool leaf_self_pairs(const Node& n, double epsilonSquared, OutputIterator& it,
+                       std::true_type) const;
+
+  template <typename Visitor>
+  bool leaf_visit(const BoundingBox& box, const Node& n, Visitor& visitor, std::false_type) const;
+  template <typename Visitor>
+  bool leaf_visit(const BoundingBox& box, const Node& n, Visitor& visitor, std::true_type) const;
+
+  // Which of the count points from offset on in the leaf n are in box
+  std::uint64_t leaf_mask(const BoundingBox& box, const Node& n, std::size_t offset,
+                          std::size_t count, std::false_type) const;
+  std::uint64_t leaf_mask(const BoundingBox& box, const Node& n, std::size_t offset,
+                          std::size_t count, std::true_type) const;
+
+  // Every point of the subtree at n, untested
+  template <typename Visitor>
+  bool visit_run(const Node& n, Visitor& visitor, std::false_type) const;
+  template <typename Visitor>
+  bool visit_run(const Node& n, Visitor& visitor, std::true_type) const;
+
+  void leaf_nearest(const Point3d& p, const Node& n, NearestSet<InputIterator>& nearest,
+                    std::false_type) const;
+  void leaf_nearest(const Point3d& p, const Node& n, NearestSet<InputIterator>& nearest,
+                    std::true_type) const;
+
+  void leaf_hits(const Ray& ray, double radiusSquared, const Node& n,
+                 NearestSet<InputIterator>& hits, std::false_type) const;
+  void leaf_hits(const Ray& ray, double radiusSquared, const Node& n,
+                 NearestSet<InputIterator>& hits, std::true_type) const;
+
+  std::size_t find_node(const index_type& key) const;
+
+  // The searches count their work in stats, a QueryStats or NoQueryStats
+  template <typename OutputIterator, typename Stats>
+  bool search_node(const BoundingBox& box, OutputIterator& it, std::size_t node, Stats& stats) const;
+
+  // active has a bit set for each plane of polytope node's parent straddles
+  template <typename OutputIterator, typename Stats>
+  bool search_node(const ConvexPolytope& polytope, std::uint64_t active, OutputIterator& it,
+                   std::size_t node, Stats& stats) const;
+
+  // Walks the tree for boxes [first, last) of the batch
+  void search_batch(const std::vector<BoundingBox>& boxes, std::size_t first, std::size_t last,
+                    batch_results& results) const;
+
+  // Answers the boxes numbered active[first, last) from node down. The boxes
+  // that still need to look inside it are appended to active for its
+  // children and dropped again afterwards.
+  void search_batch_node(const std::vector<BoundingBox>& boxes, std::vector<std::size_t>& active,
+                         std::size_t first, std::size_t last, batch_results& results,
+                         std::size_t node) const;
+
+  template <typename Visitor>
+  bool visit_node(const BoundingBox& box, Visitor& visitor, std::size_t node) const;
+
+  template <typename OutputIterator, typename Stats>
+  bool radius_search_node(const Point3d& centre, double radiusSquared,
+                          OutputIterator& it, std::size_t node, Stats& stats) const;
+
+  template <typename OutputIterator, typename Stats>
+  bool find_nearest(const Point3d& p, std::size_t k, OutputIterator& it, Stats& stats) const;
+
+  template <typename OutputIterator, typename Stats>
+  bool find_hits(const Ray& ray, double radius, std::size_t k, OutputIterator& it,
+                 Stats& stats) const;
+
+  // A pair of nodes, the second of other's, whose pairs of values are
+  // still to be found, or a node whose values are to be paired among
+  // themselves if self_ is set
+  struct JoinJob {
+    std::size_t node_;
+    std::size_t other_;
+    bool self_;
+  };
+
+  // Pairs of values under node here and otherNode in other. With jobs set,
+  // the pairs of nodes depth levels down are added to it rather than walked.
+  template <typename OutputIterator>
+  bool join_nodes(const tree_type& other, double epsilonSquared, std::size_t node,
+                  std::size_t otherNode, OutputIterator& it, std::size_t depth,
+                  std::vector<JoinJob>* jobs) const;
+
+  // The same for the pairs of values under node, each once
+  template <typename OutputIterator>
+  bool self_join_node(double epsilonSquared, std::size_t node, OutputIterator& it,
+                      std::size_t depth, std::vector<JoinJob>* jobs) const;
+
+  template <typename OutputIterator>
+  bool run_join(const tree_type& other, const JoinJob& job, double epsilonSquared,
+                OutputIterator& it, std::size_t depth, std::vector<JoinJob>* jobs) const;
+
+  // Joins the roots of this tree and other, or this tree's root with
+  // itself, on pool
+  template <typename OutputIterator>
+  bool parallel_join(const tree_type& other, bool self, double epsilonSquared,
+                     OutputIterator& it, TaskPool& pool) const;
+
+  // Batches are only split between threads into pieces at least this big
+  static const std::size_t parallel_batch_cutoff = 64;
+
+  // Parallel joins are split into this many pieces per thread, as pairs of
+  // subtrees vary a lot in how many pairs they hold, going no deeper than
+  // max_join_split_depth to find them
+  static const std::size_t join_pieces_per_thread = 8;
+  static const std::size_t max_join_split_depth = 8;
+  // Pieces are started no more than this many per thread ahead of the
+  // oldest one whose pairs haven't been written out, which bounds how many
+  // pieces' pairs are held at once
+  static const std::size_t join_jobs_held_per_thread = 4;
+
   enum class NodeContents : char {
     INTERNAL,
     LEAF
   };
 
   struct Node {
-    Node() : type_(NodeContents::INTERNAL) {}
-    Node(const Node& rhs) : extrema_(rhs.extrema_), key_(rhs.key_), type_(rhs.type_) {
-      if (type_ == NodeContents::INTERNAL) {
-        values_.internalValue_ = rhs.values_.internalValue_;
-      } else {
-        values_.leafValue_ = rhs.values_.leafValue_;
-      }
-    }
-    ~Node();
-
     BoundingBox extrema_;
-    NodeValues values_;
     index_type key_;
+    // Children are nodes_[first_, last_) for an internal node, and the node's
+    // points are [first_, last_) of the coordinate and value arrays for a leaf
+    std::size_t first_;
+    std::size_t last_;
+    // Points are stored in morton order, so every subtree's points are one
+    // run of the arrays as well
+    std::size_t points_first_;
+    std::size_t points_last_;
     NodeContents type_;
   };
 
   PointExtractor functor_;
-  std::unordered_map<index_type, Node> nodes_;
+  // Sorted by key, which also makes the children of a node adjacent
+  std::vector<Node> nodes_;
+  // Every point, split by coordinate so that leaves can be tested in bulk
+  std::vector<stored_type> xs_;
+  std::vector<stored_type> ys_;
+  std::vector<stored_type> zs_;
+  std::vector<InputIterator> values_;
   std::size_t depth_;
   std::size_t size_;
 };
 
-#define POINTERLESS_OCTREE_TEMPLATE typename InputIterator, typename PointExtractor, std::size_t max_node_size, std::size_t max_depth
-#define POINTERLESSOCTREE PointerlessOctree<InputIterator, PointExtractor, max_node_size, max_depth>
+#define POINTERLESS_OCTREE_TEMPLATE typename InputIterator, typename PointExtractor, std::size_t max_node_size, std::size_t max_depth, typename Scalar
+#define POINTERLESSOCTREE PointerlessOctree<InputIterator, PointExtractor, max_node_size, max_depth, Scalar>
 
 template <POINTERLESS_OCTREE_TEMPLATE>
-POINTERLESSOCTREE::PointerlessOctree() 
+POINTERLESSOCTREE::PointerlessOctree()
   : functor_(PointExtractor()), depth_(0), size_(0) { }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
-POINTERLESSOCTREE::PointerlessOctree(InputIterator begin, InputIterator end) 
+POINTERLESSOCTREE::PointerlessOctree(InputIterator begin, InputIterator end)
   : PointerlessOctree(begin, end, PointExtractor()) { }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
-POINTERLESSOCTREE::PointerlessOctree(InputIterator begin, InputIterator end, PointExtractor f) 
+POINTERLESSOCTREE::PointerlessOctree(InputIterator begin, InputIterator end, PointExtractor f)
   : functor_(f), depth_(0), size_(0) {
 
-  std::vector<std::pair<InputIterator, Point3d>> v;
-  v.reserve(std::distance(begin, end));
+  std::size_t count = std::distance(begin, end);
+  std::vector<build_type> xs, ys, zs;
+  xs.reserve(count);
+  ys.reserve(count);
+  zs.reserve(count);
+  values_.reserve(count);
 
   for (auto it = begin; it != end; ++it) {
-    v.push_back(std::pair<InputIterator, Point3d>(it, functor_(*it)));
+    Point3d p = toScalarPoint<build_type>(functor_(*it));
+    xs.push_back(p.x);
+    ys.push_back(p.y);
+    zs.push_back(p.z);
+    values_.push_back(it);
   }
 
-  index_type rootIndex(1); 
+  init_nodes(xs, ys, zs);
+  store_points(xs, ys, zs, is_quantized());
+}
 
-  init_nodes(v, 1, rootIndex);
+template <POINTERLESS_OCTREE_TEMPLATE>
+POINTERLESSOCTREE::PointerlessOctree(POINTERLESSOCTREE::tree_type&& rhs)
+  : functor_(rhs.functor_), nodes_(std::move(rhs.nodes_)),
+    xs_(std::move(rhs.xs_)), ys_(std::move(rhs.ys_)), zs_(std::move(rhs.zs_)),
+    values_(std::move(rhs.values_)), depth_(rhs.depth_), size_(rhs.size_) {
+  rhs.depth_ = 0;
+  rhs.size_ = 0;
 }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
-typename POINTERLESSOCTREE::Node& POINTERLESSOCTREE::init_nodes(
-    const std::vector<std::pair<InputIterator, Point3d>>& v, 
-    std::size_t depth, index_type index_so_far) {
-  BoundingBox extrema = makeBoundingBox(InnerIterator<InputIterator>(v.begin()), InnerIterator<InputIterator>(v.end()));
-  bool at_max_depth = depth == max_depth;
-  bool leaf_node = v.size() <= max_node_size;
-  NodeContents type = leaf_node || at_max_depth ? NodeContents::LEAF : NodeContents::INTERNAL;
-  std::size_t node_depth = depth;
+void POINTERLESSOCTREE::swap(POINTERLESSOCTREE::tree_type& rhs) {
+  std::swap(functor_, rhs.functor_);
+  std::swap(nodes_, rhs.nodes_);
+  std::swap(xs_, rhs.xs_);
+  std::swap(ys_, rhs.ys_);
+  std::swap(zs_, rhs.zs_);
+  std::swap(values_, rhs.values_);
+  std::swap(depth_, rhs.depth_);
+  std::swap(size_, rhs.size_);
+}
 
-  Node n;
-  n.extrema_ = extrema;
-  n.key_ = index_so_far;
-  n.type_ = type;
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::tree_type& POINTERLESSOCTREE::operator=(typename POINTERLESSOCTREE::tree_type rhs) {
+  swap(rhs);
+  return *this;
+}
 
-  if (type == NodeContents::LEAF) {
-    n.values_.leafValue_ = v;
-    size_ += v.size();
-    depth_ = std::max(node_depth, depth_);
-  } else {
-    std::array<std::vector<std::pair<InputIterator, Point3d>>, 8> childVectors;
-    auto childExtrema = extrema.partition();
-    for (unsigned char child = 0; child < 8; ++child) {
-      std::vector<std::pair<InputIterator, Point3d>>& childVector = childVectors[child];
-      childVector.reserve(v.size() / 8);
-
-      std::copy_if(
-        v.begin(), v.end(), std::back_inserter(childVector),
-        [&childExtrema, child](const std::pair<InputIterator, Point3d>& element) -> bool {
-          Point3d p = std::get<1>(element);
-
-          return childExtrema[child].contains(p);
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::tree_type& POINTERLESSOCTREE::operator=(typename POINTERLESSOCTREE::tree_type&& rhs) {
+  swap(rhs);
+  return *this;
+}
+
+// Nodes are built breadth first, in the order they are stored. Every key on
+// one level is smaller than every key on the next, and within a level the
+// children of a node are queued in octant order behind the children of the
+// nodes before it, so the array comes out sorted without an explicit sort.
+//
+// Every internal node partitions its own range of the points in place among
+// its children. That leaves the points in depth first (morton) order with
+// every leaf's points already in place, and never holds more than the one
+// copy of the input.
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::init_nodes(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                                   std::vector<build_type>& zs) {
+  struct PendingNode {
+    std::size_t first_;
+    std::size_t last_;
+    index_type key_;
+    std::size_t depth_;
+  };
+
+  auto point = [&](std::size_t i) -> Point3d { return Point3d{xs[i], ys[i], zs[i]}; };
+
+  std::deque<PendingNode> pending;
+  pending.push_back(PendingNode{0, values_.size(), index_type(1), 1});
+
+  while (!pending.empty()) {
+    const PendingNode current = pending.front();
+    pending.pop_front();
+
+    Node n;
+    n.extrema_ = initialBox;
+    for (std::size_t i = current.first_; i < current.last_; ++i) {
+      Point3d p = point(i);
+      n.extrema_.mins_.x = std::min(p.x, n.extrema_.mins_.x);
+      n.extrema_.mins_.y = std::min(p.y, n.extrema_.mins_.y);
+      n.extrema_.mins_.z = std::min(p.z, n.extrema_.mins_.z);
+      n.extrema_.maxes_.x = std::max(p.x, n.extrema_.maxes_.x);
+      n.extrema_.maxes_.y = std::max(p.y, n.extrema_.maxes_.y);
+      n.extrema_.maxes_.z = std::max(p.z, n.extrema_.maxes_.z);
+    }
+    n.key_ = current.key_;
+    n.points_first_ = current.first_;
+    n.points_last_ = current.last_;
+
+    bool at_max_depth = current.depth_ == max_depth;
+    bool leaf_node = current.last_ - current.first_ <= max_node_size;
+
+    if (leaf_node || at_max_depth) {
+      n.type_ = NodeContents::LEAF;
+      n.first_ = current.first_;
+      n.last_ = current.last_;
+      size_ += current.last_ - current.first_;
+      depth_ = std::max(current.depth_, depth_);
+    } else {
+      n.type_ = NodeContents::INTERNAL;
+      // This node goes in at nodes_.size(), and its first child lands behind
+      // everything else that is already waiting
+      n.first_ = nodes_.size() + 1 + pending.size();
+
+      std::array<std::size_t, 9> bounds = partitionByOctant(
+          n.extrema_, current.first_, current.last_,
+          point,
+          [&](std::size_t i, std::size_t j) {
+            std::swap(xs[i], xs[j]);
+            std::swap(ys[i], ys[j]);
+            std::swap(zs[i], zs[j]);
+            std::swap(values_[i], values_[j]);
+          });
+
+      for (unsigned char child = 0; child < 8; ++child) {
+        if (bounds[child] != bounds[child + 1]) {
+          index_type morton_index = (current.key_ << 3) | index_type(child);
+          pending.push_back(PendingNode{
+              bounds[child], bounds[child + 1], morton_index, current.depth_ + 1});
         }
-      );
+      }
+      n.last_ = nodes_.size() + 1 + pending.size();
+    }
+
+    nodes_.push_back(n);
+  }
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::store_points(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                                     std::vector<build_type>& zs, std::false_type) {
+  xs_.swap(xs);
+  ys_.swap(ys);
+  zs_.swap(zs);
+}
+
+// Each leaf codes its points within its own extrema. The exact coordinates
+// are dropped once that is done.
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::store_points(std::vector<build_type>& xs, std::vector<build_type>& ys,
+                                     std::vector<build_type>& zs, std::true_type) {
+  xs_.resize(xs.size());
+  ys_.resize(ys.size());
+  zs_.resize(zs.size());
+  for (const Node& n : nodes_) {
+    if (n.type_ == NodeContents::LEAF) {
+      quantizeLeaf<Scalar::width>(n.extrema_, xs.data() + n.first_, ys.data() + n.first_,
+                                 zs.data() + n.first_, n.last_ - n.first_, xs_.data() + n.first_,
+                                 ys_.data() + n.first_, zs_.data() + n.first_);
+    }
+  }
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_contained(const BoundingBox& b, const Node& n, OutputIterator& out,
+                                       std::false_type) const {
+  return emitContained(b, xs_.data() + n.first_, ys_.data() + n.first_,
+                       zs_.data() + n.first_, values_.data() + n.first_,
+                       n.last_ - n.first_, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_contained(const BoundingBox& b, const Node& n, OutputIterator& out,
+                                       std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  return emitContainedQuantized<Scalar::width>(
+      b, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_, zs_.data() + n.first_,
+      values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_inside(const ConvexPolytope& polytope, std::uint64_t active,
+                                    const Node& n, OutputIterator& out, std::false_type) const {
+  return emitInside(polytope, active, xs_.data() + n.first_, ys_.data() + n.first_,
+                    zs_.data() + n.first_, values_.data() + n.first_, n.last_ - n.first_, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_inside(const ConvexPolytope& polytope, std::uint64_t active,
+                                    const Node& n, OutputIterator& out, std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  return emitInsideQuantized<Scalar::width>(
+      polytope, active, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_,
+      zs_.data() + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_pairs(const tree_type& other, const Node& n, const Node& otherN,
+                                   double epsilonSquared, OutputIterator& out,
+                                   std::false_type) const {
+  return emitPairsWithin(epsilonSquared,
+                         xs_.data() + n.first_, ys_.data() + n.first_, zs_.data() + n.first_,
+                         values_.data() + n.first_, n.last_ - n.first_,
+                         other.xs_.data() + otherN.first_, other.ys_.data() + otherN.first_,
+                         other.zs_.data() + otherN.first_, other.values_.data() + otherN.first_,
+                         otherN.last_ - otherN.first_, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_pairs(const tree_type& other, const Node& n, const Node& otherN,
+                                   double epsilonSquared, OutputIterator& out,
+                                   std::true_type) const {
+  PointExtractor extract(functor_);
+  PointExtractor otherExtract(other.functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  const InputIterator* otherValues = other.values_.data() + otherN.first_;
+  return emitPairsWithinQuantized<Scalar::width>(
+      epsilonSquared, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_,
+      zs_.data() + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); },
+      otherN.extrema_, other.xs_.data() + otherN.first_, other.ys_.data() + otherN.first_,
+      other.zs_.data() + otherN.first_, otherValues, otherN.last_ - otherN.first_,
+      [&](std::size_t i) -> Point3d { return otherExtract(*otherValues[i]); }, out);
+}
 
-      std::array<index_type, 8> values;
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_self_pairs(const Node& n, double epsilonSquared,
+                                        OutputIterator& out, std::false_type) const {
+  return emitPairsWithin(epsilonSquared,
+                         xs_.data() + n.first_, ys_.data() + n.first_, zs_.data() + n.first_,
+                         values_.data() + n.first_, n.last_ - n.first_, out);
+}
 
-      index_type morton_index = (index_so_far << 3) | index_type(child);
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_self_pairs(const Node& n, double epsilonSquared,
+                                        OutputIterator& out, std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  return emitPairsWithinQuantized<Scalar::width>(
+      epsilonSquared, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_,
+      zs_.data() + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, out);
+}
 
-      values[child] = childVector.empty()
-        ? index_type(0)
-        : init_nodes(childVector, depth + 1, morton_index).key_;
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_within(const Point3d& centre, double radiusSquared, const Node& n,
+                                    OutputIterator& out, std::false_type) const {
+  return emitWithin(centre, radiusSquared,
+                    xs_.data() + n.first_, ys_.data() + n.first_,
+                    zs_.data() + n.first_, values_.data() + n.first_,
+                    n.last_ - n.first_, out);
+}
 
-      n.values_.internalValue_ = values;
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::leaf_within(const Point3d& centre, double radiusSquared, const Node& n,
+                                    OutputIterator& out, std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  return emitWithinQuantized<Scalar::width>(
+      centre, radiusSquared, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_,
+      zs_.data() + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::leaf_visit(const BoundingBox& b, const Node& n, Visitor& visitor,
+                                   std::false_type) const {
+  return visitContained(b, xs_.data() + n.first_, ys_.data() + n.first_,
+                        zs_.data() + n.first_, values_.data() + n.first_,
+                        n.last_ - n.first_, visitor);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::leaf_visit(const BoundingBox& b, const Node& n, Visitor& visitor,
+                                   std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  return visitContainedQuantized<Scalar::width>(
+      b, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_, zs_.data() + n.first_,
+      values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, visitor);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+std::uint64_t POINTERLESSOCTREE::leaf_mask(const BoundingBox& b, const Node& n, std::size_t offset,
+                                           std::size_t count, std::false_type) const {
+  std::size_t first = n.first_ + offset;
+  return containsBlock(b, xs_.data() + first, ys_.data() + first, zs_.data() + first, count);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+std::uint64_t POINTERLESSOCTREE::leaf_mask(const BoundingBox& b, const Node& n, std::size_t offset,
+                                           std::size_t count, std::true_type) const {
+  PointExtractor extract(functor_);
+  std::size_t first = n.first_ + offset;
+  const InputIterator* values = values_.data() + first;
+  return containsBlockQuantized<Scalar::width>(
+      b, n.extrema_, xs_.data() + first, ys_.data() + first, zs_.data() + first, count,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); });
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::visit_run(const Node& n, Visitor& visitor, std::false_type) const {
+  return visitAll(xs_.data() + n.points_first_, ys_.data() + n.points_first_,
+                  zs_.data() + n.points_first_, values_.data() + n.points_first_,
+                  n.points_last_ - n.points_first_, visitor);
+}
+
+// Codes only make sense within their own leaf, so a run over several leaves
+// looks its points up instead
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::visit_run(const Node& n, Visitor& visitor, std::true_type) const {
+  PointExtractor extract(functor_);
+  for (std::size_t i = n.points_first_; i < n.points_last_; ++i) {
+    if (visitor(values_[i], extract(*values_[i])) == Visit::STOP) {
+      return true;
     }
+  }
+  return false;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::leaf_nearest(const Point3d& p, const Node& n,
+                                     NearestSet<InputIterator>& nearest, std::false_type) const {
+  offerNearest(p, xs_.data() + n.first_, ys_.data() + n.first_,
+               zs_.data() + n.first_, values_.data() + n.first_,
+               n.last_ - n.first_, nearest);
+}
 
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::leaf_nearest(const Point3d& p, const Node& n,
+                                     NearestSet<InputIterator>& nearest, std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  offerNearestQuantized<Scalar::width>(
+      p, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_, zs_.data() + n.first_,
+      values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, nearest);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::leaf_hits(const Ray& ray, double radiusSquared, const Node& n,
+                                  NearestSet<InputIterator>& hits, std::false_type) const {
+  offerAlongRay(ray, radiusSquared, xs_.data() + n.first_, ys_.data() + n.first_,
+                zs_.data() + n.first_, values_.data() + n.first_, n.last_ - n.first_, hits);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::leaf_hits(const Ray& ray, double radiusSquared, const Node& n,
+                                  NearestSet<InputIterator>& hits, std::true_type) const {
+  PointExtractor extract(functor_);
+  const InputIterator* values = values_.data() + n.first_;
+  offerAlongRayQuantized<Scalar::width>(
+      ray, radiusSquared, n.extrema_, xs_.data() + n.first_, ys_.data() + n.first_,
+      zs_.data() + n.first_, values, n.last_ - n.first_,
+      [&](std::size_t i) -> Point3d { return extract(*values[i]); }, hits);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+bool POINTERLESSOCTREE::save(const std::string& path, InputIterator begin) const {
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  TreeFileHeader header = makeTreeFileHeader<Scalar>(nodes_.size(), values_.size(), depth_);
+  std::uint64_t written = 0;
+  auto write = [&](const void* data, std::uint64_t bytes, std::uint64_t offset) {
+    static const char padding[64] = {};
+    out.write(padding, static_cast<std::streamsize>(offset - written));
+    out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+    written = offset + bytes;
+  };
+
+  write(&header, sizeof(header), 0);
+
+  // Nodes and values are converted a block at a time, so saving never holds
+  // a second copy of either
+  const std::size_t block = 1024;
+  std::vector<TreeFileNode> nodes;
+  for (std::size_t first = 0; first < nodes_.size(); first += block) {
+    nodes.clear();
+    for (std::size_t i = first; i < std::min(nodes_.size(), first + block); ++i) {
+      const Node& n = nodes_[i];
+      nodes.push_back(TreeFileNode{n.extrema_, n.first_, n.last_, n.points_first_, n.points_last_,
+                                   n.type_ == NodeContents::LEAF});
+    }
+    write(nodes.data(), nodes.size() * sizeof(TreeFileNode),
+          header.nodes_ + first * sizeof(TreeFileNode));
   }
 
-  nodes_.insert(std::make_pair(index_so_far, n));
-  return nodes_.at(index_so_far);
+  write(xs_.data(), xs_.size() * sizeof(stored_type), header.xs_);
+  write(ys_.data(), ys_.size() * sizeof(stored_type), header.ys_);
+  write(zs_.data(), zs_.size() * sizeof(stored_type), header.zs_);
+
+  std::vector<std::uint64_t> indices;
+  for (std::size_t first = 0; first < values_.size(); first += block) {
+    indices.clear();
+    for (std::size_t i = first; i < std::min(values_.size(), first + block); ++i) {
+      indices.push_back(static_cast<std::uint64_t>(values_[i] - begin));
+    }
+    write(indices.data(), indices.size() * sizeof(std::uint64_t),
+          header.values_ + first * sizeof(std::uint64_t));
+  }
+
+  out.close();
+  return !out.fail() && written == header.file_bytes_;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+std::size_t POINTERLESSOCTREE::find_node(const index_type& key) const {
+  auto it = std::lower_bound(nodes_.begin(), nodes_.end(), key,
+      [](const Node& n, const index_type& k) -> bool { return n.key_ < k; });
+  if (it == nodes_.end() || it->key_ != key) {
+    return nodes_.size();
+  }
+  return static_cast<std::size_t>(it - nodes_.begin());
 }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
@@ -183,51 +899,659 @@ std::size_t POINTERLESSOCTREE::depth() const {
   return depth_;
 }
 
+// Children always follow their parent in key order, so one pass in order
+// works out every node's depth
 template <POINTERLESS_OCTREE_TEMPLATE>
-POINTERLESSOCTREE::Node::~Node() {
-  switch (type_) {
-    case NodeContents::INTERNAL:
-      values_.internalValue_.~InternalNodeValue();
-      break;
-    case NodeContents::LEAF:
-      values_.leafValue_.~LeafNodeValue();
-      break;
-    default:
-      throw "Invalid node type";
+TreeStats POINTERLESSOCTREE::stats() const {
+  TreeStats stats(max_node_size);
+  std::vector<std::size_t> depths(nodes_.size(), 0);
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    const Node& n = nodes_[i];
+    if (n.type_ == NodeContents::INTERNAL) {
+      for (std::size_t child = n.first_; child < n.last_; ++child) {
+        depths[child] = depths[i] + 1;
+      }
+      stats.addInternal(depths[i], n.last_ - n.first_);
+    } else {
+      stats.addLeaf(depths[i], n.last_ - n.first_, depths[i] + 1 == max_depth);
+    }
   }
+  stats.bytes_ = sizeof(*this) + nodes_.capacity() * sizeof(Node) +
+                 (xs_.capacity() + ys_.capacity() + zs_.capacity()) * sizeof(stored_type) +
+                 values_.capacity() * sizeof(InputIterator);
+  return stats;
 }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
 template <typename OutputIterator>
 bool POINTERLESSOCTREE::search(const BoundingBox& b, OutputIterator& out) const {
-  return search(b, out, 1);
+  NoQueryStats stats;
+  return !nodes_.empty() && search_node(b, out, 0, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::search(const BoundingBox& b, OutputIterator& out, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return !nodes_.empty() && search_node(b, counted, 0, stats);
 }
 
 template <POINTERLESS_OCTREE_TEMPLATE>
 template <typename OutputIterator>
 bool POINTERLESSOCTREE::search(const BoundingBox& b, OutputIterator& out, const index_type& current_index) const {
+  std::size_t node = find_node(current_index);
+  NoQueryStats stats;
+  return node != nodes_.size() && search_node(b, out, node, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::search(const ConvexPolytope& polytope, OutputIterator& out) const {
+  NoQueryStats stats;
+  return !nodes_.empty() && polytope.valid() &&
+         search_node(polytope, polytope.allPlanes(), out, 0, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::search(const ConvexPolytope& polytope, OutputIterator& out,
+                               QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return !nodes_.empty() && polytope.valid() &&
+         search_node(polytope, polytope.allPlanes(), counted, 0, stats);
+}
+
+// Subtrees outside the query are skipped, and subtrees entirely inside it
+// are emitted as one run of values without looking at their points
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool POINTERLESSOCTREE::search_node(const BoundingBox& b, OutputIterator& out, std::size_t node,
+                                    Stats& stats) const {
+  const Node& n = nodes_[node];
+  stats.visit();
+  if (!b.intersects(n.extrema_)) {
+    stats.prune();
+    return false;
+  } else if (b.contains(n.extrema_)) {
+    return emitAll(values_.data() + n.points_first_, n.points_last_ - n.points_first_, out);
+  }
+
+  bool success = false;
+  if (n.type_ == NodeContents::INTERNAL) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= search_node(b, out, child, stats);
+    }
+  } else {
+    stats.test(n.last_ - n.first_);
+    success = leaf_contained(b, n, out, is_quantized());
+  }
+  return success;
+}
+
+// The same for a polytope, with the planes a node's box is inside dropped
+// for the whole subtree
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool POINTERLESSOCTREE::search_node(const ConvexPolytope& polytope, std::uint64_t active,
+                                    OutputIterator& out, std::size_t node, Stats& stats) const {
+  const Node& n = nodes_[node];
+  stats.visit();
+  Containment where = polytope.classify(n.extrema_, active);
+  if (where == Containment::OUTSIDE) {
+    stats.prune();
+    return false;
+  } else if (where == Containment::INSIDE) {
+    return emitAll(values_.data() + n.points_first_, n.points_last_ - n.points_first_, out);
+  }
+
+  bool success = false;
+  if (n.type_ == NodeContents::INTERNAL) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= search_node(polytope, active, out, child, stats);
+    }
+  } else {
+    stats.test(n.last_ - n.first_);
+    success = leaf_inside(polytope, active, n, out, is_quantized());
+  }
+  return success;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::join(const tree_type& other, double epsilon, OutputIterator& out) const {
+  return !nodes_.empty() && !other.nodes_.empty() && epsilon >= 0 &&
+         join_nodes(other, epsilon * epsilon, 0, 0, out, 0, nullptr);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::join(const tree_type& other, double epsilon, OutputIterator& out,
+                             TaskPool& pool) const {
+  return !nodes_.empty() && !other.nodes_.empty() && epsilon >= 0 &&
+         parallel_join(other, false, epsilon * epsilon, out, pool);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::selfJoin(double epsilon, OutputIterator& out) const {
+  return !nodes_.empty() && epsilon >= 0 && self_join_node(epsilon * epsilon, 0, out, 0, nullptr);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::selfJoin(double epsilon, OutputIterator& out, TaskPool& pool) const {
+  return !nodes_.empty() && epsilon >= 0 && parallel_join(*this, true, epsilon * epsilon, out, pool);
+}
+
+// Goes down whichever of the two nodes is bigger, or isn't a leaf, until
+// the pair can be settled from their extrema or both are leaves
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::join_nodes(const tree_type& other, double epsilonSquared,
+                                   std::size_t node, std::size_t otherNode, OutputIterator& out,
+                                   std::size_t depth, std::vector<JoinJob>* jobs) const {
+  if (jobs && depth == 0) {
+    jobs->push_back(JoinJob{node, otherNode, false});
+    return false;
+  }
+  const Node& n = nodes_[node];
+  const Node& o = other.nodes_[otherNode];
+  if (!(n.extrema_.distanceSquared(o.extrema_) <= epsilonSquared)) {
+    return false;
+  } else if (n.extrema_.maxDistanceSquared(o.extrema_) <= epsilonSquared) {
+    return emitAllPairs(values_.data() + n.points_first_, n.points_last_ - n.points_first_,
+                        other.values_.data() + o.points_first_, o.points_last_ - o.points_first_,
+                        out);
+  }
+
+  std::size_t below = depth ? depth - 1 : 0;
   bool success = false;
-  if (nodes_.find(current_index) != nodes_.end() && current_index != index_type(0)) {
-    const Node& n = nodes_.at(current_index);
+  if (n.type_ == NodeContents::LEAF && o.type_ == NodeContents::LEAF) {
+    success = leaf_pairs(other, n, o, epsilonSquared, out, is_quantized());
+  } else if (n.type_ == NodeContents::INTERNAL &&
+             (o.type_ == NodeContents::LEAF ||
+              n.extrema_.maxDistanceSquared(n.extrema_) >= o.extrema_.maxDistanceSquared(o.extrema_))) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= join_nodes(other, epsilonSquared, child, otherNode, out, below, jobs);
+    }
+  } else {
+    for (std::size_t child = o.first_; child < o.last_; ++child) {
+      success |= join_nodes(other, epsilonSquared, node, child, out, below, jobs);
+    }
+  }
+  return success;
+}
+
+// Pairs within each child, then between each pair of children
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::self_join_node(double epsilonSquared, std::size_t node,
+                                       OutputIterator& out, std::size_t depth,
+                                       std::vector<JoinJob>* jobs) const {
+  if (jobs && depth == 0) {
+    jobs->push_back(JoinJob{node, node, true});
+    return false;
+  }
+  const Node& n = nodes_[node];
+  if (n.extrema_.maxDistanceSquared(n.extrema_) <= epsilonSquared) {
+    return emitAllPairs(values_.data() + n.points_first_, n.points_last_ - n.points_first_, out);
+  } else if (n.type_ == NodeContents::LEAF) {
+    return leaf_self_pairs(n, epsilonSquared, out, is_quantized());
+  }
+
+  std::size_t below = depth ? depth - 1 : 0;
+  bool success = false;
+  for (std::size_t child = n.first_; child < n.last_; ++child) {
+    success |= self_join_node(epsilonSquared, child, out, below, jobs);
+    for (std::size_t sibling = child + 1; sibling < n.last_; ++sibling) {
+      success |= join_nodes(*this, epsilonSquared, child, sibling, out, below, jobs);
+    }
+  }
+  return success;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::run_join(const tree_type& other, const JoinJob& job,
+                                 double epsilonSquared, OutputIterator& out, std::size_t depth,
+                                 std::vector<JoinJob>* jobs) const {
+  return job.self_ ? self_join_node(epsilonSquared, job.node_, out, depth, jobs)
+                   : join_nodes(other, epsilonSquared, job.node_, job.other_, out, depth, jobs);
+}
+
+// The top of the walk runs here, taking the pairs of subtrees one level
+// deeper each time until there are enough for the threads to share, and
+// finds the pairs it comes across on the way itself. Those pairs are kept in
+// walk order, with before[j] of them ahead of job j, and every job's pairs
+// are written out as soon as it and every job ahead of it are done, so the
+// pairs come out in the order the serial join finds them, whatever the
+// threads do.
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::parallel_join(const tree_type& other, bool self, double epsilonSquared,
+                                      OutputIterator& out, TaskPool& pool) const {
+  const std::size_t wanted = (pool.size() + 1) * join_pieces_per_thread;
+  std::vector<join_pair> top, deeperTop;
+  std::vector<JoinJob> jobs{JoinJob{0, 0, self}}, deeper;
+  std::vector<std::size_t> before{0}, deeperBefore;
+  for (std::size_t depth = 1; depth <= max_join_split_depth; ++depth) {
+    deeperTop.clear();
+    deeper.clear();
+    deeperBefore.clear();
+    JoinSplitOutput<join_pair, JoinJob> split(deeperTop, deeper, deeperBefore);
+    std::size_t copied = 0;
+    for (std::size_t j = 0; j < jobs.size(); ++j) {
+      deeperTop.insert(deeperTop.end(), top.begin() + copied, top.begin() + before[j]);
+      copied = before[j];
+      run_join(other, jobs[j], epsilonSquared, split, 1, &deeper);
+      split.mark();
+    }
+    deeperTop.insert(deeperTop.end(), top.begin() + copied, top.end());
+    top.swap(deeperTop);
+    jobs.swap(deeper);
+    before.swap(deeperBefore);
+    if (jobs.size() >= wanted || jobs.empty()) {
+      break;
+    }
+  }
+
+  bool success = false;
+  std::size_t emitted = 0;
+  std::vector<std::vector<join_pair>> found(jobs.size());
+  runOrdered(pool, jobs.size(), (pool.size() + 1) * join_jobs_held_per_thread,
+             [this, &other, &jobs, &found, epsilonSquared](std::size_t i) {
+               auto pairsIterator = std::back_inserter(found[i]);
+               run_join(other, jobs[i], epsilonSquared, pairsIterator, 0, nullptr);
+             },
+             [&top, &before, &found, &emitted, &success, &out](std::size_t i) {
+               success |= emitAll(top.data() + emitted, before[i] - emitted, out);
+               emitted = before[i];
+               success |= emitAll(found[i].data(), found[i].size(), out);
+               std::vector<join_pair>().swap(found[i]);
+             });
+  success |= emitAll(top.data() + emitted, top.size() - emitted, out);
+  return success;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::visit(const BoundingBox& b, Visitor&& visitor) const {
+  return !nodes_.empty() && visit_node(b, visitor, 0);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::search_range POINTERLESSOCTREE::searchRange(const BoundingBox& b) const {
+  return search_range(search_iterator(this, b), search_iterator());
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+POINTERLESSOCTREE::search_iterator::search_iterator()
+  : tree_(nullptr), box_(invalidBox), leaf_(0), first_(0), size_(0), block_(0), mask_(0),
+    whole_(false) { }
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+POINTERLESSOCTREE::search_iterator::search_iterator(const tree_type* tree, const BoundingBox& box)
+  : search_iterator() {
+  tree_ = tree;
+  box_ = box;
+  if (!tree->nodes_.empty()) {
+    pending_.push_back(0);
+  }
+  next_run();
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::search_iterator::reference
+POINTERLESSOCTREE::search_iterator::operator*() const {
+  return tree_->values_[first_ + block_ + lowestSetBit(mask_)];
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::search_iterator::pointer
+POINTERLESSOCTREE::search_iterator::operator->() const {
+  return &operator*();
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::search_iterator& POINTERLESSOCTREE::search_iterator::operator++() {
+  mask_ &= mask_ - 1;
+  if (!mask_ && !scan(block_ + 64)) {
+    next_run();
+  }
+  return *this;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+typename POINTERLESSOCTREE::search_iterator POINTERLESSOCTREE::search_iterator::operator++(int) {
+  search_iterator other = *this;
+  operator++();
+  return other;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+bool POINTERLESSOCTREE::search_iterator::operator==(const search_iterator& rhs) const {
+  return tree_ == rhs.tree_ && first_ == rhs.first_ && block_ == rhs.block_ && mask_ == rhs.mask_;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+bool POINTERLESSOCTREE::search_iterator::operator!=(const search_iterator& rhs) const {
+  return !operator==(rhs);
+}
+
+// Makes the same decisions as search_node(), with children pushed last first
+// so that they come off the stack in search_node()'s order
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::search_iterator::next_run() {
+  while (!pending_.empty()) {
+    const Node& n = tree_->nodes_[pending_.back()];
+    leaf_ = pending_.back();
+    pending_.pop_back();
+    if (!box_.intersects(n.extrema_)) {
+      continue;
+    }
+
+    whole_ = box_.contains(n.extrema_);
+    if (whole_) {
+      first_ = n.points_first_;
+      size_ = n.points_last_ - n.points_first_;
+    } else if (n.type_ == NodeContents::INTERNAL) {
+      for (std::size_t child = n.last_; child-- > n.first_; ) {
+        pending_.push_back(child);
+      }
+      continue;
+    } else {
+      first_ = n.first_;
+      size_ = n.last_ - n.first_;
+    }
+    if (scan(0)) {
+      return;
+    }
+  }
+
+  *this = search_iterator();
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+bool POINTERLESSOCTREE::search_iterator::scan(std::size_t block) {
+  for (block_ = block; block_ < size_; block_ += 64) {
+    std::size_t count = std::min<std::size_t>(size_ - block_, 64);
+    mask_ = whole_ ? lowBits(count)
+                   : tree_->leaf_mask(box_, tree_->nodes_[leaf_], block_, count, is_quantized());
+    if (mask_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The same walk as search_node(), leaving as soon as the visitor stops it
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename Visitor>
+bool POINTERLESSOCTREE::visit_node(const BoundingBox& b, Visitor& visitor, std::size_t node) const {
+  const Node& n = nodes_[node];
+  if (!b.intersects(n.extrema_)) {
+    return false;
+  } else if (b.contains(n.extrema_)) {
+    return visit_run(n, visitor, is_quantized());
+  }
+
+  if (n.type_ == NodeContents::INTERNAL) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      if (visit_node(b, visitor, child)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  return leaf_visit(b, n, visitor, is_quantized());
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename BoxIterator>
+void POINTERLESSOCTREE::searchBatch(BoxIterator first, BoxIterator last, batch_results& results) const {
+  std::vector<BoundingBox> boxes(first, last);
+  results.resize(boxes.size());
+  for (std::vector<InputIterator>& found : results) {
+    found.clear();
+  }
+  search_batch(boxes, 0, boxes.size(), results);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename BoxIterator>
+void POINTERLESSOCTREE::searchBatch(BoxIterator first, BoxIterator last, batch_results& results,
+                                    TaskPool& pool) const {
+  std::vector<BoundingBox> boxes(first, last);
+  results.resize(boxes.size());
+  for (std::vector<InputIterator>& found : results) {
+    found.clear();
+  }
+
+  // A few pieces per thread, so that one slow piece doesn't hold up the rest
+  std::size_t pieces = std::max<std::size_t>(1, std::min((pool.size() + 1) * 4,
+                                                         boxes.size() / parallel_batch_cutoff));
+  TaskGroup group(pool);
+  for (std::size_t piece = 0; piece < pieces; ++piece) {
+    std::size_t begin = boxes.size() * piece / pieces;
+    std::size_t end = boxes.size() * (piece + 1) / pieces;
+    const std::vector<BoundingBox>* shared = &boxes;
+    batch_results* output = &results;
+    group.run([this, shared, begin, end, output]() {
+      search_batch(*shared, begin, end, *output);
+    });
+  }
+  group.wait();
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::search_batch(const std::vector<BoundingBox>& boxes,
+                                     std::size_t first, std::size_t last,
+                                     batch_results& results) const {
+  if (nodes_.empty() || first == last) {
+    return;
+  }
+  std::vector<std::size_t> active;
+  for (std::size_t box = first; box < last; ++box) {
+    active.push_back(box);
+  }
+  search_batch_node(boxes, active, 0, active.size(), results, 0);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+void POINTERLESSOCTREE::search_batch_node(const std::vector<BoundingBox>& boxes,
+                                          std::vector<std::size_t>& active,
+                                          std::size_t first, std::size_t last,
+                                          batch_results& results, std::size_t node) const {
+  // The same decisions search_node() makes, for each box in turn
+  const Node& n = nodes_[node];
+  std::size_t begin = active.size();
+  for (std::size_t i = first; i < last; ++i) {
+    std::size_t box = active[i];
+    if (!boxes[box].intersects(n.extrema_)) {
+      continue;
+    }
+    if (boxes[box].contains(n.extrema_)) {
+      results[box].insert(results[box].end(), values_.begin() + n.points_first_,
+                          values_.begin() + n.points_last_);
+    } else {
+      active.push_back(box);
+    }
+  }
+  std::size_t end = active.size();
+
+  if (begin == end) {
+    return;
+  } else if (n.type_ == NodeContents::INTERNAL) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      search_batch_node(boxes, active, begin, end, results, child);
+    }
+  } else {
+    for (std::size_t i = begin; i < end; ++i) {
+      auto out = std::back_inserter(results[active[i]]);
+      leaf_contained(boxes[active[i]], n, out, is_quantized());
+    }
+  }
+  active.resize(begin);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::radiusSearch(const Point3d& centre, double radius, OutputIterator& out) const {
+  NoQueryStats stats;
+  return !nodes_.empty() && radius >= 0 && radius_search_node(centre, radius * radius, out, 0, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::radiusSearch(const Point3d& centre, double radius, OutputIterator& out,
+                                     QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return !nodes_.empty() && radius >= 0 &&
+         radius_search_node(centre, radius * radius, counted, 0, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool POINTERLESSOCTREE::radius_search_node(const Point3d& centre, double radiusSquared,
+                                           OutputIterator& out, std::size_t node,
+                                           Stats& stats) const {
+  const Node& n = nodes_[node];
+  stats.visit();
+  if (!(n.extrema_.distanceSquared(centre) <= radiusSquared)) {
+    stats.prune();
+    return false;
+  } else if (n.extrema_.maxDistanceSquared(centre) <= radiusSquared) {
+    return emitAll(values_.data() + n.points_first_, n.points_last_ - n.points_first_, out);
+  }
+
+  bool success = false;
+  if (n.type_ == NodeContents::INTERNAL) {
+    for (std::size_t child = n.first_; child < n.last_; ++child) {
+      success |= radius_search_node(centre, radiusSquared, out, child, stats);
+    }
+  } else {
+    stats.test(n.last_ - n.first_);
+    success = leaf_within(centre, radiusSquared, n, out, is_quantized());
+  }
+  return success;
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::knn(const Point3d& p, std::size_t k, OutputIterator& out) const {
+  NoQueryStats stats;
+  return find_nearest(p, k, out, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::knn(const Point3d& p, std::size_t k, OutputIterator& out,
+                            QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return find_nearest(p, k, counted, stats);
+}
+
+// Nodes still queued once nothing in them could be nearer count as pruned
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool POINTERLESSOCTREE::find_nearest(const Point3d& p, std::size_t k, OutputIterator& out,
+                                     Stats& stats) const {
+  NearestSet<InputIterator> nearest(k);
+  NearestQueue<std::size_t> pending;
+  if (!nodes_.empty()) {
+    stats.visit();
+    pending.push(std::make_pair(nodes_[0].extrema_.distanceSquared(p), std::size_t(0)));
+  }
+  while (!pending.empty() && pending.top().first < nearest.bound()) {
+    const Node& n = nodes_[pending.top().second];
+    pending.pop();
     if (n.type_ == NodeContents::INTERNAL) {
-      index_type next_index = current_index << 3;
-      for (unsigned char octant = 0; octant < 8; ++octant) {
-        index_type child_index = next_index | index_type(octant);
-        if (nodes_.find(child_index) != nodes_.end() && child_index != index_type(0)) {
-          success |= search(b, out, child_index);
+      for (std::size_t child = n.first_; child < n.last_; ++child) {
+        stats.visit();
+        double distance = nodes_[child].extrema_.distanceSquared(p);
+        if (distance < nearest.bound()) {
+          pending.push(std::make_pair(distance, child));
+        } else {
+          stats.prune();
         }
       }
     } else {
-      for (auto value : n.values_.leafValue_) {
-        if (b.contains(std::get<1>(value))) {
-          *out = std::get<0>(value);
-          ++out;
-          success = true;
+      stats.test(n.last_ - n.first_);
+      leaf_nearest(p, n, nearest, is_quantized());
+    }
+  }
+  stats.prune(pending.size());
+  return nearest.emit(out);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::raycast(const Ray& ray, double radius, OutputIterator& out) const {
+  NoQueryStats stats;
+  return find_hits(ray, radius, values_.size(), out, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::raycast(const Ray& ray, double radius, OutputIterator& out,
+                                QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return find_hits(ray, radius, values_.size(), counted, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::firstHits(const Ray& ray, double radius, std::size_t k,
+                                  OutputIterator& out) const {
+  NoQueryStats stats;
+  return find_hits(ray, radius, k, out, stats);
+}
+
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator>
+bool POINTERLESSOCTREE::firstHits(const Ray& ray, double radius, std::size_t k,
+                                  OutputIterator& out, QueryStats& stats) const {
+  CountingOutput<OutputIterator> counted(out, stats);
+  return find_hits(ray, radius, k, counted, stats);
+}
+
+// The same best first walk as find_nearest(), keyed on where the ray enters
+// each node
+template <POINTERLESS_OCTREE_TEMPLATE>
+template <typename OutputIterator, typename Stats>
+bool POINTERLESSOCTREE::find_hits(const Ray& ray, double radius, std::size_t k,
+                                  OutputIterator& out, Stats& stats) const {
+  NearestSet<InputIterator> hits(k);
+  NearestQueue<std::size_t> pending;
+  double enter, leave;
+  if (!nodes_.empty() && radius >= 0 && ray.valid()) {
+    stats.visit();
+    if (ray.clip(nodes_[0].extrema_.grown(radius), enter, leave)) {
+      pending.push(std::make_pair(enter, std::size_t(0)));
+    } else {
+      stats.prune();
+    }
+  }
+  while (!pending.empty() && pending.top().first < hits.bound()) {
+    const Node& n = nodes_[pending.top().second];
+    pending.pop();
+    if (n.type_ == NodeContents::INTERNAL) {
+      for (std::size_t child = n.first_; child < n.last_; ++child) {
+        stats.visit();
+        if (ray.clip(nodes_[child].extrema_.grown(radius), enter, leave) &&
+            enter < hits.bound()) {
+          pending.push(std::make_pair(enter, child));
+        } else {
+          stats.prune();
         }
       }
+    } else {
+      stats.test(n.last_ - n.first_);
+      leaf_hits(ray, radius * radius, n, hits, is_quantized());
     }
   }
-  return success;
+  stats.prune(pending.size());
+  return hits.emit(out);
 }
 
 #endif // defined POINTERLESS_OCTREE_CPU_H
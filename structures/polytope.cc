@@ -0,0 +1,179 @@
+#include "polytope.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+double dot(const Point3d& a, const Point3d& b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Point3d cross(const Point3d& a, const Point3d& b) {
+  return Point3d{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+Point3d scaled(const Point3d& a, double s) {
+  return Point3d{a.x * s, a.y * s, a.z * s};
+}
+
+Point3d sum(const Point3d& a, const Point3d& b) {
+  return Point3d{a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+Point3d normalised(const Point3d& a) {
+  return scaled(a, 1 / std::sqrt(dot(a, a)));
+}
+
+// One axis of the corners of a box nearest and furthest along a normal,
+// projected onto the normal. Taking both products and keeping the smaller or
+// larger gives the same values as picking the corner, without branching.
+double nearest(double normal, double low, double high) {
+  return std::min(normal * low, normal * high);
+}
+
+double furthest(double normal, double low, double high) {
+  return std::max(normal * low, normal * high);
+}
+
+// Everything, the bounds of a polytope that is only known by its planes
+const BoundingBox everywhere = {
+  { -limits::infinity(), -limits::infinity(), -limits::infinity() },
+  { limits::infinity(), limits::infinity(), limits::infinity() }
+};
+
+}  // namespace
+
+const std::size_t ConvexPolytope::max_planes;
+
+Plane Plane::through(const Point3d& p, const Point3d& normal) {
+  return Plane{normal, dot(normal, p)};
+}
+
+std::ostream& operator<<(std::ostream& out, const Plane& rhs) {
+  return out << "Plane{" << rhs.normal_ << ", " << rhs.offset_ << "}";
+}
+
+ConvexPolytope::ConvexPolytope() : bounds_(everywhere) { }
+
+ConvexPolytope::ConvexPolytope(const std::vector<Plane>& planes)
+  : planes_(planes), bounds_(everywhere) { }
+
+ConvexPolytope::ConvexPolytope(const BoundingBox& box)
+  : planes_{
+      Plane{{-1, 0, 0}, -box.mins_.x}, Plane{{1, 0, 0}, box.maxes_.x},
+      Plane{{0, -1, 0}, -box.mins_.y}, Plane{{0, 1, 0}, box.maxes_.y},
+      Plane{{0, 0, -1}, -box.mins_.z}, Plane{{0, 0, 1}, box.maxes_.z}
+    },
+    bounds_(box) { }
+
+// Each side plane passes through eye and is tilted back from forward by the
+// half angle of the view on its axis. The bounds are those of the corners of
+// the near and far faces, pushed out a little further than the planes could
+// have been rounded, so that no point the planes let in falls outside them.
+ConvexPolytope ConvexPolytope::frustum(const Point3d& eye, const Point3d& forward,
+                                       const Point3d& up, double fovY, double aspect,
+                                       double nearDistance, double farDistance) {
+  Point3d f = normalised(forward);
+  Point3d right = normalised(cross(f, up));
+  Point3d u = cross(right, f);
+  double tanY = std::tan(fovY / 2);
+  double tanX = tanY * aspect;
+
+  Point3d behind = scaled(f, -1);
+  Point3d left = normalised(sum(scaled(right, -1), scaled(f, -tanX)));
+  Point3d rightSide = normalised(sum(right, scaled(f, -tanX)));
+  Point3d bottom = normalised(sum(scaled(u, -1), scaled(f, -tanY)));
+  Point3d top = normalised(sum(u, scaled(f, -tanY)));
+  ConvexPolytope frustum(std::vector<Plane>{
+    Plane::through(eye, left),
+    Plane::through(eye, rightSide),
+    Plane::through(eye, bottom),
+    Plane::through(eye, top),
+    Plane::through(sum(eye, scaled(f, nearDistance)), behind),
+    Plane::through(sum(eye, scaled(f, farDistance)), f)
+  });
+
+  BoundingBox bounds = initialBox;
+  double magnitude = 0;
+  for (double distance : {nearDistance, farDistance}) {
+    Point3d centre = sum(eye, scaled(f, distance));
+    for (double across : {-tanX * distance, tanX * distance}) {
+      for (double upward : {-tanY * distance, tanY * distance}) {
+        Point3d corner = sum(centre, sum(scaled(right, across), scaled(u, upward)));
+        bounds.mins_ = Point3d{std::min(bounds.mins_.x, corner.x),
+                               std::min(bounds.mins_.y, corner.y),
+                               std::min(bounds.mins_.z, corner.z)};
+        bounds.maxes_ = Point3d{std::max(bounds.maxes_.x, corner.x),
+                                std::max(bounds.maxes_.y, corner.y),
+                                std::max(bounds.maxes_.z, corner.z)};
+        magnitude = std::max(magnitude, std::fabs(corner.x) + std::fabs(corner.y) +
+                                        std::fabs(corner.z) + distance);
+      }
+    }
+  }
+  // NaN when the frustum is invalid, which leaves the bounds NaN as well
+  frustum.bounds_ = bounds.grown(1e-9 * magnitude);
+  return frustum;
+}
+
+bool ConvexPolytope::valid() const {
+  if (planes_.size() > max_planes) {
+    return false;
+  }
+  for (const Plane& plane : planes_) {
+    const Point3d& n = plane.normal_;
+    if (!std::isfinite(n.x) || !std::isfinite(n.y) || !std::isfinite(n.z) ||
+        !std::isfinite(plane.offset_) || (n.x == 0 && n.y == 0 && n.z == 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::uint64_t ConvexPolytope::allPlanes() const {
+  return lowBits(planes_.size());
+}
+
+bool ConvexPolytope::contains(const Point3d& p) const {
+  for (const Plane& plane : planes_) {
+    if (!plane.contains(p)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Containment ConvexPolytope::classify(const BoundingBox& box, std::uint64_t& active) const {
+  if (!bounds_.intersects(box)) {
+    return Containment::OUTSIDE;
+  }
+  for (std::uint64_t remaining = active; remaining; remaining &= remaining - 1) {
+    std::size_t i = lowestSetBit(remaining);
+    const Plane& plane = planes_[i];
+    const Point3d& n = plane.normal_;
+    double low = nearest(n.x, box.mins_.x, box.maxes_.x) +
+                 nearest(n.y, box.mins_.y, box.maxes_.y) +
+                 nearest(n.z, box.mins_.z, box.maxes_.z);
+    if (!(low <= plane.offset_)) {
+      return Containment::OUTSIDE;
+    }
+    double high = furthest(n.x, box.mins_.x, box.maxes_.x) +
+                  furthest(n.y, box.mins_.y, box.maxes_.y) +
+                  furthest(n.z, box.mins_.z, box.maxes_.z);
+    if (high <= plane.offset_) {
+      active &= ~(std::uint64_t(1) << i);
+    }
+  }
+  return active ? Containment::INTERSECTS : Containment::INSIDE;
+}
+
+std::ostream& operator<<(std::ostream& out, const ConvexPolytope& rhs) {
+  out << "ConvexPolytope{";
+  for (std::size_t i = 0; i < rhs.planes_.size(); ++i) {
+    out << (i ? ", " : "") << rhs.planes_[i];
+  }
+  return out << "}";
+}
@@ -0,0 +1,136 @@
+/*
+    file - polytope.h
+
+    Convex polytopes, such as camera view frustums, for culling queries.
+
+    A ConvexPolytope is the intersection of half-spaces, each a Plane that
+    keeps the points on the side its normal points away from. The trees
+    classify each node's extrema against the planes as outside the polytope,
+    inside it or in between: subtrees outside are skipped, subtrees inside
+    are emitted whole, and only the points of leaves in between are tested.
+
+    A box entirely inside one plane stays inside it for the whole subtree, so
+    each node passes its children a bit mask of just the planes its box
+    straddles, and the leaves test their points against those alone. Deep
+    in the tree that is usually one or two planes out of six.
+
+    A box outside no single plane is never called outside, even where the
+    planes cut it off between them near a corner of the polytope, so a few
+    more leaves are tested than strictly need to be. The answers are exact
+    either way. Most nodes a query looks at are outside it, so boxes are
+    first compared with a box around the polytope where one is known, which
+    is much cheaper than going through the planes.
+
+ */
+
+#ifndef POLYTOPE_H
+#define POLYTOPE_H
+
+#include "boundingbox.h"
+#include "leaf_kernel.h"
+#include "point3d.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// The half-space of points p with normal_ . p <= offset_
+struct Plane {
+  // The plane through p, facing out of the half-space along normal
+  static Plane through(const Point3d& p, const Point3d& normal);
+
+  bool contains(const Point3d& p) const;
+
+  Point3d normal_;
+  double offset_;
+};
+
+std::ostream& operator<<(std::ostream& out, const Plane& rhs);
+
+// Where a box lies against a polytope
+enum class Containment : char {
+  OUTSIDE,
+  INTERSECTS,
+  INSIDE
+};
+
+struct ConvexPolytope {
+  // The most planes a polytope can have, one per bit of a plane mask
+  static const std::size_t max_planes = 64;
+
+  // No planes, holding everything
+  ConvexPolytope();
+
+  // bounds_ holds everything, as nothing is known about where planes meet
+  explicit ConvexPolytope(const std::vector<Plane>& planes);
+
+  // The six faces of box
+  explicit ConvexPolytope(const BoundingBox& box);
+
+  // What a camera at eye looking along forward sees between the near and far
+  // distances. fovY is the full vertical field of view in radians, and
+  // aspect the width of the view over its height. up need only not be
+  // parallel to forward. The planes are left, right, bottom, top, near, far.
+  static ConvexPolytope frustum(const Point3d& eye, const Point3d& forward, const Point3d& up,
+                                double fovY, double aspect, double nearDistance,
+                                double farDistance);
+
+  // Whether there are at most max_planes planes, each finite with a normal
+  // of some length. Queries with an invalid polytope find nothing.
+  bool valid() const;
+
+  // A mask with a bit set for every plane
+  std::uint64_t allPlanes() const;
+
+  bool contains(const Point3d& p) const;
+
+  // Where box lies against the planes whose bits are set in active. The
+  // bits of planes box is entirely inside are cleared, so that active holds
+  // what the parts of box still need testing against.
+  Containment classify(const BoundingBox& box, std::uint64_t& active) const;
+
+  std::vector<Plane> planes_;
+  // A box holding the polytope, which must be grown to match if planes_ is
+  // changed to take in more
+  BoundingBox bounds_;
+};
+
+std::ostream& operator<<(std::ostream& out, const ConvexPolytope& rhs);
+
+// Run once per point, so inline
+inline bool Plane::contains(const Point3d& p) const {
+  return normal_.x * p.x + normal_.y * p.y + normal_.z * p.z <= offset_;
+}
+
+// Which of count points (at most 64) are inside every plane of polytope
+// whose bit is set in active
+template <typename Scalar>
+std::uint64_t insideBlock(const ConvexPolytope& polytope, std::uint64_t active,
+                          const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                          std::size_t count) {
+  std::uint64_t mask = lowBits(count);
+  for (; active && mask; active &= active - 1) {
+    const Plane& plane = polytope.planes_[lowestSetBit(active)];
+    mask &= belowPlaneBlock(plane.normal_, plane.offset_, xs, ys, zs, count);
+  }
+  return mask;
+}
+
+// Writes values[i] to out for every point i inside the planes of polytope
+// set in active, in order, and reports whether there were any
+template <typename Scalar, typename Value, typename OutputIterator>
+bool emitInside(const ConvexPolytope& polytope, std::uint64_t active,
+                const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                const Value* values, std::size_t n, OutputIterator& out) {
+  bool success = false;
+  for (std::size_t block = 0; block < n; block += 64) {
+    std::size_t count = n - block < 64 ? n - block : 64;
+    std::uint64_t mask = insideBlock(polytope, active, xs + block, ys + block, zs + block, count);
+    success |= mask != 0;
+    emitMask(mask, values + block, out);
+  }
+  return success;
+}
+
+#endif // defined POLYTOPE_H
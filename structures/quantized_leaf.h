@@ -0,0 +1,491 @@
+/*
+    file - quantized_leaf.h
+
+    Compressed leaves: every coordinate of a leaf is stored as a bits wide
+    code for where it sits between the leaf's extrema on that axis, instead
+    of as a float or double. A 16 bit code is a quarter of a double.
+
+    Codes are worked out by a monotonic mapping, so a coordinate whose code
+    is above the code of a box's edge is above the edge itself, and one whose
+    code is below it is below it. Only points whose code equals an edge's
+    code can go either way, and only those are looked up exactly, through the
+    exact(i) functor the tree passes in. Sphere and nearest neighbour tests
+    bound each point by its decoded position, give or take one step, and look
+    up the points whose bounds straddle the radius or the current nearest
+    distance. Ray tests look up every point whose decoded position is within
+    the radius of the ray, give or take one step, and polytope tests the
+    points whose decoded position could be either side of a plane. Joins look
+    up each point of one leaf that could be close enough to the other, and
+    test it against the other's codes as a sphere. Every test answers exactly
+    what a double tree would.
+
+    Points have to be finite, as they do for the rest of PointerlessOctree.
+
+ */
+
+#ifndef QUANTIZED_LEAF_H
+#define QUANTIZED_LEAF_H
+
+#include "boundingbox.h"
+#include "leaf_kernel.h"
+#include "nearest.h"
+#include "polytope.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+// Pass as PointerlessOctree's Scalar to store leaves as bits wide codes
+template <unsigned bits>
+struct Quantized {
+  static_assert(bits >= 1 && bits <= 32, "quantized codes are 1 to 32 bits wide");
+
+  static const unsigned width = bits;
+
+  using code_type = typename std::conditional<bits <= 8, std::uint8_t,
+                    typename std::conditional<bits <= 16, std::uint16_t, std::uint32_t>::type>::type;
+
+  static const std::uint32_t max_code = static_cast<std::uint32_t>((std::uint64_t(1) << bits) - 1);
+};
+
+template <unsigned bits>
+const unsigned Quantized<bits>::width;
+
+template <unsigned bits>
+const std::uint32_t Quantized<bits>::max_code;
+
+// What a tree storing Scalar coordinates keeps in its leaves (stored_type),
+// and what it reads points as while building (build_type)
+template <typename Scalar>
+struct LeafCoordinates {
+  using stored_type = Scalar;
+  using build_type = Scalar;
+  static const bool quantized = false;
+};
+
+template <unsigned bits>
+struct LeafCoordinates<Quantized<bits>> {
+  using stored_type = typename Quantized<bits>::code_type;
+  using build_type = double;
+  static const bool quantized = true;
+};
+
+// The codes along one axis of one leaf, spreading [low, high] over
+// 0..max_code. A leaf whose extent is too small or too large to divide up
+// codes everything as 0 and reports an error as wide as the leaf.
+template <unsigned bits>
+class QuantizedAxis {
+ public:
+  using code_type = typename Quantized<bits>::code_type;
+
+  QuantizedAxis(double low, double high);
+
+  code_type code(double v) const;
+
+  // Where a code stands, within error() of every coordinate given that code
+  double decode(code_type c) const;
+  double error() const;
+
+  // Bounds on the codes of coordinates at or above v, and at or below v:
+  // codes strictly above lowerLimit(v) are strictly above v, codes below it
+  // are below v, and the limit itself is undecided. Limits beyond the leaf
+  // decide everything.
+  std::int64_t lowerLimit(double v) const;
+  std::int64_t upperLimit(double v) const;
+
+ private:
+  double low_;
+  double high_;
+  double scale_;
+  double step_;
+  double error_;
+};
+
+template <unsigned bits>
+QuantizedAxis<bits>::QuantizedAxis(double low, double high)
+  : low_(low), high_(high), scale_(0), step_(0), error_(high - low) {
+  double span = high - low;
+  double scale = Quantized<bits>::max_code / span;
+  if (span > 0 && std::isfinite(span) && std::isfinite(scale)) {
+    scale_ = scale;
+    step_ = span / Quantized<bits>::max_code;
+    // Half a step from rounding to the nearest code, and as much again to
+    // cover rounding in working it out
+    const double epsilon = std::numeric_limits<double>::epsilon();
+    error_ = step_ + 4 * epsilon * (std::fabs(low) + std::fabs(high));
+  }
+}
+
+// Each step (subtract, scale, round, clamp) never reverses the order of two
+// coordinates, which is what makes comparing codes safe
+template <unsigned bits>
+typename QuantizedAxis<bits>::code_type QuantizedAxis<bits>::code(double v) const {
+  double offset = (v - low_) * scale_;
+  if (!(offset > 0)) {
+    return 0;
+  } else if (offset >= Quantized<bits>::max_code) {
+    return static_cast<code_type>(Quantized<bits>::max_code);
+  }
+  return static_cast<code_type>(offset + 0.5);
+}
+
+template <unsigned bits>
+double QuantizedAxis<bits>::decode(code_type c) const {
+  return scale_ > 0 ? low_ + c * step_ : low_;
+}
+
+template <unsigned bits>
+double QuantizedAxis<bits>::error() const {
+  return error_;
+}
+
+template <unsigned bits>
+std::int64_t QuantizedAxis<bits>::lowerLimit(double v) const {
+  return v <= low_ ? -1 : static_cast<std::int64_t>(code(v));
+}
+
+template <unsigned bits>
+std::int64_t QuantizedAxis<bits>::upperLimit(double v) const {
+  return v >= high_ ? static_cast<std::int64_t>(Quantized<bits>::max_code) + 1
+                    : static_cast<std::int64_t>(code(v));
+}
+
+// Codes the n points of a leaf with the given extrema
+template <unsigned bits>
+void quantizeLeaf(const BoundingBox& leaf, const double* xs, const double* ys, const double* zs,
+                  std::size_t n, typename Quantized<bits>::code_type* codeXs,
+                  typename Quantized<bits>::code_type* codeYs,
+                  typename Quantized<bits>::code_type* codeZs) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  for (std::size_t i = 0; i < n; ++i) {
+    codeXs[i] = x.code(xs[i]);
+    codeYs[i] = y.code(ys[i]);
+    codeZs[i] = z.code(zs[i]);
+  }
+}
+
+// Writes, in order, the values of the leaf's points that are in box
+template <unsigned bits, typename Value, typename Exact, typename OutputIterator>
+bool emitContainedQuantized(const BoundingBox& box, const BoundingBox& leaf,
+                            const typename Quantized<bits>::code_type* xs,
+                            const typename Quantized<bits>::code_type* ys,
+                            const typename Quantized<bits>::code_type* zs,
+                            const Value* values, std::size_t n, Exact exact, OutputIterator& out) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  const std::int64_t lowX = x.lowerLimit(box.mins_.x), highX = x.upperLimit(box.maxes_.x);
+  const std::int64_t lowY = y.lowerLimit(box.mins_.y), highY = y.upperLimit(box.maxes_.y);
+  const std::int64_t lowZ = z.lowerLimit(box.mins_.z), highZ = z.upperLimit(box.maxes_.z);
+
+  bool success = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    const std::int64_t cx = xs[i], cy = ys[i], cz = zs[i];
+    if (cx < lowX || cx > highX || cy < lowY || cy > highY || cz < lowZ || cz > highZ) {
+      continue;
+    }
+    bool inside = cx != lowX && cx != highX && cy != lowY && cy != highY &&
+                  cz != lowZ && cz != highZ;
+    if (inside || box.contains(exact(i))) {
+      *out = values[i];
+      ++out;
+      success = true;
+    }
+  }
+  return success;
+}
+
+// Bit i is set for each of the first n (at most 64) of the leaf's points in
+// box, like containsBlock()
+template <unsigned bits, typename Exact>
+std::uint64_t containsBlockQuantized(const BoundingBox& box, const BoundingBox& leaf,
+                                     const typename Quantized<bits>::code_type* xs,
+                                     const typename Quantized<bits>::code_type* ys,
+                                     const typename Quantized<bits>::code_type* zs,
+                                     std::size_t n, Exact exact) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  const std::int64_t lowX = x.lowerLimit(box.mins_.x), highX = x.upperLimit(box.maxes_.x);
+  const std::int64_t lowY = y.lowerLimit(box.mins_.y), highY = y.upperLimit(box.maxes_.y);
+  const std::int64_t lowZ = z.lowerLimit(box.mins_.z), highZ = z.upperLimit(box.maxes_.z);
+
+  std::uint64_t mask = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const std::int64_t cx = xs[i], cy = ys[i], cz = zs[i];
+    if (cx < lowX || cx > highX || cy < lowY || cy > highY || cz < lowZ || cz > highZ) {
+      continue;
+    }
+    bool inside = cx != lowX && cx != highX && cy != lowY && cy != highY &&
+                  cz != lowZ && cz != highZ;
+    if (inside || box.contains(exact(i))) {
+      mask |= std::uint64_t(1) << i;
+    }
+  }
+  return mask;
+}
+
+// Calls visitor(values[i], exact(i)) for the leaf's points in box, in order,
+// until it returns Visit::STOP, and reports whether it did
+template <unsigned bits, typename Value, typename Exact, typename Visitor>
+bool visitContainedQuantized(const BoundingBox& box, const BoundingBox& leaf,
+                             const typename Quantized<bits>::code_type* xs,
+                             const typename Quantized<bits>::code_type* ys,
+                             const typename Quantized<bits>::code_type* zs,
+                             const Value* values, std::size_t n, Exact exact, Visitor& visitor) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  const std::int64_t lowX = x.lowerLimit(box.mins_.x), highX = x.upperLimit(box.maxes_.x);
+  const std::int64_t lowY = y.lowerLimit(box.mins_.y), highY = y.upperLimit(box.maxes_.y);
+  const std::int64_t lowZ = z.lowerLimit(box.mins_.z), highZ = z.upperLimit(box.maxes_.z);
+
+  for (std::size_t i = 0; i < n; ++i) {
+    const std::int64_t cx = xs[i], cy = ys[i], cz = zs[i];
+    if (cx < lowX || cx > highX || cy < lowY || cy > highY || cz < lowZ || cz > highZ) {
+      continue;
+    }
+    bool inside = cx != lowX && cx != highX && cy != lowY && cy != highY &&
+                  cz != lowZ && cz != highZ;
+    Point3d p = exact(i);
+    if ((inside || box.contains(p)) && visitor(values[i], p) == Visit::STOP) {
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace quantized_detail {
+
+// How far from c, at least and at most, a coordinate decoded to decoded may be
+inline void axisDistance(double c, double decoded, double error, double& nearest, double& furthest) {
+  double d = std::fabs(decoded - c);
+  nearest = d > error ? d - error : 0;
+  furthest = d + error;
+}
+
+// Rounding slack on a squared distance summed from three decoded axes
+const double relativeSlack = 1e-12;
+
+}  // namespace quantized_detail
+
+// Writes, in order, the values of the leaf's points no further than
+// sqrt(radiusSquared) from centre
+template <unsigned bits, typename Value, typename Exact, typename OutputIterator>
+bool emitWithinQuantized(const Point3d& centre, double radiusSquared, const BoundingBox& leaf,
+                         const typename Quantized<bits>::code_type* xs,
+                         const typename Quantized<bits>::code_type* ys,
+                         const typename Quantized<bits>::code_type* zs,
+                         const Value* values, std::size_t n, Exact exact, OutputIterator& out) {
+  using quantized_detail::axisDistance;
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  const double inner = radiusSquared * (1 - quantized_detail::relativeSlack);
+  const double outer = radiusSquared * (1 + quantized_detail::relativeSlack);
+
+  bool success = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    double nearX, farX, nearY, farY, nearZ, farZ;
+    axisDistance(centre.x, x.decode(xs[i]), x.error(), nearX, farX);
+    axisDistance(centre.y, y.decode(ys[i]), y.error(), nearY, farY);
+    axisDistance(centre.z, z.decode(zs[i]), z.error(), nearZ, farZ);
+    if (nearX * nearX + nearY * nearY + nearZ * nearZ > outer) {
+      continue;
+    }
+    bool inside = farX * farX + farY * farY + farZ * farZ <= inner;
+    if (!inside) {
+      Point3d p = exact(i);
+      double dx = p.x - centre.x, dy = p.y - centre.y, dz = p.z - centre.z;
+      inside = dx * dx + dy * dy + dz * dz <= radiusSquared;
+    }
+    if (inside) {
+      *out = values[i];
+      ++out;
+      success = true;
+    }
+  }
+  return success;
+}
+
+// Writes (values[i], otherValues[j]) to out for every point i of one leaf
+// and point j of another no further apart than the square root of
+// radiusSquared. Points of the first leaf too far from the other leaf's
+// bounds, give or take a step, are passed over without being looked up.
+template <unsigned bits, typename Value, typename Exact, typename OtherExact,
+          typename OutputIterator>
+bool emitPairsWithinQuantized(double radiusSquared, const BoundingBox& leaf,
+                              const typename Quantized<bits>::code_type* xs,
+                              const typename Quantized<bits>::code_type* ys,
+                              const typename Quantized<bits>::code_type* zs,
+                              const Value* values, std::size_t n, Exact exact,
+                              const BoundingBox& otherLeaf,
+                              const typename Quantized<bits>::code_type* otherXs,
+                              const typename Quantized<bits>::code_type* otherYs,
+                              const typename Quantized<bits>::code_type* otherZs,
+                              const Value* otherValues, std::size_t otherN, OtherExact otherExact,
+                              OutputIterator& out) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  const double outer = radiusSquared * (1 + quantized_detail::relativeSlack);
+  // How far a coordinate decoded to v may be from [low, high], at least
+  auto gap = [](double v, double error, double low, double high) {
+    double d = std::max(std::max(low - v, v - high), 0.);
+    return d > error ? d - error : 0;
+  };
+
+  bool success = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    double gapX = gap(x.decode(xs[i]), x.error(), otherLeaf.mins_.x, otherLeaf.maxes_.x);
+    double gapY = gap(y.decode(ys[i]), y.error(), otherLeaf.mins_.y, otherLeaf.maxes_.y);
+    double gapZ = gap(z.decode(zs[i]), z.error(), otherLeaf.mins_.z, otherLeaf.maxes_.z);
+    if (gapX * gapX + gapY * gapY + gapZ * gapZ > outer) {
+      continue;
+    }
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    success |= emitWithinQuantized<bits>(exact(i), radiusSquared, otherLeaf, otherXs, otherYs,
+                                         otherZs, otherValues, otherN, otherExact, paired);
+  }
+  return success;
+}
+
+// The same for the pairs within one leaf, each once, the earlier point first
+template <unsigned bits, typename Value, typename Exact, typename OutputIterator>
+bool emitPairsWithinQuantized(double radiusSquared, const BoundingBox& leaf,
+                              const typename Quantized<bits>::code_type* xs,
+                              const typename Quantized<bits>::code_type* ys,
+                              const typename Quantized<bits>::code_type* zs,
+                              const Value* values, std::size_t n, Exact exact,
+                              OutputIterator& out) {
+  bool success = false;
+  for (std::size_t i = 0; i + 1 < n; ++i) {
+    PairedOutput<Value, OutputIterator> paired(values[i], out);
+    success |= emitWithinQuantized<bits>(
+        exact(i), radiusSquared, leaf, xs + i + 1, ys + i + 1, zs + i + 1, values + i + 1,
+        n - i - 1, [&](std::size_t j) -> Point3d { return exact(i + 1 + j); }, paired);
+  }
+  return success;
+}
+
+// Offers every one of the leaf's points that could be closer to p than the
+// set's bound, at its exact distance
+template <unsigned bits, typename Value, typename Exact>
+void offerNearestQuantized(const Point3d& p, const BoundingBox& leaf,
+                           const typename Quantized<bits>::code_type* xs,
+                           const typename Quantized<bits>::code_type* ys,
+                           const typename Quantized<bits>::code_type* zs,
+                           const Value* values, std::size_t n, Exact exact,
+                           NearestSet<Value>& nearest) {
+  using quantized_detail::axisDistance;
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+
+  double bound = nearest.bound();
+  for (std::size_t i = 0; i < n; ++i) {
+    double nearX, farX, nearY, farY, nearZ, farZ;
+    axisDistance(p.x, x.decode(xs[i]), x.error(), nearX, farX);
+    axisDistance(p.y, y.decode(ys[i]), y.error(), nearY, farY);
+    axisDistance(p.z, z.decode(zs[i]), z.error(), nearZ, farZ);
+    double least = (nearX * nearX + nearY * nearY + nearZ * nearZ) * (1 - quantized_detail::relativeSlack);
+    if (!(least < bound)) {
+      continue;
+    }
+    Point3d q = exact(i);
+    double dx = q.x - p.x, dy = q.y - p.y, dz = q.z - p.z;
+    double distanceSquared = dx * dx + dy * dy + dz * dz;
+    if (distanceSquared < bound) {
+      nearest.offer(distanceSquared, values[i]);
+      bound = nearest.bound();
+    }
+  }
+}
+
+// Writes, in order, the values of the leaf's points inside the planes of
+// polytope set in active. A point's decoded position is within one step of
+// it on every axis, which along a plane's normal is no more than the steps
+// weighted by the normal, so only points that close to a plane are looked up.
+template <unsigned bits, typename Value, typename Exact, typename OutputIterator>
+bool emitInsideQuantized(const ConvexPolytope& polytope, std::uint64_t active,
+                         const BoundingBox& leaf,
+                         const typename Quantized<bits>::code_type* xs,
+                         const typename Quantized<bits>::code_type* ys,
+                         const typename Quantized<bits>::code_type* zs,
+                         const Value* values, std::size_t n, Exact exact, OutputIterator& out) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+
+  bool success = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    Point3d decoded{x.decode(xs[i]), y.decode(ys[i]), z.decode(zs[i])};
+    bool inside = true, decided = true;
+    for (std::uint64_t planes = active; planes && inside; planes &= planes - 1) {
+      const Plane& plane = polytope.planes_[lowestSetBit(planes)];
+      const Point3d& normal = plane.normal_;
+      double along = normal.x * decoded.x + normal.y * decoded.y + normal.z * decoded.z;
+      double error = std::fabs(normal.x) * x.error() + std::fabs(normal.y) * y.error() +
+                     std::fabs(normal.z) * z.error() +
+                     (std::fabs(along) + std::fabs(plane.offset_)) * quantized_detail::relativeSlack;
+      if (along - error > plane.offset_) {
+        inside = false;
+      } else if (!(along + error <= plane.offset_)) {
+        decided = false;
+      }
+    }
+    if (inside && !decided) {
+      Point3d p = exact(i);
+      for (std::uint64_t planes = active; planes && inside; planes &= planes - 1) {
+        inside = polytope.planes_[lowestSetBit(planes)].contains(p);
+      }
+    }
+    if (inside) {
+      *out = values[i];
+      ++out;
+      success = true;
+    }
+  }
+  return success;
+}
+
+// Offers every one of the leaf's points within sqrt(radiusSquared) of ray,
+// at its exact distance along it. A point is never further than the length
+// of one step on every axis from its decoded position, so only points
+// decoded within the radius plus that of the ray are looked up.
+template <unsigned bits, typename Value, typename Exact>
+void offerAlongRayQuantized(const Ray& ray, double radiusSquared, const BoundingBox& leaf,
+                            const typename Quantized<bits>::code_type* xs,
+                            const typename Quantized<bits>::code_type* ys,
+                            const typename Quantized<bits>::code_type* zs,
+                            const Value* values, std::size_t n, Exact exact,
+                            NearestSet<Value>& hits) {
+  QuantizedAxis<bits> x(leaf.mins_.x, leaf.maxes_.x);
+  QuantizedAxis<bits> y(leaf.mins_.y, leaf.maxes_.y);
+  QuantizedAxis<bits> z(leaf.mins_.z, leaf.maxes_.z);
+  double error = std::sqrt(x.error() * x.error() + y.error() * y.error() + z.error() * z.error());
+  double reach = std::sqrt(radiusSquared) + error;
+  const double outer = reach * reach * (1 + quantized_detail::relativeSlack);
+
+  double bound = hits.bound();
+  for (std::size_t i = 0; i < n; ++i) {
+    Point3d decoded{x.decode(xs[i]), y.decode(ys[i]), z.decode(zs[i])};
+    if (ray.distanceSquared(decoded, ray.along(decoded)) > outer) {
+      continue;
+    }
+    Point3d p = exact(i);
+    double t = ray.along(p);
+    if (t < bound && ray.distanceSquared(p, t) <= radiusSquared) {
+      hits.offer(t, values[i]);
+      bound = hits.bound();
+    }
+  }
+}
+
+#endif // defined QUANTIZED_LEAF_H
@@ -0,0 +1,75 @@
+#include "ray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace {
+
+double inverse(double d) {
+  return d == 0 ? 0 : 1 / d;
+}
+
+// Narrows [enter, leave] to where the ray is between low and high on one
+// axis. An axis the ray doesn't move along keeps all of it or none.
+bool clipAxis(double origin, double direction, double inverse,
+              double low, double high, double& enter, double& leave) {
+  if (direction == 0) {
+    return low <= origin && origin <= high;
+  }
+  double near = (low - origin) * inverse;
+  double far = (high - origin) * inverse;
+  if (near > far) {
+    std::swap(near, far);
+  }
+  enter = std::max(enter, near);
+  leave = std::min(leave, far);
+  return true;
+}
+
+}  // namespace
+
+Ray::Ray(const Point3d& origin, const Point3d& direction, double length)
+  : origin_(origin), direction_{0, 0, 0}, length_(length), inverse_{0, 0, 0} {
+  double norm = std::sqrt(direction.x * direction.x + direction.y * direction.y +
+                          direction.z * direction.z);
+  if (norm > 0) {
+    direction_ = Point3d{direction.x / norm, direction.y / norm, direction.z / norm};
+    inverse_ = Point3d{inverse(direction_.x), inverse(direction_.y), inverse(direction_.z)};
+  } else if (!(norm == 0)) {
+    direction_ = direction;
+  }
+}
+
+Ray Ray::segment(const Point3d& from, const Point3d& to) {
+  Point3d direction{to.x - from.x, to.y - from.y, to.z - from.z};
+  double length = std::sqrt(direction.x * direction.x + direction.y * direction.y +
+                            direction.z * direction.z);
+  return Ray(from, direction, length);
+}
+
+bool Ray::valid() const {
+  return std::isfinite(origin_.x) && std::isfinite(origin_.y) && std::isfinite(origin_.z) &&
+         std::isfinite(direction_.x) && std::isfinite(direction_.y) &&
+         std::isfinite(direction_.z) && length_ >= 0;
+}
+
+bool Ray::clip(const BoundingBox& box, double& enter, double& leave) const {
+  double low = 0, high = length_;
+  if (!clipAxis(origin_.x, direction_.x, inverse_.x, box.mins_.x, box.maxes_.x, low, high) ||
+      !clipAxis(origin_.y, direction_.y, inverse_.y, box.mins_.y, box.maxes_.y, low, high) ||
+      !clipAxis(origin_.z, direction_.z, inverse_.z, box.mins_.z, box.maxes_.z, low, high)) {
+    return false;
+  }
+  // Also false if anything was NaN
+  if (!(low <= high)) {
+    return false;
+  }
+  enter = low;
+  leave = high;
+  return true;
+}
+
+std::ostream& operator<<(std::ostream& out, const Ray& rhs) {
+  return out << "Ray{" << rhs.origin_ << ", " << rhs.direction_ << ", " << rhs.length_ << "}";
+}
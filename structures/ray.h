@@ -0,0 +1,103 @@
+/*
+    file - ray.h
+
+    Rays and segments for line of sight and picking queries.
+
+    A Ray runs from origin_ along direction_, a unit vector, for length_,
+    which is infinite for a ray and finite for a segment. Positions along it
+    are distances from origin_. A value is hit when its point is no further
+    than some radius from the ray, so the ray sweeps out a capsule, and hits
+    are ordered by how far along the ray the point of it nearest them lies.
+
+    The trees walk only the nodes whose extrema, grown by the radius, the
+    ray passes through, found by clip()'s slab test, and take them best first
+    by where the ray enters them, so hits turn up roughly front to back and a
+    search for the first few can stop early. Hits are collected in a
+    NearestSet keyed on distance along the ray.
+
+ */
+
+#ifndef RAY_H
+#define RAY_H
+
+#include "boundingbox.h"
+#include "nearest.h"
+#include "point3d.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+
+struct Ray {
+  // A direction of zero length leaves a ray that stays at its origin
+  Ray(const Point3d& origin, const Point3d& direction,
+      double length = limits::infinity());
+
+  // The segment from one point to the other
+  static Ray segment(const Point3d& from, const Point3d& to);
+
+  // Whether origin_ and direction_ are finite and length_ isn't negative
+  // or NaN. Queries along an invalid ray find nothing.
+  bool valid() const;
+
+  // The point t along the ray
+  Point3d at(double t) const;
+
+  // How far along the ray the point of it nearest p lies, in [0, length_]
+  double along(const Point3d& p) const;
+
+  // Squared distance from p to the point t along the ray
+  double distanceSquared(const Point3d& p, double t) const;
+
+  // Where the ray enters and leaves box, clipped to [0, length_], by
+  // intersecting the slabs between each pair of faces. Touching a face
+  // counts. False if the ray misses the box.
+  bool clip(const BoundingBox& box, double& enter, double& leave) const;
+
+  Point3d origin_, direction_;
+  double length_;
+  // 1 / each component of direction_, for clip()
+  Point3d inverse_;
+};
+
+std::ostream& operator<<(std::ostream& out, const Ray& rhs);
+
+// along() and distanceSquared() run once per point, so are inline
+inline Point3d Ray::at(double t) const {
+  return Point3d{origin_.x + t * direction_.x,
+                 origin_.y + t * direction_.y,
+                 origin_.z + t * direction_.z};
+}
+
+inline double Ray::along(const Point3d& p) const {
+  double t = (p.x - origin_.x) * direction_.x +
+             (p.y - origin_.y) * direction_.y +
+             (p.z - origin_.z) * direction_.z;
+  return std::min(std::max(t, 0.), length_);
+}
+
+inline double Ray::distanceSquared(const Point3d& p, double t) const {
+  Point3d q = at(t);
+  double dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// Offers every one of n points no further than sqrt(radiusSquared) from ray
+// and nearer along it than the set's bound. The coordinates may be float or
+// double.
+template <typename Scalar, typename Value>
+void offerAlongRay(const Ray& ray, double radiusSquared,
+                   const Scalar* xs, const Scalar* ys, const Scalar* zs,
+                   const Value* values, std::size_t n, NearestSet<Value>& hits) {
+  double bound = hits.bound();
+  for (std::size_t i = 0; i < n; ++i) {
+    Point3d p{static_cast<double>(xs[i]), static_cast<double>(ys[i]), static_cast<double>(zs[i])};
+    double t = ray.along(p);
+    if (t < bound && ray.distanceSquared(p, t) <= radiusSquared) {
+      hits.offer(t, values[i]);
+      bound = hits.bound();
+    }
+  }
+}
+
+#endif // defined RAY_H
@@ -0,0 +1,28 @@
+#ifndef SEARCH_RANGE_H_DEFINED
+#define SEARCH_RANGE_H_DEFINED
+
+// The begin and end of a search whose iterators find their values as they
+// are advanced, so that a range-based for loop can walk it
+template <typename Iterator>
+class SearchRange {
+ public:
+  SearchRange(Iterator begin, Iterator end) : begin_(begin), end_(end) {}
+
+  Iterator begin() const {
+    return begin_;
+  }
+
+  Iterator end() const {
+    return end_;
+  }
+
+  bool empty() const {
+    return begin_ == end_;
+  }
+
+ private:
+  Iterator begin_;
+  Iterator end_;
+};
+
+#endif // defined SEARCH_RANGE_H_DEFINED
@@ -0,0 +1,241 @@
+/*
+    file - snapshot_tree.h
+
+    Hands out versions of a tree to threads that query it concurrently while
+    another thread publishes new ones.
+
+    A reader takes a Snapshot, which pins whichever version was current when
+    it was taken. Taking one costs an atomic increment and a load, and never
+    waits on a lock or on a publisher. publish() swaps the new version in
+    with one atomic exchange, so every snapshot taken afterwards sees it, and
+    then waits out the readers that could still be looking at the old
+    version before destroying it.
+
+    Readers count themselves on one of reader_slots counters, picked per
+    thread so that concurrent readers rarely share a cache line, and split
+    into two halves by the parity of the epoch they started in. publish()
+    waits for the half the epoch isn't in, flips the epoch, then waits for
+    the other half. Readers starting while it waits count in the half it
+    isn't waiting for, so a steady stream of them can't hold it up.
+
+    A thread mustn't publish while it holds a snapshot of the same tree,
+    since publish() would wait for that snapshot for ever.
+
+ */
+
+#ifndef SNAPSHOT_TREE_H
+#define SNAPSHOT_TREE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+
+namespace snapshot_detail {
+
+// Threads are numbered as they first take a snapshot, and read through the
+// slot their number picks
+inline std::size_t threadNumber() {
+  static std::atomic<std::size_t> next(0);
+  thread_local std::size_t number = next.fetch_add(1);
+  return number;
+}
+
+}  // namespace snapshot_detail
+
+template <typename Tree>
+class SnapshotTree {
+ public:
+  // Keeps one version of the tree alive for as long as it lives. Snapshots
+  // move but don't copy.
+  class Snapshot {
+   public:
+    Snapshot(Snapshot&& rhs);
+    Snapshot& operator=(Snapshot&& rhs);
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    ~Snapshot();
+
+    const Tree& operator*() const;
+    const Tree* operator->() const;
+    const Tree* get() const;
+
+   private:
+    friend class SnapshotTree;
+
+    Snapshot(std::atomic<std::size_t>* readers, const Tree* tree);
+
+    void release();
+
+    // The count this reader added itself to, null once moved from
+    std::atomic<std::size_t>* readers_;
+    const Tree* tree_;
+  };
+
+  // Starts out with an empty tree
+  SnapshotTree();
+
+  explicit SnapshotTree(std::unique_ptr<Tree> tree);
+
+  explicit SnapshotTree(Tree&& tree);
+
+  SnapshotTree(const SnapshotTree&) = delete;
+  SnapshotTree& operator=(const SnapshotTree&) = delete;
+
+  // Every snapshot has to have gone first
+  ~SnapshotTree();
+
+  Snapshot snapshot() const;
+
+  // Makes tree the current version, and destroys the one it replaces once
+  // every snapshot of that has gone. Publishers queue up behind each other;
+  // readers never wait for them.
+  void publish(std::unique_ptr<Tree> tree);
+
+  void publish(Tree&& tree);
+
+  static const std::size_t reader_slots = 64;
+
+ private:
+  // The readers counted in each half of a slot, alone on a cache line
+  struct alignas(64) ReaderSlot {
+    std::array<std::atomic<std::size_t>, 2> readers_;
+  };
+  static_assert(sizeof(ReaderSlot) == 64, "a ReaderSlot should fill one cache line");
+
+  // Spins until no reader is counted in that half of any slot
+  void wait_for_readers(std::size_t half) const;
+
+  // new only aligns to max_align_t before C++17, so the slots are placed at
+  // the first cache line boundary of a buffer one line longer than they are
+  std::unique_ptr<char[]> slotBuffer_;
+  ReaderSlot* slots_;
+  std::atomic<std::size_t> epoch_;
+  std::atomic<const Tree*> current_;
+  std::mutex publishMutex_;
+};
+
+// Every atomic is sequentially consistent. A reader adds itself to a count
+// before it loads current_, and a publisher exchanges current_ before it
+// reads the counts, so any reader the publisher doesn't see counted loads
+// the new version.
+
+template <typename Tree>
+SnapshotTree<Tree>::Snapshot::Snapshot(std::atomic<std::size_t>* readers, const Tree* tree)
+  : readers_(readers), tree_(tree) { }
+
+template <typename Tree>
+SnapshotTree<Tree>::Snapshot::Snapshot(Snapshot&& rhs)
+  : readers_(rhs.readers_), tree_(rhs.tree_) {
+  rhs.readers_ = nullptr;
+}
+
+template <typename Tree>
+typename SnapshotTree<Tree>::Snapshot& SnapshotTree<Tree>::Snapshot::operator=(Snapshot&& rhs) {
+  if (this != &rhs) {
+    release();
+    readers_ = rhs.readers_;
+    tree_ = rhs.tree_;
+    rhs.readers_ = nullptr;
+  }
+  return *this;
+}
+
+template <typename Tree>
+SnapshotTree<Tree>::Snapshot::~Snapshot() {
+  release();
+}
+
+template <typename Tree>
+void SnapshotTree<Tree>::Snapshot::release() {
+  if (readers_) {
+    readers_->fetch_sub(1);
+    readers_ = nullptr;
+  }
+}
+
+template <typename Tree>
+const Tree& SnapshotTree<Tree>::Snapshot::operator*() const {
+  return *tree_;
+}
+
+template <typename Tree>
+const Tree* SnapshotTree<Tree>::Snapshot::operator->() const {
+  return tree_;
+}
+
+template <typename Tree>
+const Tree* SnapshotTree<Tree>::Snapshot::get() const {
+  return tree_;
+}
+
+template <typename Tree>
+SnapshotTree<Tree>::SnapshotTree()
+  : SnapshotTree(std::unique_ptr<Tree>(new Tree())) { }
+
+// ReaderSlot() zeroes both counts
+template <typename Tree>
+SnapshotTree<Tree>::SnapshotTree(std::unique_ptr<Tree> tree)
+  : slotBuffer_(new char[sizeof(ReaderSlot) * (reader_slots + 1)]),
+    slots_(nullptr), epoch_(0), current_(tree.release()) {
+  std::uintptr_t address = reinterpret_cast<std::uintptr_t>(slotBuffer_.get());
+  std::uintptr_t aligned = (address + alignof(ReaderSlot) - 1) & ~(alignof(ReaderSlot) - 1);
+  slots_ = reinterpret_cast<ReaderSlot*>(aligned);
+  for (std::size_t i = 0; i < reader_slots; ++i) {
+    new (slots_ + i) ReaderSlot();
+  }
+}
+
+template <typename Tree>
+SnapshotTree<Tree>::SnapshotTree(Tree&& tree)
+  : SnapshotTree(std::unique_ptr<Tree>(new Tree(std::move(tree)))) { }
+
+template <typename Tree>
+SnapshotTree<Tree>::~SnapshotTree() {
+  delete current_.load();
+}
+
+template <typename Tree>
+typename SnapshotTree<Tree>::Snapshot SnapshotTree<Tree>::snapshot() const {
+  ReaderSlot& slot = slots_[snapshot_detail::threadNumber() % reader_slots];
+  std::atomic<std::size_t>* readers = &slot.readers_[epoch_.load() & 1];
+  readers->fetch_add(1);
+  return Snapshot(readers, current_.load());
+}
+
+// Readers in the half the epoch isn't in started before the last flip, and
+// may have loaded anything up to the old version. Readers in the current
+// half may have loaded the old version too, until the flip sends new ones
+// to the other half.
+template <typename Tree>
+void SnapshotTree<Tree>::publish(std::unique_ptr<Tree> tree) {
+  std::lock_guard<std::mutex> lock(publishMutex_);
+  std::unique_ptr<const Tree> old(current_.exchange(tree.release()));
+  std::size_t half = epoch_.load() & 1;
+  wait_for_readers(half ^ 1);
+  epoch_.fetch_add(1);
+  wait_for_readers(half);
+}
+
+template <typename Tree>
+void SnapshotTree<Tree>::publish(Tree&& tree) {
+  publish(std::unique_ptr<Tree>(new Tree(std::move(tree))));
+}
+
+template <typename Tree>
+void SnapshotTree<Tree>::wait_for_readers(std::size_t half) const {
+  for (std::size_t i = 0; i < reader_slots; ++i) {
+    while (slots_[i].readers_[half].load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+#endif // defined SNAPSHOT_TREE_H
@@ -0,0 +1,538 @@
+/*
+    file - streaming_build.h
+
+    Builds a tree file (see mapped_octree.h) from points streamed in one at
+    a time or a chunk at a time, without ever holding more than a set number
+    of them in memory. The tree comes out as PointerlessOctree would have
+    built it over the same points, so MappedOctree answers the same queries.
+
+    Points are spilled to a scratch file as they arrive. Building then
+    splits a set too big for memory into one scratch file per octant, as
+    the in-memory build would partition it, and carries on with each octant
+    in turn until a set fits; that set's subtree is built in memory. Nodes
+    are appended to one scratch file per level and points to one per array,
+    which leaves both in the order the tree file wants them, so finishing
+    is a matter of copying the scratch files into place. Every point is
+    written to disk once per level of splitting, plus twice more.
+
+ */
+
+#ifndef STREAMING_BUILD_H
+#define STREAMING_BUILD_H
+
+#include "boundingbox.h"
+#include "leaf_kernel.h"
+#include "mapped_octree.h"
+#include "point3d.h"
+#include "quantized_leaf.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace streaming_detail {
+
+// Records of type T written to a scratch file, a block at a time
+template <typename T>
+class SpillWriter {
+ public:
+  explicit SpillWriter(const std::string& path)
+    : out_(path.c_str(), std::ios::binary | std::ios::trunc) {
+    buffer_.reserve(block);
+  }
+
+  void push(const T& record) {
+    buffer_.push_back(record);
+    if (buffer_.size() == block) {
+      flush();
+    }
+  }
+
+  void push(const T* records, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      push(records[i]);
+    }
+  }
+
+  // Reports whether everything was written
+  bool close() {
+    flush();
+    out_.close();
+    return !out_.fail();
+  }
+
+ private:
+  static const std::size_t block = 64 * 1024 / sizeof(T) + 1;
+
+  void flush() {
+    out_.write(reinterpret_cast<const char*>(buffer_.data()),
+               static_cast<std::streamsize>(buffer_.size() * sizeof(T)));
+    buffer_.clear();
+  }
+
+  std::ofstream out_;
+  std::vector<T> buffer_;
+};
+
+// Reads back what a SpillWriter wrote, up to max records at a time
+template <typename T>
+std::size_t readSpill(std::ifstream& in, std::vector<T>& records, std::size_t max) {
+  records.resize(max);
+  in.read(reinterpret_cast<char*>(records.data()), static_cast<std::streamsize>(max * sizeof(T)));
+  records.resize(static_cast<std::size_t>(in.gcount()) / sizeof(T));
+  return records.size();
+}
+
+struct SpillPoint {
+  double x;
+  double y;
+  double z;
+  std::uint64_t index;
+};
+
+}  // namespace streaming_detail
+
+// Streams points into a tree file for a MappedOctree<..., Scalar>. The
+// structure follows PointerlessOctree<..., max_node_size, max_depth, Scalar>.
+// Values are the order points were added in, so the tree is opened over a
+// random access range holding the points in that order.
+template <typename Scalar = double, std::size_t max_node_size = 16, std::size_t max_depth = 21>
+class StreamingTreeBuilder {
+ public:
+  using stored_type = typename LeafCoordinates<Scalar>::stored_type;
+  using build_type = typename LeafCoordinates<Scalar>::build_type;
+
+  static const std::size_t default_memory_points = std::size_t(1) << 24;
+
+  // Scratch files are named scratch followed by a suffix of their own, and
+  // no more than memory_points points are held in memory at once
+  explicit StreamingTreeBuilder(const std::string& scratch,
+                                std::size_t memory_points = default_memory_points);
+
+  StreamingTreeBuilder(const StreamingTreeBuilder&) = delete;
+  StreamingTreeBuilder& operator=(const StreamingTreeBuilder&) = delete;
+
+  // Removes any scratch files left behind
+  ~StreamingTreeBuilder();
+
+  // Each point gets the next index, starting from 0
+  void add(const Point3d& p);
+
+  template <typename PointIterator>
+  void add(PointIterator first, PointIterator last);
+
+  std::size_t size() const;
+
+  // Builds the tree over every point added and writes it to path. Reports
+  // whether every file was written; the builder can't be used again.
+  bool finish(const std::string& path);
+
+ private:
+  using SpillPoint = streaming_detail::SpillPoint;
+  using is_quantized = std::integral_constant<bool, LeafCoordinates<Scalar>::quantized>;
+
+  std::string bucket_path(std::size_t depth, std::size_t octant) const;
+  std::string level_path(std::size_t depth) const;
+  std::string array_path(const char* name) const;
+
+  // Builds the subtree over the count points in bucket, which has been
+  // written and closed, then removes it
+  void build_bucket(const std::string& bucket, std::size_t count, const BoundingBox& extrema,
+                    std::size_t depth);
+
+  // Builds the subtree over points whose depth is depth, the way
+  // PointerlessOctree::init_nodes() builds a whole tree
+  void build_in_memory(std::vector<SpillPoint>& points, std::size_t depth);
+
+  void append_node(std::size_t depth, const TreeFileNode& node);
+
+  // Appends the points of one leaf with the given extrema
+  void append_points(const SpillPoint* points, std::size_t n, const BoundingBox& extrema);
+  void append_coordinates(const std::vector<build_type>& xs, const std::vector<build_type>& ys,
+                          const std::vector<build_type>& zs, const BoundingBox& extrema,
+                          std::false_type);
+  void append_coordinates(const std::vector<build_type>& xs, const std::vector<build_type>& ys,
+                          const std::vector<build_type>& zs, const BoundingBox& extrema,
+                          std::true_type);
+
+  // Copies the file at path to out, starting at offset, and removes it
+  bool copy_into(std::ofstream& out, std::uint64_t& written, std::uint64_t offset,
+                 const std::string& path);
+
+  std::string scratch_;
+  std::size_t memory_points_;
+  std::unique_ptr<streaming_detail::SpillWriter<SpillPoint>> input_;
+  BoundingBox extrema_;
+  std::size_t size_;
+  std::size_t depth_;
+  // Where the next leaf's points go
+  std::size_t points_written_;
+  // One per level, index 0 for the root
+  std::vector<std::unique_ptr<streaming_detail::SpillWriter<TreeFileNode>>> levels_;
+  std::vector<std::size_t> level_sizes_;
+  std::unique_ptr<streaming_detail::SpillWriter<stored_type>> xs_;
+  std::unique_ptr<streaming_detail::SpillWriter<stored_type>> ys_;
+  std::unique_ptr<streaming_detail::SpillWriter<stored_type>> zs_;
+  std::unique_ptr<streaming_detail::SpillWriter<std::uint64_t>> values_;
+  bool ok_;
+};
+
+#define STREAMING_BUILD_TEMPLATE typename Scalar, std::size_t max_node_size, std::size_t max_depth
+#define STREAMINGTREEBUILDER StreamingTreeBuilder<Scalar, max_node_size, max_depth>
+
+template <STREAMING_BUILD_TEMPLATE>
+const std::size_t STREAMINGTREEBUILDER::default_memory_points;
+
+template <STREAMING_BUILD_TEMPLATE>
+STREAMINGTREEBUILDER::StreamingTreeBuilder(const std::string& scratch, std::size_t memory_points)
+  : scratch_(scratch), memory_points_(std::max(memory_points, max_node_size)),
+    input_(new streaming_detail::SpillWriter<SpillPoint>(bucket_path(0, 0))),
+    extrema_(initialBox), size_(0), depth_(0), points_written_(0), ok_(true) { }
+
+template <STREAMING_BUILD_TEMPLATE>
+STREAMINGTREEBUILDER::~StreamingTreeBuilder() {
+  input_.reset();
+  levels_.clear();
+  xs_.reset();
+  ys_.reset();
+  zs_.reset();
+  values_.reset();
+  std::remove(bucket_path(0, 0).c_str());
+  for (std::size_t depth = 1; depth <= max_depth; ++depth) {
+    for (std::size_t octant = 0; octant < 8; ++octant) {
+      std::remove(bucket_path(depth, octant).c_str());
+    }
+    std::remove(level_path(depth).c_str());
+  }
+  for (const char* name : {"xs", "ys", "zs", "values"}) {
+    std::remove(array_path(name).c_str());
+  }
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+std::string STREAMINGTREEBUILDER::bucket_path(std::size_t depth, std::size_t octant) const {
+  return scratch_ + ".bucket" + std::to_string(depth) + "." + std::to_string(octant);
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+std::string STREAMINGTREEBUILDER::level_path(std::size_t depth) const {
+  return scratch_ + ".level" + std::to_string(depth);
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+std::string STREAMINGTREEBUILDER::array_path(const char* name) const {
+  return scratch_ + "." + name;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::add(const Point3d& point) {
+  Point3d p = toScalarPoint<build_type>(point);
+  input_->push(SpillPoint{p.x, p.y, p.z, size_});
+  extrema_.mins_.x = std::min(p.x, extrema_.mins_.x);
+  extrema_.mins_.y = std::min(p.y, extrema_.mins_.y);
+  extrema_.mins_.z = std::min(p.z, extrema_.mins_.z);
+  extrema_.maxes_.x = std::max(p.x, extrema_.maxes_.x);
+  extrema_.maxes_.y = std::max(p.y, extrema_.maxes_.y);
+  extrema_.maxes_.z = std::max(p.z, extrema_.maxes_.z);
+  ++size_;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+template <typename PointIterator>
+void STREAMINGTREEBUILDER::add(PointIterator first, PointIterator last) {
+  for (auto it = first; it != last; ++it) {
+    add(*it);
+  }
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+std::size_t STREAMINGTREEBUILDER::size() const {
+  return size_;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+bool STREAMINGTREEBUILDER::finish(const std::string& path) {
+  if (!input_) {
+    return false;
+  }
+  ok_ &= input_->close();
+  input_.reset();
+
+  levels_.resize(max_depth);
+  level_sizes_.assign(max_depth, 0);
+  xs_.reset(new streaming_detail::SpillWriter<stored_type>(array_path("xs")));
+  ys_.reset(new streaming_detail::SpillWriter<stored_type>(array_path("ys")));
+  zs_.reset(new streaming_detail::SpillWriter<stored_type>(array_path("zs")));
+  values_.reset(new streaming_detail::SpillWriter<std::uint64_t>(array_path("values")));
+  if (size_ > 0) {
+    build_bucket(bucket_path(0, 0), size_, extrema_, 1);
+  }
+  for (auto& level : levels_) {
+    if (level) {
+      ok_ &= level->close();
+    }
+  }
+  ok_ &= xs_->close() & ys_->close() & zs_->close() & values_->close();
+  levels_.clear();
+  xs_.reset();
+  ys_.reset();
+  zs_.reset();
+  values_.reset();
+
+  std::uint64_t nodes = 0;
+  for (std::size_t count : level_sizes_) {
+    nodes += count;
+  }
+  TreeFileHeader header = makeTreeFileHeader<Scalar>(nodes, size_, depth_);
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  std::uint64_t written = sizeof(header);
+
+  // Levels follow one another in key order. Children were stored as a
+  // count; every internal node's children follow those of the internal
+  // nodes before it, so a running total turns counts into positions.
+  static const char padding[64] = {};
+  out.write(padding, static_cast<std::streamsize>(header.nodes_ - written));
+  written = header.nodes_;
+  std::uint64_t next_child = 1;
+  std::vector<TreeFileNode> block;
+  for (std::size_t depth = 1; depth <= max_depth && level_sizes_[depth - 1] > 0; ++depth) {
+    std::ifstream in(level_path(depth).c_str(), std::ios::binary);
+    while (streaming_detail::readSpill(in, block, 4096) > 0) {
+      for (TreeFileNode& node : block) {
+        if (!node.leaf_) {
+          std::uint64_t children = node.first_;
+          node.first_ = next_child;
+          next_child += children;
+          node.last_ = next_child;
+        }
+      }
+      out.write(reinterpret_cast<const char*>(block.data()),
+                static_cast<std::streamsize>(block.size() * sizeof(TreeFileNode)));
+      written += block.size() * sizeof(TreeFileNode);
+    }
+    in.close();
+    std::remove(level_path(depth).c_str());
+  }
+
+  ok_ &= copy_into(out, written, header.xs_, array_path("xs"));
+  ok_ &= copy_into(out, written, header.ys_, array_path("ys"));
+  ok_ &= copy_into(out, written, header.zs_, array_path("zs"));
+  ok_ &= copy_into(out, written, header.values_, array_path("values"));
+  out.close();
+  return ok_ && !out.fail() && written == header.file_bytes_;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+bool STREAMINGTREEBUILDER::copy_into(std::ofstream& out, std::uint64_t& written, std::uint64_t offset,
+                                     const std::string& path) {
+  static const char padding[64] = {};
+  out.write(padding, static_cast<std::streamsize>(offset - written));
+  written = offset;
+
+  std::ifstream in(path.c_str(), std::ios::binary);
+  std::vector<char> block;
+  while (streaming_detail::readSpill(in, block, 1 << 20) > 0) {
+    out.write(block.data(), static_cast<std::streamsize>(block.size()));
+    written += block.size();
+  }
+  bool read = in.eof();
+  in.close();
+  std::remove(path.c_str());
+  return read;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::build_bucket(const std::string& bucket, std::size_t count,
+                                        const BoundingBox& extrema, std::size_t depth) {
+  using streaming_detail::readSpill;
+  using streaming_detail::SpillWriter;
+  std::ifstream in(bucket.c_str(), std::ios::binary);
+  std::vector<SpillPoint> points;
+  bool leaf = count <= max_node_size || depth == max_depth;
+
+  if (count <= memory_points_) {
+    readSpill(in, points, count);
+    in.close();
+    std::remove(bucket.c_str());
+    build_in_memory(points, depth);
+    return;
+  } else if (leaf) {
+    // Only at max_depth, with more duplicates than fit in memory
+    append_node(depth, TreeFileNode{extrema, points_written_, points_written_ + count,
+                                    points_written_, points_written_ + count, 1});
+    depth_ = std::max(depth, depth_);
+    while (readSpill(in, points, memory_points_) > 0) {
+      append_points(points.data(), points.size(), extrema);
+    }
+    in.close();
+    std::remove(bucket.c_str());
+    return;
+  }
+
+  // Too many to hold: split between one bucket per octant, as
+  // partitionByOctant() would
+  std::array<std::unique_ptr<SpillWriter<SpillPoint>>, 8> children;
+  std::array<std::size_t, 8> counts{{}};
+  std::array<BoundingBox, 8> boxes;
+  boxes.fill(initialBox);
+  while (readSpill(in, points, memory_points_) > 0) {
+    for (const SpillPoint& point : points) {
+      Point3d p{point.x, point.y, point.z};
+      std::size_t octant = extrema.getChildPartitionIndex(p);
+      if (!children[octant]) {
+        children[octant].reset(new SpillWriter<SpillPoint>(bucket_path(depth, octant)));
+      }
+      children[octant]->push(point);
+      ++counts[octant];
+      BoundingBox& box = boxes[octant];
+      box.mins_.x = std::min(p.x, box.mins_.x);
+      box.mins_.y = std::min(p.y, box.mins_.y);
+      box.mins_.z = std::min(p.z, box.mins_.z);
+      box.maxes_.x = std::max(p.x, box.maxes_.x);
+      box.maxes_.y = std::max(p.y, box.maxes_.y);
+      box.maxes_.z = std::max(p.z, box.maxes_.z);
+    }
+  }
+  in.close();
+  std::remove(bucket.c_str());
+
+  std::size_t populated = 0;
+  for (auto& child : children) {
+    if (child) {
+      ok_ &= child->close();
+      child.reset();
+      ++populated;
+    }
+  }
+  append_node(depth, TreeFileNode{extrema, populated, 0, points_written_,
+                                  points_written_ + count, 0});
+  for (std::size_t octant = 0; octant < 8; ++octant) {
+    if (counts[octant] > 0) {
+      build_bucket(bucket_path(depth, octant), counts[octant], boxes[octant], depth + 1);
+    }
+  }
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::build_in_memory(std::vector<SpillPoint>& points, std::size_t depth) {
+  struct PendingNode {
+    std::size_t first_;
+    std::size_t last_;
+    std::size_t depth_;
+  };
+  struct Leaf {
+    std::size_t first_;
+    std::size_t last_;
+    BoundingBox extrema_;
+  };
+
+  auto point = [&](std::size_t i) -> Point3d { return Point3d{points[i].x, points[i].y, points[i].z}; };
+  std::vector<Leaf> leaves;
+  std::deque<PendingNode> pending;
+  pending.push_back(PendingNode{0, points.size(), depth});
+  const std::size_t offset = points_written_;
+
+  while (!pending.empty()) {
+    const PendingNode current = pending.front();
+    pending.pop_front();
+
+    BoundingBox extrema = initialBox;
+    for (std::size_t i = current.first_; i < current.last_; ++i) {
+      Point3d p = point(i);
+      extrema.mins_.x = std::min(p.x, extrema.mins_.x);
+      extrema.mins_.y = std::min(p.y, extrema.mins_.y);
+      extrema.mins_.z = std::min(p.z, extrema.mins_.z);
+      extrema.maxes_.x = std::max(p.x, extrema.maxes_.x);
+      extrema.maxes_.y = std::max(p.y, extrema.maxes_.y);
+      extrema.maxes_.z = std::max(p.z, extrema.maxes_.z);
+    }
+
+    bool at_max_depth = current.depth_ == max_depth;
+    bool leaf_node = current.last_ - current.first_ <= max_node_size;
+    if (leaf_node || at_max_depth) {
+      append_node(current.depth_, TreeFileNode{extrema, offset + current.first_, offset + current.last_,
+                                               offset + current.first_, offset + current.last_, 1});
+      leaves.push_back(Leaf{current.first_, current.last_, extrema});
+      depth_ = std::max(current.depth_, depth_);
+      continue;
+    }
+
+    std::array<std::size_t, 9> bounds = partitionByOctant(
+        extrema, current.first_, current.last_, point,
+        [&](std::size_t i, std::size_t j) { std::swap(points[i], points[j]); });
+    std::size_t populated = 0;
+    for (unsigned char child = 0; child < 8; ++child) {
+      if (bounds[child] != bounds[child + 1]) {
+        pending.push_back(PendingNode{bounds[child], bounds[child + 1], current.depth_ + 1});
+        ++populated;
+      }
+    }
+    append_node(current.depth_, TreeFileNode{extrema, populated, 0, offset + current.first_,
+                                             offset + current.last_, 0});
+  }
+
+  // Leaves were found breadth first, but their points sit depth first
+  std::sort(leaves.begin(), leaves.end(),
+            [](const Leaf& a, const Leaf& b) { return a.first_ < b.first_; });
+  for (const Leaf& leaf : leaves) {
+    append_points(points.data() + leaf.first_, leaf.last_ - leaf.first_, leaf.extrema_);
+  }
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::append_node(std::size_t depth, const TreeFileNode& node) {
+  auto& level = levels_[depth - 1];
+  if (!level) {
+    level.reset(new streaming_detail::SpillWriter<TreeFileNode>(level_path(depth)));
+  }
+  level->push(node);
+  ++level_sizes_[depth - 1];
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::append_points(const SpillPoint* points, std::size_t n,
+                                         const BoundingBox& extrema) {
+  std::vector<build_type> xs(n), ys(n), zs(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    xs[i] = static_cast<build_type>(points[i].x);
+    ys[i] = static_cast<build_type>(points[i].y);
+    zs[i] = static_cast<build_type>(points[i].z);
+    values_->push(points[i].index);
+  }
+  append_coordinates(xs, ys, zs, extrema, is_quantized());
+  points_written_ += n;
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::append_coordinates(const std::vector<build_type>& xs,
+                                              const std::vector<build_type>& ys,
+                                              const std::vector<build_type>& zs,
+                                              const BoundingBox&, std::false_type) {
+  xs_->push(xs.data(), xs.size());
+  ys_->push(ys.data(), ys.size());
+  zs_->push(zs.data(), zs.size());
+}
+
+template <STREAMING_BUILD_TEMPLATE>
+void STREAMINGTREEBUILDER::append_coordinates(const std::vector<build_type>& xs,
+                                              const std::vector<build_type>& ys,
+                                              const std::vector<build_type>& zs,
+                                              const BoundingBox& extrema, std::true_type) {
+  std::vector<stored_type> codeXs(xs.size()), codeYs(ys.size()), codeZs(zs.size());
+  quantizeLeaf<Scalar::width>(extrema, xs.data(), ys.data(), zs.data(), xs.size(),
+                              codeXs.data(), codeYs.data(), codeZs.data());
+  xs_->push(codeXs.data(), codeXs.size());
+  ys_->push(codeYs.data(), codeYs.size());
+  zs_->push(codeZs.data(), codeZs.size());
+}
+
+#endif // defined STREAMING_BUILD_H
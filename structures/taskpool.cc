@@ -0,0 +1,220 @@
+#include "taskpool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Which pool, if any, the current thread works for, and its queue in it
+thread_local const TaskPool* currentPool = nullptr;
+thread_local std::size_t currentIndex = 0;
+
+}  // namespace
+
+TaskPool::TaskPool(std::size_t threads) : queued_(0), stopping_(false) {
+  for (std::size_t i = 0; i <= threads; ++i) {
+    queues_.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+  }
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::thread(&TaskPool::work, this, i));
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    stopping_ = true;
+  }
+  sleepCondition_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::size_t TaskPool::size() const {
+  return workers_.size();
+}
+
+void TaskPool::submit(TaskPool::task_type task) {
+  // Counted before it is visible, so queued_ never drops below the number
+  // of tasks actually waiting
+  ++queued_;
+  TaskQueue& queue = *queues_[current_queue()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+    queue.tasks_.push_back(std::move(task));
+  }
+
+  // Taking the lock orders this against a worker that is about to sleep
+  { std::lock_guard<std::mutex> lock(sleepMutex_); }
+  sleepCondition_.notify_one();
+}
+
+bool TaskPool::run_pending_task() {
+  task_type task;
+  std::size_t index = current_queue();
+  if (pop_task(index, task) || steal_task(index, task)) {
+    task();
+    return true;
+  }
+  return false;
+}
+
+bool TaskPool::pop_task(std::size_t index, TaskPool::task_type& task) {
+  TaskQueue& queue = *queues_[index];
+  std::lock_guard<std::mutex> lock(queue.mutex_);
+  if (queue.tasks_.empty()) {
+    return false;
+  }
+  task = std::move(queue.tasks_.back());
+  queue.tasks_.pop_back();
+  --queued_;
+  return true;
+}
+
+bool TaskPool::steal_task(std::size_t thief, TaskPool::task_type& task) {
+  for (std::size_t offset = 1; offset < queues_.size(); ++offset) {
+    TaskQueue& queue = *queues_[(thief + offset) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+    if (!queue.tasks_.empty()) {
+      task = std::move(queue.tasks_.front());
+      queue.tasks_.pop_front();
+      --queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::size_t TaskPool::current_queue() const {
+  return currentPool == this ? currentIndex : workers_.size();
+}
+
+void TaskPool::work(std::size_t index) {
+  currentPool = this;
+  currentIndex = index;
+
+  while (true) {
+    if (run_pending_task()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleepMutex_);
+    sleepCondition_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+TaskGroup::TaskGroup(TaskPool& pool) : pool_(pool), pending_(0) { }
+
+TaskGroup::~TaskGroup() {
+  try {
+    wait();
+  } catch (...) { }
+}
+
+void TaskGroup::run(TaskPool::task_type task) {
+  ++pending_;
+  pool_.submit([this, task]() {
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+
+    // The count drops, and the last task signals, under the lock, so a
+    // waiter that takes the lock after seeing zero knows the task is done
+    // with the group
+    std::lock_guard<std::mutex> lock(doneMutex_);
+    if (--pending_ == 0) {
+      doneCondition_.notify_all();
+    }
+  });
+}
+
+void TaskGroup::wait() {
+  // Help with queued tasks while there are any, then sleep until the tasks
+  // still running on other threads finish
+  while (pending_ > 0) {
+    if (!pool_.run_pending_task()) {
+      std::unique_lock<std::mutex> lock(doneMutex_);
+      doneCondition_.wait(lock, [this]() { return pending_ == 0; });
+    }
+  }
+  // The last task may still be signalling, and the group may be destroyed
+  // as soon as this returns
+  { std::lock_guard<std::mutex> lock(doneMutex_); }
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    std::swap(error, error_);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// Finished jobs are marked under doneMutex, and the calling thread helps run
+// queued tasks until the one it wants next is marked
+void runOrdered(TaskPool& pool, std::size_t count, std::size_t window,
+                const std::function<void(std::size_t)>& produce,
+                const std::function<void(std::size_t)>& consume) {
+  std::mutex doneMutex;
+  std::condition_variable doneCondition;
+  std::vector<char> done(count, false);
+  std::exception_ptr error;
+  TaskGroup group(pool);
+
+  window = std::max<std::size_t>(window, 1);
+  std::size_t started = 0;
+  for (std::size_t next = 0; next < count; ) {
+    for (; started < count && started < next + window; ++started) {
+      std::size_t i = started;
+      group.run([&produce, &doneMutex, &doneCondition, &done, &error, i]() {
+        std::exception_ptr failure;
+        try {
+          produce(i);
+        } catch (...) {
+          failure = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(doneMutex);
+        if (failure && !error) {
+          error = failure;
+        }
+        done[i] = true;
+        doneCondition.notify_all();
+      });
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    if (!done[next]) {
+      lock.unlock();
+      if (pool.run_pending_task()) {
+        continue;
+      }
+      lock.lock();
+      doneCondition.wait(lock, [&done, next]() { return done[next] != 0; });
+    }
+    if (error) {
+      break;
+    }
+    lock.unlock();
+    consume(next++);
+  }
+
+  group.wait();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,109 @@
+/*
+    file - taskpool.h
+
+    A small work-stealing thread pool for fork/join style parallelism.
+
+    Every worker owns a deque of tasks. Workers push and pop their own tasks
+    at the back, and steal from the front of everyone else's when they run
+    dry, so the big, early tasks of a recursive split are the ones that move
+    between threads. Threads outside the pool submit through a shared queue.
+
+    Tasks are grouped with a TaskGroup. TaskGroup::wait() runs queued tasks
+    while it waits, so a task may itself spawn and wait on a group without
+    tying up a worker. Once nothing is left to run it sleeps until the last
+    of the group's tasks finishes, rather than spinning. runOrdered() runs a
+    sequence of jobs on the pool and hands their results back one by one,
+    in order, as they become ready.
+
+ */
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskPool {
+ public:
+  using task_type = std::function<void()>;
+
+  // A pool of zero threads is valid; tasks then run inside TaskGroup::wait()
+  explicit TaskPool(std::size_t threads = std::thread::hardware_concurrency());
+
+  TaskPool(const TaskPool&) = delete;
+  TaskPool& operator=(const TaskPool&) = delete;
+
+  ~TaskPool();
+
+  std::size_t size() const;
+
+  void submit(task_type task);
+
+  // Runs a single queued task on the calling thread, if there is one
+  bool run_pending_task();
+
+ private:
+  struct TaskQueue {
+    std::mutex mutex_;
+    std::deque<task_type> tasks_;
+  };
+
+  bool pop_task(std::size_t index, task_type& task);
+  bool steal_task(std::size_t thief, task_type& task);
+  std::size_t current_queue() const;
+  void work(std::size_t index);
+
+  // One queue per worker, and a last one shared by threads outside the pool
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::atomic<std::size_t> queued_;
+  std::atomic<bool> stopping_;
+  std::mutex sleepMutex_;
+  std::condition_variable sleepCondition_;
+};
+
+class TaskGroup {
+ public:
+  explicit TaskGroup(TaskPool& pool);
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  // Waits for outstanding tasks, but drops any exception they threw
+  ~TaskGroup();
+
+  void run(TaskPool::task_type task);
+
+  // Blocks until every task run through this group has finished, and
+  // rethrows the first exception any of them threw
+  void wait();
+
+ private:
+  TaskPool& pool_;
+  std::atomic<std::size_t> pending_;
+  std::mutex doneMutex_;
+  std::condition_variable doneCondition_;
+  std::mutex errorMutex_;
+  std::exception_ptr error_;
+};
+
+// Runs produce(i) for every i in [0, count) on pool, and calls consume(i) on
+// the calling thread for each in order of i, as soon as that one and every
+// one before it are done. No more than window are started ahead of the
+// oldest not yet consumed, so no more than that many finished results are
+// ever held. Rethrows the first exception produce threw, once everything
+// started has finished; nothing after it is consumed.
+void runOrdered(TaskPool& pool, std::size_t count, std::size_t window,
+                const std::function<void(std::size_t)>& produce,
+                const std::function<void(std::size_t)>& consume);
+
+#endif // defined TASKPOOL_H
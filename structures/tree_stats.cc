@@ -0,0 +1,54 @@
+#include "tree_stats.h"
+
+#include <algorithm>
+#include <cstddef>
+
+QueryStats::QueryStats() : nodes_visited_(0), nodes_pruned_(0), points_tested_(0), hits_(0) { }
+
+QueryStats& QueryStats::operator+=(const QueryStats& rhs) {
+  nodes_visited_ += rhs.nodes_visited_;
+  nodes_pruned_ += rhs.nodes_pruned_;
+  points_tested_ += rhs.points_tested_;
+  hits_ += rhs.hits_;
+  return *this;
+}
+
+TreeStats::TreeStats(std::size_t leaf_capacity)
+  : leaves_by_size_(leaf_capacity + 2, 0), nodes_(0), internal_nodes_(0), leaves_(0),
+    max_depth_leaves_(0), unsplit_nodes_(0), empty_children_(0), points_(0), bytes_(0) { }
+
+void TreeStats::addNode(std::size_t depth) {
+  if (nodes_by_depth_.size() <= depth) {
+    nodes_by_depth_.resize(depth + 1, 0);
+  }
+  ++nodes_by_depth_[depth];
+  ++nodes_;
+}
+
+void TreeStats::addInternal(std::size_t depth, std::size_t children) {
+  addNode(depth);
+  ++internal_nodes_;
+  empty_children_ += 8 - children;
+}
+
+void TreeStats::addLeaf(std::size_t depth, std::size_t points, bool max_depth_leaf) {
+  addNode(depth);
+  ++leaves_;
+  max_depth_leaves_ += max_depth_leaf;
+  ++leaves_by_size_[std::min(points, leaves_by_size_.size() - 1)];
+  points_ += points;
+}
+
+void TreeStats::addUnsplit(std::size_t depth, std::size_t points) {
+  addNode(depth);
+  ++unsplit_nodes_;
+  points_ += points;
+}
+
+double TreeStats::emptyChildRatio() const {
+  return internal_nodes_ == 0 ? 0. : empty_children_ / (8. * internal_nodes_);
+}
+
+double TreeStats::bytesPerPoint() const {
+  return points_ == 0 ? 0. : static_cast<double>(bytes_) / points_;
+}
@@ -0,0 +1,105 @@
+/*
+    file - tree_stats.h
+
+    Counters for telling a badly shaped tree from a query that is simply
+    large. QueryStats counts the work one query does, and is filled in by
+    the overloads of search(), radiusSearch() and knn() that take one. The
+    other overloads count into NoQueryStats, whose counting compiles away,
+    so queries pay nothing unless asked. TreeStats describes the shape of a
+    whole tree.
+
+ */
+
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <cstddef>
+#include <vector>
+
+struct QueryStats {
+  QueryStats();
+
+  void visit() { ++nodes_visited_; }
+  void prune(std::size_t nodes = 1) { nodes_pruned_ += nodes; }
+  void test(std::size_t points) { points_tested_ += points; }
+  void hit() { ++hits_; }
+
+  QueryStats& operator+=(const QueryStats& rhs);
+
+  // Nodes whose bounds were compared with the query
+  std::size_t nodes_visited_;
+  // Nodes the bounds ruled out, along with everything below them
+  std::size_t nodes_pruned_;
+  // Points in leaves compared with the query one by one
+  std::size_t points_tested_;
+  // Values written out
+  std::size_t hits_;
+};
+
+struct NoQueryStats {
+  void visit() {}
+  void prune(std::size_t = 1) {}
+  void test(std::size_t) {}
+  void hit() {}
+};
+
+// Passes values on to out, counting each one as a hit
+template <typename OutputIterator>
+class CountingOutput {
+ public:
+  CountingOutput(OutputIterator& out, QueryStats& stats) : out_(&out), stats_(&stats) {}
+
+  CountingOutput& operator*() { return *this; }
+
+  template <typename Value>
+  CountingOutput& operator=(const Value& value) {
+    **out_ = value;
+    stats_->hit();
+    return *this;
+  }
+
+  CountingOutput& operator++() {
+    ++*out_;
+    return *this;
+  }
+
+ private:
+  OutputIterator* out_;
+  QueryStats* stats_;
+};
+
+struct TreeStats {
+  // Leaves of up to leaf_capacity points are told apart by size
+  explicit TreeStats(std::size_t leaf_capacity = 0);
+
+  void addInternal(std::size_t depth, std::size_t children);
+  void addLeaf(std::size_t depth, std::size_t points, bool max_depth_leaf);
+  // A subtree of a lazily built Octree that no query has split yet
+  void addUnsplit(std::size_t depth, std::size_t points);
+
+  // The share of internal nodes' child slots left empty
+  double emptyChildRatio() const;
+  double bytesPerPoint() const;
+
+  // Nodes at each depth, the root's first
+  std::vector<std::size_t> nodes_by_depth_;
+  // Leaves holding each number of points, up to the leaf capacity; the last
+  // entry counts every leaf holding more, which only leaves at the maximum
+  // depth can
+  std::vector<std::size_t> leaves_by_size_;
+  std::size_t nodes_;
+  std::size_t internal_nodes_;
+  std::size_t leaves_;
+  // Leaves at the maximum depth, which can't split however full they get
+  std::size_t max_depth_leaves_;
+  std::size_t unsplit_nodes_;
+  std::size_t empty_children_;
+  std::size_t points_;
+  // Memory held by the tree, whether or not it is in use
+  std::size_t bytes_;
+
+ private:
+  void addNode(std::size_t depth);
+};
+
+#endif // defined TREE_STATS_H
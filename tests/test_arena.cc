@@ -0,0 +1,99 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/arena.h"
+
+#include "gtest/gtest.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Keeps count of how much the arena has asked for and not yet given back
+template <typename T>
+struct CountingAllocator {
+	using value_type = T;
+
+	explicit CountingAllocator(std::size_t* outstanding) : outstanding_(outstanding) {}
+
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>& other) : outstanding_(other.outstanding_) {}
+
+	T* allocate(std::size_t n) {
+		*outstanding_ += n * sizeof(T);
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T* p, std::size_t n) {
+		*outstanding_ -= n * sizeof(T);
+		std::allocator<T>().deallocate(p, n);
+	}
+
+	std::size_t* outstanding_;
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs) {
+	return lhs.outstanding_ == rhs.outstanding_;
+}
+
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>& lhs, const CountingAllocator<U>& rhs) {
+	return !(lhs == rhs);
+}
+
+TEST(Arena, AllocationsAreAligned) {
+	Arena<> arena;
+	for (std::size_t alignment = 1; alignment <= 64; alignment *= 2) {
+		arena.allocate(1, 1);
+		void* p = arena.allocate(8, alignment);
+		EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(p) % alignment) << "Alignment: " << alignment;
+	}
+}
+
+TEST(Arena, ConsecutiveAllocationsAreAdjacent) {
+	Arena<> arena;
+	double* first = arena.allocate<double>(4);
+	double* second = arena.allocate<double>(4);
+	EXPECT_EQ(first + 4, second);
+}
+
+TEST(Arena, LargeAllocation) {
+	Arena<> arena;
+	std::size_t size = 3 * Arena<>::max_chunk_size;
+	char* p = static_cast<char*>(arena.allocate(size, 1));
+	p[0] = p[size - 1] = 1;
+	EXPECT_GE(arena.reserved(), size);
+}
+
+TEST(Arena, ReleaseReturnsEverything) {
+	std::size_t outstanding = 0;
+	{
+		Arena<CountingAllocator<char>> arena{CountingAllocator<char>(&outstanding)};
+		for (int i = 0; i < 1000; ++i) {
+			arena.allocate<int>(100);
+		}
+		EXPECT_GT(outstanding, 1000 * 100 * sizeof(int));
+		EXPECT_EQ(outstanding, arena.reserved());
+
+		arena.release();
+		EXPECT_EQ(0u, outstanding);
+		EXPECT_EQ(0u, arena.reserved());
+
+		arena.allocate<int>(100);
+		EXPECT_GT(outstanding, 0u);
+	}
+	EXPECT_EQ(0u, outstanding);
+}
+
+TEST(Arena, MoveTakesChunks) {
+	Arena<> arena;
+	arena.allocate<int>(10);
+	std::size_t reserved = arena.reserved();
+	Arena<> other(std::move(arena));
+	EXPECT_EQ(reserved, other.reserved());
+	EXPECT_EQ(0u, arena.reserved());
+}
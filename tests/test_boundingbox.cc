@@ -104,6 +104,60 @@ TEST(BoundingBox, OverlapPartial) {
 	EXPECT_EQ(expected, first.overlap(second));
 }
 
+TEST(BoundingBox, IntersectsPartial) {
+	BoundingBox first{{0, 0, 0}, {10, 10, 10}};
+	BoundingBox second{{5, -5, 5}, {15, 5, 15}};
+	EXPECT_TRUE(first.intersects(second));
+	EXPECT_TRUE(second.intersects(first));
+}
+
+TEST(BoundingBox, IntersectsTouchingFace) {
+	BoundingBox first{{0, 0, 0}, {10, 10, 10}};
+	BoundingBox second{{10, 0, 0}, {20, 10, 10}};
+	EXPECT_TRUE(first.intersects(second));
+}
+
+TEST(BoundingBox, IntersectsOutside) {
+	BoundingBox first{{0, 0, 0}, {10, 10, 10}};
+	BoundingBox second{{0, 11, 0}, {10, 20, 10}};
+	EXPECT_FALSE(first.intersects(second));
+	EXPECT_FALSE(first.intersects(initialBox));
+}
+
+TEST(BoundingBox, DistanceSquaredInside) {
+	BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+	EXPECT_EQ(0, box.distanceSquared(Point3d{5, 5, 5}));
+	EXPECT_EQ(0, box.distanceSquared(Point3d{10, 0, 5}));
+}
+
+TEST(BoundingBox, DistanceSquaredOutside) {
+	BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+	EXPECT_EQ(4, box.distanceSquared(Point3d{12, 5, 5}));
+	EXPECT_EQ(1 + 4 + 9, box.distanceSquared(Point3d{-1, 12, 13}));
+}
+
+TEST(BoundingBox, MaxDistanceSquared) {
+	BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+	EXPECT_EQ(3 * 25, box.maxDistanceSquared(Point3d{5, 5, 5}));
+	EXPECT_EQ(12 * 12 + 100 + 100, box.maxDistanceSquared(Point3d{-2, 0, 10}));
+}
+
+TEST(BoundingBox, DistanceSquaredToBox) {
+	BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+	EXPECT_EQ(0, box.distanceSquared(BoundingBox{{5, 5, 5}, {20, 20, 20}}));
+	EXPECT_EQ(0, box.distanceSquared(BoundingBox{{10, 0, 0}, {20, 10, 10}}));
+	EXPECT_EQ(4, box.distanceSquared(BoundingBox{{12, 5, 5}, {13, 6, 6}}));
+	EXPECT_EQ(1 + 4 + 9, box.distanceSquared(BoundingBox{{-3, 12, 13}, {-1, 14, 15}}));
+	EXPECT_EQ(1 + 4 + 9, BoundingBox({{-3, 12, 13}, {-1, 14, 15}}).distanceSquared(box));
+}
+
+TEST(BoundingBox, MaxDistanceSquaredToBox) {
+	BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+	EXPECT_EQ(3 * 100, box.maxDistanceSquared(box));
+	EXPECT_EQ(3 * 100, box.maxDistanceSquared(BoundingBox{{5, 5, 5}, {5, 5, 5}}) * 4);
+	EXPECT_EQ(12 * 12 + 100 + 13 * 13, box.maxDistanceSquared(BoundingBox{{-2, 0, 10}, {-1, 0, 13}}));
+}
+
 TEST(BoundingBox, Partition) {
 	BoundingBox extrema{{0, 0, 0}, {100, 100, 100}};
 	array<BoundingBox, 8> partitions = extrema.partition();
@@ -120,4 +174,45 @@ TEST(BoundingBox, Partition) {
 	for (unsigned i = 0; i < 8; ++i) {
 		EXPECT_EQ(partitions[i], expectedPartitions[i]);
 	}
-}
\ No newline at end of file
+}
+
+TEST(BoundingBox, FromIteratorsNegative) {
+	vector<Point3d> points;
+	points.push_back(Point3d{-10,-10,-10});
+	points.push_back(Point3d{-5,-6,-7});
+	BoundingBox first = makeBoundingBox(points.begin(), points.end());
+	BoundingBox second{{-10, -10, -10}, {-5, -6, -7}};
+	EXPECT_EQ(first, second);
+}
+
+TEST(BoundingBox, PartitionOffset) {
+	BoundingBox extrema{{10, 20, 30}, {20, 40, 70}};
+	array<BoundingBox, 8> partitions = extrema.partition();
+	EXPECT_EQ(partitions[0], (BoundingBox{{10, 20, 30}, {15, 30, 50}}));
+	EXPECT_EQ(partitions[7], (BoundingBox{{15, 30, 50}, {20, 40, 70}}));
+}
+
+TEST(BoundingBox, ChildPartitionIndexMatchesPartition) {
+	BoundingBox extrema{{10, 20, 30}, {20, 40, 70}};
+	array<BoundingBox, 8> partitions = extrema.partition();
+	for (unsigned i = 0; i < 8; ++i) {
+		const BoundingBox& child = partitions[i];
+		Point3d centre{(child.mins_.x + child.maxes_.x) / 2,
+		               (child.mins_.y + child.maxes_.y) / 2,
+		               (child.mins_.z + child.maxes_.z) / 2};
+		EXPECT_EQ(i, extrema.getChildPartitionIndex(centre)) << "At index: " << i;
+	}
+}
+
+TEST(BoundingBox, ChildPartitionIndexOnMidplane) {
+	BoundingBox extrema{{0, 0, 0}, {100, 100, 100}};
+	EXPECT_EQ(7u, extrema.getChildPartitionIndex(Point3d{50, 50, 50}));
+	EXPECT_EQ(0u, extrema.getChildPartitionIndex(Point3d{0, 0, 0}));
+	EXPECT_EQ(1u, extrema.getChildPartitionIndex(Point3d{100, 0, 0}));
+}
+
+TEST(BoundingBox, Grown) {
+	BoundingBox extrema{{10, 20, 30}, {20, 40, 70}};
+	EXPECT_EQ((BoundingBox{{8, 18, 28}, {22, 42, 72}}), extrema.grown(2));
+	EXPECT_EQ(extrema, extrema.grown(0));
+}
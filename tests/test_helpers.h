@@ -10,6 +10,8 @@
 
 #include "../structures/point3d.h"
 #include "../structures/boundingbox.h"
+#include <cstddef>
+#include <random>
 #include <vector>
 #include "gtest/gtest.h"
 
@@ -32,6 +34,25 @@ struct ExamplePointExtractor {
   }
 };
 
+// count values spread uniformly over [0, 100) on every axis, numbered in
+// order. Tests that go on drawing from generator see the same stream they
+// would have if they'd made the points themselves.
+template <typename Generator>
+std::vector<ValuePoint<int>> randomPoints(std::size_t count, Generator& generator) {
+  std::uniform_real_distribution<double> coordinate(0, 100);
+  std::vector<ValuePoint<int>> points(count);
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    points[i].dimensions_ = Point3d{coordinate(generator), coordinate(generator), coordinate(generator)};
+    points[i].value_ = static_cast<int>(i);
+  }
+  return points;
+}
+
+inline std::vector<ValuePoint<int>> randomPoints(std::size_t count, unsigned seed) {
+  std::mt19937 generator(seed);
+  return randomPoints(count, generator);
+}
+
 class OctreeTest : public ::testing::Test {
   protected:
   	std::vector<ValuePoint<int>> data;
@@ -0,0 +1,271 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/leaf_kernel.h"
+
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+
+using std::vector;
+
+class LeafKernelTest : public ::testing::Test {
+  protected:
+	vector<double> xs, ys, zs;
+	BoundingBox box;
+
+	LeafKernelTest() : box{{2, 2, 2}, {6, 6, 6}} {}
+
+	virtual void SetUp() {
+		// Points on a grid that straddles the box, so plenty sit on its faces
+		for (double x = 0; x <= 8; x += 2) {
+			for (double y = 0; y <= 8; y += 2) {
+				for (double z = 0; z <= 8; z += 2) {
+					xs.push_back(x);
+					ys.push_back(y);
+					zs.push_back(z);
+				}
+			}
+		}
+	}
+};
+
+TEST_F(LeafKernelTest, MatchesContains) {
+	for (size_t n = 0; n <= 64; ++n) {
+		std::uint64_t mask = containsBlock(box, xs.data(), ys.data(), zs.data(), n);
+		for (size_t i = 0; i < 64; ++i) {
+			bool expected = i < n && box.contains(Point3d{xs[i], ys[i], zs[i]});
+			EXPECT_EQ(expected, ((mask >> i) & 1) == 1) << "n: " << n << " i: " << i;
+		}
+	}
+}
+
+TEST_F(LeafKernelTest, NaNIsNeverContained) {
+	double nan = std::numeric_limits<double>::quiet_NaN();
+	vector<double> nans(8, nan), fours(8, 4);
+	EXPECT_EQ(0u, containsBlock(box, nans.data(), fours.data(), fours.data(), 8));
+	EXPECT_EQ(0u, containsBlock(box, fours.data(), fours.data(), nans.data(), 8));
+}
+
+TEST_F(LeafKernelTest, EmitContainedInOrder) {
+	vector<size_t> values(xs.size());
+	vector<size_t> expected;
+	for (size_t i = 0; i < values.size(); ++i) {
+		values[i] = i;
+		if (box.contains(Point3d{xs[i], ys[i], zs[i]})) {
+			expected.push_back(i);
+		}
+	}
+
+	// More than one 64 point block
+	ASSERT_GT(values.size(), 64u);
+	vector<size_t> output;
+	auto outputIterator = std::back_inserter(output);
+	EXPECT_TRUE(emitContained(box, xs.data(), ys.data(), zs.data(), values.data(), values.size(), outputIterator));
+	EXPECT_EQ(expected, output);
+}
+
+TEST_F(LeafKernelTest, VisitContainedStops) {
+	vector<size_t> values(xs.size());
+	vector<size_t> expected;
+	for (size_t i = 0; i < values.size(); ++i) {
+		values[i] = i;
+		if (box.contains(Point3d{xs[i], ys[i], zs[i]})) {
+			expected.push_back(i);
+		}
+	}
+
+	vector<size_t> output;
+	auto all = [&](size_t value, const Point3d& p) {
+		EXPECT_EQ((Point3d{xs[value], ys[value], zs[value]}), p);
+		output.push_back(value);
+		return Visit::CONTINUE;
+	};
+	EXPECT_FALSE(visitContained(box, xs.data(), ys.data(), zs.data(), values.data(), values.size(), all));
+	EXPECT_EQ(expected, output);
+
+	// Stopping on the first point past the first block leaves the rest alone
+	output.clear();
+	auto some = [&](size_t value, const Point3d&) {
+		output.push_back(value);
+		return value >= 64 ? Visit::STOP : Visit::CONTINUE;
+	};
+	EXPECT_TRUE(visitContained(box, xs.data(), ys.data(), zs.data(), values.data(), values.size(), some));
+	ASSERT_FALSE(output.empty());
+	EXPECT_GE(output.back(), 64u);
+	EXPECT_EQ(vector<size_t>(expected.begin(), expected.begin() + output.size()), output);
+}
+
+TEST_F(LeafKernelTest, EmitContainedNone) {
+	BoundingBox away{{100, 100, 100}, {101, 101, 101}};
+	vector<size_t> values(xs.size());
+	vector<size_t> output;
+	auto outputIterator = std::back_inserter(output);
+	EXPECT_FALSE(emitContained(away, xs.data(), ys.data(), zs.data(), values.data(), values.size(), outputIterator));
+	EXPECT_TRUE(output.empty());
+}
+
+TEST_F(LeafKernelTest, WithinMatchesDistance) {
+	// A radius of 4 puts grid points exactly on the sphere
+	Point3d centre{4, 4, 4};
+	for (double radiusSquared : {0., 4., 15.9, 16., 48.}) {
+		for (size_t n = 0; n <= 64; ++n) {
+			std::uint64_t mask = withinBlock(centre, radiusSquared, xs.data(), ys.data(), zs.data(), n);
+			for (size_t i = 0; i < 64; ++i) {
+				double dx = xs[i] - centre.x, dy = ys[i] - centre.y, dz = zs[i] - centre.z;
+				bool expected = i < n && dx * dx + dy * dy + dz * dz <= radiusSquared;
+				EXPECT_EQ(expected, ((mask >> i) & 1) == 1) << "r2: " << radiusSquared << " n: " << n << " i: " << i;
+			}
+		}
+	}
+}
+
+TEST_F(LeafKernelTest, EmitWithinInOrder) {
+	Point3d centre{3, 5, 4};
+	vector<size_t> values(xs.size());
+	vector<size_t> expected;
+	for (size_t i = 0; i < values.size(); ++i) {
+		values[i] = i;
+		double dx = xs[i] - centre.x, dy = ys[i] - centre.y, dz = zs[i] - centre.z;
+		if (dx * dx + dy * dy + dz * dz <= 20) {
+			expected.push_back(i);
+		}
+	}
+
+	vector<size_t> output;
+	auto outputIterator = std::back_inserter(output);
+	EXPECT_TRUE(emitWithin(centre, 20., xs.data(), ys.data(), zs.data(), values.data(), values.size(), outputIterator));
+	EXPECT_EQ(expected, output);
+}
+
+TEST_F(LeafKernelTest, EmitPairsWithinInOrder) {
+	using pair = std::pair<size_t, size_t>;
+	vector<size_t> values(xs.size());
+	for (size_t i = 0; i < values.size(); ++i) {
+		values[i] = i;
+	}
+	// Grid neighbours are exactly 2 apart
+	for (double radiusSquared : {0., 4., 8., 1000.}) {
+		vector<pair> expected, expectedSelf;
+		for (size_t i = 0; i < values.size(); ++i) {
+			for (size_t j = 0; j < values.size(); ++j) {
+				double dx = xs[i] - xs[j], dy = ys[i] - ys[j], dz = zs[i] - zs[j];
+				if (dx * dx + dy * dy + dz * dz > radiusSquared) {
+					continue;
+				}
+				if (i < 40 && j >= 40) {
+					expected.push_back(pair(i, j));
+				}
+				if (i < j) {
+					expectedSelf.push_back(pair(i, j));
+				}
+			}
+		}
+
+		// The first 40 points against the rest, and all of them among themselves
+		vector<pair> output, self;
+		auto outputIterator = std::back_inserter(output);
+		auto selfIterator = std::back_inserter(self);
+		EXPECT_EQ(!expected.empty(), emitPairsWithin(radiusSquared, xs.data(), ys.data(), zs.data(), values.data(), 40,
+		                                             xs.data() + 40, ys.data() + 40, zs.data() + 40, values.data() + 40,
+		                                             values.size() - 40, outputIterator));
+		EXPECT_EQ(!expectedSelf.empty(), emitPairsWithin(radiusSquared, xs.data(), ys.data(), zs.data(), values.data(),
+		                                                 values.size(), selfIterator));
+		EXPECT_EQ(expected, output) << "r2: " << radiusSquared;
+		EXPECT_EQ(expectedSelf, self) << "r2: " << radiusSquared;
+
+		if (radiusSquared == 1000.) {
+			vector<pair> all, allSelf;
+			auto allIterator = std::back_inserter(all);
+			auto allSelfIterator = std::back_inserter(allSelf);
+			EXPECT_TRUE(emitAllPairs(values.data(), 40, values.data() + 40, values.size() - 40, allIterator));
+			EXPECT_TRUE(emitAllPairs(values.data(), values.size(), allSelfIterator));
+			EXPECT_EQ(expected, all);
+			EXPECT_EQ(expectedSelf, allSelf);
+		}
+	}
+
+	// One point has no pairs among itself
+	vector<pair> none;
+	auto noneIterator = std::back_inserter(none);
+	EXPECT_FALSE(emitPairsWithin(1000., xs.data(), ys.data(), zs.data(), values.data(), 1, noneIterator));
+	EXPECT_FALSE(emitAllPairs(values.data(), 1, noneIterator));
+	EXPECT_FALSE(emitAllPairs(values.data(), 0, values.data(), 5, noneIterator));
+	EXPECT_TRUE(none.empty());
+}
+
+TEST_F(LeafKernelTest, BelowPlaneMatchesDotProduct) {
+	// Planes through grid points, some square on and some at an angle
+	const Point3d normals[] = {{1, 0, 0}, {0, -1, 0}, {0.6, 0, 0.8}, {1, 2, -3}, {-1, -1, -1}};
+	for (const Point3d& normal : normals) {
+		for (double offset : {-4., 0., 2., 5.5, 10.}) {
+			for (size_t n = 0; n <= 64; ++n) {
+				std::uint64_t mask = belowPlaneBlock(normal, offset, xs.data(), ys.data(), zs.data(), n);
+				for (size_t i = 0; i < 64; ++i) {
+					bool expected = i < n && normal.x * xs[i] + normal.y * ys[i] + normal.z * zs[i] <= offset;
+					EXPECT_EQ(expected, ((mask >> i) & 1) == 1) << normal << " " << offset << " n: " << n << " i: " << i;
+				}
+			}
+		}
+	}
+}
+
+TEST(LeafKernel, ScalarRounding) {
+	const double third = 1. / 3.;
+	EXPECT_GE(static_cast<double>(scalarAtLeast<float>(third)), third);
+	EXPECT_LT(static_cast<double>(std::nextafter(scalarAtLeast<float>(third), 0.f)), third);
+	EXPECT_LE(static_cast<double>(scalarAtMost<float>(third)), third);
+	EXPECT_GT(static_cast<double>(std::nextafter(scalarAtMost<float>(third), 1.f)), third);
+	EXPECT_EQ(0.5f, scalarAtLeast<float>(0.5));
+	EXPECT_EQ(0.5f, scalarAtMost<float>(0.5));
+	EXPECT_EQ(third, scalarAtLeast<double>(third));
+
+	// Past the end of float's range
+	EXPECT_EQ(std::numeric_limits<float>::infinity(), toScalar<float>(1e300));
+	EXPECT_EQ(-std::numeric_limits<float>::max(), scalarAtLeast<float>(-1e300));
+	EXPECT_EQ(std::numeric_limits<float>::max(), scalarAtMost<float>(1e300));
+}
+
+TEST(LeafKernel, FloatMatchesDouble) {
+	// Box edges that float can't represent, with points right next to them
+	std::mt19937 generator(37);
+	std::uniform_real_distribution<double> coordinate(0, 1);
+	vector<float> xs, ys, zs;
+	vector<double> wideXs, wideYs, wideZs;
+	BoundingBox box{{0.3, 0.2, 0.1}, {0.7, 0.8, 0.9}};
+	const double edges[] = {0.1, 0.2, 0.3, 0.7, 0.8, 0.9};
+	for (size_t i = 0; i < 64; ++i) {
+		float x = static_cast<float>(coordinate(generator));
+		float y = static_cast<float>(coordinate(generator));
+		float z = static_cast<float>(coordinate(generator));
+		if (i % 2 == 0) {
+			float edge = static_cast<float>(edges[i / 2 % 6]);
+			x = y = z = i % 4 == 0 ? edge : std::nextafter(edge, 1.f);
+		}
+		xs.push_back(x);
+		ys.push_back(y);
+		zs.push_back(z);
+		wideXs.push_back(x);
+		wideYs.push_back(y);
+		wideZs.push_back(z);
+	}
+
+	Point3d centre{0.5, 0.5, 0.5};
+	for (size_t n = 0; n <= 64; ++n) {
+		EXPECT_EQ(containsBlock(box, wideXs.data(), wideYs.data(), wideZs.data(), n),
+		          containsBlock(box, xs.data(), ys.data(), zs.data(), n)) << "n: " << n;
+		EXPECT_EQ(withinBlock(centre, 0.1, wideXs.data(), wideYs.data(), wideZs.data(), n),
+		          withinBlock(centre, 0.1, xs.data(), ys.data(), zs.data(), n)) << "n: " << n;
+		EXPECT_EQ(belowPlaneBlock(Point3d{0.6, 0, 0.8}, 0.7, wideXs.data(), wideYs.data(), wideZs.data(), n),
+		          belowPlaneBlock(Point3d{0.6, 0, 0.8}, 0.7, xs.data(), ys.data(), zs.data(), n)) << "n: " << n;
+	}
+}
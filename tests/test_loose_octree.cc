@@ -0,0 +1,154 @@
+// Stupid mingw port of gtest
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/loose_octree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+struct BoxIdentity {
+    BoundingBox operator()(const BoundingBox& box) const {
+        return box;
+    }
+};
+
+using BoxIterator = vector<BoundingBox>::const_iterator;
+
+// Boxes of every size from points to ones spanning most of the space, with
+// a few copies of one small box to fill a node past max_depth
+class LooseOctreeTest : public ::testing::Test {
+  protected:
+    vector<BoundingBox> boxes;
+    vector<BoundingBox> queries;
+
+    virtual void SetUp() {
+        std::mt19937 generator(29);
+        std::uniform_real_distribution<double> coordinate(0, 100);
+        std::uniform_real_distribution<double> unit(0, 1);
+        for (size_t i = 0; i < 5000; ++i) {
+            Point3d corner{coordinate(generator), coordinate(generator), coordinate(generator)};
+            // Mostly small, some huge
+            double scale = i % 100 == 0 ? 60. : i % 10 == 0 ? 10. : i % 3 == 0 ? 0. : 2.;
+            Point3d size{unit(generator) * scale, unit(generator) * scale, unit(generator) * scale};
+            boxes.push_back(BoundingBox{corner, {corner.x + size.x, corner.y + size.y, corner.z + size.z}});
+        }
+        for (size_t i = 0; i < 40; ++i) {
+            boxes.push_back(BoundingBox{{40, 40, 40}, {40.5, 40.5, 40.5}});
+        }
+
+        queries = {
+            BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+            BoundingBox{{-10, -10, -10}, {200, 200, 200}},
+            BoundingBox{{0, 0, 0}, {50, 50, 50}},
+            BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+            BoundingBox{{40, 40, 40}, {40, 40, 40}},
+            BoundingBox{{25, 25, 25}, {75, 75, 75}},
+            BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+        };
+        for (size_t i = 0; i < 20; ++i) {
+            queries.push_back(boxes[i * 37]);
+        }
+    }
+
+    template <typename Tree>
+    void checkMatchesBruteForce(const Tree& tree) {
+        ASSERT_EQ(boxes.size(), tree.size());
+        for (const BoundingBox& query : queries) {
+            vector<BoxIterator> overlapping, contained, expectedOverlapping, expectedContained;
+            for (auto it = boxes.cbegin(); it != boxes.cend(); ++it) {
+                // overlap() gives the invalid box, all NaN, if they don't meet
+                if (!std::isnan(query.overlap(*it).mins_.x)) {
+                    expectedOverlapping.push_back(it);
+                }
+                if (query.contains(*it)) {
+                    expectedContained.push_back(it);
+                }
+            }
+
+            auto overlappingIterator = std::back_inserter(overlapping);
+            EXPECT_EQ(!expectedOverlapping.empty(), tree.search(query, overlappingIterator)) << query;
+            std::sort(overlapping.begin(), overlapping.end());
+            EXPECT_EQ(expectedOverlapping, overlapping) << query;
+
+            auto containedIterator = std::back_inserter(contained);
+            EXPECT_EQ(!expectedContained.empty(), tree.searchContained(query, containedIterator)) << query;
+            std::sort(contained.begin(), contained.end());
+            EXPECT_EQ(expectedContained, contained) << query;
+        }
+    }
+};
+
+TEST_F(LooseOctreeTest, Empty) {
+    LooseOctree<BoxIterator, BoxIdentity> tree;
+    vector<BoxIterator> found;
+    auto foundIterator = std::back_inserter(found);
+    EXPECT_EQ(0u, tree.size());
+    EXPECT_FALSE(tree.search(BoundingBox{{-1, -1, -1}, {1, 1, 1}}, foundIterator));
+    EXPECT_TRUE(found.empty());
+}
+
+TEST_F(LooseOctreeTest, MatchesBruteForce) {
+    LooseOctree<BoxIterator, BoxIdentity> tree(boxes.cbegin(), boxes.cend());
+    EXPECT_GT(tree.depth(), 3u);
+    checkMatchesBruteForce(tree);
+}
+
+TEST_F(LooseOctreeTest, LoosenessAndDepth) {
+    LooseOctree<BoxIterator, BoxIdentity> tight(boxes.cbegin(), boxes.cend(), 1.);
+    EXPECT_EQ(1., tight.looseness());
+    checkMatchesBruteForce(tight);
+
+    LooseOctree<BoxIterator, BoxIdentity> clamped(boxes.cbegin(), boxes.cend(), 0.5);
+    EXPECT_EQ(1., clamped.looseness());
+
+    LooseOctree<BoxIterator, BoxIdentity> loose(boxes.cbegin(), boxes.cend(), 4.);
+    checkMatchesBruteForce(loose);
+
+    LooseOctree<BoxIterator, BoxIdentity, 16, 4> shallow(boxes.cbegin(), boxes.cend());
+    EXPECT_EQ(4u, shallow.depth());
+    checkMatchesBruteForce(shallow);
+}
+
+TEST_F(LooseOctreeTest, StoresEachValueOnce) {
+    LooseOctree<BoxIterator, BoxIdentity> tree(boxes.cbegin(), boxes.cend());
+    vector<BoxIterator> found, expected;
+    auto foundIterator = std::back_inserter(found);
+    tree.search(BoundingBox{{-10, -10, -10}, {200, 200, 200}}, foundIterator);
+    std::sort(found.begin(), found.end());
+    for (auto it = boxes.cbegin(); it != boxes.cend(); ++it) {
+        expected.push_back(it);
+    }
+    EXPECT_EQ(expected, found);
+}
+
+TEST_F(LooseOctreeTest, UnusableBoxesLeftOut) {
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    double infinity = std::numeric_limits<double>::infinity();
+    vector<BoundingBox> some = {
+        BoundingBox{{0, 0, 0}, {1, 1, 1}},
+        BoundingBox{{nan, 0, 0}, {1, 1, 1}},
+        BoundingBox{{0, 0, 0}, {1, infinity, 1}},
+        BoundingBox{{2, 0, 0}, {1, 1, 1}},
+        BoundingBox{{5, 5, 5}, {5, 5, 5}}
+    };
+    LooseOctree<BoxIterator, BoxIdentity> tree(some.cbegin(), some.cend());
+    EXPECT_EQ(2u, tree.size());
+
+    vector<BoxIterator> found;
+    auto foundIterator = std::back_inserter(found);
+    tree.search(BoundingBox{{-10, -10, -10}, {10, 10, 10}}, foundIterator);
+    EXPECT_EQ((vector<BoxIterator>{some.cbegin(), some.cbegin() + 4}), found);
+}
@@ -0,0 +1,82 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/mapped_file.h"
+
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <utility>
+
+class MappedFileTest : public ::testing::Test {
+  protected:
+	std::string path;
+	std::string contents;
+
+	MappedFileTest() : path("test_mapped_file.tmp") {}
+
+	virtual void SetUp() {
+		for (int i = 0; i < 10000; ++i) {
+			contents.push_back(static_cast<char>(i * 7));
+		}
+		std::ofstream out(path.c_str(), std::ios::binary);
+		out.write(contents.data(), contents.size());
+	}
+
+	virtual void TearDown() {
+		std::remove(path.c_str());
+	}
+};
+
+TEST_F(MappedFileTest, OpenReadsContents) {
+	MappedFile file;
+	EXPECT_FALSE(file.is_open());
+	ASSERT_TRUE(file.open(path));
+	EXPECT_TRUE(file.is_open());
+	ASSERT_EQ(contents.size(), file.size());
+	EXPECT_EQ(contents, std::string(file.data(), file.size()));
+	EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(file.data()) % alignof(std::uint64_t));
+
+	file.close();
+	EXPECT_FALSE(file.is_open());
+	EXPECT_EQ(0u, file.size());
+}
+
+TEST_F(MappedFileTest, OpenMissing) {
+	MappedFile file;
+	ASSERT_TRUE(file.open(path));
+	EXPECT_FALSE(file.open("no_such_file.tmp"));
+	EXPECT_FALSE(file.is_open());
+}
+
+TEST_F(MappedFileTest, OpenEmpty) {
+	{
+		std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+	}
+	MappedFile file;
+	ASSERT_TRUE(file.open(path));
+	EXPECT_TRUE(file.is_open());
+	EXPECT_EQ(0u, file.size());
+}
+
+TEST_F(MappedFileTest, Move) {
+	MappedFile file;
+	ASSERT_TRUE(file.open(path));
+	const char* data = file.data();
+
+	MappedFile moved(std::move(file));
+	EXPECT_FALSE(file.is_open());
+	EXPECT_EQ(data, moved.data());
+
+	MappedFile assigned;
+	assigned = std::move(moved);
+	EXPECT_FALSE(moved.is_open());
+	EXPECT_EQ(data, assigned.data());
+	EXPECT_EQ(contents, std::string(assigned.data(), assigned.size()));
+}
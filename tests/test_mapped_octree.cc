@@ -0,0 +1,161 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/mapped_octree.h"
+#include "../structures/pointerless_octree.h"
+#include "test_helpers.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+using Iterator = vector<ValuePoint<int>>::const_iterator;
+
+class MappedOctreeTest : public ::testing::Test {
+  protected:
+    vector<ValuePoint<int>> points;
+    std::string path;
+
+    MappedOctreeTest() : path("test_mapped_octree.tmp") {}
+
+    virtual void SetUp() {
+        points = randomPoints(5000, 61);
+    }
+
+    virtual void TearDown() {
+        std::remove(path.c_str());
+    }
+
+    // Every query against the tree in memory and the same tree mapped back in
+    template <typename Scalar>
+    void checkMatchesSaved() {
+        PointerlessOctree<Iterator, ExamplePointExtractor<int>, 16, 21, Scalar> built(points.cbegin(), points.cend());
+        ASSERT_TRUE(built.save(path, points.cbegin()));
+
+        MappedOctree<Iterator, ExamplePointExtractor<int>, Scalar> mapped;
+        ASSERT_TRUE(mapped.open(path, points.cbegin()));
+        EXPECT_EQ(built.size(), mapped.size());
+        EXPECT_EQ(built.depth(), mapped.depth());
+
+        for (size_t q = 0; q < 20; ++q) {
+            const Point3d& low = points[q].dimensions_;
+            const Point3d& high = points[q + 100].dimensions_;
+            BoundingBox box{
+                {std::min(low.x, high.x), std::min(low.y, high.y), std::min(low.z, high.z)},
+                {std::max(low.x, high.x), std::max(low.y, high.y), std::max(low.z, high.z)}
+            };
+            vector<Iterator> expected, output;
+            auto expectedIterator = back_inserter(expected);
+            auto outputIterator = back_inserter(output);
+            EXPECT_EQ(built.search(box, expectedIterator), mapped.search(box, outputIterator));
+            EXPECT_EQ(expected, output) << box;
+
+            expected.clear();
+            output.clear();
+            EXPECT_EQ(built.radiusSearch(low, 10., expectedIterator), mapped.radiusSearch(low, 10., outputIterator));
+            EXPECT_EQ(expected, output) << low;
+
+            expected.clear();
+            output.clear();
+            EXPECT_EQ(built.knn(high, 10, expectedIterator), mapped.knn(high, 10, outputIterator));
+            EXPECT_EQ(expected, output) << high;
+        }
+    }
+};
+
+TEST_F(MappedOctreeTest, DoubleMatchesSaved) {
+    checkMatchesSaved<double>();
+}
+
+TEST_F(MappedOctreeTest, FloatMatchesSaved) {
+    checkMatchesSaved<float>();
+}
+
+TEST_F(MappedOctreeTest, QuantizedMatchesSaved) {
+    checkMatchesSaved<Quantized<16>>();
+}
+
+TEST_F(MappedOctreeTest, Empty) {
+    PointerlessOctree<Iterator, ExamplePointExtractor<int>> built(points.cend(), points.cend());
+    ASSERT_TRUE(built.save(path, points.cbegin()));
+
+    MappedOctree<Iterator, ExamplePointExtractor<int>> mapped;
+    ASSERT_TRUE(mapped.open(path, points.cbegin()));
+    EXPECT_EQ(0u, mapped.size());
+    vector<Iterator> output;
+    auto outputIterator = back_inserter(output);
+    EXPECT_FALSE(mapped.search(BoundingBox{{0, 0, 0}, {100, 100, 100}}, outputIterator));
+    EXPECT_FALSE(mapped.knn(Point3d{0, 0, 0}, 3, outputIterator));
+    EXPECT_TRUE(output.empty());
+}
+
+TEST_F(MappedOctreeTest, RejectsOtherScalar) {
+    PointerlessOctree<Iterator, ExamplePointExtractor<int>> built(points.cbegin(), points.cend());
+    ASSERT_TRUE(built.save(path, points.cbegin()));
+
+    MappedOctree<Iterator, ExamplePointExtractor<int>, float> asFloat;
+    EXPECT_FALSE(asFloat.open(path, points.cbegin()));
+    MappedOctree<Iterator, ExamplePointExtractor<int>, Quantized<16>> asQuantized;
+    EXPECT_FALSE(asQuantized.open(path, points.cbegin()));
+    EXPECT_EQ(0u, asQuantized.size());
+}
+
+TEST_F(MappedOctreeTest, RejectsDamagedFiles) {
+    PointerlessOctree<Iterator, ExamplePointExtractor<int>> built(points.cbegin(), points.cend());
+    ASSERT_TRUE(built.save(path, points.cbegin()));
+    std::string contents;
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    auto opens = [&](const std::string& damaged) {
+        {
+            std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+            out.write(damaged.data(), damaged.size());
+        }
+        MappedOctree<Iterator, ExamplePointExtractor<int>> mapped;
+        return mapped.open(path, points.cbegin());
+    };
+
+    EXPECT_TRUE(opens(contents));
+    EXPECT_FALSE(opens(contents.substr(0, contents.size() - 1)));
+    EXPECT_FALSE(opens(contents.substr(0, 10)));
+    EXPECT_FALSE(opens(""));
+    std::string wrongMagic = contents;
+    wrongMagic[0] = 'X';
+    EXPECT_FALSE(opens(wrongMagic));
+    std::string wrongVersion = contents;
+    wrongVersion[8] = 2;
+    EXPECT_FALSE(opens(wrongVersion));
+    MappedOctree<Iterator, ExamplePointExtractor<int>> missing;
+    EXPECT_FALSE(missing.open("no_such_file.tmp", points.cbegin()));
+}
+
+TEST_F(MappedOctreeTest, Move) {
+    PointerlessOctree<Iterator, ExamplePointExtractor<int>> built(points.cbegin(), points.cend());
+    ASSERT_TRUE(built.save(path, points.cbegin()));
+    MappedOctree<Iterator, ExamplePointExtractor<int>> mapped;
+    ASSERT_TRUE(mapped.open(path, points.cbegin()));
+
+    MappedOctree<Iterator, ExamplePointExtractor<int>> moved(std::move(mapped));
+    EXPECT_EQ(0u, mapped.size());
+    EXPECT_EQ(points.size(), moved.size());
+    vector<Iterator> output;
+    auto outputIterator = back_inserter(output);
+    EXPECT_TRUE(moved.knn(points[5].dimensions_, 1, outputIterator));
+    ASSERT_EQ(1u, output.size());
+    EXPECT_EQ(points.cbegin() + 5, output[0]);
+}
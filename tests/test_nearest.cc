@@ -0,0 +1,64 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/nearest.h"
+
+#include "gtest/gtest.h"
+#include <iterator>
+#include <limits>
+#include <vector>
+
+using std::vector;
+
+TEST(NearestSet, KeepsClosest) {
+	NearestSet<int> nearest(3);
+	double distances[] = {9, 4, 7, 1, 8, 2};
+	for (int i = 0; i < 6; ++i) {
+		nearest.offer(distances[i], i);
+	}
+	EXPECT_EQ(4, nearest.bound());
+
+	vector<int> values;
+	auto out = std::back_inserter(values);
+	EXPECT_TRUE(nearest.emit(out));
+	EXPECT_EQ((vector<int>{3, 5, 1}), values);
+}
+
+TEST(NearestSet, UnboundedUntilFull) {
+	NearestSet<int> nearest(2);
+	EXPECT_EQ(std::numeric_limits<double>::infinity(), nearest.bound());
+	nearest.offer(5, 0);
+	EXPECT_EQ(std::numeric_limits<double>::infinity(), nearest.bound());
+	nearest.offer(3, 1);
+	EXPECT_EQ(5, nearest.bound());
+}
+
+TEST(NearestSet, Empty) {
+	NearestSet<int> nearest(0);
+	nearest.offer(0, 1);
+
+	vector<int> values;
+	auto out = std::back_inserter(values);
+	EXPECT_FALSE(nearest.emit(out));
+	EXPECT_TRUE(values.empty());
+}
+
+TEST(NearestSet, OfferNearest) {
+	double xs[] = {0, 5, 1, 10, 0};
+	double ys[] = {0, 0, 1, 10, 2};
+	double zs[] = {0, 0, 1, 10, 0};
+	int values[] = {0, 1, 2, 3, 4};
+
+	NearestSet<int> nearest(2);
+	offerNearest(Point3d{1, 1, 1}, xs, ys, zs, values, 5, nearest);
+
+	vector<int> found;
+	auto out = std::back_inserter(found);
+	EXPECT_TRUE(nearest.emit(out));
+	EXPECT_EQ((vector<int>{2, 0}), found);
+}
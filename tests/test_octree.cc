@@ -8,10 +8,18 @@
 #include "../structures/point3d.h"
 #include "../structures/boundingbox.h"
 #include "../structures/octree.h"
+#include "../structures/polytope.h"
+#include "../structures/ray.h"
+#include "../structures/taskpool.h"
 #include "test_helpers.h"
 
+#include <algorithm>
 #include <vector>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
 #include "gtest/gtest.h"
 
 using std::vector;
@@ -20,6 +28,35 @@ using std::array;
 
 class DefaultOctreeTest : public OctreeTest {};
 
+// Counts bytes handed out and not yet returned, across every instance
+size_t trackedBytes = 0;
+
+template <typename T>
+struct TrackingAllocator {
+    using value_type = T;
+
+    TrackingAllocator() = default;
+
+    template <typename U>
+    TrackingAllocator(const TrackingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        trackedBytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        trackedBytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const TrackingAllocator<T>&, const TrackingAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const TrackingAllocator<T>&, const TrackingAllocator<U>&) { return false; }
+
 TEST_F(DefaultOctreeTest, DefaultConstructor) {
     Octree<std::vector<ValuePoint<int>>::iterator, ExamplePointExtractor<int>> o(data.begin(), data.end());
     EXPECT_EQ(o.size(), 100);
@@ -59,6 +96,49 @@ TEST_F(DefaultOctreeTest, BoxSearchPresent) {
     EXPECT_EQ(expectedValues, outputValues);
 }
 
+TEST_F(DefaultOctreeTest, MaxDepthLeafSearch) {
+    // Identical points can never be split apart, so they all end up in one leaf past max_depth
+    vector<ValuePoint<int>> same(50, ValuePoint<int>{{1, 2, 3}, 0});
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 3> o(same.cbegin(), same.cend());
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    EXPECT_EQ(same.size(), outputValues.size());
+}
+
+TEST_F(DefaultOctreeTest, SearchEmpty) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.search(allBox, outputIterator));
+}
+
+TEST_F(DefaultOctreeTest, CustomAllocator) {
+    {
+        Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 4, 100, TrackingAllocator<char>> o(data.cbegin(), data.cend());
+        EXPECT_GT(trackedBytes, 0u);
+
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+        auto outputIterator = back_inserter(outputValues);
+        EXPECT_TRUE(o.search(allBox, outputIterator));
+        EXPECT_EQ(data.size(), outputValues.size());
+    }
+    EXPECT_EQ(0u, trackedBytes);
+}
+
+TEST_F(DefaultOctreeTest, MoveConstructor) {
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(data.cbegin(), data.cend());
+    Tree moved(std::move(o));
+    EXPECT_EQ(data.size(), moved.size());
+    EXPECT_EQ(0u, o.size());
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(moved.search(allBox, outputIterator));
+    EXPECT_EQ(data.size(), outputValues.size());
+}
+
 TEST_F(OctreeTest, BoxSearchAll) {
     Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
     vector<vector<ValuePoint<int>>::const_iterator> outputValues;
@@ -85,3 +165,1103 @@ TEST_F(OctreeTest, BoxSearchAll) {
         EXPECT_EQ(outputValues[index], expectedValues[index]) << "At index: " << index;
     }
 }
+
+TEST(OctreeParallel, ParallelBuildMatchesSerial) {
+    vector<ValuePoint<int>> points = randomPoints(50000, 7);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    TaskPool pool(4);
+    Tree serial(points.cbegin(), points.cend());
+    Tree parallel(points.cbegin(), points.cend(), pool);
+    EXPECT_EQ(serial.size(), parallel.size());
+
+    BoundingBox boxes[] = {
+        BoundingBox{{0, 0, 0}, {100, 100, 100}},
+        BoundingBox{{10, 20, 30}, {40, 50, 60}},
+        BoundingBox{{49, 49, 49}, {51, 51, 51}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<vector<ValuePoint<int>>::const_iterator> serialValues, parallelValues;
+        auto serialIterator = back_inserter(serialValues);
+        auto parallelIterator = back_inserter(parallelValues);
+        serial.search(box, serialIterator);
+        parallel.search(box, parallelIterator);
+        EXPECT_EQ(serialValues, parallelValues);
+    }
+}
+
+TEST(OctreeLazy, LazyMatchesEager) {
+    std::mt19937 generator(73);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    vector<ValuePoint<int>> points = randomPoints(50000, generator);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+    Tree eager(points.cbegin(), points.cend());
+    Tree lazy(points.cbegin(), points.cend(), LazyBuild(500));
+    EXPECT_EQ(eager.size(), lazy.size());
+
+    // Small queries first, so later ones meet a tree split in some places only
+    for (double size : {1., 5., 20., 120.}) {
+        for (size_t q = 0; q < 10; ++q) {
+            Point3d low{coordinate(generator), coordinate(generator), coordinate(generator)};
+            BoundingBox box{low, {low.x + size, low.y + size, low.z + size}};
+            Found expectedValues, outputValues;
+            auto expectedIterator = back_inserter(expectedValues);
+            auto outputIterator = back_inserter(outputValues);
+            EXPECT_EQ(eager.search(box, expectedIterator), lazy.search(box, outputIterator));
+            EXPECT_EQ(expectedValues, outputValues) << box;
+
+            expectedValues.clear();
+            outputValues.clear();
+            EXPECT_EQ(eager.radiusSearch(low, size, expectedIterator), lazy.radiusSearch(low, size, outputIterator));
+            EXPECT_EQ(expectedValues, outputValues) << low;
+
+            expectedValues.clear();
+            outputValues.clear();
+            EXPECT_EQ(eager.knn(low, 5, expectedIterator), lazy.knn(low, 5, outputIterator));
+            EXPECT_EQ(expectedValues, outputValues) << low;
+        }
+    }
+}
+
+TEST(OctreeLazy, ConcurrentQueries) {
+    std::mt19937 generator(79);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    vector<ValuePoint<int>> points = randomPoints(50000, generator);
+    vector<BoundingBox> boxes;
+    for (size_t i = 0; i < 400; ++i) {
+        Point3d low{coordinate(generator), coordinate(generator), coordinate(generator)};
+        boxes.push_back(BoundingBox{low, {low.x + 10, low.y + 10, low.z + 10}});
+    }
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree eager(points.cbegin(), points.cend());
+    Tree::batch_results expected;
+    eager.searchBatch(boxes.begin(), boxes.end(), expected);
+
+    // Every thread starts at the unsplit root, and threads keep meeting
+    // subtrees another is splitting
+    TaskPool pool(4);
+    for (size_t round = 0; round < 3; ++round) {
+        Tree lazy(points.cbegin(), points.cend(), LazyBuild(200));
+        Tree::batch_results found(boxes.size());
+        {
+            TaskGroup group(pool);
+            for (size_t task = 0; task < 8; ++task) {
+                group.run([&lazy, &boxes, &found, task]() {
+                    for (size_t i = task; i < boxes.size(); i += 8) {
+                        auto outputIterator = back_inserter(found[i]);
+                        lazy.search(boxes[i], outputIterator);
+                    }
+                });
+            }
+            group.wait();
+        }
+        EXPECT_EQ(expected, found);
+
+        Tree::batch_results batch;
+        Tree lazyBatch(points.cbegin(), points.cend(), LazyBuild(200));
+        lazyBatch.searchBatch(boxes.begin(), boxes.end(), batch, pool);
+        EXPECT_EQ(expected, batch);
+    }
+}
+
+TEST(OctreeLazy, ChangesBeforeSplitting) {
+    std::mt19937 generator(83);
+    std::uniform_real_distribution<double> jitter(-2, 2);
+    vector<ValuePoint<int>> points = randomPoints(5000, generator);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+    Tree lazy(points.cbegin(), points.cend(), LazyBuild(100));
+    EXPECT_TRUE(lazy.erase(points.cbegin() + 10));
+    EXPECT_FALSE(lazy.erase(points.cbegin() + 10));
+    EXPECT_TRUE(lazy.insert(points.cbegin() + 10));
+    for (ValuePoint<int>& point : points) {
+        point.dimensions_.x += jitter(generator);
+        point.dimensions_.y += jitter(generator);
+        point.dimensions_.z += jitter(generator);
+    }
+    points[20].dimensions_ = Point3d{99.5, 99.5, 99.5};
+    points[30].dimensions_ = Point3d{0.5, 0.5, 0.5};
+
+    // Only the two that jumped leave their nodes, and only the paths they go
+    // back in along are split
+    size_t unsplit = lazy.stats().unsplit_nodes_;
+    ASSERT_GT(unsplit, 2u);
+    EXPECT_EQ(2u, lazy.update(2.));
+    EXPECT_GE(lazy.stats().unsplit_nodes_, unsplit - 2);
+
+    // Moved, so the queries split what update() left alone
+    Tree moved(std::move(lazy));
+    ASSERT_EQ(points.size(), moved.size());
+    BoundingBox box{{20, 20, 20}, {60, 60, 60}};
+    Found expectedValues, outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    for (auto it = points.cbegin(); it != points.cend(); ++it) {
+        if (box.contains(it->dimensions_)) {
+            expectedValues.push_back(it);
+        }
+    }
+    moved.search(box, outputIterator);
+    std::sort(outputValues.begin(), outputValues.end());
+    EXPECT_EQ(expectedValues, outputValues);
+}
+
+TEST(OctreeStats, QueriesCountTheirWork) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 89);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+    Tree o(points.cbegin(), points.cend());
+
+    BoundingBox box{{10, 20, 30}, {25, 35, 45}};
+    Found expectedValues, outputValues;
+    auto expectedIterator = back_inserter(expectedValues);
+    auto outputIterator = back_inserter(outputValues);
+    QueryStats stats;
+    EXPECT_EQ(o.search(box, expectedIterator), o.search(box, outputIterator, stats));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(outputValues.size(), stats.hits_);
+    EXPECT_GT(stats.nodes_pruned_, 0u);
+    EXPECT_LT(stats.nodes_pruned_, stats.nodes_visited_);
+    EXPECT_GT(stats.points_tested_, 0u);
+    EXPECT_LT(stats.points_tested_, points.size());
+
+    // Everything is inside, so nothing below the root is looked at
+    QueryStats all;
+    outputValues.clear();
+    o.search(BoundingBox{{-1, -1, -1}, {101, 101, 101}}, outputIterator, all);
+    EXPECT_EQ(points.size(), all.hits_);
+    EXPECT_EQ(1u, all.nodes_visited_);
+    EXPECT_EQ(0u, all.points_tested_);
+
+    Point3d centre{50, 50, 50};
+    QueryStats radius;
+    expectedValues.clear();
+    outputValues.clear();
+    EXPECT_EQ(o.radiusSearch(centre, 8., expectedIterator), o.radiusSearch(centre, 8., outputIterator, radius));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(outputValues.size(), radius.hits_);
+    EXPECT_GT(radius.nodes_pruned_, 0u);
+
+    QueryStats nearest;
+    expectedValues.clear();
+    outputValues.clear();
+    EXPECT_EQ(o.knn(centre, 10, expectedIterator), o.knn(centre, 10, outputIterator, nearest));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(10u, nearest.hits_);
+    EXPECT_GE(nearest.points_tested_, 10u);
+    EXPECT_GT(nearest.nodes_pruned_, 0u);
+    EXPECT_LE(nearest.nodes_pruned_, nearest.nodes_visited_);
+}
+
+TEST(OctreeStats, Shape) {
+    vector<ValuePoint<int>> points = randomPoints(5000, 97);
+    // Too many to split apart before the depth limit
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{50, 50, 50};
+    }
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 8>;
+    Tree o(points.cbegin(), points.cend());
+    TreeStats stats = o.stats();
+    EXPECT_EQ(points.size(), stats.points_);
+    EXPECT_EQ(stats.nodes_, stats.internal_nodes_ + stats.leaves_);
+    EXPECT_EQ(stats.nodes_, std::accumulate(stats.nodes_by_depth_.begin(), stats.nodes_by_depth_.end(), size_t(0)));
+    EXPECT_EQ(stats.leaves_, std::accumulate(stats.leaves_by_size_.begin(), stats.leaves_by_size_.end(), size_t(0)));
+    EXPECT_EQ(1u, stats.nodes_by_depth_[0]);
+    EXPECT_EQ(18u, stats.leaves_by_size_.size());
+    EXPECT_EQ(1u, stats.leaves_by_size_.back());
+    EXPECT_EQ(1u, stats.max_depth_leaves_);
+    EXPECT_EQ(10u, stats.nodes_by_depth_.size());
+    EXPECT_GT(stats.emptyChildRatio(), 0.);
+    EXPECT_LT(stats.emptyChildRatio(), 1.);
+    EXPECT_GT(stats.bytesPerPoint(), 3 * sizeof(double));
+
+    EXPECT_EQ(0u, Tree().stats().nodes_);
+}
+
+TEST(OctreeStats, LazyShape) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 101);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree eager(points.cbegin(), points.cend());
+    Tree lazy(points.cbegin(), points.cend(), LazyBuild(1000));
+    TreeStats before = lazy.stats();
+    EXPECT_EQ(1u, before.nodes_);
+    EXPECT_EQ(1u, before.unsplit_nodes_);
+    EXPECT_EQ(points.size(), before.points_);
+
+    vector<vector<ValuePoint<int>>::const_iterator> found;
+    auto outputIterator = back_inserter(found);
+    lazy.search(BoundingBox{{-1, -1, -1}, {101, 101, 101}}, outputIterator);
+    TreeStats after = lazy.stats();
+    TreeStats expected = eager.stats();
+    EXPECT_EQ(0u, after.unsplit_nodes_);
+    EXPECT_EQ(expected.nodes_by_depth_, after.nodes_by_depth_);
+    EXPECT_EQ(expected.leaves_by_size_, after.leaves_by_size_);
+}
+
+TEST(OctreeSearch, SearchMatchesBruteForce) {
+    // Queries that miss, graze, cut through and swallow whole subtrees
+    vector<ValuePoint<int>> points = randomPoints(20000, 11);
+
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{25, 25, 25}, {75, 75, 75}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (box.contains(it->dimensions_)) {
+                expectedValues.push_back(it);
+            }
+        }
+
+        EXPECT_EQ(!expectedValues.empty(), o.search(box, outputIterator)) << box;
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << box;
+    }
+}
+
+TEST(OctreeSearch, VisitMatchesSearch) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 17);
+    // Enough copies of one point to fill a max depth leaf
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    Octree<iterator, ExamplePointExtractor<int>, 16, 8> o(points.cbegin(), points.cend());
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<iterator> expectedValues, visited;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(box, expectedIterator);
+
+        auto all = [&](iterator value, const Point3d& p) {
+            EXPECT_EQ(value->dimensions_, p);
+            visited.push_back(value);
+            return Visit::CONTINUE;
+        };
+        EXPECT_FALSE(o.visit(box, all)) << box;
+        EXPECT_EQ(expectedValues, visited) << box;
+
+        // Asking whether there is anything in the box stops at the first value
+        size_t calls = 0;
+        bool any = o.visit(box, [&](iterator, const Point3d&) {
+            ++calls;
+            return Visit::STOP;
+        });
+        EXPECT_EQ(!expectedValues.empty(), any) << box;
+        EXPECT_EQ(expectedValues.empty() ? 0u : 1u, calls) << box;
+
+        visited.clear();
+        EXPECT_EQ(expectedValues.size() >= 100, o.visit(box, [&](iterator value, const Point3d&) {
+            visited.push_back(value);
+            return visited.size() == 100 ? Visit::STOP : Visit::CONTINUE;
+        })) << box;
+        expectedValues.resize(std::min<size_t>(expectedValues.size(), 100));
+        EXPECT_EQ(expectedValues, visited) << box;
+    }
+}
+
+TEST(OctreeSearch, SearchRangeMatchesSearch) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 19);
+    // More copies of one point than a block holds, in a max depth leaf
+    for (size_t i = 0; i < 100; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = Octree<iterator, ExamplePointExtractor<int>, 16, 8>;
+    Tree eager(points.cbegin(), points.cend());
+    Tree lazy(points.cbegin(), points.cend(), LazyBuild(500));
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{29, 29, 29}, {30, 30, 30}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const Tree* o : {&eager, &lazy}) {
+        for (const BoundingBox& box : boxes) {
+            vector<iterator> expectedValues, found;
+            auto expectedIterator = back_inserter(expectedValues);
+            eager.search(box, expectedIterator);
+
+            Tree::search_range range = o->searchRange(box);
+            EXPECT_EQ(expectedValues.empty(), range.empty()) << box;
+            for (iterator value : range) {
+                found.push_back(value);
+            }
+            EXPECT_EQ(expectedValues, found) << box;
+
+            // Stopping early, through post increment
+            found.clear();
+            for (Tree::search_iterator it = range.begin(); it != range.end() && found.size() < 10; ) {
+                found.push_back(*it++);
+            }
+            expectedValues.resize(std::min<size_t>(expectedValues.size(), 10));
+            EXPECT_EQ(expectedValues, found) << box;
+        }
+    }
+
+    Tree empty;
+    EXPECT_TRUE(empty.searchRange(BoundingBox{{-10, -10, -10}, {110, 110, 110}}).empty());
+}
+
+TEST(OctreeSearch, KnnMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 13);
+
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    Point3d centres[] = {
+        Point3d{50, 50, 50}, Point3d{0, 0, 0}, Point3d{-20, 130, 40}, points[17].dimensions_
+    };
+    auto distance = [](const Point3d& a, const Point3d& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+    };
+    for (const Point3d& centre : centres) {
+        for (size_t k : {size_t(1), size_t(10), size_t(100)}) {
+            vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+            auto outputIterator = back_inserter(outputValues);
+            for (auto it = points.cbegin(); it != points.cend(); ++it) {
+                expectedValues.push_back(it);
+            }
+            std::partial_sort(expectedValues.begin(), expectedValues.begin() + k, expectedValues.end(),
+                [&](vector<ValuePoint<int>>::const_iterator a, vector<ValuePoint<int>>::const_iterator b) {
+                    return distance(a->dimensions_, centre) < distance(b->dimensions_, centre);
+                });
+            expectedValues.resize(k);
+
+            EXPECT_TRUE(o.knn(centre, k, outputIterator));
+            EXPECT_EQ(expectedValues, outputValues) << centre << " k=" << k;
+        }
+    }
+}
+
+TEST_F(DefaultOctreeTest, KnnMoreThanSize) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(o.knn(Point3d{-1, 0, 1}, 1000, outputIterator));
+
+    // The data lies on a line that starts nearest the query point
+    vector<vector<ValuePoint<int>>::const_iterator> expectedValues;
+    for (auto it = data.cbegin(); it != data.cend(); ++it) {
+        expectedValues.push_back(it);
+    }
+    EXPECT_EQ(expectedValues, outputValues);
+}
+
+TEST_F(DefaultOctreeTest, KnnNone) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.knn(Point3d{0, 0, 0}, 0, outputIterator));
+    EXPECT_FALSE(empty.knn(Point3d{0, 0, 0}, 5, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(OctreeSearch, RadiusSearchMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 17);
+
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    std::pair<Point3d, double> spheres[] = {
+        {Point3d{50, 50, 50}, 0.},
+        {Point3d{50, 50, 50}, 7.5},
+        {Point3d{50, 50, 50}, 40.},
+        {Point3d{0, 100, 0}, 30.},
+        {Point3d{-50, -50, -50}, 10.},
+        {Point3d{50, 50, 50}, 1000.},
+        {points[5].dimensions_, 3.}
+    };
+    for (const std::pair<Point3d, double>& sphere : spheres) {
+        const Point3d& centre = sphere.first;
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            double dx = it->dimensions_.x - centre.x;
+            double dy = it->dimensions_.y - centre.y;
+            double dz = it->dimensions_.z - centre.z;
+            if (dx * dx + dy * dy + dz * dz <= sphere.second * sphere.second) {
+                expectedValues.push_back(it);
+            }
+        }
+
+        EXPECT_EQ(!expectedValues.empty(), o.radiusSearch(centre, sphere.second, outputIterator)) << centre;
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << centre << " r=" << sphere.second;
+    }
+}
+
+TEST_F(DefaultOctreeTest, RadiusSearchNone) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.radiusSearch(data[0].dimensions_, -1, outputIterator));
+    EXPECT_FALSE(empty.radiusSearch(data[0].dimensions_, 10, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(OctreeSearch, RaycastMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 31);
+    // Copies of one point in a max depth leaf, all hit at once
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    Octree<iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    std::pair<Ray, double> rays[] = {
+        {Ray(Point3d{-10, 50, 50}, Point3d{1, 0, 0}), 2.},
+        {Ray(Point3d{50, 50, 50}, Point3d{1, 2, 3}), 5.},
+        {Ray(Point3d{-10, -10, -10}, Point3d{1, 1, 1}), 1.},
+        {Ray::segment(Point3d{10, 90, 20}, Point3d{80, 15, 60}), 4.},
+        {Ray(Point3d{0, 0, 200}, Point3d{0, 0, 1}), 50.},
+        {Ray(Point3d{-10, 50, 50}, Point3d{-1, 0, 0}), 20.},
+        {Ray::segment(points[77].dimensions_, points[77].dimensions_), 6.},
+        {Ray(Point3d{50, 50, 50}, Point3d{0, 1, 0}), 0.}
+    };
+    for (const std::pair<Ray, double>& query : rays) {
+        const Ray& ray = query.first;
+        double radius = query.second;
+        vector<std::pair<double, iterator>> expected;
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            double t = ray.along(it->dimensions_);
+            if (ray.distanceSquared(it->dimensions_, t) <= radius * radius) {
+                expected.push_back(std::make_pair(t, it));
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        vector<iterator> hits, expectedHits;
+        auto hitsIterator = back_inserter(hits);
+        EXPECT_EQ(!expected.empty(), o.raycast(ray, radius, hitsIterator)) << ray;
+        for (size_t i = 1; i < hits.size(); ++i) {
+            EXPECT_LE(ray.along(hits[i - 1]->dimensions_), ray.along(hits[i]->dimensions_)) << ray;
+        }
+        for (const std::pair<double, iterator>& hit : expected) {
+            expectedHits.push_back(hit.second);
+        }
+        std::sort(expectedHits.begin(), expectedHits.end());
+        std::sort(hits.begin(), hits.end());
+        EXPECT_EQ(expectedHits, hits) << ray << " r=" << radius;
+
+        for (size_t k : {size_t(1), size_t(10)}) {
+            vector<iterator> first;
+            auto firstIterator = back_inserter(first);
+            EXPECT_EQ(!expected.empty(), o.firstHits(ray, radius, k, firstIterator)) << ray;
+            ASSERT_EQ(std::min(k, expected.size()), first.size()) << ray;
+            for (size_t i = 0; i < first.size(); ++i) {
+                EXPECT_EQ(expected[i].first, ray.along(first[i]->dimensions_)) << ray << " k=" << k;
+            }
+        }
+    }
+}
+
+TEST_F(DefaultOctreeTest, RaycastNone) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    Ray ray(Point3d{0, 0, 0}, Point3d{1, 1, 1});
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    EXPECT_FALSE(o.raycast(ray, -1, outputIterator));
+    EXPECT_FALSE(o.raycast(Ray(Point3d{nan, 0, 0}, Point3d{1, 1, 1}), 10, outputIterator));
+    EXPECT_FALSE(o.firstHits(ray, 10, 0, outputIterator));
+    EXPECT_FALSE(empty.raycast(ray, 10, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+
+    // The data lies along the line from (0, 1, 2) in steps of (1, 1, 1)
+    EXPECT_TRUE(o.firstHits(Ray(Point3d{200, 201, 202}, Point3d{-1, -1, -1}), 0.5, 1, outputIterator));
+    EXPECT_EQ((vector<vector<ValuePoint<int>>::const_iterator>{data.cend() - 1}), outputValues);
+}
+
+TEST(OctreeSearch, PolytopeMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 37);
+    // Copies of one point in a max depth leaf
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    Octree<iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    ConvexPolytope polytopes[] = {
+        ConvexPolytope::frustum(Point3d{-20, 50, 50}, Point3d{1, 0, 0}, Point3d{0, 0, 1}, 1., 1.5, 5., 80.),
+        ConvexPolytope::frustum(Point3d{50, 50, 50}, Point3d{1, 2, -1}, Point3d{0, 0, 1}, 2., 1., 0.5, 30.),
+        ConvexPolytope::frustum(Point3d{500, 500, 500}, Point3d{1, 0, 0}, Point3d{0, 0, 1}, 1., 1., 1., 100.),
+        ConvexPolytope(BoundingBox{{20, 20, 20}, {60, 70, 45}}),
+        ConvexPolytope(BoundingBox{{30, 30, 30}, {30, 30, 30}}),
+        ConvexPolytope(vector<Plane>{Plane{{1, 1, 1}, 150}, Plane{{-1, -1, -1}, -120}, Plane{{0, 1, -1}, 10}}),
+        ConvexPolytope()
+    };
+    for (const ConvexPolytope& polytope : polytopes) {
+        vector<iterator> expected;
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (polytope.contains(it->dimensions_)) {
+                expected.push_back(it);
+            }
+        }
+
+        vector<iterator> found;
+        auto foundIterator = back_inserter(found);
+        EXPECT_EQ(!expected.empty(), o.search(polytope, foundIterator)) << polytope;
+        std::sort(found.begin(), found.end());
+        EXPECT_EQ(expected, found) << polytope;
+    }
+}
+
+TEST_F(DefaultOctreeTest, PolytopeSearchNone) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    EXPECT_FALSE(o.search(ConvexPolytope(vector<Plane>{Plane{{nan, 0, 0}, 1}}), outputIterator));
+    EXPECT_FALSE(o.search(ConvexPolytope(vector<Plane>{Plane{{1, 0, 0}, -1}}), outputIterator));
+    EXPECT_FALSE(empty.search(ConvexPolytope(), outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(OctreeSearch, JoinMatchesBruteForce) {
+    std::mt19937 generator(41);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    vector<ValuePoint<int>> points = randomPoints(1200, generator);
+    vector<ValuePoint<int>> others(900);
+    for (size_t i = 0; i < others.size(); ++i) {
+        others[i].dimensions_ = Point3d{coordinate(generator) + 20, coordinate(generator), coordinate(generator)};
+        others[i].value_ = static_cast<int>(i);
+    }
+    // Copies of one point in a max depth leaf in each
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = others[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = Octree<iterator, ExamplePointExtractor<int>>;
+    using pair = Tree::join_pair;
+    Tree o(points.cbegin(), points.cend()), other(others.cbegin(), others.cend());
+    Tree lazy(points.cbegin(), points.cend(), LazyBuild(500));
+    TaskPool pool(3);
+    auto within = [](iterator a, iterator b, double epsilon) {
+        double dx = a->dimensions_.x - b->dimensions_.x;
+        double dy = a->dimensions_.y - b->dimensions_.y;
+        double dz = a->dimensions_.z - b->dimensions_.z;
+        return dx * dx + dy * dy + dz * dz <= epsilon * epsilon;
+    };
+    for (double epsilon : {0., 2.5, 8., 1000.}) {
+        vector<pair> expected, expectedSelf;
+        for (auto a = points.cbegin(); a != points.cend(); ++a) {
+            for (auto b = others.cbegin(); b != others.cend(); ++b) {
+                if (within(a, b, epsilon)) {
+                    expected.push_back(pair(a, b));
+                }
+            }
+            for (auto b = a + 1; b != points.cend(); ++b) {
+                if (within(a, b, epsilon)) {
+                    expectedSelf.push_back(pair(a, b));
+                }
+            }
+        }
+
+        vector<pair> found, parallel;
+        auto foundIterator = back_inserter(found);
+        auto parallelIterator = back_inserter(parallel);
+        EXPECT_EQ(!expected.empty(), o.join(other, epsilon, foundIterator)) << epsilon;
+        EXPECT_EQ(!expected.empty(), o.join(other, epsilon, parallelIterator, pool)) << epsilon;
+        std::sort(found.begin(), found.end());
+        std::sort(parallel.begin(), parallel.end());
+        EXPECT_EQ(expected, found) << epsilon;
+        EXPECT_EQ(expected, parallel) << epsilon;
+
+        // Each pair once, in either order
+        for (const Tree* tree : {&o, &lazy}) {
+            for (bool inPool : {false, true}) {
+                vector<pair> self;
+                auto selfIterator = back_inserter(self);
+                EXPECT_EQ(!expectedSelf.empty(), inPool ? tree->selfJoin(epsilon, selfIterator, pool)
+                                                        : tree->selfJoin(epsilon, selfIterator)) << epsilon;
+                for (pair& p : self) {
+                    if (p.second < p.first) {
+                        std::swap(p.first, p.second);
+                    }
+                }
+                std::sort(self.begin(), self.end());
+                EXPECT_EQ(expectedSelf, self) << epsilon;
+            }
+        }
+    }
+}
+
+// However many threads share the join, the pairs come out in the order the
+// serial join finds them. Pairs of points scattered around a dense clump
+// sit in shallow leaves, whose pairs the top of the walk finds itself.
+TEST(OctreeSearch, JoinOrderIndependentOfThreads) {
+    vector<ValuePoint<int>> points = randomPoints(8000, 43), others = randomPoints(8000, 47);
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i >= 100) {
+            points[i].dimensions_ = Point3d{points[i].dimensions_.x * 0.4, points[i].dimensions_.y * 0.4,
+                                            points[i].dimensions_.z * 0.4};
+            others[i].dimensions_ = Point3d{others[i].dimensions_.x * 0.4, others[i].dimensions_.y * 0.4,
+                                            others[i].dimensions_.z * 0.4};
+        } else if (i % 2) {
+            points[i].dimensions_ = others[i].dimensions_ = points[i - 1].dimensions_;
+        }
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = Octree<iterator, ExamplePointExtractor<int>>;
+    using pair = Tree::join_pair;
+    Tree o(points.cbegin(), points.cend()), other(others.cbegin(), others.cend());
+    vector<pair> serial, serialSelf;
+    auto serialIterator = back_inserter(serial);
+    auto serialSelfIterator = back_inserter(serialSelf);
+    o.join(other, 5., serialIterator);
+    o.selfJoin(5., serialSelfIterator);
+    ASSERT_FALSE(serial.empty());
+    ASSERT_FALSE(serialSelf.empty());
+
+    for (size_t threads : {0, 1, 3, 7}) {
+        TaskPool pool(threads);
+        vector<pair> parallel, parallelSelf;
+        auto parallelIterator = back_inserter(parallel);
+        auto parallelSelfIterator = back_inserter(parallelSelf);
+        o.join(other, 5., parallelIterator, pool);
+        o.selfJoin(5., parallelSelfIterator, pool);
+        EXPECT_EQ(serial, parallel) << threads;
+        EXPECT_EQ(serialSelf, parallelSelf) << threads;
+    }
+}
+
+TEST_F(DefaultOctreeTest, JoinNone) {
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(data.cbegin(), data.cend()), empty;
+    TaskPool pool(2);
+    vector<Tree::join_pair> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.join(o, -1, outputIterator));
+    EXPECT_FALSE(o.join(empty, 10, outputIterator));
+    EXPECT_FALSE(empty.join(o, 10, outputIterator, pool));
+    EXPECT_FALSE(o.selfJoin(std::numeric_limits<double>::quiet_NaN(), outputIterator, pool));
+    EXPECT_FALSE(empty.selfJoin(10, outputIterator));
+    // Neighbours are sqrt(3) apart
+    EXPECT_FALSE(o.selfJoin(1.7, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(OctreeSearch, SearchBatchMatchesSearch) {
+    std::mt19937 generator(19);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    std::uniform_real_distribution<double> edge(0, 20);
+    vector<ValuePoint<int>> points = randomPoints(20000, generator);
+
+    // Plenty of boxes that overlap each other, and some that miss entirely
+    vector<BoundingBox> boxes;
+    for (size_t i = 0; i < 500; ++i) {
+        Point3d low{coordinate(generator) - 10, coordinate(generator) - 10, coordinate(generator) - 10};
+        boxes.push_back(BoundingBox{low, {low.x + edge(generator), low.y + edge(generator), low.z + edge(generator)}});
+    }
+    boxes.push_back(BoundingBox{{-10, -10, -10}, {110, 110, 110}});
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(points.cbegin(), points.cend());
+    TaskPool pool(3);
+    Tree::batch_results serial, parallel;
+    o.searchBatch(boxes.begin(), boxes.end(), serial);
+    o.searchBatch(boxes.begin(), boxes.end(), parallel, pool);
+    ASSERT_EQ(boxes.size(), serial.size());
+    ASSERT_EQ(boxes.size(), parallel.size());
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        vector<vector<ValuePoint<int>>::const_iterator> expectedValues;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(boxes[i], expectedIterator);
+        EXPECT_EQ(expectedValues, serial[i]) << boxes[i];
+        EXPECT_EQ(expectedValues, parallel[i]) << boxes[i];
+    }
+}
+
+TEST_F(DefaultOctreeTest, SearchBatchEmpty) {
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(data.cbegin(), data.cend()), empty;
+    vector<BoundingBox> boxes{allBox, allBox};
+    Tree::batch_results results;
+
+    o.searchBatch(boxes.begin(), boxes.begin(), results);
+    EXPECT_TRUE(results.empty());
+
+    empty.searchBatch(boxes.begin(), boxes.end(), results);
+    ASSERT_EQ(2u, results.size());
+    EXPECT_TRUE(results[0].empty());
+    EXPECT_TRUE(results[1].empty());
+}
+
+TEST_F(DefaultOctreeTest, InsertIntoEmpty) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o;
+    for (auto it = data.cbegin(); it != data.cend(); ++it) {
+        EXPECT_TRUE(o.insert(it));
+    }
+    EXPECT_EQ(data.size(), o.size());
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+    auto outputIterator = back_inserter(outputValues);
+    for (auto it = data.cbegin(); it != data.cend(); ++it) {
+        expectedValues.push_back(it);
+    }
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    std::sort(outputValues.begin(), outputValues.end());
+    EXPECT_EQ(expectedValues, outputValues);
+}
+
+TEST_F(DefaultOctreeTest, EraseEverything) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    for (auto it = data.cbegin(); it != data.cend(); ++it) {
+        EXPECT_TRUE(o.erase(it));
+    }
+    EXPECT_EQ(0u, o.size());
+    EXPECT_FALSE(o.erase(data.cbegin()));
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.search(allBox, outputIterator));
+
+    // And the tree still works afterwards
+    EXPECT_TRUE(o.insert(data.cbegin() + 10));
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    ASSERT_EQ(1u, outputValues.size());
+    EXPECT_EQ(data.cbegin() + 10, outputValues[0]);
+}
+
+TEST_F(DefaultOctreeTest, EraseMissing) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cbegin() + 50);
+    EXPECT_FALSE(o.erase(data.cbegin() + 75));
+    EXPECT_EQ(50u, o.size());
+}
+
+TEST_F(DefaultOctreeTest, InsertNonFinite) {
+    vector<ValuePoint<int>> bad{
+        ValuePoint<int>{{std::numeric_limits<double>::quiet_NaN(), 0, 0}, 0},
+        ValuePoint<int>{{0, std::numeric_limits<double>::infinity(), 0}, 1}
+    };
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    EXPECT_FALSE(o.insert(bad.cbegin()));
+    EXPECT_FALSE(o.insert(bad.cbegin() + 1));
+    EXPECT_EQ(data.size(), o.size());
+}
+
+TEST_F(DefaultOctreeTest, InsertEraseMaxDepth) {
+    // Identical points sink past max_depth, into a leaf that has to grow
+    vector<ValuePoint<int>> same(200, ValuePoint<int>{{1, 2, 3}, 0});
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 4, 3> o(same.cbegin(), same.cbegin() + 10);
+    for (auto it = same.cbegin() + 10; it != same.cend(); ++it) {
+        EXPECT_TRUE(o.insert(it));
+    }
+    for (auto it = same.cbegin(); it != same.cend(); it += 2) {
+        EXPECT_TRUE(o.erase(it));
+    }
+    EXPECT_EQ(100u, o.size());
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+    auto outputIterator = back_inserter(outputValues);
+    for (auto it = same.cbegin() + 1; it < same.cend(); it += 2) {
+        expectedValues.push_back(it);
+    }
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    std::sort(outputValues.begin(), outputValues.end());
+    EXPECT_EQ(expectedValues, outputValues);
+}
+
+TEST(OctreeSearch, InsertEraseMatchesBruteForce) {
+    // Later points are spread wider than the first ones, so the root has to grow
+    std::mt19937 generator(23);
+    std::uniform_real_distribution<double> inner(0, 100), outer(-250, 350);
+    std::uniform_int_distribution<size_t> pick(0, 9999);
+    vector<ValuePoint<int>> points(10000);
+    for (size_t i = 0; i < points.size(); ++i) {
+        std::uniform_real_distribution<double>& coordinate = i < 5000 ? inner : outer;
+        points[i].dimensions_ = Point3d{coordinate(generator), coordinate(generator), coordinate(generator)};
+        points[i].value_ = static_cast<int>(i);
+    }
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(points.cbegin(), points.cbegin() + 5000);
+    vector<bool> present(points.size(), false);
+    std::fill(present.begin(), present.begin() + 5000, true);
+
+    BoundingBox boxes[] = {
+        BoundingBox{{-300, -300, -300}, {400, 400, 400}},
+        BoundingBox{{0, 0, 0}, {100, 100, 100}},
+        BoundingBox{{20, -100, 50}, {200, 40, 60}},
+        BoundingBox{{-250, 90, 90}, {0, 110, 350}}
+    };
+    for (size_t round = 0; round < 10; ++round) {
+        for (size_t change = 0; change < 1000; ++change) {
+            size_t i = pick(generator);
+            if (present[i]) {
+                EXPECT_TRUE(o.erase(points.cbegin() + i));
+            } else {
+                EXPECT_TRUE(o.insert(points.cbegin() + i));
+            }
+            present[i] = !present[i];
+        }
+        EXPECT_EQ(static_cast<size_t>(std::count(present.begin(), present.end(), true)), o.size());
+
+        for (const BoundingBox& box : boxes) {
+            vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+            auto outputIterator = back_inserter(outputValues);
+            for (size_t i = 0; i < points.size(); ++i) {
+                if (present[i] && box.contains(points[i].dimensions_)) {
+                    expectedValues.push_back(points.cbegin() + i);
+                }
+            }
+            o.search(box, outputIterator);
+            std::sort(outputValues.begin(), outputValues.end());
+            EXPECT_EQ(expectedValues, outputValues) << "round " << round << " " << box;
+        }
+    }
+}
+
+TEST_F(DefaultOctreeTest, InsertTooFarToGrow) {
+    // Further out than doubling the root max_root_growth times reaches
+    vector<ValuePoint<int>> far{ValuePoint<int>{{1e300, -1e300, 0}, 0}};
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    EXPECT_TRUE(o.insert(far.cbegin()));
+    EXPECT_EQ(data.size() + 1, o.size());
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(o.search(BoundingBox{{1e299, -1e301, -1}, {1e301, -1e299, 1}}, outputIterator));
+    ASSERT_EQ(1u, outputValues.size());
+    EXPECT_EQ(far.cbegin(), outputValues[0]);
+
+    outputValues.clear();
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    EXPECT_EQ(data.size(), outputValues.size());
+}
+
+TEST_F(DefaultOctreeTest, UpdateUnmoved) {
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    EXPECT_EQ(0u, o.update());
+    EXPECT_EQ(data.size(), o.size());
+}
+
+TEST_F(DefaultOctreeTest, UpdateDropsNonFinite) {
+    vector<ValuePoint<int>> moving(data);
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(moving.cbegin(), moving.cend());
+    moving[3].dimensions_.x = std::numeric_limits<double>::quiet_NaN();
+    EXPECT_EQ(1u, o.update());
+    EXPECT_EQ(moving.size() - 1, o.size());
+    EXPECT_FALSE(o.erase(moving.cbegin() + 3));
+}
+
+// A big tolerance widens every node test, but only until the next update()
+// with a smaller one
+TEST(OctreeSearch, UpdateTightensSlackAgain) {
+    vector<ValuePoint<int>> points = randomPoints(5000, 31);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+    Tree o(points.cbegin(), points.cend());
+    BoundingBox box{{10, 20, 30}, {25, 35, 45}};
+    Found outputValues;
+    auto outputIterator = back_inserter(outputValues);
+
+    QueryStats tight;
+    o.search(box, outputIterator, tight);
+    EXPECT_EQ(0u, o.update(20.));
+    QueryStats loose;
+    o.search(box, outputIterator, loose);
+    EXPECT_GT(loose.points_tested_, tight.points_tested_);
+    EXPECT_EQ(0u, o.update());
+    QueryStats again;
+    o.search(box, outputIterator, again);
+    EXPECT_EQ(tight.nodes_visited_, again.nodes_visited_);
+    EXPECT_EQ(tight.points_tested_, again.points_tested_);
+}
+
+// Points drift a little each step, and a few jump right across the space or
+// out of it. With and without tolerance, every kind of search must agree
+// with brute force over the points where they are now.
+TEST(OctreeSearch, UpdateMatchesBruteForce) {
+    auto distance = [](const Point3d& a, const Point3d& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+    };
+    for (double tolerance : {0., 0.5, 5.}) {
+        std::mt19937 generator(29);
+        std::uniform_real_distribution<double> coordinate(0, 100), jitter(-1, 1), jump(-50, 150), extent(1, 20);
+        std::uniform_int_distribution<size_t> pick(0, 2999);
+        vector<ValuePoint<int>> points = randomPoints(3000, generator);
+
+        using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+        using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+        Tree o(points.cbegin(), points.cend());
+
+        for (size_t step = 0; step < 10; ++step) {
+            for (ValuePoint<int>& point : points) {
+                point.dimensions_.x += jitter(generator);
+                point.dimensions_.y += jitter(generator);
+                point.dimensions_.z += jitter(generator);
+            }
+            for (size_t j = 0; j < 20; ++j) {
+                points[pick(generator)].dimensions_ = Point3d{jump(generator), jump(generator), jump(generator)};
+            }
+            o.update(tolerance);
+            ASSERT_EQ(points.size(), o.size());
+
+            for (size_t query = 0; query < 5; ++query) {
+                Point3d centre{coordinate(generator), coordinate(generator), coordinate(generator)};
+                double radius = extent(generator);
+                BoundingBox box{
+                    {centre.x - radius, centre.y - extent(generator), centre.z - radius},
+                    {centre.x + extent(generator), centre.y + radius, centre.z + extent(generator)}
+                };
+
+                Found outputValues, expectedValues;
+                auto outputIterator = back_inserter(outputValues);
+                for (auto it = points.cbegin(); it != points.cend(); ++it) {
+                    if (box.contains(it->dimensions_)) {
+                        expectedValues.push_back(it);
+                    }
+                }
+                o.search(box, outputIterator);
+                std::sort(outputValues.begin(), outputValues.end());
+                EXPECT_EQ(expectedValues, outputValues) << "tolerance " << tolerance << " step " << step;
+
+                Tree::batch_results batch;
+                o.searchBatch(&box, &box + 1, batch);
+                std::sort(batch[0].begin(), batch[0].end());
+                EXPECT_EQ(expectedValues, batch[0]) << "tolerance " << tolerance << " step " << step;
+
+                outputValues.clear();
+                expectedValues.clear();
+                for (auto it = points.cbegin(); it != points.cend(); ++it) {
+                    if (distance(it->dimensions_, centre) <= radius * radius) {
+                        expectedValues.push_back(it);
+                    }
+                }
+                o.radiusSearch(centre, radius, outputIterator);
+                std::sort(outputValues.begin(), outputValues.end());
+                EXPECT_EQ(expectedValues, outputValues) << "tolerance " << tolerance << " step " << step;
+
+                Found nearest;
+                auto nearestIterator = back_inserter(nearest);
+                o.knn(centre, 10, nearestIterator);
+                vector<double> distances, expectedDistances;
+                for (auto it = points.cbegin(); it != points.cend(); ++it) {
+                    expectedDistances.push_back(distance(it->dimensions_, centre));
+                }
+                std::sort(expectedDistances.begin(), expectedDistances.end());
+                expectedDistances.resize(10);
+                for (auto it : nearest) {
+                    distances.push_back(distance(it->dimensions_, centre));
+                }
+                EXPECT_EQ(expectedDistances, distances) << "tolerance " << tolerance << " step " << step;
+            }
+        }
+
+        // Values left loose in their leaves can still be erased
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            EXPECT_TRUE(o.erase(it));
+        }
+        EXPECT_EQ(0u, o.size());
+    }
+}
+
+TEST(OctreeSearch, InsertJustOutsideGrownRoot) {
+    // The root can't double to exactly this low edge, so points just below it
+    // end up in the old root's half of the new one
+    const double low = 0.0015290431247458585;
+    std::mt19937 generator(31);
+    std::uniform_real_distribution<double> coordinate(low, 999.99618826151902);
+    vector<ValuePoint<int>> points;
+    points.push_back(ValuePoint<int>{{low, 0, 0}, 0});
+    points.push_back(ValuePoint<int>{{999.99618826151902, 1000, 1000}, 1});
+    for (int i = 2; i < 100; ++i) {
+        points.push_back(ValuePoint<int>{{coordinate(generator), coordinate(generator), coordinate(generator)}, i});
+    }
+    points.push_back(ValuePoint<int>{{-0.051616630967689703, 500, 500}, 100});
+    double x = low;
+    for (int i = 101; i < 300; ++i) {
+        x = std::nextafter(x, -1.);
+        points.push_back(ValuePoint<int>{{x, 0, 0}, i});
+    }
+
+    Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cbegin() + 100);
+    for (auto it = points.cbegin() + 100; it != points.cend(); ++it) {
+        EXPECT_TRUE(o.insert(it));
+    }
+    for (auto it = points.cbegin() + 100; it != points.cend(); ++it) {
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+        auto outputIterator = back_inserter(outputValues);
+        EXPECT_TRUE(o.search(BoundingBox{it->dimensions_, it->dimensions_}, outputIterator));
+        EXPECT_NE(outputValues.end(), std::find(outputValues.begin(), outputValues.end(), it)) << it->value_;
+    }
+    for (auto it = points.cbegin(); it != points.cend(); ++it) {
+        EXPECT_TRUE(o.erase(it)) << it->value_;
+    }
+}
+
+// Points float can't hold exactly, answered for where the float tree rounds
+// them to, including by the values inserted after the build
+TEST(OctreeSearch, FloatMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(5000, 41);
+
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 100,
+                        std::allocator<char>, float>;
+    Tree o(points.cbegin(), points.cbegin() + 2500);
+    for (auto it = points.cbegin() + 2500; it != points.cend(); ++it) {
+        EXPECT_TRUE(o.insert(it));
+    }
+
+    // Edges right on points, which rounding may leave either side
+    for (size_t q = 0; q < 20; ++q) {
+        const Point3d& low = points[q].dimensions_;
+        const Point3d& high = points[q + 100].dimensions_;
+        BoundingBox box{
+            {std::min(low.x, high.x), std::min(low.y, high.y), std::min(low.z, high.z)},
+            {std::max(low.x, high.x), std::max(low.y, high.y), std::max(low.z, high.z)}
+        };
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (box.contains(toScalarPoint<float>(it->dimensions_))) {
+                expectedValues.push_back(it);
+            }
+        }
+        o.search(box, outputIterator);
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << box;
+
+        outputValues.clear();
+        expectedValues.clear();
+        double radius = std::sqrt((high.x - low.x) * (high.x - low.x) + (high.y - low.y) * (high.y - low.y) +
+                                  (high.z - low.z) * (high.z - low.z)) / 2;
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            Point3d p = toScalarPoint<float>(it->dimensions_);
+            if ((p.x - low.x) * (p.x - low.x) + (p.y - low.y) * (p.y - low.y) + (p.z - low.z) * (p.z - low.z) <= radius * radius) {
+                expectedValues.push_back(it);
+            }
+        }
+        o.radiusSearch(low, radius, outputIterator);
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << low;
+    }
+
+    for (auto it = points.cbegin(); it != points.cend(); ++it) {
+        EXPECT_TRUE(o.erase(it));
+    }
+}
@@ -8,10 +8,16 @@
 #include "../structures/point3d.h"
 #include "../structures/boundingbox.h"
 #include "../structures/pointerless_octree.h"
+#include "../structures/polytope.h"
+#include "../structures/ray.h"
+#include "../structures/taskpool.h"
 #include "test_helpers.h"
 
+#include <algorithm>
 #include <vector>
 #include <iterator>
+#include <random>
+#include <type_traits>
 #include "gtest/gtest.h"
 
 using std::vector;
@@ -100,3 +106,750 @@ TEST_F(PointerlessOctreeTest, BoxSearchAll) {
         EXPECT_EQ(outputValues[index], expectedValues[index]) << "At index: " << index;
     }
 }
+
+TEST_F(PointerlessOctreeTest, SubtreeSearchFromRoot) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    vector<vector<ValuePoint<int>>::const_iterator> fromRoot, fromIndex;
+    auto rootIterator = back_inserter(fromRoot);
+    auto indexIterator = back_inserter(fromIndex);
+
+    EXPECT_TRUE(o.search(allBox, rootIterator));
+    EXPECT_TRUE(o.search(allBox, indexIterator, 1));
+    EXPECT_EQ(fromRoot, fromIndex);
+}
+
+TEST_F(PointerlessOctreeTest, SubtreeSearchMissingIndex) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+
+    // The data lies on a diagonal, so nothing is ever in the bottom right front octant
+    EXPECT_FALSE(o.search(allBox, outputIterator, (1 << 3) | 1));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST_F(PointerlessOctreeTest, SearchEmpty) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.search(allBox, outputIterator));
+}
+
+TEST_F(PointerlessOctreeTest, WideIndexMaxDepth) {
+    // Identical points can never be split apart, so they sink to max_depth,
+    // which needs more than 64 bits of key at this depth
+    vector<ValuePoint<int>> same(50, ValuePoint<int>{{1, 2, 3}, 0});
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 30> o(same.cbegin(), same.cend());
+    EXPECT_EQ(o.size(), 50);
+    EXPECT_EQ(o.depth(), 30);
+
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(o.search(allBox, outputIterator));
+    EXPECT_EQ(outputValues.size(), same.size());
+}
+
+TEST_F(PointerlessOctreeTest, CopyConstructor) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> copy(o);
+    EXPECT_EQ(copy.size(), o.size());
+    EXPECT_EQ(copy.depth(), o.depth());
+
+    vector<vector<ValuePoint<int>>::const_iterator> original, copied;
+    auto originalIterator = back_inserter(original);
+    auto copiedIterator = back_inserter(copied);
+    o.search(allBox, originalIterator);
+    copy.search(allBox, copiedIterator);
+    EXPECT_EQ(original, copied);
+}
+
+TEST(PointerlessOctreeStats, QueriesCountTheirWork) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 103);
+
+    using Tree = PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    using Found = vector<vector<ValuePoint<int>>::const_iterator>;
+    Tree o(points.cbegin(), points.cend());
+
+    BoundingBox box{{10, 20, 30}, {25, 35, 45}};
+    Found expectedValues, outputValues;
+    auto expectedIterator = back_inserter(expectedValues);
+    auto outputIterator = back_inserter(outputValues);
+    QueryStats stats;
+    EXPECT_EQ(o.search(box, expectedIterator), o.search(box, outputIterator, stats));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(outputValues.size(), stats.hits_);
+    EXPECT_GT(stats.nodes_pruned_, 0u);
+    EXPECT_LT(stats.nodes_pruned_, stats.nodes_visited_);
+    EXPECT_GT(stats.points_tested_, 0u);
+    EXPECT_LT(stats.points_tested_, points.size());
+
+    Point3d centre{50, 50, 50};
+    QueryStats radius;
+    expectedValues.clear();
+    outputValues.clear();
+    EXPECT_EQ(o.radiusSearch(centre, 8., expectedIterator), o.radiusSearch(centre, 8., outputIterator, radius));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(outputValues.size(), radius.hits_);
+
+    QueryStats nearest;
+    expectedValues.clear();
+    outputValues.clear();
+    EXPECT_EQ(o.knn(centre, 10, expectedIterator), o.knn(centre, 10, outputIterator, nearest));
+    EXPECT_EQ(expectedValues, outputValues);
+    EXPECT_EQ(10u, nearest.hits_);
+    EXPECT_GE(nearest.points_tested_, 10u);
+    EXPECT_LE(nearest.nodes_pruned_, nearest.nodes_visited_);
+}
+
+TEST(PointerlessOctreeStats, Shape) {
+    vector<ValuePoint<int>> points = randomPoints(5000, 107);
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{50, 50, 50};
+    }
+
+    using Tree = PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 8>;
+    Tree o(points.cbegin(), points.cend());
+    TreeStats stats = o.stats();
+    EXPECT_EQ(points.size(), stats.points_);
+    EXPECT_EQ(stats.nodes_, stats.internal_nodes_ + stats.leaves_);
+    EXPECT_EQ(o.depth(), stats.nodes_by_depth_.size());
+    EXPECT_EQ(1u, stats.nodes_by_depth_[0]);
+    EXPECT_EQ(1u, stats.leaves_by_size_.back());
+    EXPECT_GE(stats.max_depth_leaves_, 1u);
+    EXPECT_GT(stats.emptyChildRatio(), 0.);
+    EXPECT_GT(stats.bytesPerPoint(), 3 * sizeof(double));
+
+    EXPECT_EQ(0u, Tree().stats().nodes_);
+}
+
+TEST(PointerlessOctreeSearch, SearchMatchesBruteForce) {
+    // Queries that miss, graze, cut through and swallow whole subtrees
+    vector<ValuePoint<int>> points = randomPoints(20000, 11);
+
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{25, 25, 25}, {75, 75, 75}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (box.contains(it->dimensions_)) {
+                expectedValues.push_back(it);
+            }
+        }
+
+        EXPECT_EQ(!expectedValues.empty(), o.search(box, outputIterator)) << box;
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << box;
+    }
+}
+
+template <typename Scalar>
+void checkVisitMatchesSearch() {
+    vector<ValuePoint<int>> points = randomPoints(20000, 17);
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    PointerlessOctree<iterator, ExamplePointExtractor<int>, 16, 21, Scalar> o(points.cbegin(), points.cend());
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<iterator> expectedValues, visited;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(box, expectedIterator);
+
+        auto all = [&](iterator value, const Point3d& p) {
+            EXPECT_EQ(value->dimensions_, p);
+            visited.push_back(value);
+            return Visit::CONTINUE;
+        };
+        EXPECT_FALSE(o.visit(box, all)) << box;
+        EXPECT_EQ(expectedValues, visited) << box;
+
+        size_t calls = 0;
+        bool any = o.visit(box, [&](iterator, const Point3d&) {
+            ++calls;
+            return Visit::STOP;
+        });
+        EXPECT_EQ(!expectedValues.empty(), any) << box;
+        EXPECT_EQ(expectedValues.empty() ? 0u : 1u, calls) << box;
+
+        visited.clear();
+        EXPECT_EQ(expectedValues.size() >= 100, o.visit(box, [&](iterator value, const Point3d&) {
+            visited.push_back(value);
+            return visited.size() == 100 ? Visit::STOP : Visit::CONTINUE;
+        })) << box;
+        expectedValues.resize(std::min<size_t>(expectedValues.size(), 100));
+        EXPECT_EQ(expectedValues, visited) << box;
+    }
+}
+
+TEST(PointerlessOctreeSearch, VisitMatchesSearch) {
+    checkVisitMatchesSearch<double>();
+    checkVisitMatchesSearch<Quantized<16>>();
+}
+
+template <typename Scalar>
+void checkSearchRangeMatchesSearch() {
+    vector<ValuePoint<int>> points = randomPoints(20000, 19);
+    // More copies of one point than a block holds, in a max depth leaf
+    for (size_t i = 0; i < 100; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = PointerlessOctree<iterator, ExamplePointExtractor<int>, 16, 21, Scalar>;
+    Tree o(points.cbegin(), points.cend());
+    BoundingBox boxes[] = {
+        BoundingBox{{-10, -10, -10}, {-1, -1, -1}},
+        BoundingBox{{-10, -10, -10}, {110, 110, 110}},
+        BoundingBox{{0, 0, 0}, {50, 50, 50}},
+        BoundingBox{{12.5, 30, 70}, {13, 80, 71}},
+        BoundingBox{{29, 29, 29}, {30, 30, 30}},
+        BoundingBox{{-5, 40, -5}, {105, 60, 105}}
+    };
+    for (const BoundingBox& box : boxes) {
+        vector<iterator> expectedValues, found;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(box, expectedIterator);
+
+        typename Tree::search_range range = o.searchRange(box);
+        EXPECT_EQ(expectedValues.empty(), range.empty()) << box;
+        for (iterator value : range) {
+            found.push_back(value);
+        }
+        EXPECT_EQ(expectedValues, found) << box;
+
+        // Stopping early, through post increment
+        found.clear();
+        for (typename Tree::search_iterator it = range.begin(); it != range.end() && found.size() < 10; ) {
+            found.push_back(*it++);
+        }
+        expectedValues.resize(std::min<size_t>(expectedValues.size(), 10));
+        EXPECT_EQ(expectedValues, found) << box;
+    }
+
+    Tree empty;
+    EXPECT_TRUE(empty.searchRange(BoundingBox{{-10, -10, -10}, {110, 110, 110}}).empty());
+}
+
+TEST(PointerlessOctreeSearch, SearchRangeMatchesSearch) {
+    checkSearchRangeMatchesSearch<double>();
+    checkSearchRangeMatchesSearch<float>();
+    checkSearchRangeMatchesSearch<Quantized<16>>();
+}
+
+TEST(PointerlessOctreeSearch, KnnMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 13);
+
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    Point3d centres[] = {
+        Point3d{50, 50, 50}, Point3d{0, 0, 0}, Point3d{-20, 130, 40}, points[17].dimensions_
+    };
+    auto distance = [](const Point3d& a, const Point3d& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+    };
+    for (const Point3d& centre : centres) {
+        for (size_t k : {size_t(1), size_t(10), size_t(100)}) {
+            vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+            auto outputIterator = back_inserter(outputValues);
+            for (auto it = points.cbegin(); it != points.cend(); ++it) {
+                expectedValues.push_back(it);
+            }
+            std::partial_sort(expectedValues.begin(), expectedValues.begin() + k, expectedValues.end(),
+                [&](vector<ValuePoint<int>>::const_iterator a, vector<ValuePoint<int>>::const_iterator b) {
+                    return distance(a->dimensions_, centre) < distance(b->dimensions_, centre);
+                });
+            expectedValues.resize(k);
+
+            EXPECT_TRUE(o.knn(centre, k, outputIterator));
+            EXPECT_EQ(expectedValues, outputValues) << centre << " k=" << k;
+        }
+    }
+}
+
+TEST_F(PointerlessOctreeTest, KnnMoreThanSize) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend());
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_TRUE(o.knn(Point3d{-1, 0, 1}, 1000, outputIterator));
+
+    // The data lies on a line that starts nearest the query point
+    vector<vector<ValuePoint<int>>::const_iterator> expectedValues;
+    for (auto it = data.cbegin(); it != data.cend(); ++it) {
+        expectedValues.push_back(it);
+    }
+    EXPECT_EQ(expectedValues, outputValues);
+}
+
+TEST_F(PointerlessOctreeTest, KnnNone) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.knn(Point3d{0, 0, 0}, 0, outputIterator));
+    EXPECT_FALSE(empty.knn(Point3d{0, 0, 0}, 5, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(PointerlessOctreeSearch, RadiusSearchMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(20000, 17);
+
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(points.cbegin(), points.cend());
+    std::pair<Point3d, double> spheres[] = {
+        {Point3d{50, 50, 50}, 0.},
+        {Point3d{50, 50, 50}, 7.5},
+        {Point3d{50, 50, 50}, 40.},
+        {Point3d{0, 100, 0}, 30.},
+        {Point3d{-50, -50, -50}, 10.},
+        {Point3d{50, 50, 50}, 1000.},
+        {points[5].dimensions_, 3.}
+    };
+    for (const std::pair<Point3d, double>& sphere : spheres) {
+        const Point3d& centre = sphere.first;
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            double dx = it->dimensions_.x - centre.x;
+            double dy = it->dimensions_.y - centre.y;
+            double dz = it->dimensions_.z - centre.z;
+            if (dx * dx + dy * dy + dz * dz <= sphere.second * sphere.second) {
+                expectedValues.push_back(it);
+            }
+        }
+
+        EXPECT_EQ(!expectedValues.empty(), o.radiusSearch(centre, sphere.second, outputIterator)) << centre;
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << centre << " r=" << sphere.second;
+    }
+}
+
+template <typename Scalar>
+void checkRaycastMatchesBruteForce() {
+    vector<ValuePoint<int>> points = randomPoints(20000, 31);
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+    // The points a float tree answers for
+    auto stored = [](const Point3d& p) {
+        return std::is_same<Scalar, float>::value ? toScalarPoint<float>(p) : p;
+    };
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    PointerlessOctree<iterator, ExamplePointExtractor<int>, 16, 21, Scalar> o(points.cbegin(), points.cend());
+    std::pair<Ray, double> rays[] = {
+        {Ray(Point3d{-10, 50, 50}, Point3d{1, 0, 0}), 2.},
+        {Ray(Point3d{50, 50, 50}, Point3d{1, 2, 3}), 5.},
+        {Ray(Point3d{-10, -10, -10}, Point3d{1, 1, 1}), 1.},
+        {Ray::segment(Point3d{10, 90, 20}, Point3d{80, 15, 60}), 4.},
+        {Ray(Point3d{0, 0, 200}, Point3d{0, 0, 1}), 50.},
+        {Ray::segment(points[77].dimensions_, points[77].dimensions_), 6.}
+    };
+    for (const std::pair<Ray, double>& query : rays) {
+        const Ray& ray = query.first;
+        double radius = query.second;
+        vector<std::pair<double, iterator>> expected;
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            Point3d p = stored(it->dimensions_);
+            double t = ray.along(p);
+            if (ray.distanceSquared(p, t) <= radius * radius) {
+                expected.push_back(std::make_pair(t, it));
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        vector<iterator> hits, expectedHits;
+        auto hitsIterator = back_inserter(hits);
+        EXPECT_EQ(!expected.empty(), o.raycast(ray, radius, hitsIterator)) << ray;
+        for (size_t i = 1; i < hits.size(); ++i) {
+            EXPECT_LE(ray.along(stored(hits[i - 1]->dimensions_)), ray.along(stored(hits[i]->dimensions_)))
+                << ray;
+        }
+        for (const std::pair<double, iterator>& hit : expected) {
+            expectedHits.push_back(hit.second);
+        }
+        std::sort(expectedHits.begin(), expectedHits.end());
+        std::sort(hits.begin(), hits.end());
+        EXPECT_EQ(expectedHits, hits) << ray << " r=" << radius;
+
+        for (size_t k : {size_t(1), size_t(10)}) {
+            vector<iterator> first;
+            auto firstIterator = back_inserter(first);
+            EXPECT_EQ(!expected.empty(), o.firstHits(ray, radius, k, firstIterator)) << ray;
+            ASSERT_EQ(std::min(k, expected.size()), first.size()) << ray;
+            for (size_t i = 0; i < first.size(); ++i) {
+                EXPECT_EQ(expected[i].first, ray.along(stored(first[i]->dimensions_))) << ray << " k=" << k;
+            }
+        }
+    }
+
+    vector<iterator> none;
+    auto noneIterator = back_inserter(none);
+    decltype(o) empty;
+    EXPECT_FALSE(o.raycast(rays[0].first, -1, noneIterator));
+    EXPECT_FALSE(o.firstHits(rays[0].first, 2, 0, noneIterator));
+    EXPECT_FALSE(empty.raycast(rays[0].first, 2, noneIterator));
+    EXPECT_TRUE(none.empty());
+}
+
+TEST(PointerlessOctreeSearch, RaycastMatchesBruteForce) {
+    checkRaycastMatchesBruteForce<double>();
+    checkRaycastMatchesBruteForce<float>();
+    checkRaycastMatchesBruteForce<Quantized<16>>();
+    checkRaycastMatchesBruteForce<Quantized<3>>();
+}
+
+template <typename Scalar>
+void checkPolytopeMatchesBruteForce() {
+    vector<ValuePoint<int>> points = randomPoints(20000, 37);
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = Point3d{30, 30, 30};
+    }
+    // The points a float tree answers for
+    auto stored = [](const Point3d& p) {
+        return std::is_same<Scalar, float>::value ? toScalarPoint<float>(p) : p;
+    };
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    PointerlessOctree<iterator, ExamplePointExtractor<int>, 16, 21, Scalar> o(points.cbegin(), points.cend());
+    ConvexPolytope polytopes[] = {
+        ConvexPolytope::frustum(Point3d{-20, 50, 50}, Point3d{1, 0, 0}, Point3d{0, 0, 1}, 1., 1.5, 5., 80.),
+        ConvexPolytope::frustum(Point3d{50, 50, 50}, Point3d{1, 2, -1}, Point3d{0, 0, 1}, 2., 1., 0.5, 30.),
+        ConvexPolytope(BoundingBox{{20, 20, 20}, {60, 70, 45}}),
+        ConvexPolytope(BoundingBox{{30, 30, 30}, {30, 30, 30}}),
+        ConvexPolytope(vector<Plane>{Plane{{1, 1, 1}, 150}, Plane{{-1, -1, -1}, -120}, Plane{{0, 1, -1}, 10}}),
+        ConvexPolytope()
+    };
+    for (const ConvexPolytope& polytope : polytopes) {
+        vector<iterator> expected;
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (polytope.contains(stored(it->dimensions_))) {
+                expected.push_back(it);
+            }
+        }
+
+        vector<iterator> found;
+        auto foundIterator = back_inserter(found);
+        EXPECT_EQ(!expected.empty(), o.search(polytope, foundIterator)) << polytope;
+        std::sort(found.begin(), found.end());
+        EXPECT_EQ(expected, found) << polytope;
+    }
+
+    vector<iterator> none;
+    auto noneIterator = back_inserter(none);
+    decltype(o) empty;
+    EXPECT_FALSE(o.search(ConvexPolytope(vector<Plane>{Plane{{0, 0, 0}, 1}}), noneIterator));
+    EXPECT_FALSE(empty.search(ConvexPolytope(), noneIterator));
+    EXPECT_TRUE(none.empty());
+}
+
+TEST(PointerlessOctreeSearch, PolytopeMatchesBruteForce) {
+    checkPolytopeMatchesBruteForce<double>();
+    checkPolytopeMatchesBruteForce<float>();
+    checkPolytopeMatchesBruteForce<Quantized<16>>();
+    checkPolytopeMatchesBruteForce<Quantized<3>>();
+}
+
+template <typename Scalar>
+void checkJoinMatchesBruteForce() {
+    std::mt19937 generator(41);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    vector<ValuePoint<int>> points = randomPoints(1200, generator);
+    vector<ValuePoint<int>> others(900);
+    for (size_t i = 0; i < others.size(); ++i) {
+        others[i].dimensions_ = Point3d{coordinate(generator) + 20, coordinate(generator), coordinate(generator)};
+        others[i].value_ = static_cast<int>(i);
+    }
+    for (size_t i = 0; i < 40; ++i) {
+        points[i].dimensions_ = others[i].dimensions_ = Point3d{30, 30, 30};
+    }
+    // The points a float tree answers for
+    auto stored = [](const Point3d& p) {
+        return std::is_same<Scalar, float>::value ? toScalarPoint<float>(p) : p;
+    };
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = PointerlessOctree<iterator, ExamplePointExtractor<int>, 16, 21, Scalar>;
+    using pair = typename Tree::join_pair;
+    Tree o(points.cbegin(), points.cend()), other(others.cbegin(), others.cend());
+    TaskPool pool(3);
+    auto within = [&](iterator a, iterator b, double epsilon) {
+        Point3d p = stored(a->dimensions_), q = stored(b->dimensions_);
+        double dx = p.x - q.x;
+        double dy = p.y - q.y;
+        double dz = p.z - q.z;
+        return dx * dx + dy * dy + dz * dz <= epsilon * epsilon;
+    };
+    for (double epsilon : {0., 2.5, 8., 1000.}) {
+        vector<pair> expected, expectedSelf;
+        for (auto a = points.cbegin(); a != points.cend(); ++a) {
+            for (auto b = others.cbegin(); b != others.cend(); ++b) {
+                if (within(a, b, epsilon)) {
+                    expected.push_back(pair(a, b));
+                }
+            }
+            for (auto b = a + 1; b != points.cend(); ++b) {
+                if (within(a, b, epsilon)) {
+                    expectedSelf.push_back(pair(a, b));
+                }
+            }
+        }
+
+        vector<pair> found, parallel;
+        auto foundIterator = back_inserter(found);
+        auto parallelIterator = back_inserter(parallel);
+        EXPECT_EQ(!expected.empty(), o.join(other, epsilon, foundIterator)) << epsilon;
+        EXPECT_EQ(!expected.empty(), o.join(other, epsilon, parallelIterator, pool)) << epsilon;
+        std::sort(found.begin(), found.end());
+        std::sort(parallel.begin(), parallel.end());
+        EXPECT_EQ(expected, found) << epsilon;
+        EXPECT_EQ(expected, parallel) << epsilon;
+
+        // Each pair once, in either order
+        for (bool inPool : {false, true}) {
+            vector<pair> self;
+            auto selfIterator = back_inserter(self);
+            EXPECT_EQ(!expectedSelf.empty(), inPool ? o.selfJoin(epsilon, selfIterator, pool)
+                                                    : o.selfJoin(epsilon, selfIterator)) << epsilon;
+            for (pair& p : self) {
+                if (p.second < p.first) {
+                    std::swap(p.first, p.second);
+                }
+            }
+            std::sort(self.begin(), self.end());
+            EXPECT_EQ(expectedSelf, self) << epsilon;
+        }
+    }
+
+    vector<pair> none;
+    auto noneIterator = back_inserter(none);
+    Tree empty;
+    EXPECT_FALSE(o.join(other, -1, noneIterator));
+    EXPECT_FALSE(o.join(empty, 10, noneIterator, pool));
+    EXPECT_FALSE(empty.selfJoin(10, noneIterator));
+    EXPECT_TRUE(none.empty());
+}
+
+TEST(PointerlessOctreeSearch, JoinMatchesBruteForce) {
+    checkJoinMatchesBruteForce<double>();
+    checkJoinMatchesBruteForce<float>();
+    checkJoinMatchesBruteForce<Quantized<16>>();
+    checkJoinMatchesBruteForce<Quantized<3>>();
+}
+
+// However many threads share the join, the pairs come out in the order the
+// serial join finds them. Pairs of points scattered around a dense clump
+// sit in shallow leaves, whose pairs the top of the walk finds itself.
+TEST(PointerlessOctreeSearch, JoinOrderIndependentOfThreads) {
+    vector<ValuePoint<int>> points = randomPoints(8000, 43), others = randomPoints(8000, 47);
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i >= 100) {
+            points[i].dimensions_ = Point3d{points[i].dimensions_.x * 0.4, points[i].dimensions_.y * 0.4,
+                                            points[i].dimensions_.z * 0.4};
+            others[i].dimensions_ = Point3d{others[i].dimensions_.x * 0.4, others[i].dimensions_.y * 0.4,
+                                            others[i].dimensions_.z * 0.4};
+        } else if (i % 2) {
+            points[i].dimensions_ = others[i].dimensions_ = points[i - 1].dimensions_;
+        }
+    }
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = PointerlessOctree<iterator, ExamplePointExtractor<int>>;
+    using pair = Tree::join_pair;
+    Tree o(points.cbegin(), points.cend()), other(others.cbegin(), others.cend());
+    vector<pair> serial, serialSelf;
+    auto serialIterator = back_inserter(serial);
+    auto serialSelfIterator = back_inserter(serialSelf);
+    o.join(other, 5., serialIterator);
+    o.selfJoin(5., serialSelfIterator);
+    ASSERT_FALSE(serial.empty());
+    ASSERT_FALSE(serialSelf.empty());
+
+    for (size_t threads : {0, 1, 3, 7}) {
+        TaskPool pool(threads);
+        vector<pair> parallel, parallelSelf;
+        auto parallelIterator = back_inserter(parallel);
+        auto parallelSelfIterator = back_inserter(parallelSelf);
+        o.join(other, 5., parallelIterator, pool);
+        o.selfJoin(5., parallelSelfIterator, pool);
+        EXPECT_EQ(serial, parallel) << threads;
+        EXPECT_EQ(serialSelf, parallelSelf) << threads;
+    }
+}
+
+TEST_F(PointerlessOctreeTest, RadiusSearchNone) {
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>> o(data.cbegin(), data.cend()), empty;
+    vector<vector<ValuePoint<int>>::const_iterator> outputValues;
+    auto outputIterator = back_inserter(outputValues);
+    EXPECT_FALSE(o.radiusSearch(data[0].dimensions_, -1, outputIterator));
+    EXPECT_FALSE(empty.radiusSearch(data[0].dimensions_, 10, outputIterator));
+    EXPECT_TRUE(outputValues.empty());
+}
+
+TEST(PointerlessOctreeSearch, SearchBatchMatchesSearch) {
+    std::mt19937 generator(19);
+    std::uniform_real_distribution<double> coordinate(0, 100);
+    std::uniform_real_distribution<double> edge(0, 20);
+    vector<ValuePoint<int>> points = randomPoints(20000, generator);
+
+    // Plenty of boxes that overlap each other, and some that miss entirely
+    vector<BoundingBox> boxes;
+    for (size_t i = 0; i < 500; ++i) {
+        Point3d low{coordinate(generator) - 10, coordinate(generator) - 10, coordinate(generator) - 10};
+        boxes.push_back(BoundingBox{low, {low.x + edge(generator), low.y + edge(generator), low.z + edge(generator)}});
+    }
+    boxes.push_back(BoundingBox{{-10, -10, -10}, {110, 110, 110}});
+
+    using Tree = PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(points.cbegin(), points.cend());
+    TaskPool pool(3);
+    Tree::batch_results serial, parallel;
+    o.searchBatch(boxes.begin(), boxes.end(), serial);
+    o.searchBatch(boxes.begin(), boxes.end(), parallel, pool);
+    ASSERT_EQ(boxes.size(), serial.size());
+    ASSERT_EQ(boxes.size(), parallel.size());
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        vector<vector<ValuePoint<int>>::const_iterator> expectedValues;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(boxes[i], expectedIterator);
+        EXPECT_EQ(expectedValues, serial[i]) << boxes[i];
+        EXPECT_EQ(expectedValues, parallel[i]) << boxes[i];
+    }
+}
+
+TEST_F(PointerlessOctreeTest, SearchBatchEmpty) {
+    using Tree = PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    Tree o(data.cbegin(), data.cend()), empty;
+    vector<BoundingBox> boxes{allBox, allBox};
+    Tree::batch_results results;
+
+    o.searchBatch(boxes.begin(), boxes.begin(), results);
+    EXPECT_TRUE(results.empty());
+
+    empty.searchBatch(boxes.begin(), boxes.end(), results);
+    ASSERT_EQ(2u, results.size());
+    EXPECT_TRUE(results[0].empty());
+    EXPECT_TRUE(results[1].empty());
+}
+
+// Points float can't hold exactly, answered for where the float tree rounds
+// them to
+TEST(PointerlessOctreeSearch, FloatMatchesBruteForce) {
+    vector<ValuePoint<int>> points = randomPoints(5000, 43);
+
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 21, float>
+        o(points.cbegin(), points.cend());
+
+    // Edges right on points, which rounding may leave either side
+    for (size_t q = 0; q < 20; ++q) {
+        const Point3d& low = points[q].dimensions_;
+        const Point3d& high = points[q + 100].dimensions_;
+        BoundingBox box{
+            {std::min(low.x, high.x), std::min(low.y, high.y), std::min(low.z, high.z)},
+            {std::max(low.x, high.x), std::max(low.y, high.y), std::max(low.z, high.z)}
+        };
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (box.contains(toScalarPoint<float>(it->dimensions_))) {
+                expectedValues.push_back(it);
+            }
+        }
+        o.search(box, outputIterator);
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << box;
+
+        vector<vector<ValuePoint<int>>::const_iterator> nearest;
+        auto nearestIterator = back_inserter(nearest);
+        o.knn(low, 5, nearestIterator);
+        ASSERT_EQ(5u, nearest.size());
+        EXPECT_EQ(points.cbegin() + q, nearest[0]);
+    }
+}
+
+// Coarse codes leave many points for the tree to look up exactly, fine ones
+// few, and both have to answer exactly what a double tree would
+template <typename Scalar>
+void checkQuantizedMatchesBruteForce() {
+    vector<ValuePoint<int>> points = randomPoints(5000, 47);
+
+    PointerlessOctree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>, 16, 21, Scalar>
+        o(points.cbegin(), points.cend());
+    EXPECT_EQ(points.size(), o.size());
+    auto distance = [](const Point3d& a, const Point3d& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+    };
+
+    vector<BoundingBox> boxes;
+    for (size_t q = 0; q < 20; ++q) {
+        // Edges, and a radius, right on points
+        const Point3d& low = points[q].dimensions_;
+        const Point3d& high = points[q + 100].dimensions_;
+        BoundingBox box{
+            {std::min(low.x, high.x), std::min(low.y, high.y), std::min(low.z, high.z)},
+            {std::max(low.x, high.x), std::max(low.y, high.y), std::max(low.z, high.z)}
+        };
+        boxes.push_back(box);
+
+        vector<vector<ValuePoint<int>>::const_iterator> outputValues, expectedValues;
+        auto outputIterator = back_inserter(outputValues);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (box.contains(it->dimensions_)) {
+                expectedValues.push_back(it);
+            }
+        }
+        o.search(box, outputIterator);
+        std::sort(outputValues.begin(), outputValues.end());
+        EXPECT_EQ(expectedValues, outputValues) << box;
+
+        double radius = std::sqrt(distance(low, high));
+        vector<vector<ValuePoint<int>>::const_iterator> within, expectedWithin;
+        auto withinIterator = back_inserter(within);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            if (distance(it->dimensions_, low) <= radius * radius) {
+                expectedWithin.push_back(it);
+            }
+        }
+        o.radiusSearch(low, radius, withinIterator);
+        std::sort(within.begin(), within.end());
+        EXPECT_EQ(expectedWithin, within) << low << " radius " << radius;
+
+        vector<vector<ValuePoint<int>>::const_iterator> nearest, expectedNearest;
+        auto nearestIterator = back_inserter(nearest);
+        for (auto it = points.cbegin(); it != points.cend(); ++it) {
+            expectedNearest.push_back(it);
+        }
+        std::partial_sort(expectedNearest.begin(), expectedNearest.begin() + 10, expectedNearest.end(),
+            [&](vector<ValuePoint<int>>::const_iterator a, vector<ValuePoint<int>>::const_iterator b) {
+                return distance(a->dimensions_, high) < distance(b->dimensions_, high);
+            });
+        expectedNearest.resize(10);
+        o.knn(high, 10, nearestIterator);
+        EXPECT_EQ(expectedNearest, nearest) << high;
+    }
+
+    typename decltype(o)::batch_results results;
+    o.searchBatch(boxes.begin(), boxes.end(), results);
+    ASSERT_EQ(boxes.size(), results.size());
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        vector<vector<ValuePoint<int>>::const_iterator> expectedValues;
+        auto expectedIterator = back_inserter(expectedValues);
+        o.search(boxes[i], expectedIterator);
+        EXPECT_EQ(expectedValues, results[i]) << boxes[i];
+    }
+}
+
+TEST(PointerlessOctreeSearch, QuantizedMatchesBruteForce) {
+    checkQuantizedMatchesBruteForce<Quantized<16>>();
+    checkQuantizedMatchesBruteForce<Quantized<3>>();
+}
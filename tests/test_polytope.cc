@@ -0,0 +1,168 @@
+// Stupid mingw port of gtest
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/polytope.h"
+
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+TEST(Plane, Through) {
+    Plane plane = Plane::through(Point3d{1, 2, 3}, Point3d{0, 0, 2});
+    EXPECT_EQ(6., plane.offset_);
+    EXPECT_TRUE(plane.contains(Point3d{100, -100, 3}));
+    EXPECT_TRUE(plane.contains(Point3d{0, 0, -50}));
+    EXPECT_FALSE(plane.contains(Point3d{0, 0, 3.5}));
+}
+
+TEST(ConvexPolytope, NoPlanesHoldsEverything) {
+    ConvexPolytope everything;
+    EXPECT_TRUE(everything.valid());
+    EXPECT_EQ(0u, everything.allPlanes());
+    EXPECT_TRUE(everything.contains(Point3d{1e300, -1e300, 0}));
+    std::uint64_t active = everything.allPlanes();
+    EXPECT_EQ(Containment::INSIDE, everything.classify(BoundingBox{{0, 0, 0}, {1, 1, 1}}, active));
+}
+
+TEST(ConvexPolytope, FromBox) {
+    BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+    ConvexPolytope polytope(box);
+    EXPECT_EQ(6u, polytope.planes_.size());
+    EXPECT_EQ(0x3Fu, polytope.allPlanes());
+    EXPECT_TRUE(polytope.contains(Point3d{0, 5, 10}));
+    EXPECT_FALSE(polytope.contains(Point3d{-0.1, 5, 5}));
+    EXPECT_FALSE(polytope.contains(Point3d{5, 5, 10.1}));
+}
+
+TEST(ConvexPolytope, Classify) {
+    ConvexPolytope polytope(BoundingBox{{0, 0, 0}, {10, 10, 10}});
+
+    std::uint64_t active = polytope.allPlanes();
+    EXPECT_EQ(Containment::INSIDE, polytope.classify(BoundingBox{{1, 1, 1}, {9, 9, 9}}, active));
+    EXPECT_EQ(0u, active);
+
+    // Faces touching count as inside
+    active = polytope.allPlanes();
+    EXPECT_EQ(Containment::INSIDE, polytope.classify(BoundingBox{{0, 0, 0}, {10, 10, 10}}, active));
+
+    active = polytope.allPlanes();
+    EXPECT_EQ(Containment::OUTSIDE, polytope.classify(BoundingBox{{11, 1, 1}, {12, 2, 2}}, active));
+
+    // Straddling the high x face alone leaves just that plane to test
+    active = polytope.allPlanes();
+    EXPECT_EQ(Containment::INTERSECTS, polytope.classify(BoundingBox{{5, 1, 1}, {15, 2, 2}}, active));
+    EXPECT_EQ(std::uint64_t(1) << 1, active);
+
+    EXPECT_EQ(Containment::OUTSIDE, polytope.classify(invalidBox, active = polytope.allPlanes()));
+
+    // Planes already dropped aren't looked at again
+    ConvexPolytope planes(polytope.planes_);
+    active = 0;
+    EXPECT_EQ(Containment::INSIDE, planes.classify(BoundingBox{{11, 1, 1}, {12, 2, 2}}, active));
+}
+
+TEST(ConvexPolytope, Bounds) {
+    EXPECT_EQ((BoundingBox{{0, 0, 0}, {10, 10, 10}}), ConvexPolytope(BoundingBox{{0, 0, 0}, {10, 10, 10}}).bounds_);
+    EXPECT_TRUE(std::isinf(ConvexPolytope(vector<Plane>{Plane{{1, 0, 0}, 1}}).bounds_.maxes_.x));
+
+    // Out to the far corners, and a little more
+    ConvexPolytope frustum = ConvexPolytope::frustum(
+        Point3d{0, 0, 0}, Point3d{1, 0, 0}, Point3d{0, 0, 1}, std::acos(0.), 2., 1., 10.);
+    const BoundingBox& bounds = frustum.bounds_;
+    EXPECT_NEAR(1., bounds.mins_.x, 1e-6);
+    EXPECT_LT(bounds.mins_.x, 1.);
+    EXPECT_NEAR(10., bounds.maxes_.x, 1e-6);
+    EXPECT_GT(bounds.maxes_.x, 10.);
+    EXPECT_NEAR(-20., bounds.mins_.y, 1e-6);
+    EXPECT_NEAR(10., bounds.maxes_.z, 1e-6);
+    EXPECT_GT(bounds.maxes_.z, 10.);
+
+    // Boxes past the bounds are outside without looking at the planes
+    std::uint64_t active = frustum.allPlanes();
+    EXPECT_EQ(Containment::OUTSIDE, frustum.classify(BoundingBox{{11, 0, 0}, {12, 1, 1}}, active));
+    EXPECT_EQ(Containment::INTERSECTS, frustum.classify(BoundingBox{{9, 0, 0}, {12, 1, 1}}, active));
+}
+
+TEST(ConvexPolytope, Frustum) {
+    // Looking down +x from the origin with a 90 degree view, twice as wide as
+    // it is high
+    ConvexPolytope frustum = ConvexPolytope::frustum(
+        Point3d{0, 0, 0}, Point3d{2, 0, 0}, Point3d{0, 0, 1}, std::acos(0.), 2., 1., 10.);
+    ASSERT_EQ(6u, frustum.planes_.size());
+    EXPECT_TRUE(frustum.valid());
+
+    EXPECT_TRUE(frustum.contains(Point3d{5, 0, 0}));
+    EXPECT_TRUE(frustum.contains(Point3d{5, 9.9, 4.9}));
+    EXPECT_TRUE(frustum.contains(Point3d{5, -9.9, -4.9}));
+    EXPECT_FALSE(frustum.contains(Point3d{5, 10.1, 0}));
+    EXPECT_FALSE(frustum.contains(Point3d{5, 0, 5.1}));
+    EXPECT_FALSE(frustum.contains(Point3d{5, 0, -5.1}));
+    // Before the near plane, beyond the far one and behind the camera
+    EXPECT_FALSE(frustum.contains(Point3d{0.9, 0, 0}));
+    EXPECT_FALSE(frustum.contains(Point3d{10.1, 0, 0}));
+    EXPECT_FALSE(frustum.contains(Point3d{-5, 0, 0}));
+
+    // Which way is right follows from forward and up
+    EXPECT_GT(frustum.planes_[0].normal_.y, 0.);
+    EXPECT_LT(frustum.planes_[1].normal_.y, 0.);
+    EXPECT_LT(frustum.planes_[2].normal_.z, 0.);
+    EXPECT_GT(frustum.planes_[3].normal_.z, 0.);
+}
+
+TEST(ConvexPolytope, Invalid) {
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    EXPECT_FALSE(ConvexPolytope(vector<Plane>{Plane{{0, 0, 0}, 1}}).valid());
+    EXPECT_FALSE(ConvexPolytope(vector<Plane>{Plane{{nan, 0, 1}, 1}}).valid());
+    EXPECT_FALSE(ConvexPolytope(vector<Plane>{Plane{{0, 0, 1}, nan}}).valid());
+    EXPECT_FALSE(ConvexPolytope(vector<Plane>(65, Plane{{0, 0, 1}, 1})).valid());
+    EXPECT_TRUE(ConvexPolytope(vector<Plane>(64, Plane{{0, 0, 1}, 1})).valid());
+    // Looking straight up
+    EXPECT_FALSE(ConvexPolytope::frustum(Point3d{0, 0, 0}, Point3d{0, 0, 1}, Point3d{0, 0, 1},
+                                         1., 1., 1., 10.).valid());
+}
+
+TEST(ConvexPolytope, EmitInside) {
+    ConvexPolytope polytope(BoundingBox{{0, 0, 0}, {10, 10, 10}});
+    vector<double> xs, ys, zs;
+    vector<int> values;
+    for (int i = 0; i < 150; ++i) {
+        xs.push_back(i % 20 - 5);
+        ys.push_back(5);
+        zs.push_back(i % 7);
+        values.push_back(i);
+    }
+
+    vector<int> found, expected;
+    auto out = std::back_inserter(found);
+    EXPECT_TRUE(emitInside(polytope, polytope.allPlanes(), xs.data(), ys.data(), zs.data(),
+                           values.data(), values.size(), out));
+    for (int i = 0; i < 150; ++i) {
+        if (polytope.contains(Point3d{xs[i], ys[i], zs[i]})) {
+            expected.push_back(i);
+        }
+    }
+    EXPECT_EQ(expected, found);
+
+    // Only the planes left active are tested
+    found.clear();
+    emitInside(polytope, std::uint64_t(1) << 1, xs.data(), ys.data(), zs.data(),
+               values.data(), values.size(), out);
+    expected.clear();
+    for (int i = 0; i < 150; ++i) {
+        if (xs[i] <= 10) {
+            expected.push_back(i);
+        }
+    }
+    EXPECT_EQ(expected, found);
+}
@@ -0,0 +1,215 @@
+// Stupid mingw port of gtest
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/quantized_leaf.h"
+
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <vector>
+
+using std::vector;
+
+TEST(QuantizedAxis, CodesKeepOrder) {
+	std::mt19937 generator(53);
+	std::uniform_real_distribution<double> coordinate(-3, 7);
+	vector<double> values(1000);
+	for (double& v : values) {
+		v = coordinate(generator);
+	}
+	values.push_back(-3);
+	values.push_back(7);
+	std::sort(values.begin(), values.end());
+
+	QuantizedAxis<10> axis(-3, 7);
+	EXPECT_EQ(0u, axis.code(-3));
+	EXPECT_EQ(Quantized<10>::max_code, axis.code(7));
+	for (size_t i = 1; i < values.size(); ++i) {
+		EXPECT_LE(axis.code(values[i - 1]), axis.code(values[i])) << values[i - 1] << " " << values[i];
+	}
+	for (double v : values) {
+		EXPECT_LE(std::fabs(axis.decode(axis.code(v)) - v), axis.error()) << v;
+	}
+}
+
+TEST(QuantizedAxis, Limits) {
+	QuantizedAxis<8> axis(0, 255);
+	EXPECT_EQ(-1, axis.lowerLimit(0));
+	EXPECT_EQ(-1, axis.lowerLimit(-10));
+	EXPECT_EQ(256, axis.upperLimit(255));
+	EXPECT_EQ(256, axis.upperLimit(1000));
+	EXPECT_EQ(17, axis.lowerLimit(17.2));
+	EXPECT_EQ(18, axis.upperLimit(17.6));
+}
+
+TEST(QuantizedAxis, FlatLeaf) {
+	QuantizedAxis<16> axis(2.5, 2.5);
+	EXPECT_EQ(0u, axis.code(2.5));
+	EXPECT_EQ(2.5, axis.decode(0));
+	EXPECT_EQ(0, axis.error());
+}
+
+class QuantizedLeafTest : public ::testing::Test {
+  protected:
+	vector<Point3d> points;
+	vector<double> xs, ys, zs;
+	vector<std::uint8_t> codeXs, codeYs, codeZs;
+	vector<size_t> values;
+	BoundingBox leaf;
+	size_t lookups;
+
+	QuantizedLeafTest() : leaf(initialBox), lookups(0) {}
+
+	virtual void SetUp() {
+		// Far more points than 4 bit codes can tell apart, so most share a
+		// code with something on either side of any edge
+		std::mt19937 generator(59);
+		std::uniform_real_distribution<double> coordinate(0, 10);
+		for (size_t i = 0; i < 500; ++i) {
+			Point3d p{coordinate(generator), coordinate(generator), coordinate(generator)};
+			if (i % 10 == 0) {
+				p.x = std::floor(p.x);
+				p.y = std::floor(p.y);
+				p.z = std::floor(p.z);
+			}
+			points.push_back(p);
+			xs.push_back(p.x);
+			ys.push_back(p.y);
+			zs.push_back(p.z);
+			values.push_back(i);
+			leaf.mins_.x = std::min(leaf.mins_.x, p.x);
+			leaf.mins_.y = std::min(leaf.mins_.y, p.y);
+			leaf.mins_.z = std::min(leaf.mins_.z, p.z);
+			leaf.maxes_.x = std::max(leaf.maxes_.x, p.x);
+			leaf.maxes_.y = std::max(leaf.maxes_.y, p.y);
+			leaf.maxes_.z = std::max(leaf.maxes_.z, p.z);
+		}
+		codeXs.resize(points.size());
+		codeYs.resize(points.size());
+		codeZs.resize(points.size());
+		quantizeLeaf<4>(leaf, xs.data(), ys.data(), zs.data(), points.size(),
+		                codeXs.data(), codeYs.data(), codeZs.data());
+	}
+
+	Point3d exact(size_t i) {
+		++lookups;
+		return points[i];
+	}
+};
+
+TEST_F(QuantizedLeafTest, ContainedMatchesExact) {
+	BoundingBox boxes[] = {
+		BoundingBox{{2, 3, 4}, {6, 7, 8}},
+		BoundingBox{{-1, -1, -1}, {11, 11, 11}},
+		BoundingBox{{2.25, 0, 5}, {2.75, 10, 5.5}},
+		BoundingBox{{20, 20, 20}, {30, 30, 30}}
+	};
+	for (const BoundingBox& box : boxes) {
+		vector<size_t> expected, output;
+		for (size_t i = 0; i < points.size(); ++i) {
+			if (box.contains(points[i])) {
+				expected.push_back(i);
+			}
+		}
+		auto outputIterator = std::back_inserter(output);
+		lookups = 0;
+		bool found = emitContainedQuantized<4>(box, leaf, codeXs.data(), codeYs.data(), codeZs.data(),
+		                                       values.data(), values.size(),
+		                                       [this](size_t i) { return exact(i); }, outputIterator);
+		EXPECT_EQ(!expected.empty(), found) << box;
+		EXPECT_EQ(expected, output) << box;
+		EXPECT_LT(lookups, points.size()) << box;
+	}
+
+	// A box around the whole leaf never needs to look anything up
+	vector<size_t> output;
+	auto outputIterator = std::back_inserter(output);
+	lookups = 0;
+	emitContainedQuantized<4>(leaf, leaf, codeXs.data(), codeYs.data(), codeZs.data(),
+	                          values.data(), values.size(), [this](size_t i) { return exact(i); },
+	                          outputIterator);
+	EXPECT_EQ(values, output);
+	EXPECT_EQ(0u, lookups);
+}
+
+TEST_F(QuantizedLeafTest, WithinMatchesExact) {
+	Point3d centres[] = {Point3d{5, 5, 5}, Point3d{0, 0, 0}, points[3], Point3d{-4, 5, 12}};
+	for (const Point3d& centre : centres) {
+		for (double radiusSquared : {0., 1., 9., 16., 400.}) {
+			vector<size_t> expected, output;
+			for (size_t i = 0; i < points.size(); ++i) {
+				double dx = points[i].x - centre.x, dy = points[i].y - centre.y, dz = points[i].z - centre.z;
+				if (dx * dx + dy * dy + dz * dz <= radiusSquared) {
+					expected.push_back(i);
+				}
+			}
+			auto outputIterator = std::back_inserter(output);
+			bool found = emitWithinQuantized<4>(centre, radiusSquared, leaf, codeXs.data(), codeYs.data(),
+			                                    codeZs.data(), values.data(), values.size(),
+			                                    [this](size_t i) { return exact(i); }, outputIterator);
+			EXPECT_EQ(!expected.empty(), found) << centre << " r2: " << radiusSquared;
+			EXPECT_EQ(expected, output) << centre << " r2: " << radiusSquared;
+		}
+	}
+}
+
+TEST_F(QuantizedLeafTest, PairsWithinMatchExact) {
+	using pair = std::pair<size_t, size_t>;
+	auto exactFrom = [this](size_t first) { return [this, first](size_t i) { return exact(first + i); }; };
+	// The first 200 points against the rest, as if they were two leaves
+	for (double radiusSquared : {0., 0.25, 1., 4.}) {
+		vector<pair> expected, expectedSelf;
+		for (size_t i = 0; i < points.size(); ++i) {
+			for (size_t j = i + 1; j < points.size(); ++j) {
+				double dx = points[i].x - points[j].x, dy = points[i].y - points[j].y, dz = points[i].z - points[j].z;
+				if (dx * dx + dy * dy + dz * dz <= radiusSquared) {
+					if (i < 200 && j >= 200) {
+						expected.push_back(pair(i, j));
+					}
+					expectedSelf.push_back(pair(i, j));
+				}
+			}
+		}
+
+		vector<pair> output, self;
+		auto outputIterator = std::back_inserter(output);
+		auto selfIterator = std::back_inserter(self);
+		bool found = emitPairsWithinQuantized<4>(
+			radiusSquared, leaf, codeXs.data(), codeYs.data(), codeZs.data(), values.data(), 200, exactFrom(0),
+			leaf, codeXs.data() + 200, codeYs.data() + 200, codeZs.data() + 200, values.data() + 200,
+			values.size() - 200, exactFrom(200), outputIterator);
+		EXPECT_EQ(!expected.empty(), found) << "r2: " << radiusSquared;
+		found = emitPairsWithinQuantized<4>(radiusSquared, leaf, codeXs.data(), codeYs.data(), codeZs.data(),
+		                                    values.data(), values.size(), exactFrom(0), selfIterator);
+		EXPECT_EQ(!expectedSelf.empty(), found) << "r2: " << radiusSquared;
+		EXPECT_EQ(expected, output) << "r2: " << radiusSquared;
+		EXPECT_EQ(expectedSelf, self) << "r2: " << radiusSquared;
+	}
+}
+
+TEST_F(QuantizedLeafTest, NearestMatchesExact) {
+	Point3d centres[] = {Point3d{5, 5, 5}, points[7], Point3d{-4, 5, 12}};
+	for (const Point3d& centre : centres) {
+		NearestSet<size_t> quantized(10), plain(10);
+		offerNearestQuantized<4>(centre, leaf, codeXs.data(), codeYs.data(), codeZs.data(),
+		                         values.data(), values.size(), [this](size_t i) { return exact(i); },
+		                         quantized);
+		offerNearest(centre, xs.data(), ys.data(), zs.data(), values.data(), values.size(), plain);
+
+		vector<size_t> expected, output;
+		auto expectedIterator = std::back_inserter(expected);
+		auto outputIterator = std::back_inserter(output);
+		plain.emit(expectedIterator);
+		quantized.emit(outputIterator);
+		EXPECT_EQ(expected, output) << centre;
+	}
+}
@@ -0,0 +1,112 @@
+// Stupid mingw port of gtest
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/ray.h"
+
+#include <cmath>
+#include <limits>
+#include "gtest/gtest.h"
+
+TEST(Ray, Normalises) {
+    Ray ray(Point3d{1, 2, 3}, Point3d{0, 3, 4});
+    EXPECT_EQ((Point3d{0, 0.6, 0.8}), ray.direction_);
+    EXPECT_TRUE(std::isinf(ray.length_));
+    EXPECT_TRUE(ray.valid());
+    EXPECT_EQ((Point3d{1, 5, 7}), ray.at(5));
+}
+
+TEST(Ray, Segment) {
+    Ray ray = Ray::segment(Point3d{0, 0, 0}, Point3d{0, 3, 4});
+    EXPECT_EQ(5., ray.length_);
+    EXPECT_EQ((Point3d{0, 3, 4}), ray.at(ray.length_));
+
+    // A segment of no length stays put
+    Ray point = Ray::segment(Point3d{1, 1, 1}, Point3d{1, 1, 1});
+    EXPECT_TRUE(point.valid());
+    EXPECT_EQ(0., point.along(Point3d{5, 5, 5}));
+    EXPECT_EQ(48., point.distanceSquared(Point3d{5, 5, 5}, 0));
+}
+
+TEST(Ray, Invalid) {
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    double infinity = std::numeric_limits<double>::infinity();
+    EXPECT_FALSE(Ray(Point3d{nan, 0, 0}, Point3d{1, 0, 0}).valid());
+    EXPECT_FALSE(Ray(Point3d{0, 0, 0}, Point3d{infinity, 0, 0}).valid());
+    EXPECT_FALSE(Ray(Point3d{0, 0, 0}, Point3d{0, nan, 0}).valid());
+    EXPECT_FALSE(Ray(Point3d{0, 0, 0}, Point3d{1, 0, 0}, -1).valid());
+    EXPECT_FALSE(Ray(Point3d{0, 0, 0}, Point3d{1, 0, 0}, nan).valid());
+}
+
+TEST(Ray, AlongClampsToTheRay) {
+    Ray ray = Ray::segment(Point3d{0, 0, 0}, Point3d{10, 0, 0});
+    EXPECT_EQ(4., ray.along(Point3d{4, 3, 0}));
+    EXPECT_EQ(9., ray.distanceSquared(Point3d{4, 3, 0}, 4));
+    // Behind the origin, and past the end
+    EXPECT_EQ(0., ray.along(Point3d{-4, 3, 0}));
+    EXPECT_EQ(25., ray.distanceSquared(Point3d{-4, 3, 0}, 0));
+    EXPECT_EQ(10., ray.along(Point3d{14, 0, 3}));
+    EXPECT_EQ(25., ray.distanceSquared(Point3d{14, 0, 3}, 10));
+}
+
+TEST(Ray, ClipThroughBox) {
+    BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+    double enter, leave;
+    Ray ray(Point3d{-5, 5, 5}, Point3d{1, 0, 0});
+    EXPECT_TRUE(ray.clip(box, enter, leave));
+    EXPECT_EQ(5., enter);
+    EXPECT_EQ(15., leave);
+
+    // Backwards
+    Ray back(Point3d{15, 5, 5}, Point3d{-1, 0, 0});
+    EXPECT_TRUE(back.clip(box, enter, leave));
+    EXPECT_EQ(5., enter);
+    EXPECT_EQ(15., leave);
+
+    // Diagonally through a corner
+    Ray diagonal(Point3d{-1, -1, -1}, Point3d{1, 1, 1});
+    EXPECT_TRUE(diagonal.clip(box, enter, leave));
+    EXPECT_NEAR(std::sqrt(3.), enter, 1e-12);
+    EXPECT_NEAR(11 * std::sqrt(3.), leave, 1e-12);
+}
+
+TEST(Ray, ClipFromInside) {
+    BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+    double enter, leave;
+    Ray ray(Point3d{5, 5, 5}, Point3d{0, 0, 1});
+    EXPECT_TRUE(ray.clip(box, enter, leave));
+    EXPECT_EQ(0., enter);
+    EXPECT_EQ(5., leave);
+}
+
+TEST(Ray, ClipMisses) {
+    BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+    double enter, leave;
+    // Pointing away
+    EXPECT_FALSE(Ray(Point3d{-5, 5, 5}, Point3d{-1, 0, 0}).clip(box, enter, leave));
+    // Passing by
+    EXPECT_FALSE(Ray(Point3d{-5, 5, 5}, Point3d{1, 2, 0}).clip(box, enter, leave));
+    // Parallel to a slab it is outside of
+    EXPECT_FALSE(Ray(Point3d{-5, 11, 5}, Point3d{1, 0, 0}).clip(box, enter, leave));
+    // Stopping short
+    EXPECT_FALSE(Ray::segment(Point3d{-5, 5, 5}, Point3d{-1, 5, 5}).clip(box, enter, leave));
+    EXPECT_FALSE(Ray(Point3d{-5, 5, 5}, Point3d{1, 0, 0}).clip(invalidBox, enter, leave));
+}
+
+TEST(Ray, ClipTouchesFace) {
+    BoundingBox box{{0, 0, 0}, {10, 10, 10}};
+    double enter, leave;
+    // Along a face
+    EXPECT_TRUE(Ray(Point3d{-5, 10, 5}, Point3d{1, 0, 0}).clip(box, enter, leave));
+    EXPECT_EQ(5., enter);
+    EXPECT_EQ(15., leave);
+    // Ending on one
+    EXPECT_TRUE(Ray::segment(Point3d{-5, 5, 5}, Point3d{0, 5, 5}).clip(box, enter, leave));
+    EXPECT_EQ(5., enter);
+    EXPECT_EQ(5., leave);
+}
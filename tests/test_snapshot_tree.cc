@@ -0,0 +1,123 @@
+// Stupid mingw port of gtest
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/octree.h"
+#include "../structures/snapshot_tree.h"
+#include "test_helpers.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+// Counts its own destruction
+struct Version {
+    explicit Version(int id = 0, std::atomic<int>* destroyed = nullptr)
+      : id_(id), destroyed_(destroyed) {}
+
+    ~Version() {
+        if (destroyed_) {
+            ++*destroyed_;
+        }
+    }
+
+    int id_;
+    std::atomic<int>* destroyed_;
+};
+
+TEST(SnapshotTree, StartsEmpty) {
+    using Tree = Octree<vector<ValuePoint<int>>::const_iterator, ExamplePointExtractor<int>>;
+    SnapshotTree<Tree> trees;
+    EXPECT_EQ(0u, trees.snapshot()->size());
+}
+
+TEST(SnapshotTree, PublishReplaces) {
+    std::atomic<int> destroyed(0);
+    SnapshotTree<Version> versions(std::unique_ptr<Version>(new Version(1, &destroyed)));
+    EXPECT_EQ(1, versions.snapshot()->id_);
+
+    versions.publish(std::unique_ptr<Version>(new Version(2, &destroyed)));
+    EXPECT_EQ(1, destroyed.load());
+    EXPECT_EQ(2, versions.snapshot()->id_);
+
+    // Moving a snapshot moves the version it pins
+    SnapshotTree<Version>::Snapshot first = versions.snapshot();
+    SnapshotTree<Version>::Snapshot second(std::move(first));
+    first = versions.snapshot();
+    EXPECT_EQ(2, (*first).id_);
+    EXPECT_EQ(2, second.get()->id_);
+}
+
+TEST(SnapshotTree, SnapshotOutlivesPublish) {
+    std::atomic<int> destroyed(0);
+    SnapshotTree<Version> versions(std::unique_ptr<Version>(new Version(1, &destroyed)));
+    std::unique_ptr<SnapshotTree<Version>::Snapshot> old(
+        new SnapshotTree<Version>::Snapshot(versions.snapshot()));
+
+    std::thread publisher([&]() {
+        versions.publish(std::unique_ptr<Version>(new Version(2, &destroyed)));
+    });
+
+    // New snapshots see the new version while the publisher waits on the old
+    // one, which stays put
+    while (versions.snapshot()->id_ != 2) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(1, (*old)->id_);
+    EXPECT_EQ(0, destroyed.load());
+
+    old.reset();
+    publisher.join();
+    EXPECT_EQ(1, destroyed.load());
+}
+
+TEST(SnapshotTree, ConcurrentQueries) {
+    // Every version holds a different number of points, and every search
+    // through a snapshot has to find exactly the points of that version
+    vector<ValuePoint<int>> points = randomPoints(5000, 23);
+
+    using iterator = vector<ValuePoint<int>>::const_iterator;
+    using Tree = Octree<iterator, ExamplePointExtractor<int>>;
+    SnapshotTree<Tree> trees(Tree(points.cbegin(), points.cbegin() + 100));
+    std::atomic<bool> done(false);
+    std::atomic<size_t> mismatches(0), queries(0);
+    BoundingBox all{{-1, -1, -1}, {101, 101, 101}};
+
+    vector<std::thread> readers;
+    for (size_t t = 0; t < 4; ++t) {
+        readers.emplace_back([&]() {
+            vector<iterator> found;
+            while (!done.load()) {
+                SnapshotTree<Tree>::Snapshot tree = trees.snapshot();
+                found.clear();
+                auto out = std::back_inserter(found);
+                tree->search(all, out);
+                if (found.size() != tree->size() || found.size() % 100 != 0) {
+                    ++mismatches;
+                }
+                ++queries;
+            }
+        });
+    }
+
+    for (size_t version = 2; version <= 50; ++version) {
+        trees.publish(Tree(points.cbegin(), points.cbegin() + 100 * version));
+    }
+    done.store(true);
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(0u, mismatches.load());
+    EXPECT_LT(0u, queries.load());
+    EXPECT_EQ(5000u, trees.snapshot()->size());
+}
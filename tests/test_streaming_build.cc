@@ -0,0 +1,140 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/point3d.h"
+#include "../structures/boundingbox.h"
+#include "../structures/mapped_octree.h"
+#include "../structures/pointerless_octree.h"
+#include "../structures/streaming_build.h"
+#include "test_helpers.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+using Iterator = vector<ValuePoint<int>>::const_iterator;
+
+class StreamingBuildTest : public ::testing::Test {
+  protected:
+    vector<ValuePoint<int>> points;
+    std::string path;
+    std::string scratch;
+
+    StreamingBuildTest() : path("test_streaming_build.tmp"), scratch("test_streaming_build_scratch.tmp") {}
+
+    virtual void SetUp() {
+        points = randomPoints(5000, 67);
+        // A clump of duplicates too big to split or to hold in memory
+        for (size_t i = 4000; i < 4300; ++i) {
+            points[i].dimensions_ = Point3d{25, 50, 75};
+        }
+    }
+
+    virtual void TearDown() {
+        std::remove(path.c_str());
+    }
+
+    template <typename Scalar, size_t max_depth>
+    void stream(size_t memory_points) {
+        StreamingTreeBuilder<Scalar, 16, max_depth> builder(scratch, memory_points);
+        for (const ValuePoint<int>& point : points) {
+            builder.add(point.dimensions_);
+        }
+        EXPECT_EQ(points.size(), builder.size());
+        ASSERT_TRUE(builder.finish(path));
+    }
+
+    // Points within a leaf may come out in another order, so results are compared as sets
+    template <typename Scalar, size_t max_depth = 21>
+    void checkMatchesInMemory(size_t memory_points) {
+        stream<Scalar, max_depth>(memory_points);
+        PointerlessOctree<Iterator, ExamplePointExtractor<int>, 16, max_depth, Scalar> built(points.cbegin(), points.cend());
+        MappedOctree<Iterator, ExamplePointExtractor<int>, Scalar> mapped;
+        ASSERT_TRUE(mapped.open(path, points.cbegin()));
+        EXPECT_EQ(built.size(), mapped.size());
+        EXPECT_EQ(built.depth(), mapped.depth());
+
+        for (size_t q = 0; q < 20; ++q) {
+            const Point3d& low = points[q * 200].dimensions_;
+            const Point3d& high = points[q * 200 + 100].dimensions_;
+            BoundingBox box{
+                {std::min(low.x, high.x), std::min(low.y, high.y), std::min(low.z, high.z)},
+                {std::max(low.x, high.x), std::max(low.y, high.y), std::max(low.z, high.z)}
+            };
+            vector<Iterator> expected, output;
+            auto expectedIterator = back_inserter(expected);
+            auto outputIterator = back_inserter(output);
+            EXPECT_EQ(built.search(box, expectedIterator), mapped.search(box, outputIterator));
+            std::sort(expected.begin(), expected.end());
+            std::sort(output.begin(), output.end());
+            EXPECT_EQ(expected, output) << box;
+
+            expected.clear();
+            output.clear();
+            EXPECT_EQ(built.radiusSearch(low, 10., expectedIterator), mapped.radiusSearch(low, 10., outputIterator));
+            std::sort(expected.begin(), expected.end());
+            std::sort(output.begin(), output.end());
+            EXPECT_EQ(expected, output) << low;
+
+            expected.clear();
+            output.clear();
+            EXPECT_EQ(built.knn(high, 10, expectedIterator), mapped.knn(high, 10, outputIterator));
+            std::sort(expected.begin(), expected.end());
+            std::sort(output.begin(), output.end());
+            EXPECT_EQ(expected, output) << high;
+        }
+    }
+};
+
+TEST_F(StreamingBuildTest, AllInMemory) {
+    checkMatchesInMemory<double>(points.size());
+}
+
+TEST_F(StreamingBuildTest, SplitToFit) {
+    checkMatchesInMemory<double>(100);
+}
+
+TEST_F(StreamingBuildTest, StreamsDuplicatesAtMaxDepth) {
+    checkMatchesInMemory<double, 6>(100);
+}
+
+TEST_F(StreamingBuildTest, Float) {
+    checkMatchesInMemory<float>(100);
+}
+
+TEST_F(StreamingBuildTest, Quantized) {
+    checkMatchesInMemory<Quantized<16>, 6>(100);
+}
+
+TEST_F(StreamingBuildTest, Empty) {
+    points.clear();
+    stream<double, 21>(100);
+    MappedOctree<Iterator, ExamplePointExtractor<int>> mapped;
+    ASSERT_TRUE(mapped.open(path, points.cbegin()));
+    EXPECT_EQ(0u, mapped.size());
+    vector<Iterator> output;
+    auto outputIterator = back_inserter(output);
+    EXPECT_FALSE(mapped.search(BoundingBox{{0, 0, 0}, {100, 100, 100}}, outputIterator));
+}
+
+TEST_F(StreamingBuildTest, RemovesScratchFiles) {
+    stream<double, 21>(100);
+    const char* suffixes[] = {".bucket0.0", ".bucket1.0", ".level1", ".level2", ".xs", ".values"};
+    for (const char* suffix : suffixes) {
+        std::string name = scratch + suffix;
+        std::FILE* file = std::fopen(name.c_str(), "rb");
+        EXPECT_EQ(nullptr, file) << name;
+        if (file) {
+            std::fclose(file);
+        }
+    }
+}
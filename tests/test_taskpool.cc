@@ -0,0 +1,131 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+	#ifdef __STRICT_ANSI__
+	#undef __STRICT_ANSI__
+	#endif
+#endif
+
+#include "../structures/taskpool.h"
+
+#include "gtest/gtest.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST(TaskPool, RunsEveryTask) {
+	TaskPool pool(4);
+	std::atomic<int> count(0);
+	TaskGroup group(pool);
+	for (int i = 0; i < 1000; ++i) {
+		group.run([&count]() { ++count; });
+	}
+	group.wait();
+	EXPECT_EQ(1000, count);
+}
+
+TEST(TaskPool, ZeroThreadsRunsInWait) {
+	TaskPool pool(0);
+	EXPECT_EQ(0u, pool.size());
+	std::vector<int> values(10, 0);
+	TaskGroup group(pool);
+	for (int i = 0; i < 10; ++i) {
+		group.run([&values, i]() { values[i] = i; });
+	}
+	group.wait();
+	for (int i = 0; i < 10; ++i) {
+		EXPECT_EQ(i, values[i]);
+	}
+}
+
+// A recursive fork/join sum, where every level waits on its own group
+long long parallelSum(TaskPool& pool, long long low, long long high) {
+	if (high - low <= 16) {
+		long long sum = 0;
+		for (long long i = low; i < high; ++i) {
+			sum += i;
+		}
+		return sum;
+	}
+	long long mid = low + (high - low) / 2;
+	long long left = 0;
+	TaskGroup group(pool);
+	group.run([&pool, &left, low, mid]() { left = parallelSum(pool, low, mid); });
+	long long right = parallelSum(pool, mid, high);
+	group.wait();
+	return left + right;
+}
+
+TEST(TaskPool, NestedGroups) {
+	TaskPool pool(3);
+	EXPECT_EQ(99999LL * 100000LL / 2, parallelSum(pool, 0, 100000));
+}
+
+// Every group is gone as soon as wait() returns, while the task that
+// finished it may only just have signalled
+TEST(TaskPool, ShortLivedGroups) {
+	TaskPool pool(3);
+	std::atomic<int> count(0);
+	for (int i = 0; i < 2000; ++i) {
+		TaskGroup group(pool);
+		group.run([&count]() { ++count; });
+		group.run([&count]() { ++count; });
+		group.wait();
+	}
+	EXPECT_EQ(4000, count);
+}
+
+// With nothing left to run, wait() sleeps until the running task is done
+// instead of spinning, so the process uses next to no CPU meanwhile
+TEST(TaskPool, WaitSleepsOnRunningTasks) {
+	TaskPool pool(1);
+	std::atomic<bool> started(false), finished(false);
+	TaskGroup group(pool);
+	group.run([&started, &finished]() {
+		started = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		finished = true;
+	});
+	while (!started) {
+		std::this_thread::yield();
+	}
+
+	std::clock_t before = std::clock();
+	group.wait();
+	double seconds = double(std::clock() - before) / CLOCKS_PER_SEC;
+	EXPECT_TRUE(finished);
+	EXPECT_LT(seconds, 0.1);
+}
+
+// Results are consumed in order, and never more than window are held
+TEST(TaskPool, RunOrdered) {
+	TaskPool pool(3);
+	std::vector<int> produced(500, -1), consumed;
+	std::atomic<int> held(0), mostHeld(0);
+	runOrdered(pool, produced.size(), 8,
+	           [&produced, &held, &mostHeld](std::size_t i) {
+	               produced[i] = static_cast<int>(i);
+	               int now = ++held;
+	               for (int most = mostHeld; now > most && !mostHeld.compare_exchange_weak(most, now); ) { }
+	           },
+	           [&produced, &consumed, &held](std::size_t i) {
+	               consumed.push_back(produced[i]);
+	               --held;
+	           });
+	ASSERT_EQ(produced.size(), consumed.size());
+	for (std::size_t i = 0; i < consumed.size(); ++i) {
+		EXPECT_EQ(static_cast<int>(i), consumed[i]);
+	}
+	EXPECT_LE(mostHeld, 8);
+}
+
+TEST(TaskPool, WaitRethrows) {
+	TaskPool pool(2);
+	TaskGroup group(pool);
+	group.run([]() { throw std::runtime_error("task failed"); });
+	EXPECT_THROW(group.wait(), std::runtime_error);
+}
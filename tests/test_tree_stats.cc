@@ -0,0 +1,81 @@
+// Stupid mingw port of gtest 
+#ifdef MINGW_COMPILER
+    #ifdef __STRICT_ANSI__
+    #undef __STRICT_ANSI__
+    #endif
+#endif
+
+#include "../structures/tree_stats.h"
+
+#include <iterator>
+#include <vector>
+#include "gtest/gtest.h"
+
+using std::vector;
+
+TEST(QueryStats, Counts) {
+    QueryStats stats;
+    stats.visit();
+    stats.visit();
+    stats.prune();
+    stats.prune(3);
+    stats.test(16);
+    stats.hit();
+    EXPECT_EQ(2u, stats.nodes_visited_);
+    EXPECT_EQ(4u, stats.nodes_pruned_);
+    EXPECT_EQ(16u, stats.points_tested_);
+    EXPECT_EQ(1u, stats.hits_);
+
+    QueryStats total;
+    total += stats;
+    total += stats;
+    EXPECT_EQ(4u, total.nodes_visited_);
+    EXPECT_EQ(8u, total.nodes_pruned_);
+    EXPECT_EQ(32u, total.points_tested_);
+    EXPECT_EQ(2u, total.hits_);
+}
+
+TEST(QueryStats, CountingOutputPassesValuesOn) {
+    vector<int> values;
+    auto out = std::back_inserter(values);
+    QueryStats stats;
+    CountingOutput<std::back_insert_iterator<vector<int>>> counted(out, stats);
+    for (int i = 0; i < 5; ++i) {
+        *counted = i;
+        ++counted;
+    }
+    EXPECT_EQ((vector<int>{0, 1, 2, 3, 4}), values);
+    EXPECT_EQ(5u, stats.hits_);
+}
+
+TEST(TreeStats, Shape) {
+    // A root with two leaves below it, one of them at the depth limit
+    TreeStats stats(4);
+    stats.addLeaf(1, 3, false);
+    stats.addLeaf(1, 9, true);
+    stats.addInternal(0, 2);
+    stats.bytes_ = 240;
+
+    EXPECT_EQ((vector<size_t>{1, 2}), stats.nodes_by_depth_);
+    EXPECT_EQ((vector<size_t>{0, 0, 0, 1, 0, 1}), stats.leaves_by_size_);
+    EXPECT_EQ(3u, stats.nodes_);
+    EXPECT_EQ(1u, stats.internal_nodes_);
+    EXPECT_EQ(2u, stats.leaves_);
+    EXPECT_EQ(1u, stats.max_depth_leaves_);
+    EXPECT_EQ(6u, stats.empty_children_);
+    EXPECT_EQ(12u, stats.points_);
+    EXPECT_DOUBLE_EQ(0.75, stats.emptyChildRatio());
+    EXPECT_DOUBLE_EQ(20., stats.bytesPerPoint());
+
+    stats.addUnsplit(2, 100);
+    EXPECT_EQ(1u, stats.unsplit_nodes_);
+    EXPECT_EQ(112u, stats.points_);
+    EXPECT_EQ(3u, stats.nodes_by_depth_.size());
+}
+
+TEST(TreeStats, Empty) {
+    TreeStats stats;
+    EXPECT_EQ(0u, stats.nodes_);
+    EXPECT_EQ(0., stats.emptyChildRatio());
+    EXPECT_EQ(0., stats.bytesPerPoint());
+}